@@ -20,6 +20,7 @@
 
 #include "Poco/Net/Socket.h"
 #include <map>
+#include <vector>
 
 
 namespace Poco {
@@ -41,11 +42,31 @@ public:
 	{
 		POLL_READ  = 0x01,
 		POLL_WRITE = 0x02,
-		POLL_ERROR = 0x04
+		POLL_ERROR = 0x04,
+		POLL_EDGE  = 0x08
+			/// Requests edge-triggered notification (EPOLLET) for
+			/// the socket. A socket becoming readable or writable is
+			/// only reported once, so the caller must read or write
+			/// until the operation would block. Only supported by the
+			/// epoll implementation; ignored on other platforms.
 	};
 
 	using SocketModeMap = std::map<Poco::Net::Socket, int>;
 
+	struct SocketEvent
+		/// A state change of a socket, as reported by
+		/// poll(const Poco::Timespan&, SocketEventList&).
+	{
+		SocketImpl* pSocket;
+			/// The socket that has had its state changed.
+		int mode;
+			/// An OR'd combination of POLL_READ, POLL_WRITE and POLL_ERROR.
+		void* pUserData;
+			/// The user data given when adding the socket.
+	};
+
+	using SocketEventList = std::vector<SocketEvent>;
+
 	PollSet();
 		/// Creates an empty PollSet.
 
@@ -55,7 +76,16 @@ public:
 	void add(const Poco::Net::Socket& socket, int mode);
 		/// Adds the given socket to the set, for polling with
 		/// the given mode, which can be an OR'd combination of
-		/// POLL_READ, POLL_WRITE and POLL_ERROR.
+		/// POLL_READ, POLL_WRITE, POLL_ERROR and POLL_EDGE.
+
+	void add(const Poco::Net::Socket& socket, int mode, void* pUserData);
+		/// Adds the given socket to the set, for polling with
+		/// the given mode, and associates the given user data
+		/// with the socket. The user data is reported with
+		/// every SocketEvent for the socket.
+		///
+		/// If the socket is already in the set, its mode and
+		/// user data are updated.
 
 	void remove(const Poco::Net::Socket& socket);
 		/// Removes the given socket from the set.
@@ -80,6 +110,22 @@ public:
 		/// changes accordingly to its mode, or the timeout expires.
 		/// Returns a PollMap containing the sockets that have had
 		/// their state changed.
+
+	int poll(const Poco::Timespan& timeout, SocketEventList& events);
+		/// Waits until the state of at least one of the PollSet's sockets
+		/// changes accordingly to its mode, or the timeout expires.
+		/// Replaces the contents of events with the sockets that have had
+		/// their state changed, and returns the number of events.
+		///
+		/// Unlike poll(const Poco::Timespan&), this does not allocate
+		/// memory once the capacity of events is sufficient, and,
+		/// with the epoll implementation, does not perform any lookups.
+		///
+		/// The PollSet does not keep the sockets referenced by events
+		/// alive after they have been removed from the set. A caller
+		/// that removes sockets while processing events must
+		/// keep its own references (e.g., via the user data) until
+		/// all events have been processed.
 	
 	void wakeUp();
 		/// Causes a blocked call to poll() to return early.
@@ -21,6 +21,7 @@
 #include "Poco/Net/Net.h"
 #include "Poco/Net/StreamSocket.h"
 #include "Poco/Net/HTTPCredentials.h"
+#include "Poco/Net/WebSocketDeflate.h"
 #include "Poco/Buffer.h"
 
 
@@ -54,6 +55,14 @@ class Net_API WebSocket: public StreamSocket
 	/// mode, by calling setBlocking(false). 
 	/// Please refer to the sendFrame() and receiveFrame() documentation
 	/// for non-blocking behavior.
+	///
+	/// The permessage-deflate extension (RFC 7692) is supported.
+	/// A client offers it by calling offerDeflate() on the handshake
+	/// request, and a server accepts it if the WebSocket is created
+	/// with the constructor taking WebSocketDeflate::Params.
+	/// If the extension has been negotiated, text and binary messages
+	/// sent in a single frame are compressed, and compressed messages
+	/// are decompressed transparently by receiveFrame().
 {
 public:
 	enum Mode
@@ -66,7 +75,7 @@ public:
 		/// Frame header flags.
 	{
 		FRAME_FLAG_FIN  = 0x80, /// FIN bit: final fragment of a multi-fragment message.
-		FRAME_FLAG_RSV1 = 0x40, /// Reserved for future use. Must be zero.
+		FRAME_FLAG_RSV1 = 0x40, /// Compressed message, if permessage-deflate is used. Otherwise must be zero.
 		FRAME_FLAG_RSV2 = 0x20, /// Reserved for future use. Must be zero.
 		FRAME_FLAG_RSV3 = 0x10  /// Reserved for future use. Must be zero.
 	};
@@ -127,10 +136,14 @@ public:
 			/// No Sec-WebSocket-Accept header or wrong value.
 		WS_ERR_UNAUTHORIZED                   = 6,
 			/// The server rejected the username or password for authentication.
+		WS_ERR_HANDSHAKE_EXTENSION            = 7,
+			/// Invalid or unsupported Sec-WebSocket-Extensions header in handshake response.
 		WS_ERR_PAYLOAD_TOO_BIG                = 10,
 			/// Payload too big for supplied buffer.
-		WS_ERR_INCOMPLETE_FRAME               = 11
+		WS_ERR_INCOMPLETE_FRAME               = 11,
 			/// Incomplete frame received.
+		WS_ERR_DECOMPRESSION                  = 12
+			/// Compressed payload cannot be decompressed.
 	};
 
 	WebSocket(HTTPServerRequest& request, HTTPServerResponse& response);
@@ -144,6 +157,16 @@ public:
 		/// Throws an exception if the request is not a proper WebSocket
 		/// upgrade request.
 
+	WebSocket(HTTPServerRequest& request, HTTPServerResponse& response, const WebSocketDeflate::Params& deflateParams);
+		/// Creates a server-side WebSocket from within a
+		/// HTTPRequestHandler, like the constructor above.
+		///
+		/// Additionally accepts the permessage-deflate extension,
+		/// if offered by the client, using the given parameters.
+		/// The window bits and context takeover parameters specify
+		/// the server's own requirements. Client requirements
+		/// from the offer are honored.
+
 	WebSocket(HTTPClientSession& cs, HTTPRequest& request, HTTPResponse& response);
 		/// Creates a client-side WebSocket, using the given
 		/// HTTPClientSession and HTTPRequest for the initial handshake
@@ -324,13 +347,31 @@ public:
 		///
 		/// The default is std::numeric_limits<int>::max().
 
+	bool deflateEnabled() const;
+		/// Returns true if the permessage-deflate extension
+		/// has been negotiated for the WebSocket.
+
+	void setCompressionLevel(int level);
+		/// Sets the compression level (1 - 9) for sent messages,
+		/// if the permessage-deflate extension has been negotiated.
+		///
+		/// Throws a Poco::IllegalStateException otherwise.
+
+	static void offerDeflate(HTTPRequest& request, const WebSocketDeflate::Params& params = WebSocketDeflate::Params());
+		/// Adds an offer for the permessage-deflate extension, with
+		/// the given parameters, to the given client handshake request.
+		///
+		/// If the server accepts the offer, the extension is enabled
+		/// for the WebSocket created with the request. The server may
+		/// also decline the offer, in which case messages are not compressed.
+
 	static const std::string WEBSOCKET_VERSION;
 		/// The WebSocket protocol version supported (13).
 
 protected:
-	static WebSocketImpl* accept(HTTPServerRequest& request, HTTPServerResponse& response);
+	static WebSocketImpl* accept(HTTPServerRequest& request, HTTPServerResponse& response, const WebSocketDeflate::Params* pDeflateParams = nullptr);
 	static WebSocketImpl* connect(HTTPClientSession& cs, HTTPRequest& request, HTTPResponse& response, HTTPCredentials& credentials);
-	static WebSocketImpl* completeHandshake(HTTPClientSession& cs, HTTPResponse& response, const std::string& key);
+	static WebSocketImpl* completeHandshake(HTTPClientSession& cs, HTTPRequest& request, HTTPResponse& response, const std::string& key);
 	static std::string computeAccept(const std::string& key);
 	static std::string createKey();
 
@@ -338,6 +379,7 @@ private:
 	WebSocket();
 
 	static const std::string WEBSOCKET_GUID;
+	static const std::string WEBSOCKET_EXTENSIONS;
 	static HTTPCredentials _defaultCreds;
 };
 
@@ -0,0 +1,156 @@
+//
+// WebSocketDeflate.h
+//
+// Library: Net
+// Package: WebSocket
+// Module:  WebSocketDeflate
+//
+// Definition of the WebSocketDeflate class.
+//
+// Copyright (c) 2012, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef Net_WebSocketDeflate_INCLUDED
+#define Net_WebSocketDeflate_INCLUDED
+
+
+#include "Poco/Net/Net.h"
+#include "Poco/Buffer.h"
+#if defined(POCO_UNBUNDLED)
+#include <zlib.h>
+#else
+#include "Poco/zlib.h"
+#endif
+#include <string>
+
+
+namespace Poco {
+namespace Net {
+
+
+class Net_API WebSocketDeflate
+	/// This class implements the permessage-deflate WebSocket
+	/// extension, according to RFC 7692.
+	///
+	/// Besides the negotiation of extension parameters in the
+	/// opening handshake, it keeps the compression and decompression
+	/// contexts of a WebSocket connection. It is used internally by
+	/// WebSocket and WebSocketImpl.
+	///
+	/// Messages are compressed with a single deflate stream per
+	/// direction, so that the compression context is kept across
+	/// messages, unless "no context takeover" has been negotiated.
+	/// Only text and binary messages sent in a single frame are
+	/// compressed. Received messages may be fragmented.
+{
+public:
+	struct Params
+		/// Parameters of the permessage-deflate extension.
+	{
+		int compressionLevel = Z_DEFAULT_COMPRESSION;
+			/// Compression level (1 - 9) for sent messages.
+		int clientMaxWindowBits = 15;
+			/// Window size (9 - 15) used for compressing messages sent by the client.
+		int serverMaxWindowBits = 15;
+			/// Window size (9 - 15) used for compressing messages sent by the server.
+		bool clientNoContextTakeover = false;
+			/// The client resets its compression context after every message.
+		bool serverNoContextTakeover = false;
+			/// The server resets its compression context after every message.
+	};
+
+	enum
+	{
+		MIN_WINDOW_BITS = 9,
+		MAX_WINDOW_BITS = 15
+	};
+
+	WebSocketDeflate(const Params& params, bool server);
+		/// Creates the WebSocketDeflate with the negotiated
+		/// parameters, for the server or client side of a connection.
+
+	~WebSocketDeflate();
+		/// Destroys the WebSocketDeflate.
+
+	void setCompressionLevel(int level);
+		/// Sets the compression level (1 - 9) for subsequently
+		/// sent messages.
+
+	int deflate(const char* pMessage, int length, Poco::Buffer<char>& buffer, int offset);
+		/// Compresses the given message and stores the compressed data
+		/// in buffer, starting at offset. The buffer is resized to
+		/// offset plus the compressed length.
+		///
+		/// Returns the length of the compressed data.
+
+	int inflate(const char* pData, int length, bool final, char* pBuffer, int bufferSize);
+		/// Decompresses the given (part of a) compressed message into
+		/// the given buffer. final must be true for the last frame of
+		/// a message.
+		///
+		/// Returns the number of bytes stored in the buffer.
+		///
+		/// Throws a WebSocketException if the data is corrupt, or if the
+		/// decompressed data does not fit into the buffer.
+
+	int inflate(const char* pData, int length, bool final, Poco::Buffer<char>& buffer, int maxLength);
+		/// Decompresses the given (part of a) compressed message and
+		/// appends the decompressed data to the given buffer, which
+		/// is grown as necessary.
+		///
+		/// Returns the number of bytes appended to the buffer.
+		///
+		/// Throws a WebSocketException if the data is corrupt, or if
+		/// the decompressed data exceeds maxLength bytes.
+
+	static std::string offer(const Params& params);
+		/// Returns the value of the Sec-WebSocket-Extensions header
+		/// of a client handshake request offering the extension
+		/// with the given parameters.
+
+	static bool negotiate(const std::string& offers, const Params& params, Params& agreed, std::string& response);
+		/// Selects the first acceptable permessage-deflate offer
+		/// from the given Sec-WebSocket-Extensions header value sent by
+		/// a client. The given parameters specify the server's own
+		/// requirements.
+		///
+		/// If an offer is acceptable, stores the negotiated parameters
+		/// in agreed and the value of the Sec-WebSocket-Extensions response
+		/// header in response, and returns true. Otherwise returns false.
+
+	static bool accept(const std::string& response, const std::string& offer, Params& agreed);
+		/// Validates the value of the Sec-WebSocket-Extensions header
+		/// received from the server, for the given offer (as sent in
+		/// the client's handshake request).
+		///
+		/// Returns true and stores the negotiated parameters in
+		/// agreed if the server has accepted the offer, or false
+		/// if the server has not accepted any extension.
+		///
+		/// Throws a WebSocketException if the response is invalid.
+
+	static const std::string EXTENSION_NAME;
+		/// The name of the extension ("permessage-deflate").
+
+private:
+	WebSocketDeflate(const WebSocketDeflate&) = delete;
+	WebSocketDeflate& operator = (const WebSocketDeflate&) = delete;
+
+	void setInput(const char* pData, int length);
+	int inflateSome(char* pBuffer, int bufferSize);
+
+	z_stream _deflater;
+	z_stream _inflater;
+	bool _resetDeflater;
+	bool _resetInflater;
+};
+
+
+} } // namespace Poco::Net
+
+
+#endif // Net_WebSocketDeflate_INCLUDED
@@ -19,9 +19,10 @@
 
 
 #include "Poco/Net/StreamSocketImpl.h"
+#include "Poco/Net/WebSocketDeflate.h"
 #include "Poco/Buffer.h"
 #include "Poco/Random.h"
-#include "Poco/Buffer.h"
+#include "Poco/SharedPtr.h"
 
 
 namespace Poco {
@@ -104,6 +105,17 @@ public:
 		///
 		/// The default is std::numeric_limits<int>::max().
 
+	void enableDeflate(const WebSocketDeflate::Params& params);
+		/// Enables the permessage-deflate extension with the
+		/// parameters negotiated in the handshake.
+
+	bool deflateEnabled() const;
+		/// Returns true if the permessage-deflate extension is used.
+
+	void setCompressionLevel(int level);
+		/// Sets the compression level used for the permessage-deflate
+		/// extension.
+
 protected:
 	enum
 	{
@@ -122,6 +134,7 @@ protected:
 		int remainingPayloadLength = 0;
 		Poco::Buffer<char> payload{0};
 		int maskOffset = 0;
+		bool compressed = false;
 	};
 
 	struct SendState
@@ -133,6 +146,9 @@ protected:
 	};
 
 	int peekHeader(ReceiveState& receiveState);
+	bool compressedFrame();
+	int inflatePayload(void* buffer, int length);
+	int inflatePayload(Poco::Buffer<char>& buffer);
 	void skipHeader(int headerLength);
 	int receivePayload(char *buffer, int payloadLength, char mask[MASK_LENGTH], bool useMask, int maskOffset);
 	int receiveNBytes(void* buffer, int length);
@@ -151,6 +167,8 @@ private:
 	ReceiveState _receiveState;
 	SendState _sendState;
 	Poco::Random _rnd;
+	Poco::SharedPtr<WebSocketDeflate> _pDeflate;
+	bool _inflating;
 };
 
 
@@ -175,6 +193,12 @@ inline int WebSocketImpl::getMaxPayloadSize() const
 }
 
 
+inline bool WebSocketImpl::deflateEnabled() const
+{
+	return !_pDeflate.isNull();
+}
+
+
 } } // namespace Poco::Net
 
 
@@ -0,0 +1,86 @@
+//
+// WebSocketMask.h
+//
+// Library: Net
+// Package: WebSocket
+// Module:  WebSocketMask
+//
+// Definition of the WebSocketMask class.
+//
+// Copyright (c) 2012, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef Net_WebSocketMask_INCLUDED
+#define Net_WebSocketMask_INCLUDED
+
+
+#include "Poco/Net/Net.h"
+#include <string>
+#include <cstddef>
+
+
+namespace Poco {
+namespace Net {
+
+
+class Net_API WebSocketMask
+	/// This class applies the masking key of a WebSocket frame
+	/// to the frame's payload data, as specified in RFC 6455,
+	/// section 5.3. Masking and unmasking are the same operation.
+	///
+	/// Depending on the CPU, the payload is processed with AVX2,
+	/// SSE2 or NEON instructions, or eight bytes at a time. The
+	/// implementation is selected when the class is first used.
+	/// The class is used internally by WebSocketImpl.
+{
+public:
+	enum
+	{
+		MASK_LENGTH = 4
+	};
+
+	static void apply(const char* source, char* target, std::size_t length, const char mask[MASK_LENGTH], std::size_t offset = 0);
+		/// Applies the given mask to length bytes of payload data
+		/// from source, and stores the result in target.
+		///
+		/// Source and target may be the same, but must not
+		/// otherwise overlap.
+		///
+		/// The offset is the position of the first byte within
+		/// the frame's payload, which allows a payload received
+		/// in multiple parts to be unmasked part by part.
+
+	static void apply(char* data, std::size_t length, const char mask[MASK_LENGTH], std::size_t offset = 0);
+		/// Applies the given mask to length bytes of payload data in place.
+
+	static const std::string& implementation();
+		/// Returns the name of the implementation used
+		/// ("avx2", "sse2", "neon" or "word").
+
+private:
+	enum
+	{
+		SHORT_PAYLOAD_LENGTH = 16
+	};
+
+	WebSocketMask() = delete;
+};
+
+
+//
+// inlines
+//
+inline void WebSocketMask::apply(char* data, std::size_t length, const char mask[MASK_LENGTH], std::size_t offset)
+{
+	apply(data, data, length, mask, offset);
+}
+
+
+} } // namespace Poco::Net
+
+
+#endif // Net_WebSocketMask_INCLUDED
@@ -0,0 +1,102 @@
+//
+// WebSocketMaskBenchmark.cpp
+//
+// This sample shows a benchmark of WebSocket payload masking.
+//
+// Copyright (c) 2012, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/Net/WebSocketMask.h"
+#include "Poco/Stopwatch.h"
+#include "Poco/NumberParser.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <algorithm>
+
+
+using Poco::Net::WebSocketMask;
+
+
+namespace
+{
+	// The byte-wise loop previously used by WebSocketImpl, for comparison.
+
+	void maskBytewise(const char* source, char* target, int length, const char mask[WebSocketMask::MASK_LENGTH], int offset)
+	{
+		for (int i = 0; i < length; i++)
+		{
+			target[i] = source[i] ^ mask[(i + offset) % WebSocketMask::MASK_LENGTH];
+		}
+	}
+
+	void report(const std::string& name, const Poco::Stopwatch& sw, std::size_t bytes)
+	{
+		std::cout
+			<< std::left << std::setw(32) << name
+			<< std::right << std::setw(10) << std::fixed << std::setprecision(1)
+			<< bytes/(sw.elapsed() > 0 ? static_cast<double>(sw.elapsed()) : 1.0) << " [MB/s]" << std::endl;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	std::size_t totalBytes = 1024*1024*1024;
+	if (argc > 1) totalBytes = static_cast<std::size_t>(Poco::NumberParser::parseUnsigned64(argv[1]));
+
+	static const std::size_t sizes[] = {16, 125, 1400, 16384, 65536};
+	const char mask[WebSocketMask::MASK_LENGTH] = {'\x3c', '\xa5', '\x0f', '\x96'};
+	Poco::UInt32 checksum = 0;
+	Poco::Stopwatch sw;
+
+	std::cout << "WebSocket Mask Benchmark" << std::endl;
+	std::cout << "========================" << std::endl;
+	std::cout << totalBytes << " bytes per test, implementation: " << WebSocketMask::implementation() << std::endl;
+
+	for (std::size_t size: sizes)
+	{
+		// The payload starts at an odd address, as it does in a frame
+		// buffer following a header of 2 + 4 bytes.
+		std::vector<char> source(size + 1, 'x');
+		std::vector<char> target(size + 1);
+		const std::size_t iterations = (std::max)(totalBytes/size, std::size_t(1));
+		const std::size_t bytes = iterations*size;
+
+		std::cout << std::endl << size << " byte payload" << std::endl;
+
+		sw.restart();
+		for (std::size_t i = 0; i < iterations; i++)
+		{
+			maskBytewise(source.data() + 1, target.data() + 1, static_cast<int>(size), mask, static_cast<int>(i & 3));
+			checksum += static_cast<Poco::UInt8>(target[1 + (i % size)]);
+		}
+		sw.stop();
+		report("byte-wise", sw, bytes);
+
+		sw.restart();
+		for (std::size_t i = 0; i < iterations; i++)
+		{
+			WebSocketMask::apply(source.data() + 1, target.data() + 1, size, mask, i & 3);
+			checksum += static_cast<Poco::UInt8>(target[1 + (i % size)]);
+		}
+		sw.stop();
+		report("WebSocketMask", sw, bytes);
+
+		sw.restart();
+		for (std::size_t i = 0; i < iterations; i++)
+		{
+			WebSocketMask::apply(target.data() + 1, size, mask, i & 3);
+			checksum += static_cast<Poco::UInt8>(target[1 + (i % size)]);
+		}
+		sw.stop();
+		report("WebSocketMask (in place)", sw, bytes);
+	}
+
+	std::cout << std::endl << "checksum: " << checksum << std::endl;
+	return 0;
+}
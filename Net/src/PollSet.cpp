@@ -16,6 +16,7 @@
 #include "Poco/Net/SocketImpl.h"
 #include "Poco/Mutex.h"
 #include <set>
+#include <memory>
 
 
 #if defined(_WIN32) && _WIN32_WINNT >= 0x0600
@@ -55,6 +56,7 @@ public:
 	PollSetImpl():
 		_epollfd(-1),
 		_eventfd(eventfd(0, 0)),
+		_polling(false),
 		_events(1024)
 	{
 		_epollfd = epoll_create(1);
@@ -81,31 +83,32 @@ public:
 		::close(_eventfd);
 	}
 
-	void add(const Socket& socket, int mode)
+	void add(const Socket& socket, int mode, void* pUserData)
 	{
 		Poco::FastMutex::ScopedLock lock(_mutex);
 
 		SocketImpl* sockImpl = socket.impl();
 		poco_socket_t fd = sockImpl->sockfd();
+		std::unique_ptr<Entry>& pEntry = _socketMap[sockImpl];
+		bool isNew = !pEntry;
+		if (isNew)
+			pEntry.reset(new Entry(socket, pUserData));
+		else
+			pEntry->pUserData = pUserData;
+
 		struct epoll_event ev;
-		ev.events = 0;
-		if (mode & PollSet::POLL_READ)
-			ev.events |= EPOLLIN;
-		if (mode & PollSet::POLL_WRITE)
-			ev.events |= EPOLLOUT;
-		if (mode & PollSet::POLL_ERROR)
-			ev.events |= EPOLLERR;
-		ev.data.ptr = socket.impl();
+		ev.events = epollEvents(mode);
+		ev.data.ptr = pEntry.get();
 		int err = epoll_ctl(_epollfd, EPOLL_CTL_ADD, fd, &ev);
+		if (err && errno == EEXIST)
+			err = epoll_ctl(_epollfd, EPOLL_CTL_MOD, fd, &ev);
 
 		if (err)
 		{
-			if (errno == EEXIST) update(socket, mode);
-			else SocketImpl::error();
+			int code = SocketImpl::lastError();
+			if (isNew) _socketMap.erase(sockImpl);
+			SocketImpl::error(code);
 		}
-
-		if (_socketMap.find(sockImpl) == _socketMap.end())
-			_socketMap[sockImpl] = socket;
 	}
 
 	void remove(const Socket& socket)
@@ -119,21 +122,25 @@ public:
 		int err = epoll_ctl(_epollfd, EPOLL_CTL_DEL, fd, &ev);
 		if (err) SocketImpl::error();
 
-		_socketMap.erase(socket.impl());
+		EntryMap::iterator it = _socketMap.find(socket.impl());
+		if (it != _socketMap.end())
+		{
+			if (_polling) retire(std::move(it->second));
+			_socketMap.erase(it);
+		}
 	}
 
 	void update(const Socket& socket, int mode)
 	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
 		poco_socket_t fd = socket.impl()->sockfd();
+		EntryMap::iterator it = _socketMap.find(socket.impl());
+		if (it == _socketMap.end()) SocketImpl::error(ENOENT);
+
 		struct epoll_event ev;
-		ev.events = 0;
-		if (mode & PollSet::POLL_READ)
-			ev.events |= EPOLLIN;
-		if (mode & PollSet::POLL_WRITE)
-			ev.events |= EPOLLOUT;
-		if (mode & PollSet::POLL_ERROR)
-			ev.events |= EPOLLERR;
-		ev.data.ptr = socket.impl();
+		ev.events = epollEvents(mode);
+		ev.data.ptr = it->second.get();
 		int err = epoll_ctl(_epollfd, EPOLL_CTL_MOD, fd, &ev);
 		if (err)
 		{
@@ -169,19 +176,103 @@ public:
 		Poco::FastMutex::ScopedLock lock(_mutex);
 
 		::close(_epollfd);
+		if (_polling)
+		{
+			for (auto& p: _socketMap)
+			{
+				retire(std::move(p.second));
+			}
+		}
 		_socketMap.clear();
 		_epollfd = epoll_create(1);
 		if (_epollfd < 0)
 		{
 			SocketImpl::error();
 		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN;
+		ev.data.ptr = 0;
+		if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, _eventfd, &ev) < 0)
+		{
+			SocketImpl::error();
+		}
 	}
 
 	PollSet::SocketModeMap poll(const Poco::Timespan& timeout)
 	{
 		PollSet::SocketModeMap result;
+		poll(timeout, [&result](Entry& entry, int mode)
+			{
+				result[entry.socket] |= mode;
+			});
+		return result;
+	}
+
+	int poll(const Poco::Timespan& timeout, PollSet::SocketEventList& events)
+	{
+		events.clear();
+		poll(timeout, [&events](Entry& entry, int mode)
+			{
+				events.push_back({entry.socket.impl(), mode, entry.pUserData});
+			});
+		return static_cast<int>(events.size());
+	}
+
+	void wakeUp()
+	{
+		Poco::UInt64 d = 1;
+		write(_eventfd, &d, sizeof(d));
+	}
+
+private:
+	struct Entry
+		/// The address of an Entry is stored in epoll_event.data,
+		/// so that events can be dispatched without a lookup.
+	{
+		Entry(const Socket& s, void* pData):
+			socket(s),
+			pUserData(pData)
+		{
+		}
+
+		Socket socket;
+		void* pUserData;
+		bool removed = false;
+	};
+
+	using EntryMap = std::map<void*, std::unique_ptr<Entry>>;
+
+	static Poco::UInt32 epollEvents(int mode)
+	{
+		Poco::UInt32 events = 0;
+		if (mode & PollSet::POLL_READ)
+			events |= EPOLLIN;
+		if (mode & PollSet::POLL_WRITE)
+			events |= EPOLLOUT;
+		if (mode & PollSet::POLL_ERROR)
+			events |= EPOLLERR;
+		if (mode & PollSet::POLL_EDGE)
+			events |= EPOLLET;
+		return events;
+	}
 
-		if (_socketMap.empty()) return result;
+	void retire(std::unique_ptr<Entry>&& pEntry)
+		/// Events for a socket removed during poll() may already have been
+		/// returned by epoll_wait(), so the Entry is kept until poll() is done.
+	{
+		pEntry->removed = true;
+		_retiredEntries.push_back(std::move(pEntry));
+	}
+
+	template <class Fn>
+	void poll(const Poco::Timespan& timeout, Fn&& report)
+	{
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			if (_socketMap.empty()) return;
+			_polling = true;
+		}
 
 		Poco::Timespan remainingTime(timeout);
 		int rc;
@@ -200,10 +291,16 @@ public:
 			}
 		}
 		while (rc < 0 && SocketImpl::lastError() == POCO_EINTR);
-		if (rc < 0) SocketImpl::error();
+		int err = rc < 0 ? SocketImpl::lastError() : 0;
 
 		Poco::FastMutex::ScopedLock lock(_mutex);
 
+		_polling = false;
+		if (err)
+		{
+			_retiredEntries.clear();
+			SocketImpl::error(err);
+		}
 		for (int i = 0; i < rc; i++)
 		{
 			if (_events[i].data.ptr == nullptr)
@@ -213,33 +310,29 @@ public:
 			}
 			else
 			{
-				std::map<void*, Socket>::iterator it = _socketMap.find(_events[i].data.ptr);
-				if (it != _socketMap.end())
+				Entry* pEntry = static_cast<Entry*>(_events[i].data.ptr);
+				if (!pEntry->removed)
 				{
+					int mode = 0;
 					if (_events[i].events & EPOLLIN)
-						result[it->second] |= PollSet::POLL_READ;
+						mode |= PollSet::POLL_READ;
 					if (_events[i].events & EPOLLOUT)
-						result[it->second] |= PollSet::POLL_WRITE;
+						mode |= PollSet::POLL_WRITE;
 					if (_events[i].events & EPOLLERR)
-						result[it->second] |= PollSet::POLL_ERROR;
+						mode |= PollSet::POLL_ERROR;
+					if (mode) report(*pEntry, mode);
 				}
 			}
 		}
-
-		return result;
-	}
-
-	void wakeUp()
-	{
-		Poco::UInt64 d = 1;
-		write(_eventfd, &d, sizeof(d));
+		_retiredEntries.clear();
 	}
 
-private:
 	mutable Poco::FastMutex _mutex;
 	int _epollfd;
 	int _eventfd;
-	std::map<void*, Socket> _socketMap;
+	EntryMap _socketMap;
+	bool _polling;
+	std::vector<std::unique_ptr<Entry>> _retiredEntries;
 	std::vector<struct epoll_event> _events;
 };
 
@@ -257,14 +350,14 @@ public:
 	{
 	}
 
-	void add(const Socket& socket, int mode)
+	void add(const Socket& socket, int mode, void* pUserData)
 	{
 		Poco::FastMutex::ScopedLock lock(_mutex);
 
 		poco_socket_t fd = socket.impl()->sockfd();
 		_addMap[fd] = mode;
 		_removeSet.erase(fd);
-		_socketMap[fd] = socket;
+		_socketMap[fd] = Entry(socket, pUserData);
 	}
 
 	void remove(const Socket& socket)
@@ -330,6 +423,48 @@ public:
 	PollSet::SocketModeMap poll(const Poco::Timespan& timeout)
 	{
 		PollSet::SocketModeMap result;
+		poll(timeout, [&result](const Entry& entry, int mode)
+			{
+				result[entry.socket] |= mode;
+			});
+		return result;
+	}
+
+	int poll(const Poco::Timespan& timeout, PollSet::SocketEventList& events)
+	{
+		events.clear();
+		poll(timeout, [&events](const Entry& entry, int mode)
+			{
+				events.push_back({entry.socket.impl(), mode, entry.pUserData});
+			});
+		return static_cast<int>(events.size());
+	}
+
+	void wakeUp()
+	{
+	}
+
+private:
+	struct Entry
+	{
+		Entry():
+			pUserData(nullptr)
+		{
+		}
+
+		Entry(const Socket& s, void* pData):
+			socket(s),
+			pUserData(pData)
+		{
+		}
+
+		Socket socket;
+		void* pUserData;
+	};
+
+	template <class Fn>
+	void poll(const Poco::Timespan& timeout, Fn&& report)
+	{
 		{
 			Poco::FastMutex::ScopedLock lock(_mutex);
 
@@ -363,7 +498,7 @@ public:
 			_addMap.clear();
 		}
 
-		if (_pollfds.empty()) return result;
+		if (_pollfds.empty()) return;
 
 		Poco::Timespan remainingTime(timeout);
 		int rc;
@@ -395,33 +530,28 @@ public:
 			{
 				for (auto it = _pollfds.begin(); it != _pollfds.end(); ++it)
 				{
-					std::map<poco_socket_t, Socket>::const_iterator its = _socketMap.find(it->fd);
+					std::map<poco_socket_t, Entry>::const_iterator its = _socketMap.find(it->fd);
 					if (its != _socketMap.end())
 					{
+						int mode = 0;
 						if ((it->revents & POLLIN) && (it->events & POLLIN)) 
-							result[its->second] |= PollSet::POLL_READ;
+							mode |= PollSet::POLL_READ;
 						if ((it->revents & POLLOUT) && (it->events & POLLOUT))
-							result[its->second] |= PollSet::POLL_WRITE;
+							mode |= PollSet::POLL_WRITE;
 						if (it->revents & POLLERR)
-							result[its->second] |= PollSet::POLL_ERROR;
+							mode |= PollSet::POLL_ERROR;
 						if ((it->revents & POLLHUP) && (it->events & POLLIN))
-							result[its->second] |= PollSet::POLL_READ;
+							mode |= PollSet::POLL_READ;
+						if (mode) report(its->second, mode);
 					}
 					it->revents = 0;
 				}
 			}
 		}
-
-		return result;
-	}
-
-	void wakeUp()
-	{
 	}
 
-private:
 	mutable Poco::FastMutex _mutex;
-	std::map<poco_socket_t, Socket> _socketMap;
+	std::map<poco_socket_t, Entry> _socketMap;
 	std::map<poco_socket_t, int> _addMap;
 	std::set<poco_socket_t> _removeSet;
 	std::vector<pollfd> _pollfds;
@@ -437,11 +567,13 @@ private:
 class PollSetImpl
 {
 public:
-	void add(const Socket& socket, int mode)
+	void add(const Socket& socket, int mode, void* pUserData)
 	{
 		Poco::FastMutex::ScopedLock lock(_mutex);
 
-		_map[socket] = mode;
+		Entry& entry = _map[socket];
+		entry.mode = mode;
+		entry.pUserData = pUserData;
 	}
 
 	void remove(const Socket& socket)
@@ -455,7 +587,7 @@ public:
 	{
 		Poco::FastMutex::ScopedLock lock(_mutex);
 
-		_map[socket] = mode;
+		_map[socket].mode = mode;
 	}
 
 	bool has(const Socket& socket) const
@@ -487,6 +619,38 @@ public:
 	}
 
 	PollSet::SocketModeMap poll(const Poco::Timespan& timeout)
+	{
+		PollSet::SocketModeMap result;
+		poll(timeout, [&result](const Socket& socket, const Entry& entry, int mode)
+			{
+				result[socket] |= mode;
+			});
+		return result;
+	}
+
+	int poll(const Poco::Timespan& timeout, PollSet::SocketEventList& events)
+	{
+		events.clear();
+		poll(timeout, [&events](const Socket& socket, const Entry& entry, int mode)
+			{
+				events.push_back({socket.impl(), mode, entry.pUserData});
+			});
+		return static_cast<int>(events.size());
+	}
+
+	void wakeUp()
+	{
+	}
+
+private:
+	struct Entry
+	{
+		int mode = 0;
+		void* pUserData = nullptr;
+	};
+
+	template <class Fn>
+	void poll(const Poco::Timespan& timeout, Fn&& report)
 	{
 		fd_set fdRead;
 		fd_set fdWrite;
@@ -503,19 +667,19 @@ public:
 			for (auto it = _map.begin(); it != _map.end(); ++it)
 			{
 				poco_socket_t fd = it->first.impl()->sockfd();
-				if (fd != POCO_INVALID_SOCKET && it->second)
+				if (fd != POCO_INVALID_SOCKET && it->second.mode)
 				{
 					if (int(fd) > nfd) nfd = int(fd);
 
-					if (it->second & PollSet::POLL_READ)
+					if (it->second.mode & PollSet::POLL_READ)
 					{
 						FD_SET(fd, &fdRead);
 					}
-					if (it->second & PollSet::POLL_WRITE)
+					if (it->second.mode & PollSet::POLL_WRITE)
 					{
 						FD_SET(fd, &fdWrite);
 					}
-					if (it->second & PollSet::POLL_ERROR)
+					if (it->second.mode & PollSet::POLL_ERROR)
 					{
 						FD_SET(fd, &fdExcept);
 					}
@@ -523,8 +687,7 @@ public:
 			}
 		}
 
-		PollSet::SocketModeMap result;
-		if (nfd == 0) return result;
+		if (nfd == 0) return;
 
 		Poco::Timespan remainingTime(timeout);
 		int rc;
@@ -556,32 +719,27 @@ public:
 				poco_socket_t fd = it->first.impl()->sockfd();
 				if (fd != POCO_INVALID_SOCKET)
 				{
+					int mode = 0;
 					if (FD_ISSET(fd, &fdRead))
 					{
-						result[it->first] |= PollSet::POLL_READ;
+						mode |= PollSet::POLL_READ;
 					}
 					if (FD_ISSET(fd, &fdWrite))
 					{
-						result[it->first] |= PollSet::POLL_WRITE;
+						mode |= PollSet::POLL_WRITE;
 					}
 					if (FD_ISSET(fd, &fdExcept))
 					{
-						result[it->first] |= PollSet::POLL_ERROR;
+						mode |= PollSet::POLL_ERROR;
 					}
+					if (mode) report(it->first, it->second, mode);
 				}
 			}
 		}
-
-		return result;
 	}
 
-	void wakeUp()
-	{
-	}
-
-private:
 	mutable Poco::FastMutex _mutex;
-	PollSet::SocketModeMap  _map;
+	std::map<Socket, Entry> _map;
 };
 
 
@@ -602,7 +760,13 @@ PollSet::~PollSet()
 
 void PollSet::add(const Socket& socket, int mode)
 {
-	_pImpl->add(socket, mode);
+	_pImpl->add(socket, mode, nullptr);
+}
+
+
+void PollSet::add(const Socket& socket, int mode, void* pUserData)
+{
+	_pImpl->add(socket, mode, pUserData);
 }
 
 
@@ -648,6 +812,12 @@ PollSet::SocketModeMap PollSet::poll(const Poco::Timespan& timeout)
 }
 
 
+int PollSet::poll(const Poco::Timespan& timeout, SocketEventList& events)
+{
+	return _pImpl->poll(timeout, events);
+}
+
+
 void PollSet::wakeUp()
 {
 	_pImpl->wakeUp();
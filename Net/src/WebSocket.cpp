@@ -36,6 +36,7 @@ namespace Net {
 
 const std::string WebSocket::WEBSOCKET_GUID("258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
 const std::string WebSocket::WEBSOCKET_VERSION("13");
+const std::string WebSocket::WEBSOCKET_EXTENSIONS("Sec-WebSocket-Extensions");
 HTTPCredentials WebSocket::_defaultCreds;
 
 
@@ -45,6 +46,12 @@ WebSocket::WebSocket(HTTPServerRequest& request, HTTPServerResponse& response):
 }
 
 
+WebSocket::WebSocket(HTTPServerRequest& request, HTTPServerResponse& response, const WebSocketDeflate::Params& deflateParams):
+	StreamSocket(accept(request, response, &deflateParams))
+{
+}
+
+
 WebSocket::WebSocket(HTTPClientSession& cs, HTTPRequest& request, HTTPResponse& response):
 	StreamSocket(connect(cs, request, response, _defaultCreds))
 {
@@ -138,7 +145,25 @@ int WebSocket::getMaxPayloadSize() const
 }
 
 
-WebSocketImpl* WebSocket::accept(HTTPServerRequest& request, HTTPServerResponse& response)
+bool WebSocket::deflateEnabled() const
+{
+	return static_cast<WebSocketImpl*>(impl())->deflateEnabled();
+}
+
+
+void WebSocket::setCompressionLevel(int level)
+{
+	static_cast<WebSocketImpl*>(impl())->setCompressionLevel(level);
+}
+
+
+void WebSocket::offerDeflate(HTTPRequest& request, const WebSocketDeflate::Params& params)
+{
+	request.set(WEBSOCKET_EXTENSIONS, WebSocketDeflate::offer(params));
+}
+
+
+WebSocketImpl* WebSocket::accept(HTTPServerRequest& request, HTTPServerResponse& response, const WebSocketDeflate::Params* pDeflateParams)
 {
 	if (request.hasToken("Connection", "upgrade") && icompare(request.get("Upgrade", ""), "websocket") == 0)
 	{
@@ -153,11 +178,21 @@ WebSocketImpl* WebSocket::accept(HTTPServerRequest& request, HTTPServerResponse&
 		response.set("Upgrade", "websocket");
 		response.set("Connection", "Upgrade");
 		response.set("Sec-WebSocket-Accept", computeAccept(key));
+		WebSocketDeflate::Params deflateParams;
+		bool deflate = false;
+		if (pDeflateParams)
+		{
+			std::string extensions;
+			deflate = WebSocketDeflate::negotiate(request.get(WEBSOCKET_EXTENSIONS, ""), *pDeflateParams, deflateParams, extensions);
+			if (deflate) response.set(WEBSOCKET_EXTENSIONS, extensions);
+		}
 		response.setContentLength(HTTPResponse::UNKNOWN_CONTENT_LENGTH);
 		response.send().flush();
 
 		HTTPServerRequestImpl& requestImpl = static_cast<HTTPServerRequestImpl&>(request);
-		return new WebSocketImpl(static_cast<StreamSocketImpl*>(requestImpl.detachSocket().impl()), requestImpl.session(), false);
+		WebSocketImpl* pImpl = new WebSocketImpl(static_cast<StreamSocketImpl*>(requestImpl.detachSocket().impl()), requestImpl.session(), false);
+		if (deflate) pImpl->enableDeflate(deflateParams);
+		return pImpl;
 	}
 	else throw WebSocketException("No WebSocket handshake", WS_ERR_NO_HANDSHAKE);
 }
@@ -180,7 +215,7 @@ WebSocketImpl* WebSocket::connect(HTTPClientSession& cs, HTTPRequest& request, H
 	std::istream& istr = cs.receiveResponse(response);
 	if (response.getStatus() == HTTPResponse::HTTP_SWITCHING_PROTOCOLS)
 	{
-		return completeHandshake(cs, response, key);
+		return completeHandshake(cs, request, response, key);
 	}
 	else if (response.getStatus() == HTTPResponse::HTTP_UNAUTHORIZED)
 	{
@@ -198,7 +233,7 @@ WebSocketImpl* WebSocket::connect(HTTPClientSession& cs, HTTPRequest& request, H
 			cs.receiveResponse(response);
 			if (response.getStatus() == HTTPResponse::HTTP_SWITCHING_PROTOCOLS)
 			{
-				return completeHandshake(cs, response, key);
+				return completeHandshake(cs, request, response, key);
 			}
 			else if (response.getStatus() == HTTPResponse::HTTP_UNAUTHORIZED)
 			{
@@ -218,7 +253,7 @@ WebSocketImpl* WebSocket::connect(HTTPClientSession& cs, HTTPRequest& request, H
 }
 
 
-WebSocketImpl* WebSocket::completeHandshake(HTTPClientSession& cs, HTTPResponse& response, const std::string& key)
+WebSocketImpl* WebSocket::completeHandshake(HTTPClientSession& cs, HTTPRequest& request, HTTPResponse& response, const std::string& key)
 {
 	std::string connection = response.get("Connection", "");
 	if (Poco::icompare(connection, "Upgrade") != 0)
@@ -229,7 +264,11 @@ WebSocketImpl* WebSocket::completeHandshake(HTTPClientSession& cs, HTTPResponse&
 	std::string accept = response.get("Sec-WebSocket-Accept", "");
 	if (accept != computeAccept(key))
 		throw WebSocketException("Invalid or missing Sec-WebSocket-Accept header in handshake response", WS_ERR_HANDSHAKE_ACCEPT);
-	return new WebSocketImpl(static_cast<StreamSocketImpl*>(cs.detachSocket().impl()), cs, true);
+	WebSocketDeflate::Params deflateParams;
+	bool deflate = WebSocketDeflate::accept(response.get(WEBSOCKET_EXTENSIONS, ""), request.get(WEBSOCKET_EXTENSIONS, ""), deflateParams);
+	WebSocketImpl* pImpl = new WebSocketImpl(static_cast<StreamSocketImpl*>(cs.detachSocket().impl()), cs, true);
+	if (deflate) pImpl->enableDeflate(deflateParams);
+	return pImpl;
 }
 
 
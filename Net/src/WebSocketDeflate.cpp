@@ -0,0 +1,387 @@
+//
+// WebSocketDeflate.cpp
+//
+// Library: Net
+// Package: WebSocket
+// Module:  WebSocketDeflate
+//
+// Copyright (c) 2012, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/Net/WebSocketDeflate.h"
+#include "Poco/Net/WebSocket.h"
+#include "Poco/Net/NetException.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/NumberParser.h"
+#include "Poco/NumberFormatter.h"
+#include "Poco/String.h"
+#include <algorithm>
+#include <cstring>
+#include <set>
+#include <utility>
+#include <vector>
+
+
+namespace Poco {
+namespace Net {
+
+
+namespace
+{
+	// The trailer of a sync flush, which is removed from the end of
+	// every compressed message by the sender.
+	const char TRAILER[] = {'\x00', '\x00', '\xff', '\xff'};
+
+	struct Extension
+	{
+		std::string name;
+		std::vector<std::pair<std::string, std::string>> params;
+	};
+
+	std::vector<Extension> parseExtensions(const std::string& header)
+	{
+		std::vector<Extension> extensions;
+		Poco::StringTokenizer offers(header, ",", Poco::StringTokenizer::TOK_TRIM | Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+		for (const auto& offer: offers)
+		{
+			Poco::StringTokenizer tok(offer, ";", Poco::StringTokenizer::TOK_TRIM | Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+			if (tok.count() == 0) continue;
+
+			Extension extension;
+			extension.name = Poco::toLower(tok[0]);
+			for (std::size_t i = 1; i < tok.count(); i++)
+			{
+				std::string::size_type pos = tok[i].find('=');
+				std::string name = Poco::toLower(Poco::trim(tok[i].substr(0, pos)));
+				std::string value;
+				if (pos != std::string::npos)
+				{
+					value = Poco::trim(tok[i].substr(pos + 1));
+					if (value.size() >= 2 && value[0] == '"' && value[value.size() - 1] == '"')
+					{
+						value = value.substr(1, value.size() - 2);
+					}
+				}
+				extension.params.emplace_back(name, value);
+			}
+			extensions.push_back(extension);
+		}
+		return extensions;
+	}
+
+	bool parseWindowBits(const std::string& value, int& bits)
+	{
+		return Poco::NumberParser::tryParse(value, bits) && bits >= 8 && bits <= WebSocketDeflate::MAX_WINDOW_BITS;
+	}
+}
+
+
+const std::string WebSocketDeflate::EXTENSION_NAME("permessage-deflate");
+
+
+WebSocketDeflate::WebSocketDeflate(const Params& params, bool server):
+	_resetDeflater(server ? params.serverNoContextTakeover : params.clientNoContextTakeover),
+	_resetInflater(server ? params.clientNoContextTakeover : params.serverNoContextTakeover)
+{
+	std::memset(&_deflater, 0, sizeof(_deflater));
+	std::memset(&_inflater, 0, sizeof(_inflater));
+
+	// zlib does not support raw deflate streams with a window size of 8 bits.
+	int windowBits = std::max(std::min(server ? params.serverMaxWindowBits : params.clientMaxWindowBits, static_cast<int>(MAX_WINDOW_BITS)), static_cast<int>(MIN_WINDOW_BITS));
+	int rc = deflateInit2(&_deflater, params.compressionLevel, Z_DEFLATED, -windowBits, 8, Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) throw Poco::IOException(zError(rc));
+	rc = inflateInit2(&_inflater, -MAX_WINDOW_BITS);
+	if (rc != Z_OK)
+	{
+		deflateEnd(&_deflater);
+		throw Poco::IOException(zError(rc));
+	}
+}
+
+
+WebSocketDeflate::~WebSocketDeflate()
+{
+	inflateEnd(&_inflater);
+	deflateEnd(&_deflater);
+}
+
+
+void WebSocketDeflate::setCompressionLevel(int level)
+{
+	int rc = deflateParams(&_deflater, level, Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) throw Poco::InvalidArgumentException("Invalid compression level", zError(rc));
+}
+
+
+int WebSocketDeflate::deflate(const char* pMessage, int length, Poco::Buffer<char>& buffer, int offset)
+{
+	if (length == 0)
+	{
+		// An empty stored block, as recommended by RFC 7692, section 7.2.3.6.
+		buffer.resize(offset + 1, false);
+		buffer[offset] = 0;
+		return 1;
+	}
+
+	buffer.resize(offset + deflateBound(&_deflater, static_cast<uLong>(length)) + 16, false);
+	_deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pMessage));
+	_deflater.avail_in = static_cast<uInt>(length);
+	std::size_t used = offset;
+	for (;;)
+	{
+		_deflater.next_out = reinterpret_cast<Bytef*>(buffer.begin() + used);
+		_deflater.avail_out = static_cast<uInt>(buffer.size() - used);
+		int rc = ::deflate(&_deflater, Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_BUF_ERROR) throw Poco::IOException("Cannot compress WebSocket message", zError(rc));
+		used = buffer.size() - _deflater.avail_out;
+		if (_deflater.avail_out > 0) break;
+		buffer.resize(2*buffer.size(), true);
+	}
+	if (used < offset + sizeof(TRAILER) || std::memcmp(buffer.begin() + used - sizeof(TRAILER), TRAILER, sizeof(TRAILER)) != 0)
+	{
+		throw Poco::IOException("Unexpected end of compressed WebSocket message");
+	}
+	used -= sizeof(TRAILER);
+	buffer.resize(used, true);
+	if (_resetDeflater) deflateReset(&_deflater);
+	return static_cast<int>(used - offset);
+}
+
+
+int WebSocketDeflate::inflate(const char* pData, int length, bool final, char* pBuffer, int bufferSize)
+{
+	setInput(pData, length);
+	int used = inflateSome(pBuffer, bufferSize);
+	if (_inflater.avail_in == 0 && final)
+	{
+		setInput(TRAILER, sizeof(TRAILER));
+		used += inflateSome(pBuffer + used, bufferSize - used);
+	}
+	bool tooBig = _inflater.avail_in > 0;
+	if (!tooBig && used == bufferSize)
+	{
+		// check whether there is more output pending
+		char c;
+		tooBig = inflateSome(&c, 1) > 0;
+	}
+	if (tooBig) throw WebSocketException("Insufficient buffer for decompressed payload", WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
+	if (final && _resetInflater) inflateReset(&_inflater);
+	return used;
+}
+
+
+int WebSocketDeflate::inflate(const char* pData, int length, bool final, Poco::Buffer<char>& buffer, int maxLength)
+{
+	const std::size_t oldSize = buffer.size();
+	const std::size_t limit = oldSize + maxLength + 1;
+	std::size_t used = oldSize;
+	for (int pass = 0; pass < (final ? 2 : 1); pass++)
+	{
+		if (pass == 0)
+			setInput(pData, length);
+		else
+			setInput(TRAILER, sizeof(TRAILER));
+
+		for (;;)
+		{
+			if (used == buffer.size())
+			{
+				if (used == limit) throw WebSocketException("Decompressed payload too big", WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
+				buffer.resize(std::min(used + std::max<std::size_t>(4*length, 1024), limit), true);
+			}
+			used += inflateSome(buffer.begin() + used, static_cast<int>(buffer.size() - used));
+			if (_inflater.avail_in == 0 && used < buffer.size()) break;
+		}
+	}
+	if (used - oldSize > static_cast<std::size_t>(maxLength)) throw WebSocketException("Decompressed payload too big", WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
+	buffer.resize(used, true);
+	if (final && _resetInflater) inflateReset(&_inflater);
+	return static_cast<int>(used - oldSize);
+}
+
+
+void WebSocketDeflate::setInput(const char* pData, int length)
+{
+	_inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pData));
+	_inflater.avail_in = static_cast<uInt>(length);
+}
+
+
+int WebSocketDeflate::inflateSome(char* pBuffer, int bufferSize)
+{
+	_inflater.next_out = reinterpret_cast<Bytef*>(pBuffer);
+	_inflater.avail_out = static_cast<uInt>(bufferSize);
+	// Input not producing any output (like the trailer) is consumed
+	// even if the output buffer is full.
+	while (_inflater.avail_in > 0)
+	{
+		int rc = ::inflate(&_inflater, Z_SYNC_FLUSH);
+		if (rc == Z_STREAM_END)
+		{
+			// The peer has finished the deflate stream (BFINAL set).
+			// Any subsequent data starts a new stream.
+			inflateReset(&_inflater);
+		}
+		else if (rc == Z_BUF_ERROR)
+		{
+			break;
+		}
+		else if (rc != Z_OK)
+		{
+			throw WebSocketException("Cannot decompress payload", zError(rc), WebSocket::WS_ERR_DECOMPRESSION);
+		}
+	}
+	if (_inflater.avail_in == 0 && _inflater.avail_out > 0)
+	{
+		// flush any output still held back by zlib
+		int rc = ::inflate(&_inflater, Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_BUF_ERROR && rc != Z_STREAM_END)
+		{
+			throw WebSocketException("Cannot decompress payload", zError(rc), WebSocket::WS_ERR_DECOMPRESSION);
+		}
+	}
+	return bufferSize - static_cast<int>(_inflater.avail_out);
+}
+
+
+std::string WebSocketDeflate::offer(const Params& params)
+{
+	std::string result(EXTENSION_NAME);
+	if (params.clientNoContextTakeover) result += "; client_no_context_takeover";
+	if (params.serverNoContextTakeover) result += "; server_no_context_takeover";
+	if (params.serverMaxWindowBits < MAX_WINDOW_BITS)
+	{
+		result += "; server_max_window_bits=";
+		result += Poco::NumberFormatter::format(std::max(params.serverMaxWindowBits, static_cast<int>(MIN_WINDOW_BITS)));
+	}
+	result += "; client_max_window_bits";
+	if (params.clientMaxWindowBits < MAX_WINDOW_BITS)
+	{
+		result += "=";
+		result += Poco::NumberFormatter::format(std::max(params.clientMaxWindowBits, static_cast<int>(MIN_WINDOW_BITS)));
+	}
+	return result;
+}
+
+
+bool WebSocketDeflate::negotiate(const std::string& offers, const Params& params, Params& agreed, std::string& response)
+{
+	for (const auto& extension: parseExtensions(offers))
+	{
+		if (extension.name != EXTENSION_NAME) continue;
+
+		Params p(params);
+		bool serverWindowBits = false;
+		bool clientWindowBits = false;
+		bool valid = true;
+		std::set<std::string> seen;
+		for (const auto& param: extension.params)
+		{
+			int bits;
+			if (!seen.insert(param.first).second)
+				valid = false;
+			else if (param.first == "server_no_context_takeover" && param.second.empty())
+				p.serverNoContextTakeover = true;
+			else if (param.first == "client_no_context_takeover" && param.second.empty())
+				p.clientNoContextTakeover = true;
+			else if (param.first == "server_max_window_bits" && parseWindowBits(param.second, bits))
+			{
+				serverWindowBits = true;
+				p.serverMaxWindowBits = std::min(bits, params.serverMaxWindowBits);
+			}
+			else if (param.first == "client_max_window_bits" && (param.second.empty() || parseWindowBits(param.second, bits)))
+			{
+				clientWindowBits = true;
+				if (!param.second.empty()) p.clientMaxWindowBits = std::min(bits, params.clientMaxWindowBits);
+			}
+			else valid = false;
+		}
+		// Decline offers requiring a window size not supported by zlib.
+		if (!valid || p.serverMaxWindowBits < MIN_WINDOW_BITS) continue;
+
+		// Our own window for decompressing is always the maximum,
+		// so the client's window only needs to be restricted on request.
+		if (!clientWindowBits) p.clientMaxWindowBits = MAX_WINDOW_BITS;
+
+		response = EXTENSION_NAME;
+		if (p.serverNoContextTakeover) response += "; server_no_context_takeover";
+		if (p.clientNoContextTakeover) response += "; client_no_context_takeover";
+		if (serverWindowBits)
+		{
+			response += "; server_max_window_bits=";
+			response += Poco::NumberFormatter::format(p.serverMaxWindowBits);
+		}
+		if (clientWindowBits && p.clientMaxWindowBits < MAX_WINDOW_BITS)
+		{
+			response += "; client_max_window_bits=";
+			response += Poco::NumberFormatter::format(p.clientMaxWindowBits);
+		}
+		agreed = p;
+		return true;
+	}
+	return false;
+}
+
+
+bool WebSocketDeflate::accept(const std::string& response, const std::string& offer, Params& agreed)
+{
+	std::vector<Extension> accepted = parseExtensions(response);
+	if (accepted.empty()) return false;
+	if (accepted.size() > 1 || accepted[0].name != EXTENSION_NAME)
+		throw WebSocketException("Unsupported extension in handshake response", response, WebSocket::WS_ERR_HANDSHAKE_EXTENSION);
+
+	Params offered;
+	bool clientWindowBitsOffered = false;
+	bool found = false;
+	for (const auto& extension: parseExtensions(offer))
+	{
+		if (extension.name != EXTENSION_NAME) continue;
+		found = true;
+		for (const auto& param: extension.params)
+		{
+			int bits;
+			if (param.first == "client_no_context_takeover")
+				offered.clientNoContextTakeover = true;
+			else if (param.first == "server_no_context_takeover")
+				offered.serverNoContextTakeover = true;
+			else if (param.first == "server_max_window_bits" && parseWindowBits(param.second, bits))
+				offered.serverMaxWindowBits = bits;
+			else if (param.first == "client_max_window_bits")
+			{
+				clientWindowBitsOffered = true;
+				if (parseWindowBits(param.second, bits)) offered.clientMaxWindowBits = bits;
+			}
+		}
+		break;
+	}
+	if (!found)
+		throw WebSocketException("Extension in handshake response has not been offered", response, WebSocket::WS_ERR_HANDSHAKE_EXTENSION);
+
+	Params p(offered);
+	std::set<std::string> seen;
+	for (const auto& param: accepted[0].params)
+	{
+		int bits;
+		if (!seen.insert(param.first).second)
+			throw WebSocketException("Duplicate extension parameter in handshake response", param.first, WebSocket::WS_ERR_HANDSHAKE_EXTENSION);
+		else if (param.first == "server_no_context_takeover" && param.second.empty())
+			p.serverNoContextTakeover = true;
+		else if (param.first == "client_no_context_takeover" && param.second.empty())
+			p.clientNoContextTakeover = true;
+		else if (param.first == "server_max_window_bits" && parseWindowBits(param.second, bits) && bits <= offered.serverMaxWindowBits)
+			p.serverMaxWindowBits = bits;
+		else if (param.first == "client_max_window_bits" && clientWindowBitsOffered && parseWindowBits(param.second, bits) && bits >= MIN_WINDOW_BITS)
+			p.clientMaxWindowBits = std::min(bits, offered.clientMaxWindowBits);
+		else
+			throw WebSocketException("Invalid extension parameter in handshake response", param.first, WebSocket::WS_ERR_HANDSHAKE_EXTENSION);
+	}
+	agreed = p;
+	return true;
+}
+
+
+} } // namespace Poco::Net
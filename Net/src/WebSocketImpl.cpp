@@ -17,12 +17,14 @@
 #include "Poco/Net/WebSocketImpl.h"
 #include "Poco/Net/NetException.h"
 #include "Poco/Net/WebSocket.h"
+#include "Poco/Net/WebSocketMask.h"
 #include "Poco/Net/HTTPSession.h"
 #include "Poco/Buffer.h"
 #include "Poco/BinaryWriter.h"
 #include "Poco/BinaryReader.h"
 #include "Poco/MemoryStream.h"
 #include "Poco/Format.h"
+#include <algorithm>
 #include <limits>
 #include <cstring>
 
@@ -37,7 +39,8 @@ WebSocketImpl::WebSocketImpl(StreamSocketImpl* pStreamSocketImpl, HTTPSession& s
 	_maxPayloadSize(std::numeric_limits<int>::max()),
 	_buffer(0),
 	_bufferOffset(0),
-	_mustMaskPayload(mustMaskPayload)
+	_mustMaskPayload(mustMaskPayload),
+	_inflating(false)
 {
 	poco_check_ptr(pStreamSocketImpl);
 	_pStreamSocketImpl->duplicate();
@@ -87,59 +90,81 @@ int WebSocketImpl::sendBytes(const void* buffer, int length, int flags)
 		else return -1;
 	}
 
+	if (flags == 0) flags = WebSocket::FRAME_BINARY;
+	flags &= 0xff;
+
+	// The payload is placed at MAX_HEADER_LENGTH, and the header is
+	// written right in front of it, so that a compressed payload
+	// can be produced directly in the frame buffer.
 	Poco::Buffer<char>& frame(_sendState.payload);
-	frame.resize(length + MAX_HEADER_LENGTH, false);
-	Poco::MemoryOutputStream ostr(frame.begin(), frame.size());
+	const char* payload = reinterpret_cast<const char*>(buffer);
+	int payloadLength = length;
+	const int opcode = flags & WebSocket::FRAME_OP_BITMASK;
+	if (_pDeflate && (flags & WebSocket::FRAME_FLAG_FIN) && !(flags & WebSocket::FRAME_FLAG_RSV1) && (opcode == WebSocket::FRAME_OP_TEXT || opcode == WebSocket::FRAME_OP_BINARY))
+	{
+		payloadLength = _pDeflate->deflate(payload, length, frame, MAX_HEADER_LENGTH);
+		payload = frame.begin() + MAX_HEADER_LENGTH;
+		flags |= WebSocket::FRAME_FLAG_RSV1;
+	}
+	else
+	{
+		frame.resize(length + MAX_HEADER_LENGTH, false);
+	}
+
+	int headerLength = 2;
+	if (payloadLength >= 65536)
+		headerLength += 8;
+	else if (payloadLength >= 126)
+		headerLength += 2;
+	if (_mustMaskPayload)
+		headerLength += MASK_LENGTH;
+	const int frameOffset = MAX_HEADER_LENGTH - headerLength;
+
+	Poco::MemoryOutputStream ostr(frame.begin() + frameOffset, headerLength);
 	Poco::BinaryWriter writer(ostr, Poco::BinaryWriter::NETWORK_BYTE_ORDER);
 
-	if (flags == 0) flags = WebSocket::FRAME_BINARY;
-	flags &= 0xff;
 	writer << static_cast<Poco::UInt8>(flags);
 	Poco::UInt8 lengthByte(0);
 	if (_mustMaskPayload)
 	{
 		lengthByte |= FRAME_FLAG_MASK;
 	}
-	if (length < 126)
+	if (payloadLength < 126)
 	{
-		lengthByte |= static_cast<Poco::UInt8>(length);
+		lengthByte |= static_cast<Poco::UInt8>(payloadLength);
 		writer << lengthByte;
 	}
-	else if (length < 65536)
+	else if (payloadLength < 65536)
 	{
 		lengthByte |= 126;
-		writer << lengthByte << static_cast<Poco::UInt16>(length);
+		writer << lengthByte << static_cast<Poco::UInt16>(payloadLength);
 	}
 	else
 	{
 		lengthByte |= 127;
-		writer << lengthByte << static_cast<Poco::UInt64>(length);
+		writer << lengthByte << static_cast<Poco::UInt64>(payloadLength);
 	}
+	char* p = frame.begin() + MAX_HEADER_LENGTH;
 	if (_mustMaskPayload)
 	{
 		const Poco::UInt32 mask = _rnd.next();
 		const char* m = reinterpret_cast<const char*>(&mask);
-		const char* b = reinterpret_cast<const char*>(buffer);
 		writer.writeRaw(m, MASK_LENGTH);
-		char* p = frame.begin() + ostr.charsWritten();
-		for (int i = 0; i < length; i++)
-		{
-			p[i] = b[i] ^ m[i % MASK_LENGTH];
-		}
+		WebSocketMask::apply(payload, p, payloadLength, m);
 	}
-	else
+	else if (payload != p)
 	{
-		std::memcpy(frame.begin() + ostr.charsWritten(), buffer, length);
+		std::memcpy(p, payload, payloadLength);
 	}
 
-	int frameLength = length + static_cast<int>(ostr.charsWritten());
-	int sent = _pStreamSocketImpl->sendBytes(frame.begin(), frameLength);
+	int frameLength = headerLength + payloadLength;
+	int sent = _pStreamSocketImpl->sendBytes(frame.begin() + frameOffset, frameLength);
 	if (sent >= 0)
 	{
 		if (sent < frameLength)
 		{
 			_sendState.length = length;
-			_sendState.remainingPayloadOffset = sent;
+			_sendState.remainingPayloadOffset = frameOffset + sent;
 			_sendState.remainingPayloadLength = frameLength - sent;
 			return -1;
 		}
@@ -154,7 +179,7 @@ int WebSocketImpl::sendBytes(const void* buffer, int length, int flags)
 	else
 	{
 		_sendState.length = length;
-		_sendState.remainingPayloadOffset = 0;
+		_sendState.remainingPayloadOffset = frameOffset;
 		_sendState.remainingPayloadLength = frameLength;
 		return -1;
 	}	
@@ -254,6 +279,52 @@ void WebSocketImpl::skipHeader(int headerLength)
 }
 
 
+bool WebSocketImpl::compressedFrame()
+{
+	if (!_pDeflate || _receiveState.headerLength == 0) return false;
+
+	// RSV1 is only set in the first frame of a compressed message.
+	const int opcode = _receiveState.frameFlags & WebSocket::FRAME_OP_BITMASK;
+	if (opcode == WebSocket::FRAME_OP_TEXT || opcode == WebSocket::FRAME_OP_BINARY)
+		_inflating = (_receiveState.frameFlags & WebSocket::FRAME_FLAG_RSV1) != 0;
+	else if (opcode != WebSocket::FRAME_OP_CONT)
+		return false;
+
+	_receiveState.frameFlags &= ~WebSocket::FRAME_FLAG_RSV1;
+	bool compressed = _inflating;
+	if (_receiveState.frameFlags & WebSocket::FRAME_FLAG_FIN) _inflating = false;
+	return compressed;
+}
+
+
+int WebSocketImpl::inflatePayload(void* buffer, int length)
+{
+	const bool final = (_receiveState.frameFlags & WebSocket::FRAME_FLAG_FIN) != 0;
+	return _pDeflate->inflate(_receiveState.payload.begin(), _receiveState.payloadLength, final, reinterpret_cast<char*>(buffer), std::min(length, _maxPayloadSize));
+}
+
+
+int WebSocketImpl::inflatePayload(Poco::Buffer<char>& buffer)
+{
+	const bool final = (_receiveState.frameFlags & WebSocket::FRAME_FLAG_FIN) != 0;
+	return _pDeflate->inflate(_receiveState.payload.begin(), _receiveState.payloadLength, final, buffer, _maxPayloadSize);
+}
+
+
+void WebSocketImpl::enableDeflate(const WebSocketDeflate::Params& params)
+{
+	_pDeflate = new WebSocketDeflate(params, !_mustMaskPayload);
+}
+
+
+void WebSocketImpl::setCompressionLevel(int level)
+{
+	if (!_pDeflate) throw Poco::IllegalStateException("permessage-deflate not enabled");
+
+	_pDeflate->setCompressionLevel(level);
+}
+
+
 void WebSocketImpl::setMaxPayloadSize(int maxPayloadSize)
 {
 	poco_assert (maxPayloadSize > 0);
@@ -267,10 +338,7 @@ int WebSocketImpl::receivePayload(char *buffer, int payloadLength, char mask[MAS
 	int received = receiveNBytes(reinterpret_cast<char*>(buffer), payloadLength);
 	if (received > 0 && useMask)
 	{
-		for (int i = 0; i < received; i++)
-		{
-			buffer[i] ^= mask[(i + maskOffset) % MASK_LENGTH];
-		}
+		WebSocketMask::apply(buffer, received, mask, maskOffset);
 	}
 	return received;
 }
@@ -285,6 +353,20 @@ int WebSocketImpl::receiveBytes(void* buffer, int length, int)
 		{
 			payloadLength = peekHeader(_receiveState);
 		}
+		// The payload is received in full below, so nothing remains
+		// for a subsequent non-blocking receiveBytes().
+		_receiveState.remainingPayloadLength = 0;
+		_receiveState.compressed = compressedFrame();
+		if (_receiveState.compressed)
+		{
+			skipHeader(_receiveState.headerLength);
+
+			_receiveState.payload.resize(payloadLength, false);
+			if (payloadLength > 0 && receivePayload(_receiveState.payload.begin(), payloadLength, _receiveState.mask, _receiveState.useMask, 0) != payloadLength)
+				throw WebSocketException("Incomplete frame received", WebSocket::WS_ERR_INCOMPLETE_FRAME);
+
+			return inflatePayload(buffer, length);
+		}
 		if (payloadLength <= 0)
 		{
 			skipHeader(_receiveState.headerLength);
@@ -307,12 +389,14 @@ int WebSocketImpl::receiveBytes(void* buffer, int length, int)
 		if (_receiveState.remainingPayloadLength == 0)
 		{
 			int payloadLength = peekHeader(_receiveState);
+			_receiveState.compressed = compressedFrame();
 			if (payloadLength <= 0)
 			{
 				skipHeader(_receiveState.headerLength);
+				if (_receiveState.compressed) return inflatePayload(buffer, length);
 				return payloadLength;
 			}
-			else if (payloadLength > length)
+			else if (payloadLength > length && !_receiveState.compressed)
 			{
 				throw WebSocketException(Poco::format("Insufficient buffer for payload size %d", payloadLength), WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
 			}
@@ -321,7 +405,7 @@ int WebSocketImpl::receiveBytes(void* buffer, int length, int)
 
 			_receiveState.payload.resize(payloadLength, false);
 		}
-		else if (_receiveState.payloadLength > length)
+		else if (_receiveState.payloadLength > length && !_receiveState.compressed)
 		{
 			throw WebSocketException(Poco::format("Insufficient buffer for payload size %d", _receiveState.payloadLength), WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
 		}
@@ -333,6 +417,7 @@ int WebSocketImpl::receiveBytes(void* buffer, int length, int)
 			if (_receiveState.remainingPayloadLength == 0)
 			{
 				_receiveState.maskOffset = 0;
+				if (_receiveState.compressed) return inflatePayload(buffer, length);
 				std::memcpy(buffer, _receiveState.payload.begin(), _receiveState.payloadLength);
 				return _receiveState.payloadLength;
 			}
@@ -363,6 +448,20 @@ int WebSocketImpl::receiveBytes(Poco::Buffer<char>& buffer, int, const Poco::Tim
 		{
 			payloadLength = peekHeader(_receiveState);
 		}
+		// The payload is received in full below, so nothing remains
+		// for a subsequent non-blocking receiveBytes().
+		_receiveState.remainingPayloadLength = 0;
+		_receiveState.compressed = compressedFrame();
+		if (_receiveState.compressed)
+		{
+			skipHeader(_receiveState.headerLength);
+
+			_receiveState.payload.resize(payloadLength, false);
+			if (payloadLength > 0 && receivePayload(_receiveState.payload.begin(), payloadLength, _receiveState.mask, _receiveState.useMask, 0) != payloadLength)
+				throw WebSocketException("Incomplete frame received", WebSocket::WS_ERR_INCOMPLETE_FRAME);
+
+			return inflatePayload(buffer);
+		}
 		if (payloadLength <= 0)
 			return payloadLength;
 
@@ -381,6 +480,12 @@ int WebSocketImpl::receiveBytes(Poco::Buffer<char>& buffer, int, const Poco::Tim
 		if (_receiveState.remainingPayloadLength == 0)
 		{
 			int payloadLength = peekHeader(_receiveState);
+			_receiveState.compressed = compressedFrame();
+			if (_receiveState.compressed && payloadLength == 0)
+			{
+				skipHeader(_receiveState.headerLength);
+				return inflatePayload(buffer);
+			}
 			if (payloadLength <= 0)
 				return payloadLength;
 
@@ -396,6 +501,7 @@ int WebSocketImpl::receiveBytes(Poco::Buffer<char>& buffer, int, const Poco::Tim
 			if (_receiveState.remainingPayloadLength == 0)
 			{
 				_receiveState.maskOffset = 0;
+				if (_receiveState.compressed) return inflatePayload(buffer);
 				std::size_t oldSize = buffer.size();
 				buffer.resize(oldSize + _receiveState.payloadLength);
 
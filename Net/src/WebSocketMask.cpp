@@ -0,0 +1,218 @@
+//
+// WebSocketMask.cpp
+//
+// Library: Net
+// Package: WebSocket
+// Module:  WebSocketMask
+//
+// Copyright (c) 2012, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/Net/WebSocketMask.h"
+#include "Poco/Types.h"
+#include <cstring>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define POCO_WEBSOCKET_MASK_SSE2
+#include <emmintrin.h>
+#endif
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define POCO_WEBSOCKET_MASK_AVX2
+#define POCO_WEBSOCKET_MASK_AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define POCO_WEBSOCKET_MASK_AVX2
+#define POCO_WEBSOCKET_MASK_AVX2_TARGET
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define POCO_WEBSOCKET_MASK_NEON
+#include <arm_neon.h>
+#endif
+
+
+namespace Poco {
+namespace Net {
+
+
+namespace
+{
+	// All kernels expect the mask to be rotated so that mask[0] applies
+	// to the first byte. As every kernel processes a multiple of four bytes
+	// before handing the remaining bytes on, the mask stays aligned.
+	// On x86, the memory order of the bytes of a 32-bit lane is
+	// the same as for the mask.
+
+	using Kernel = void (*)(const char* source, char* target, std::size_t length, const char* mask);
+
+	void maskWord(const char* source, char* target, std::size_t length, const char* mask)
+	{
+		Poco::UInt32 mask32;
+		std::memcpy(&mask32, mask, sizeof(mask32));
+		const Poco::UInt64 mask64 = (static_cast<Poco::UInt64>(mask32) << 32) | mask32;
+
+		std::size_t i = 0;
+		for (; i + sizeof(mask64) <= length; i += sizeof(mask64))
+		{
+			Poco::UInt64 word;
+			std::memcpy(&word, source + i, sizeof(word));
+			word ^= mask64;
+			std::memcpy(target + i, &word, sizeof(word));
+		}
+		for (; i < length; i++)
+		{
+			target[i] = source[i] ^ mask[i & 3];
+		}
+	}
+
+#if defined(POCO_WEBSOCKET_MASK_SSE2)
+
+	void maskSSE2(const char* source, char* target, std::size_t length, const char* mask)
+	{
+		Poco::Int32 mask32;
+		std::memcpy(&mask32, mask, sizeof(mask32));
+		const __m128i m = _mm_set1_epi32(mask32);
+
+		std::size_t i = 0;
+		for (; i + 16 <= length; i += 16)
+		{
+			__m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(target + i), _mm_xor_si128(data, m));
+		}
+		maskWord(source + i, target + i, length - i, mask);
+	}
+
+#endif // POCO_WEBSOCKET_MASK_SSE2
+
+#if defined(POCO_WEBSOCKET_MASK_AVX2)
+
+	POCO_WEBSOCKET_MASK_AVX2_TARGET
+	void maskAVX2(const char* source, char* target, std::size_t length, const char* mask)
+	{
+		Poco::Int32 mask32;
+		std::memcpy(&mask32, mask, sizeof(mask32));
+		const __m256i m = _mm256_set1_epi32(mask32);
+
+		std::size_t i = 0;
+		for (; i + 64 <= length; i += 64)
+		{
+			__m256i data0 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+			__m256i data1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i + 32));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), _mm256_xor_si256(data0, m));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i + 32), _mm256_xor_si256(data1, m));
+		}
+		for (; i + 32 <= length; i += 32)
+		{
+			__m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(source + i));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(target + i), _mm256_xor_si256(data, m));
+		}
+		maskWord(source + i, target + i, length - i, mask);
+	}
+
+	bool haveAVX2()
+	{
+#if defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) return false;
+		__cpuid(info, 1);
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		const bool avx = (info[2] & (1 << 28)) != 0;
+		if (!osxsave || !avx || (_xgetbv(0) & 6) != 6) return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}
+
+#endif // POCO_WEBSOCKET_MASK_AVX2
+
+#if defined(POCO_WEBSOCKET_MASK_NEON)
+
+	void maskNEON(const char* source, char* target, std::size_t length, const char* mask)
+	{
+		Poco::UInt8 mask128[16];
+		for (int k = 0; k < 16; k += 4) std::memcpy(mask128 + k, mask, 4);
+		const uint8x16_t m = vld1q_u8(mask128);
+
+		std::size_t i = 0;
+		for (; i + 32 <= length; i += 32)
+		{
+			uint8x16_t data0 = vld1q_u8(reinterpret_cast<const Poco::UInt8*>(source + i));
+			uint8x16_t data1 = vld1q_u8(reinterpret_cast<const Poco::UInt8*>(source + i + 16));
+			vst1q_u8(reinterpret_cast<Poco::UInt8*>(target + i), veorq_u8(data0, m));
+			vst1q_u8(reinterpret_cast<Poco::UInt8*>(target + i + 16), veorq_u8(data1, m));
+		}
+		for (; i + 16 <= length; i += 16)
+		{
+			uint8x16_t data = vld1q_u8(reinterpret_cast<const Poco::UInt8*>(source + i));
+			vst1q_u8(reinterpret_cast<Poco::UInt8*>(target + i), veorq_u8(data, m));
+		}
+		maskWord(source + i, target + i, length - i, mask);
+	}
+
+#endif // POCO_WEBSOCKET_MASK_NEON
+
+	struct Implementation
+	{
+		Kernel kernel;
+		std::string name;
+	};
+
+	Implementation selectImplementation()
+	{
+#if defined(POCO_WEBSOCKET_MASK_AVX2)
+		if (haveAVX2()) return Implementation{maskAVX2, "avx2"};
+#endif
+#if defined(POCO_WEBSOCKET_MASK_SSE2)
+		return Implementation{maskSSE2, "sse2"};
+#elif defined(POCO_WEBSOCKET_MASK_NEON)
+		return Implementation{maskNEON, "neon"};
+#else
+		return Implementation{maskWord, "word"};
+#endif
+	}
+
+	const Implementation& selectedImplementation()
+	{
+		static const Implementation impl = selectImplementation();
+		return impl;
+	}
+}
+
+
+void WebSocketMask::apply(const char* source, char* target, std::size_t length, const char mask[MASK_LENGTH], std::size_t offset)
+{
+	// Short payloads, e.g. of control frames, are not
+	// worth setting up a kernel for.
+	if (length < SHORT_PAYLOAD_LENGTH)
+	{
+		for (std::size_t i = 0; i < length; i++)
+		{
+			target[i] = source[i] ^ mask[(i + offset) & 3];
+		}
+		return;
+	}
+
+	char rotatedMask[MASK_LENGTH];
+	for (std::size_t k = 0; k < MASK_LENGTH; k++)
+	{
+		rotatedMask[k] = mask[(k + offset) & 3];
+	}
+	selectedImplementation().kernel(source, target, length, rotatedMask);
+}
+
+
+const std::string& WebSocketMask::implementation()
+{
+	return selectedImplementation().name;
+}
+
+
+} } // namespace Poco::Net
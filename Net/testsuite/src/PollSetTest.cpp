@@ -194,6 +194,125 @@ void PollSetTest::testPollClosedServer()
 }
 
 
+void PollSetTest::testPollEvents()
+{
+	EchoServer echoServer1;
+	EchoServer echoServer2;
+	StreamSocket ss1;
+	StreamSocket ss2;
+
+	ss1.connect(SocketAddress("127.0.0.1", echoServer1.port()));
+	ss2.connect(SocketAddress("127.0.0.1", echoServer2.port()));
+
+	int data1 = 1;
+	int data2 = 2;
+	PollSet ps;
+	ps.add(ss1, PollSet::POLL_READ, &data1);
+	ps.add(ss2, PollSet::POLL_READ, &data2);
+
+	PollSet::SocketEventList events;
+	Timespan timeout(1000000);
+	assertTrue (ps.poll(Timespan(100000), events) == 0);
+	assertTrue (events.empty());
+
+	ss2.sendBytes("HELLO", 5);
+	Stopwatch sw; sw.start();
+	do
+	{
+		ps.poll(timeout, events);
+		if (sw.elapsedSeconds() > 10) fail();
+	} while (events.empty());
+	assertTrue (events.size() == 1);
+	assertTrue (events[0].pSocket == ss2.impl());
+	assertTrue (events[0].mode == PollSet::POLL_READ);
+	assertTrue (events[0].pUserData == &data2);
+
+	char buffer[256];
+	int n = ss2.receiveBytes(buffer, sizeof(buffer));
+	assertTrue (n == 5);
+
+	// updating the mode keeps the user data
+	ps.update(ss1, PollSet::POLL_READ | PollSet::POLL_WRITE);
+	assertTrue (ps.poll(timeout, events) == 1);
+	assertTrue (events[0].pSocket == ss1.impl());
+	assertTrue (events[0].mode == PollSet::POLL_WRITE);
+	assertTrue (events[0].pUserData == &data1);
+
+	// adding again replaces the user data
+	ps.add(ss1, PollSet::POLL_WRITE, &data2);
+	assertTrue (ps.poll(timeout, events) == 1);
+	assertTrue (events[0].pUserData == &data2);
+
+	ps.remove(ss1);
+	assertTrue (ps.poll(Timespan(100000), events) == 0);
+
+	ss1.close();
+	ss2.close();
+}
+
+
+void PollSetTest::testPollEdge()
+{
+#if defined(POCO_HAVE_FD_EPOLL)
+	EchoServer echoServer;
+	StreamSocket ss;
+	ss.connect(SocketAddress("127.0.0.1", echoServer.port()));
+
+	PollSet ps;
+	ps.add(ss, PollSet::POLL_READ | PollSet::POLL_EDGE);
+
+	ss.sendBytes("hello", 5);
+	Timespan timeout(1000000);
+	PollSet::SocketModeMap sm = ps.poll(timeout);
+	assertTrue (sm.find(ss) != sm.end());
+	assertTrue (sm.find(ss)->second == PollSet::POLL_READ);
+
+	// not reported again, as no new data has arrived
+	sm = ps.poll(Timespan(100000));
+	assertTrue (sm.empty());
+
+	char buffer[256];
+	int n = ss.receiveBytes(buffer, sizeof(buffer));
+	assertTrue (n == 5);
+	assertTrue (std::string(buffer, n) == "hello");
+
+	// updating the mode re-arms the socket
+	ss.sendBytes("HELLO", 5);
+	sm = ps.poll(timeout);
+	assertTrue (sm.find(ss) != sm.end());
+	ps.update(ss, PollSet::POLL_READ | PollSet::POLL_EDGE);
+	sm = ps.poll(timeout);
+	assertTrue (sm.find(ss) != sm.end());
+
+	n = ss.receiveBytes(buffer, sizeof(buffer));
+	assertTrue (n == 5);
+	assertTrue (std::string(buffer, n) == "HELLO");
+#endif // POCO_HAVE_FD_EPOLL
+}
+
+
+void PollSetTest::testWakeUpAfterClear()
+{
+#if defined(POCO_HAVE_FD_EPOLL)
+	EchoServer echoServer;
+	StreamSocket ss;
+	ss.connect(SocketAddress("127.0.0.1", echoServer.port()));
+
+	PollSet ps;
+	ps.add(ss, PollSet::POLL_READ);
+	ps.clear();
+	assertTrue(ps.empty());
+	ps.add(ss, PollSet::POLL_READ);
+
+	ps.wakeUp();
+	Stopwatch sw; sw.start();
+	PollSet::SocketModeMap sm = ps.poll(Timespan(10, 0));
+	assertTrue(sm.empty());
+	assertTrue(sw.elapsedSeconds() < 5);
+#endif // POCO_HAVE_FD_EPOLL
+}
+
+
 void PollSetTest::setUp()
 {
 }
@@ -211,6 +330,9 @@ CppUnit::Test* PollSetTest::suite()
 	CppUnit_addTest(pSuite, PollSetTest, testPoll);
 	CppUnit_addTest(pSuite, PollSetTest, testPollNoServer);
 	CppUnit_addTest(pSuite, PollSetTest, testPollClosedServer);
+	CppUnit_addTest(pSuite, PollSetTest, testPollEvents);
+	CppUnit_addTest(pSuite, PollSetTest, testPollEdge);
+	CppUnit_addTest(pSuite, PollSetTest, testWakeUpAfterClear);
 
 	return pSuite;
 }
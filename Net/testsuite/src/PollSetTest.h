@@ -27,6 +27,9 @@ public:
 	void testPoll();
 	void testPollNoServer();
 	void testPollClosedServer();
+	void testPollEvents();
+	void testPollEdge();
+	void testWakeUpAfterClear();
 
 	void setUp();
 	void tearDown();
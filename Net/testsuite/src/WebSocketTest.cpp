@@ -12,6 +12,7 @@
 #include "CppUnit/TestCaller.h"
 #include "CppUnit/TestSuite.h"
 #include "Poco/Net/WebSocket.h"
+#include "Poco/Net/WebSocketMask.h"
 #include "Poco/Net/SocketStream.h"
 #include "Poco/Net/HTTPClientSession.h"
 #include "Poco/Net/HTTPServer.h"
@@ -34,6 +35,7 @@ using Poco::Net::HTTPServerResponse;
 using Poco::Net::SocketStream;
 using Poco::Net::WebSocket;
 using Poco::Net::WebSocketException;
+using Poco::Net::WebSocketMask;
 
 
 namespace
@@ -41,7 +43,7 @@ namespace
 	class WebSocketRequestHandler: public Poco::Net::HTTPRequestHandler
 	{
 	public:
-		WebSocketRequestHandler(std::size_t bufSize = 1024): _bufSize(bufSize)
+		WebSocketRequestHandler(std::size_t bufSize = 1024, bool deflate = false): _bufSize(bufSize), _deflate(deflate)
 		{
 		}
 
@@ -49,7 +51,7 @@ namespace
 		{
 			try
 			{
-				WebSocket ws(request, response);
+				WebSocket ws = _deflate ? WebSocket(request, response, Poco::Net::WebSocketDeflate::Params()) : WebSocket(request, response);
 				Poco::Buffer<char> buffer(_bufSize);
 				int flags;
 				int n;
@@ -80,22 +82,24 @@ namespace
 
 	private:
 		std::size_t _bufSize;
+		bool _deflate;
 	};
 	
 	class WebSocketRequestHandlerFactory: public Poco::Net::HTTPRequestHandlerFactory
 	{
 	public:
-		WebSocketRequestHandlerFactory(std::size_t bufSize = 1024): _bufSize(bufSize)
+		WebSocketRequestHandlerFactory(std::size_t bufSize = 1024, bool deflate = false): _bufSize(bufSize), _deflate(deflate)
 		{
 		}
 
 		Poco::Net::HTTPRequestHandler* createRequestHandler(const HTTPServerRequest& request)
 		{
-			return new WebSocketRequestHandler(_bufSize);
+			return new WebSocketRequestHandler(_bufSize, _deflate);
 		}
 
 	private:
 		std::size_t _bufSize;
+		bool _deflate;
 	};
 }
 
@@ -343,6 +347,179 @@ void WebSocketTest::testWebSocketNB()
 }
 
 
+void WebSocketTest::testDeflate(const Poco::Net::WebSocketDeflate::Params& params)
+{
+	const int msgSize = 70000;
+
+	Poco::Net::ServerSocket ss(0);
+	Poco::Net::HTTPServer server(new WebSocketRequestHandlerFactory(msgSize, true), ss, new Poco::Net::HTTPServerParams);
+	server.start();
+
+	Poco::Thread::sleep(200);
+
+	HTTPClientSession cs("127.0.0.1", ss.address().port());
+	HTTPRequest request(HTTPRequest::HTTP_GET, "/ws", HTTPRequest::HTTP_1_1);
+	HTTPResponse response;
+	WebSocket::offerDeflate(request, params);
+	WebSocket ws(cs, request, response);
+	assertTrue (ws.deflateEnabled());
+	assertTrue (response.get("Sec-WebSocket-Extensions", "").find("permessage-deflate") == 0);
+
+	Poco::Buffer<char> buffer(msgSize);
+	int flags;
+	int n;
+	for (int i = 0; i < 3; i++)
+	{
+		std::string payload("Hello, world!");
+		ws.sendFrame(payload.data(), (int) payload.size());
+		n = ws.receiveFrame(buffer.begin(), static_cast<int>(buffer.size()), flags);
+		assertTrue (n == payload.size());
+		assertTrue (payload.compare(0, payload.size(), buffer.begin(), n) == 0);
+		assertTrue (flags == WebSocket::FRAME_TEXT);
+
+		payload.clear();
+		for (int k = 0; payload.size() < msgSize; k++)
+		{
+			payload += "line ";
+			payload += std::to_string(k);
+			payload += '\n';
+		}
+		payload.resize(msgSize);
+		ws.sendFrame(payload.data(), (int) payload.size(), WebSocket::FRAME_BINARY);
+		n = ws.receiveFrame(buffer.begin(), static_cast<int>(buffer.size()), flags);
+		assertTrue (n == payload.size());
+		assertTrue (payload.compare(0, payload.size(), buffer.begin(), n) == 0);
+		assertTrue (flags == WebSocket::FRAME_BINARY);
+
+		ws.sendFrame(payload.data(), (int) payload.size());
+		Poco::Buffer<char> pocobuffer(0);
+		n = ws.receiveFrame(pocobuffer, flags);
+		assertTrue (n == payload.size());
+		assertTrue (n == pocobuffer.size());
+		assertTrue (payload.compare(0, payload.size(), pocobuffer.begin(), n) == 0);
+		assertTrue (flags == WebSocket::FRAME_TEXT);
+	}
+
+	ws.setBlocking(false);
+	std::string payload(40000, 'z');
+	n = ws.sendFrame(payload.data(), (int) payload.size());
+	assertTrue (n == payload.size());
+	n = -1;
+	while (n < 0 && ws.poll(1000000, Poco::Net::Socket::SELECT_READ))
+	{
+		n = ws.receiveFrame(buffer.begin(), static_cast<int>(buffer.size()), flags);
+	}
+	assertTrue (n == payload.size());
+	assertTrue (payload.compare(0, payload.size(), buffer.begin(), n) == 0);
+	assertTrue (flags == WebSocket::FRAME_TEXT);
+	ws.setBlocking(true);
+
+	try
+	{
+		std::string payload(1024, 'x');
+		ws.sendFrame(payload.data(), (int) payload.size());
+		ws.receiveFrame(buffer.begin(), 1000, flags);
+		fail("decompressed payload does not fit - must throw");
+	}
+	catch (WebSocketException& exc)
+	{
+		assertTrue (exc.code() == WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
+	}
+
+	ws.close();
+	server.stop();
+}
+
+
+void WebSocketTest::testWebSocketDeflate()
+{
+	testDeflate(Poco::Net::WebSocketDeflate::Params());
+}
+
+
+void WebSocketTest::testWebSocketDeflateNoContextTakeover()
+{
+	Poco::Net::WebSocketDeflate::Params params;
+	params.clientNoContextTakeover = true;
+	params.serverNoContextTakeover = true;
+	params.clientMaxWindowBits = 10;
+	params.serverMaxWindowBits = 9;
+	testDeflate(params);
+}
+
+
+void WebSocketTest::testWebSocketDeflateDeclined()
+{
+	Poco::Net::ServerSocket ss(0);
+	Poco::Net::HTTPServer server(new WebSocketRequestHandlerFactory, ss, new Poco::Net::HTTPServerParams);
+	server.start();
+
+	Poco::Thread::sleep(200);
+
+	HTTPClientSession cs("127.0.0.1", ss.address().port());
+	HTTPRequest request(HTTPRequest::HTTP_GET, "/ws", HTTPRequest::HTTP_1_1);
+	HTTPResponse response;
+	WebSocket::offerDeflate(request);
+	WebSocket ws(cs, request, response);
+	assertTrue (!ws.deflateEnabled());
+
+	std::string payload(500, 'x');
+	ws.sendFrame(payload.data(), (int) payload.size());
+	char buffer[1024] = {};
+	int flags;
+	int n = ws.receiveFrame(buffer, sizeof(buffer), flags);
+	assertTrue (n == payload.size());
+	assertTrue (payload.compare(0, payload.size(), buffer, n) == 0);
+	assertTrue (flags == WebSocket::FRAME_TEXT);
+
+	ws.close();
+	server.stop();
+}
+
+
+void WebSocketTest::testWebSocketMask()
+{
+	const char mask[] = {'\x12', '\x34', '\x56', '\x78'};
+	std::string payload;
+	for (int i = 0; i < 300; i++) payload += static_cast<char>(i*7 + 3);
+
+	// All lengths, offsets and source and target alignments, so that
+	// every vector and tail code path is taken.
+	for (std::size_t length = 0; length <= 260; length++)
+	{
+		for (std::size_t offset = 0; offset < 4; offset++)
+		{
+			for (std::size_t align = 0; align < 4; align++)
+			{
+				std::string expected(payload, align, length);
+				for (std::size_t i = 0; i < length; i++) expected[i] ^= mask[(i + offset) % 4];
+
+				std::string target(length + 4, '\0');
+				WebSocketMask::apply(payload.data() + align, &target[3 - align], length, mask, offset);
+				assertTrue (target.compare(3 - align, length, expected) == 0);
+
+				std::string data(payload, align, length);
+				WebSocketMask::apply(&data[0], length, mask, offset);
+				assertTrue (data == expected);
+				WebSocketMask::apply(&data[0], length, mask, offset);
+				assertTrue (data.compare(0, length, payload, align, length) == 0);
+			}
+		}
+	}
+
+	// Unmasking in parts must give the same result as unmasking at once.
+	std::string data(payload);
+	WebSocketMask::apply(&data[0], 5, mask, 0);
+	WebSocketMask::apply(&data[5], 100, mask, 5);
+	WebSocketMask::apply(&data[105], data.size() - 105, mask, 105);
+	WebSocketMask::apply(&data[0], data.size(), mask, 0);
+	assertTrue (data == payload);
+
+	const std::string& impl = WebSocketMask::implementation();
+	assertTrue (impl == "avx2" || impl == "sse2" || impl == "neon" || impl == "word");
+}
+
+
 void WebSocketTest::setUp()
 {
 }
@@ -361,6 +538,10 @@ CppUnit::Test* WebSocketTest::suite()
 	CppUnit_addTest(pSuite, WebSocketTest, testWebSocketLarge);
 	CppUnit_addTest(pSuite, WebSocketTest, testWebSocketLargeInOneFrame);
 	CppUnit_addTest(pSuite, WebSocketTest, testWebSocketNB);
+	CppUnit_addTest(pSuite, WebSocketTest, testWebSocketDeflate);
+	CppUnit_addTest(pSuite, WebSocketTest, testWebSocketDeflateNoContextTakeover);
+	CppUnit_addTest(pSuite, WebSocketTest, testWebSocketDeflateDeclined);
+	CppUnit_addTest(pSuite, WebSocketTest, testWebSocketMask);
 
 	return pSuite;
 }
@@ -15,6 +15,7 @@
 
 
 #include "Poco/Net/Net.h"
+#include "Poco/Net/WebSocketDeflate.h"
 #include "CppUnit/TestCase.h"
 
 
@@ -28,6 +29,10 @@ public:
 	void testWebSocketLarge();
 	void testWebSocketLargeInOneFrame();
 	void testWebSocketNB();
+	void testWebSocketDeflate();
+	void testWebSocketDeflateNoContextTakeover();
+	void testWebSocketDeflateDeclined();
+	void testWebSocketMask();
 
 	void setUp();
 	void tearDown();
@@ -36,6 +41,7 @@ public:
 
 private:
 	void testOneLargeFrame(int msgSize);
+	void testDeflate(const Poco::Net::WebSocketDeflate::Params& params);
 };
 
 
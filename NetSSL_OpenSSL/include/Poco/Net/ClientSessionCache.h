@@ -0,0 +1,119 @@
+//
+// ClientSessionCache.h
+//
+// Library: NetSSL_OpenSSL
+// Package: SSLCore
+// Module:  ClientSessionCache
+//
+// Definition of the ClientSessionCache class.
+//
+// Copyright (c) 2010, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef NetSSL_ClientSessionCache_INCLUDED
+#define NetSSL_ClientSessionCache_INCLUDED
+
+
+#include "Poco/Net/NetSSL.h"
+#include "Poco/Net/Context.h"
+#include "Poco/Net/Session.h"
+#include "Poco/Mutex.h"
+#include <openssl/ssl.h>
+#include <map>
+
+
+namespace Poco {
+namespace Net {
+
+
+class NetSSL_API ClientSessionCache
+	/// ClientSessionCache keeps the most recent resumable TLS session
+	/// for every server host name, so that new connections to the
+	/// same server can use an abbreviated handshake.
+	///
+	/// A cache is attached to one or more client Context objects.
+	/// All sessions established with an attached Context are added
+	/// to the cache, including TLS 1.3 session tickets, which the server
+	/// sends only after the handshake has been completed. The host
+	/// name is taken from the Server Name Indication (SNI) of the connection.
+	///
+	/// HTTPSSessionInstantiator looks up a cached session for the host
+	/// of the URI if its Context has a cache attached, so that
+	/// all HTTPS and secure WebSocket connections created through the
+	/// HTTPSessionFactory automatically resume cached sessions.
+	///
+	/// Sessions can be saved to and loaded from a file, so that they
+	/// survive a restart of the process. Note that such a file contains
+	/// the session secrets and must be protected accordingly.
+{
+public:
+	ClientSessionCache();
+		/// Creates an empty ClientSessionCache.
+
+	~ClientSessionCache();
+		/// Destroys the ClientSessionCache.
+		///
+		/// The ClientSessionCache must not be destroyed while
+		/// Context objects it has been attached to are still in use.
+
+	void attach(Context::Ptr pContext);
+		/// Attaches the cache to the given client Context, and
+		/// enables client-side session caching for the Context.
+
+	static ClientSessionCache* attachedCache(Context::Ptr pContext);
+		/// Returns the cache attached to the given Context, or
+		/// null if no cache has been attached.
+
+	Session::Ptr find(const std::string& host);
+		/// Returns the cached session for the given host, or null
+		/// if no session is available. Expired sessions are removed.
+
+	void add(const std::string& host, Session::Ptr pSession);
+		/// Adds the given session for the given host to the cache,
+		/// replacing any session previously cached for the host.
+
+	void remove(const std::string& host);
+		/// Removes the cached session for the given host.
+
+	void clear();
+		/// Removes all sessions from the cache.
+
+	std::size_t size() const;
+		/// Returns the number of cached sessions.
+
+	void load(const std::string& path);
+		/// Adds all sessions that have not expired yet from the given file,
+		/// which must have been written with save().
+
+	void save(const std::string& path) const;
+		/// Writes all sessions that have not expired yet to the given file.
+		///
+		/// The file is written atomically by writing a temporary
+		/// file first, which is then renamed. On POSIX platforms,
+		/// the file is only accessible by its owner.
+
+	static ClientSessionCache& defaultCache();
+		/// Returns a reference to the process-wide default cache.
+
+protected:
+	static int onNewSession(SSL* pSSL, SSL_SESSION* pSession);
+	static bool expired(SSL_SESSION* pSession);
+	static int contextIndex();
+
+private:
+	std::map<std::string, Session::Ptr> _sessions;
+	mutable Poco::FastMutex _mutex;
+
+	ClientSessionCache(const ClientSessionCache&) = delete;
+	ClientSessionCache& operator = (const ClientSessionCache&) = delete;
+};
+
+
+} } // namespace Poco::Net
+
+
+#endif // NetSSL_ClientSessionCache_INCLUDED
@@ -44,6 +44,9 @@ public:
 
 	HTTPClientSession* createClientSession(const Poco::URI& uri);
 		/// Creates a HTTPSClientSession for the given URI.
+		///
+		/// If a ClientSessionCache has been attached to the Context,
+		/// the session cached for the host of the URI, if any, is resumed.
 
 	static void registerInstantiator();
 		/// Registers the instantiator with the global HTTPSessionFactory.
@@ -0,0 +1,233 @@
+//
+// ClientSessionCache.cpp
+//
+// Library: NetSSL_OpenSSL
+// Package: SSLCore
+// Module:  ClientSessionCache
+//
+// Copyright (c) 2010, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/Net/ClientSessionCache.h"
+#include "Poco/FileStream.h"
+#include "Poco/File.h"
+#include "Poco/Base64Encoder.h"
+#include "Poco/Base64Decoder.h"
+#include "Poco/StreamCopier.h"
+#include "Poco/SingletonHolder.h"
+#include "Poco/String.h"
+#include "Poco/Buffer.h"
+#include <sstream>
+#include <ctime>
+#if defined(POCO_OS_FAMILY_UNIX)
+#include <sys/stat.h>
+#endif
+
+
+namespace Poco {
+namespace Net {
+
+
+ClientSessionCache::ClientSessionCache()
+{
+}
+
+
+ClientSessionCache::~ClientSessionCache()
+{
+}
+
+
+void ClientSessionCache::attach(Context::Ptr pContext)
+{
+	poco_check_ptr (pContext);
+	poco_assert (!pContext->isForServerUse());
+
+	pContext->enableSessionCache(true);
+	SSL_CTX_set_ex_data(pContext->sslContext(), contextIndex(), this);
+	SSL_CTX_sess_set_new_cb(pContext->sslContext(), &ClientSessionCache::onNewSession);
+}
+
+
+ClientSessionCache* ClientSessionCache::attachedCache(Context::Ptr pContext)
+{
+	if (!pContext) return 0;
+	return reinterpret_cast<ClientSessionCache*>(SSL_CTX_get_ex_data(pContext->sslContext(), contextIndex()));
+}
+
+
+Session::Ptr ClientSessionCache::find(const std::string& host)
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	auto it = _sessions.find(Poco::toLower(host));
+	if (it != _sessions.end())
+	{
+		if (!expired(it->second->sslSession()))
+			return it->second;
+		_sessions.erase(it);
+	}
+	return 0;
+}
+
+
+void ClientSessionCache::add(const std::string& host, Session::Ptr pSession)
+{
+	poco_check_ptr (pSession);
+
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	_sessions[Poco::toLower(host)] = pSession;
+}
+
+
+void ClientSessionCache::remove(const std::string& host)
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	_sessions.erase(Poco::toLower(host));
+}
+
+
+void ClientSessionCache::clear()
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	_sessions.clear();
+}
+
+
+std::size_t ClientSessionCache::size() const
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	return _sessions.size();
+}
+
+
+void ClientSessionCache::load(const std::string& path)
+{
+	Poco::FileInputStream istr(path);
+	std::string line;
+	while (std::getline(istr, line))
+	{
+		// Each line contains the host name and the base64-encoded
+		// DER representation of the session, separated by a space.
+		std::string::size_type pos = line.find(' ');
+		if (pos == std::string::npos || pos == 0) continue;
+
+		std::istringstream encoded(line.substr(pos + 1));
+		Poco::Base64Decoder decoder(encoded);
+		std::string der;
+		try
+		{
+			Poco::StreamCopier::copyToString(decoder, der);
+		}
+		catch (Poco::DataFormatException&)
+		{
+			continue;
+		}
+		const unsigned char* pDER = reinterpret_cast<const unsigned char*>(der.data());
+		SSL_SESSION* pSSLSession = d2i_SSL_SESSION(0, &pDER, static_cast<long>(der.size()));
+		if (pSSLSession)
+		{
+			Session::Ptr pSession = new Session(pSSLSession);
+			if (!expired(pSSLSession))
+			{
+				add(line.substr(0, pos), pSession);
+			}
+		}
+	}
+}
+
+
+void ClientSessionCache::save(const std::string& path) const
+{
+	std::string tempPath(path);
+	tempPath += ".tmp";
+	{
+		Poco::FileOutputStream ostr(tempPath);
+#if defined(POCO_OS_FAMILY_UNIX)
+		::chmod(tempPath.c_str(), S_IRUSR | S_IWUSR);
+#endif
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		for (const auto& p: _sessions)
+		{
+			SSL_SESSION* pSSLSession = p.second->sslSession();
+			if (expired(pSSLSession)) continue;
+
+			int length = i2d_SSL_SESSION(pSSLSession, 0);
+			if (length <= 0) continue;
+			Poco::Buffer<unsigned char> der(length);
+			unsigned char* pDER = der.begin();
+			i2d_SSL_SESSION(pSSLSession, &pDER);
+
+			ostr << p.first << ' ';
+			Poco::Base64Encoder encoder(ostr);
+			encoder.rdbuf()->setLineLength(0);
+			encoder.write(reinterpret_cast<const char*>(der.begin()), length);
+			encoder.close();
+			ostr << '\n';
+		}
+		ostr.close();
+	}
+	Poco::File(tempPath).renameTo(path);
+}
+
+
+namespace
+{
+	static Poco::SingletonHolder<ClientSessionCache> singleton;
+}
+
+
+ClientSessionCache& ClientSessionCache::defaultCache()
+{
+	return *singleton.get();
+}
+
+
+int ClientSessionCache::onNewSession(SSL* pSSL, SSL_SESSION* pSSLSession)
+{
+	// Called by OpenSSL for every new session, including every TLS 1.3
+	// session ticket. The cache takes its own reference to the session,
+	// so the reference passed in is always left to OpenSSL.
+	try
+	{
+		ClientSessionCache* pCache = reinterpret_cast<ClientSessionCache*>(SSL_CTX_get_ex_data(SSL_get_SSL_CTX(pSSL), contextIndex()));
+		const char* pHost = SSL_get_servername(pSSL, TLSEXT_NAMETYPE_host_name);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		if (!SSL_SESSION_is_resumable(pSSLSession)) return 0;
+#endif
+		if (pCache && pHost && *pHost)
+		{
+			SSL_SESSION_up_ref(pSSLSession);
+			pCache->add(pHost, new Session(pSSLSession));
+		}
+	}
+	catch (...)
+	{
+	}
+	return 0;
+}
+
+
+bool ClientSessionCache::expired(SSL_SESSION* pSSLSession)
+{
+	return static_cast<std::time_t>(SSL_SESSION_get_time(pSSLSession) + SSL_SESSION_get_timeout(pSSLSession)) <= std::time(0);
+}
+
+
+int ClientSessionCache::contextIndex()
+{
+	static const int index = SSL_CTX_get_ex_new_index(0, 0, 0, 0, 0);
+	return index;
+}
+
+
+} } // namespace Poco::Net
@@ -15,6 +15,8 @@
 #include "Poco/Net/HTTPSSessionInstantiator.h"
 #include "Poco/Net/HTTPSessionFactory.h"
 #include "Poco/Net/HTTPSClientSession.h"
+#include "Poco/Net/ClientSessionCache.h"
+#include "Poco/Net/SSLManager.h"
 
 
 namespace Poco {
@@ -40,7 +42,14 @@ HTTPSSessionInstantiator::~HTTPSSessionInstantiator()
 HTTPClientSession* HTTPSSessionInstantiator::createClientSession(const Poco::URI& uri)
 {
 	poco_assert (uri.getScheme() == "https");
-	HTTPSClientSession* pSession = _pContext.isNull() ? new HTTPSClientSession(uri.getHost(), uri.getPort()) : new HTTPSClientSession(uri.getHost(), uri.getPort(), _pContext);
+	Context::Ptr pContext = _pContext.isNull() ? SSLManager::instance().defaultClientContext() : _pContext;
+	Session::Ptr pCachedSession;
+	ClientSessionCache* pCache = ClientSessionCache::attachedCache(pContext);
+	if (pCache)
+	{
+		pCachedSession = pCache->find(uri.getHost());
+	}
+	HTTPSClientSession* pSession = new HTTPSClientSession(uri.getHost(), uri.getPort(), pContext, pCachedSession);
 	if (!getProxyConfig().host.empty())
 	{
 		pSession->setProxyConfig(getProxyConfig());
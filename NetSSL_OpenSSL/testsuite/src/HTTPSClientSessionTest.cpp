@@ -23,6 +23,8 @@
 #include "Poco/Net/SecureStreamSocket.h"
 #include "Poco/Net/Context.h"
 #include "Poco/Net/Session.h"
+#include "Poco/Net/ClientSessionCache.h"
+#include "Poco/Net/HTTPSSessionInstantiator.h"
 #include "Poco/Net/SSLManager.h"
 #include "Poco/Net/SSLException.h"
 #include "Poco/Util/Application.h"
@@ -32,10 +34,13 @@
 #include "Poco/DateTimeFormatter.h"
 #include "Poco/DateTimeFormat.h"
 #include "Poco/Thread.h"
+#include "Poco/TemporaryFile.h"
+#include "Poco/URI.h"
 #include "HTTPSTestServer.h"
 #include <istream>
 #include <ostream>
 #include <sstream>
+#include <memory>
 
 
 using namespace Poco::Net;
@@ -404,6 +409,101 @@ void HTTPSClientSessionTest::testCachedSession()
 }
 
 
+void HTTPSClientSessionTest::testClientSessionCache()
+{
+	// ensure OpenSSL machinery is fully setup
+	Context::Ptr pDefaultServerContext = SSLManager::instance().defaultServerContext();
+	Context::Ptr pDefaultClientContext = SSLManager::instance().defaultClientContext();
+
+	Context::Ptr pServerContext = new Context(
+		Context::SERVER_USE,
+		Application::instance().config().getString("openSSL.server.privateKeyFile"),
+		Application::instance().config().getString("openSSL.server.privateKeyFile"),
+		Application::instance().config().getString("openSSL.server.caConfig"),
+		Context::VERIFY_NONE,
+		9,
+		true,
+		"ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH");
+	pServerContext->enableSessionCache(true, "TestSuite");
+
+	HTTPSTestServer srv(pServerContext);
+
+	Context::Ptr pClientContext = new Context(
+		Context::CLIENT_USE,
+		Application::instance().config().getString("openSSL.client.privateKeyFile"),
+		Application::instance().config().getString("openSSL.client.privateKeyFile"),
+		Application::instance().config().getString("openSSL.client.caConfig"),
+		Context::VERIFY_RELAXED,
+		9,
+		true,
+		"ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH");
+
+	ClientSessionCache cache;
+	cache.attach(pClientContext);
+	assertTrue (ClientSessionCache::attachedCache(pClientContext) == &cache);
+	assertTrue (ClientSessionCache::attachedCache(pDefaultClientContext) == 0);
+
+	HTTPSSessionInstantiator instantiator(pClientContext);
+	Poco::URI uri("https://127.0.0.1/small");
+	uri.setPort(srv.port());
+
+	std::unique_ptr<HTTPClientSession> pSession1(instantiator.createClientSession(uri));
+	HTTPRequest request1(HTTPRequest::HTTP_GET, "/small");
+	pSession1->sendRequest(request1);
+	HTTPResponse response1;
+	std::istream& rs1 = pSession1->receiveResponse(response1);
+	std::ostringstream ostr1;
+	StreamCopier::copyStream(rs1, ostr1);
+	assertTrue (ostr1.str() == HTTPSTestServer::SMALL_BODY);
+	assertTrue (!SecureStreamSocket(pSession1->socket()).sessionWasReused());
+	assertTrue (cache.size() == 1);
+	assertTrue (!cache.find("127.0.0.1").isNull());
+
+	std::unique_ptr<HTTPClientSession> pSession2(instantiator.createClientSession(uri));
+	HTTPRequest request2(HTTPRequest::HTTP_GET, "/small");
+	pSession2->sendRequest(request2);
+	HTTPResponse response2;
+	std::istream& rs2 = pSession2->receiveResponse(response2);
+	std::ostringstream ostr2;
+	StreamCopier::copyStream(rs2, ostr2);
+	assertTrue (ostr2.str() == HTTPSTestServer::SMALL_BODY);
+	assertTrue (SecureStreamSocket(pSession2->socket()).sessionWasReused());
+
+	Poco::TemporaryFile file;
+	cache.save(file.path());
+
+	Context::Ptr pClientContext2 = new Context(
+		Context::CLIENT_USE,
+		Application::instance().config().getString("openSSL.client.privateKeyFile"),
+		Application::instance().config().getString("openSSL.client.privateKeyFile"),
+		Application::instance().config().getString("openSSL.client.caConfig"),
+		Context::VERIFY_RELAXED,
+		9,
+		true,
+		"ALL:!ADH:!LOW:!EXP:!MD5:@STRENGTH");
+
+	ClientSessionCache cache2;
+	cache2.load(file.path());
+	assertTrue (cache2.size() == 1);
+	cache2.attach(pClientContext2);
+
+	HTTPSSessionInstantiator instantiator2(pClientContext2);
+	std::unique_ptr<HTTPClientSession> pSession3(instantiator2.createClientSession(uri));
+	HTTPRequest request3(HTTPRequest::HTTP_GET, "/small");
+	pSession3->sendRequest(request3);
+	HTTPResponse response3;
+	std::istream& rs3 = pSession3->receiveResponse(response3);
+	std::ostringstream ostr3;
+	StreamCopier::copyStream(rs3, ostr3);
+	assertTrue (ostr3.str() == HTTPSTestServer::SMALL_BODY);
+	assertTrue (SecureStreamSocket(pSession3->socket()).sessionWasReused());
+
+	cache2.clear();
+	assertTrue (cache2.size() == 0);
+	assertTrue (cache2.find("127.0.0.1").isNull());
+}
+
+
 void HTTPSClientSessionTest::testUnknownContentLength()
 {
 	HTTPSTestServer srv;
@@ -463,6 +563,7 @@ CppUnit::Test* HTTPSClientSessionTest::suite()
 	CppUnit_addTest(pSuite, HTTPSClientSessionTest, testInterop);
 	CppUnit_addTest(pSuite, HTTPSClientSessionTest, testProxy);
 	CppUnit_addTest(pSuite, HTTPSClientSessionTest, testCachedSession);
+	CppUnit_addTest(pSuite, HTTPSClientSessionTest, testClientSessionCache);
 	CppUnit_addTest(pSuite, HTTPSClientSessionTest, testUnknownContentLength);
 	CppUnit_addTest(pSuite, HTTPSClientSessionTest, testServerAbort);
 
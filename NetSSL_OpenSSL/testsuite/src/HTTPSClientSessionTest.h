@@ -36,6 +36,7 @@ public:
 	void testInterop();
 	void testProxy();
 	void testCachedSession();
+	void testClientSessionCache();
 	void testUnknownContentLength();
 	void testServerAbort();
 
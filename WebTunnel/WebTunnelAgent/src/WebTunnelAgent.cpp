@@ -9,6 +9,7 @@
 
 
 #include "Poco/WebTunnel/RemotePortForwarder.h"
+#include "Poco/WebTunnel/PooledSocketFactory.h"
 #include "Poco/Net/HTTPSessionFactory.h"
 #include "Poco/Net/HTTPSessionInstantiator.h"
 #include "Poco/Net/HTTPClientSession.h"
@@ -25,6 +26,9 @@
 #include "Poco/Net/AcceptCertificateHandler.h"
 #include "Poco/Net/RejectCertificateHandler.h"
 #include "Poco/Net/SSLManager.h"
+#if !defined(POCO_NETSSL_WIN)
+#include "Poco/Net/ClientSessionCache.h"
+#endif
 #endif
 #include "Poco/Util/ServerApplication.h"
 #include "Poco/Util/Option.h"
@@ -50,7 +54,11 @@
 #include "Poco/PipeStream.h"
 #include "Poco/StreamCopier.h"
 #include "Poco/String.h"
+#include "Poco/File.h"
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <atomic>
 
 
 using Poco::Util::Option;
@@ -116,6 +124,22 @@ public:
 		}
 	}
 
+	Poco::Net::StreamSocket createConnectedSocket(const Poco::Net::SocketAddress& addr, Poco::Timespan timeout)
+	{
+		if (addr.port() == _tlsPort)
+		{
+			// connect() also performs the TLS handshake
+			Poco::Net::SecureStreamSocket streamSocket(_pContext);
+			streamSocket.connect(addr, timeout);
+			streamSocket.setBlocking(false);
+			return streamSocket;
+		}
+		else
+		{
+			return Poco::WebTunnel::SocketFactory::createConnectedSocket(addr, timeout);
+		}
+	}
+
 private:
 	Poco::UInt16 _tlsPort;
 	Poco::Net::Context::Ptr _pContext;
@@ -138,7 +162,8 @@ public:
 	enum
 	{
 		MIN_RETRY_DELAY = 1000,
-		MAX_RETRY_DELAY = 30000
+		MAX_RETRY_DELAY = 30000,
+		MAX_CONNECTIONS = 16
 	};
 
 	Poco::BasicEvent<const std::string> connected;
@@ -155,6 +180,18 @@ public:
 		_appPort(0),
 		_useProxy(false),
 		_proxyPort(0),
+		_dispatcherThreads(1),
+		_connections(1),
+		_highWatermark(0),
+		_lowWatermark(0),
+		_tunnelHighWatermark(0),
+		_tunnelLowWatermark(0),
+		_readBudget(0),
+		_maxFrameSize(Poco::WebTunnel::Protocol::WT_FRAME_PREFERRED_SIZE),
+		_batchEnabled(true),
+		_flowControlEnabled(true),
+		_compressionLevel(0),
+		_webSocketDeflate(false),
 		_retryDelay(MIN_RETRY_DELAY),
 		_status(STATUS_DISCONNECTED)
 	{
@@ -342,6 +379,91 @@ protected:
 		return result;
 	}
 
+	Poco::SharedPtr<Poco::Net::HTTPClientSession> createSession(const Poco::URI& reflectorURI)
+	{
+		Poco::SharedPtr<Poco::Net::HTTPClientSession> pSession = Poco::Net::HTTPSessionFactory::defaultFactory().createClientSession(reflectorURI);
+		pSession->setTimeout(_httpTimeout);
+		if (_useProxy && !_proxyHost.empty())
+		{
+			logger().debug("Connecting via proxy %s:%hu"s, _proxyHost, _proxyPort);
+			pSession->setProxy(_proxyHost, _proxyPort);
+			if (!_proxyUsername.empty())
+			{
+				pSession->setProxyCredentials(_proxyUsername, _proxyPassword);
+			}
+		}
+		return pSession;
+	}
+
+	void prepareRequest(Poco::Net::HTTPRequest& request)
+	{
+		request.set(SEC_WEBSOCKET_PROTOCOL, WEBTUNNEL_PROTOCOL);
+		request.set(X_WEBTUNNEL_KEEPALIVE, Poco::NumberFormatter::format(_remoteTimeout.totalSeconds()));
+		if (_maxFrameSize > Poco::WebTunnel::Protocol::WT_FRAME_MAX_SIZE)
+		{
+			request.set(X_WEBTUNNEL_MAXFRAMESIZE, Poco::NumberFormatter::format(_maxFrameSize));
+		}
+		int offeredCapabilities = Poco::WebTunnel::Protocol::WT_CAP_BATCH;
+		if (_flowControlEnabled) offeredCapabilities |= Poco::WebTunnel::Protocol::WT_CAP_FLOW_CONTROL;
+		request.set(X_WEBTUNNEL_CAPABILITIES, Poco::WebTunnel::Protocol::formatCapabilities(offeredCapabilities));
+		if (_webSocketDeflate)
+		{
+			Poco::Net::WebSocket::offerDeflate(request, _deflateParams);
+		}
+	}
+
+	void authenticate(Poco::Net::HTTPRequest& request)
+	{
+		// Note: Obtain username/password as late as possible. Reason: The username
+		// may contain ${system.nodeId} (Ethernet address), which may not be available
+		// by the time we launch, as the network interface may not be up yet.
+		std::string username = config().getString("webtunnel.username"s, ""s);
+		std::string password = config().getString("webtunnel.password"s, ""s);
+		if (!username.empty())
+		{
+			logger().debug("Authenticating as %s."s, username);
+			Poco::Net::HTTPBasicCredentials creds(username, password);
+			creds.authenticate(request);
+		}
+	}
+
+	Poco::SharedPtr<Poco::WebTunnel::RemotePortForwarder> createForwarder(Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, const Poco::Net::HTTPResponse& response)
+	{
+		std::size_t maxFrameSize = Poco::WebTunnel::Protocol::negotiatedFrameSize(response.get(X_WEBTUNNEL_MAXFRAMESIZE, ""s), _maxFrameSize);
+		logger().debug("Using a maximum frame size of %z bytes."s, maxFrameSize);
+		if (pWebSocket->deflateEnabled())
+		{
+			logger().debug("Using permessage-deflate WebSocket compression."s);
+			pWebSocket->setCompressionLevel(_deflateParams.compressionLevel);
+		}
+		pWebSocket->setNoDelay(true);
+		Poco::SharedPtr<Poco::WebTunnel::RemotePortForwarder> pForwarder = new Poco::WebTunnel::RemotePortForwarder(*_pDispatcher, pWebSocket, _host, _ports, _remoteTimeout, _pSocketFactory, maxFrameSize);
+		_pDispatcher->setWatermarks(*pWebSocket, _tunnelHighWatermark, _tunnelLowWatermark);
+		if (_readBudget > 0) pForwarder->setReadBudget(_readBudget);
+		int peerCapabilities = Poco::WebTunnel::Protocol::parseCapabilities(response.get(X_WEBTUNNEL_CAPABILITIES, ""s));
+		if (_batchEnabled && (peerCapabilities & Poco::WebTunnel::Protocol::WT_CAP_BATCH))
+		{
+			logger().debug("Batching of small frames enabled."s);
+			pForwarder->enableBatching(_batchDelay);
+		}
+		if (_flowControlEnabled && (peerCapabilities & Poco::WebTunnel::Protocol::WT_CAP_FLOW_CONTROL))
+		{
+			logger().debug("Per-channel flow control enabled."s);
+			pForwarder->enableFlowControl();
+		}
+		if (_compressionLevel > 0)
+		{
+			pForwarder->enableCompression(_compressionLevel);
+		}
+		for (const auto& p: _portWeights)
+		{
+			pForwarder->setPortWeight(p.first, p.second);
+		}
+		pForwarder->setConnectTimeout(_connectTimeout);
+		pForwarder->setLocalTimeout(_localTimeout);
+		return pForwarder;
+	}
+
 	void connect()
 	{
 		Poco::URI reflectorURI;
@@ -352,44 +474,27 @@ protected:
 
 		logger().information("Connecting to %s..."s, reflectorURI.toString());
 
-		_pHTTPClientSession = Poco::Net::HTTPSessionFactory::defaultFactory().createClientSession(reflectorURI);
-		_pHTTPClientSession->setTimeout(_httpTimeout);
-		if (_useProxy && !_proxyHost.empty())
-		{
-			logger().debug("Connecting via proxy %s:%hu"s, _proxyHost, _proxyPort);
-			_pHTTPClientSession->setProxy(_proxyHost, _proxyPort);
-			if (!_proxyUsername.empty())
-			{
-				_pHTTPClientSession->setProxyCredentials(_proxyUsername, _proxyPassword);
-			}
-		}
+		_pHTTPClientSession = createSession(reflectorURI);
 
 		std::string path(reflectorURI.getPathEtc());
 		if (path.empty()) path = "/";
 		Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, path, Poco::Net::HTTPRequest::HTTP_1_1);
 		Poco::Net::HTTPResponse response;
-		request.set(SEC_WEBSOCKET_PROTOCOL, WEBTUNNEL_PROTOCOL);
+		prepareRequest(request);
 
 		std::map<std::string, std::string> props;
 		collectProperties(props);
 		addProperties(request, props);
-		request.set(X_WEBTUNNEL_KEEPALIVE, Poco::NumberFormatter::format(_remoteTimeout.totalSeconds()));
+		if (_connections > 1)
+		{
+			request.set(X_WEBTUNNEL_CONNECTIONS, Poco::NumberFormatter::format(_connections));
+		}
 
 		try
 		{
 			Poco::Net::DNS::reload();
 
-			// Note: Obtain username/password as late as possible. Reason: The username
-			// may contain ${system.nodeId} (Ethernet address), which may not be available
-			// by the time we launch, as the network interface may not be up yet.
-			std::string username = config().getString("webtunnel.username"s, ""s);
-			std::string password = config().getString("webtunnel.password"s, ""s);
-			if (!username.empty())
-			{
-				logger().debug("Authenticating as %s."s, username);
-				Poco::Net::HTTPBasicCredentials creds(username, password);
-				creds.authenticate(request);
-			}
+			authenticate(request);
 
 			logger().debug("Creating WebSocket..."s);
 			Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket = new Poco::Net::WebSocket(*_pHTTPClientSession, request, response);
@@ -402,19 +507,28 @@ protected:
 					_remoteTimeout.assign(keepAlive, 0);
 					logger().debug("Server has requested a keep-alive timeout (remoteTimeout) of %d seconds."s, keepAlive);
 				}
-				pWebSocket->setNoDelay(true);
 				_retryDelay = MIN_RETRY_DELAY;
-				_pDispatcher = new Poco::WebTunnel::SocketDispatcher;
-				_pForwarder = new Poco::WebTunnel::RemotePortForwarder(*_pDispatcher, pWebSocket, _host, _ports, _remoteTimeout, _pSocketFactory);
+				if (_pSocketPool) _pSocketPool->start();
+				_pDispatcher = new Poco::WebTunnel::SocketDispatcher(_dispatcherThreads);
+				_pDispatcher->setWatermarks(_highWatermark, _lowWatermark);
+				_pForwarder = createForwarder(pWebSocket, response);
 				_pForwarder->webSocketClosed += Poco::delegate(this, &WebTunnelAgent::onClose);
-				_pForwarder->setConnectTimeout(_connectTimeout);
-				_pForwarder->setLocalTimeout(_localTimeout);
 				logger().information("WebTunnel connection established."s);
 
+				if (_connections > 1)
+				{
+					connectStripes(reflectorURI, path, response);
+				}
+				saveSessionCache();
+
 				if (!props.empty() && _propertiesUpdateInterval > 0)
 				{
 					startPropertiesUpdateTask();
 				}
+				if (_metricsInterval > 0)
+				{
+					startMetricsTask();
+				}
 
 				statusChanged(STATUS_CONNECTED);
 				return;
@@ -476,9 +590,121 @@ protected:
 		scheduleReconnect();
 	}
 
+	void connectStripes(const Poco::URI& reflectorURI, const std::string& path, const Poco::Net::HTTPResponse& tunnelResponse)
+	{
+		// The server assigns every channel to one of the connections of
+		// the tunnel, so all frames of a channel stay in order. Every
+		// connection has its own RemotePortForwarder, and is handled by
+		// the least loaded dispatcher thread.
+		std::string tunnelId = tunnelResponse.get(X_WEBTUNNEL_TUNNEL, ""s);
+		int connections = 1;
+		Poco::NumberParser::tryParse(tunnelResponse.get(X_WEBTUNNEL_CONNECTIONS, ""s), connections);
+		if (tunnelId.empty() || connections < 2)
+		{
+			logger().debug("Server does not support multiple connections per tunnel."s);
+			return;
+		}
+		connections = std::min(connections, _connections);
+		_tunnelURI = reflectorURI;
+		_tunnelPath = path;
+		_tunnelId = tunnelId;
+		_stripes.assign(connections - 1, nullptr);
+		_stripeRetryDelays.assign(connections - 1, MIN_RETRY_DELAY);
+		int established = 1;
+		for (int i = 1; i < connections; i++)
+		{
+			if (!connectStripe(i)) break;
+			established++;
+		}
+		logger().information("Using %d connections for WebTunnel."s, established);
+	}
+
+	bool connectStripe(int index)
+		/// Establishes the additional connection with the given index
+		/// (1 .. connections - 1) for the current tunnel.
+	{
+		const int connections = static_cast<int>(_stripes.size()) + 1;
+		Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, _tunnelPath, Poco::Net::HTTPRequest::HTTP_1_1);
+		Poco::Net::HTTPResponse response;
+		prepareRequest(request);
+		request.set(X_WEBTUNNEL_TUNNEL, _tunnelId);
+		request.set(X_WEBTUNNEL_CONNECTION, Poco::NumberFormatter::format(index));
+		request.set("User-Agent"s, _userAgent);
+		try
+		{
+			authenticate(request);
+			Poco::SharedPtr<Poco::Net::HTTPClientSession> pSession = createSession(_tunnelURI);
+			Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket = new Poco::Net::WebSocket(*pSession, request, response);
+			if (response.get(SEC_WEBSOCKET_PROTOCOL, ""s) != WEBTUNNEL_PROTOCOL)
+			{
+				pWebSocket->close();
+				throw Poco::ProtocolException("Server does not support the WebTunnel protocol"s);
+			}
+			Poco::SharedPtr<Poco::WebTunnel::RemotePortForwarder> pForwarder = createForwarder(pWebSocket, response);
+			pForwarder->webSocketClosed += Poco::delegate(this, &WebTunnelAgent::onStripeClose);
+			_stripes[index - 1] = pForwarder;
+			logger().debug("WebTunnel connection %d of %d established."s, index + 1, connections);
+			return true;
+		}
+		catch (Poco::Exception& exc)
+		{
+			std::string msg = response.get(X_PTTH_ERROR, exc.displayText());
+			logger().warning("Cannot establish additional WebTunnel connection %d of %d: %s"s, index + 1, connections, msg);
+			return false;
+		}
+	}
+
+	void retireStripe(const void* pSender, int generation)
+		/// Removes the closed additional connection from the tunnel
+		/// and schedules its reconnect.
+	{
+		if (generation != _tunnelGeneration) return;
+
+		for (std::size_t i = 0; i < _stripes.size(); i++)
+		{
+			if (_stripes[i] && _stripes[i].get() == pSender)
+			{
+				Poco::SharedPtr<Poco::WebTunnel::RemotePortForwarder> pForwarder = _stripes[i];
+				_stripes[i].reset();
+				pForwarder->webSocketClosed -= Poco::delegate(this, &WebTunnelAgent::onStripeClose);
+				pForwarder->stop();
+				scheduleStripeReconnect(static_cast<int>(i + 1));
+				return;
+			}
+		}
+	}
+
+	void reconnectStripe(int index, int generation)
+	{
+		if (generation != _tunnelGeneration || !_pForwarder) return;
+
+		int& retryDelay = _stripeRetryDelays[index - 1];
+		if (connectStripe(index))
+		{
+			logger().information("Additional WebTunnel connection %d re-established."s, index + 1);
+			retryDelay = MIN_RETRY_DELAY;
+		}
+		else
+		{
+			if (retryDelay < MAX_RETRY_DELAY)
+			{
+				retryDelay *= 2;
+			}
+			scheduleStripeReconnect(index);
+		}
+	}
+
 	void disconnect()
 	{
 		stopPropertiesUpdateTask();
+		stopMetricsTask();
+		_tunnelGeneration++;
+		for (auto& pForwarder: _stripes)
+		{
+			if (!pForwarder) continue;
+			pForwarder->webSocketClosed -= Poco::delegate(this, &WebTunnelAgent::onStripeClose);
+			pForwarder->stop();
+		}
 		if (_pForwarder)
 		{
 			logger().information("Disconnecting from reflector server."s);
@@ -487,6 +713,7 @@ protected:
 			_pForwarder->stop();
 			Poco::Thread::sleep(100);
 			_pDispatcher->reset();
+			_stripes.clear();
 			_pForwarder.reset();
 			_pDispatcher.reset();
 		}
@@ -500,34 +727,54 @@ protected:
 			{
 			}
 		}
+		if (_pSocketPool) _pSocketPool->stop();
 		statusChanged(STATUS_DISCONNECTED);
 		logger().debug("Disconnected."s);
 	}
 
 	void onClose(const int& reason)
 	{
+		// Pending reconnects of additional connections are obsolete,
+		// as the whole tunnel will be reconnected.
+		_tunnelGeneration++;
 		stopPropertiesUpdateTask();
+		stopMetricsTask();
+
+		logger().information(closeMessage(reason));
 
-		std::string message;
+		statusChanged(STATUS_DISCONNECTED);
+		scheduleReconnect();
+	}
+
+	void onStripeClose(const void* pSender, const int& reason)
+	{
+		// Channels on the remaining connections are not affected.
+		// The connection is removed from the tunnel and re-established
+		// by the timer thread, which also handles all other connects.
+		logger().warning("Additional connection: %s"s, closeMessage(reason));
+		int generation = _tunnelGeneration;
+		_pTimer->schedule(Poco::Util::Timer::func(
+			[this, pSender, generation]()
+			{
+				retireStripe(pSender, generation);
+			}), Poco::Clock());
+	}
+
+	static std::string closeMessage(int reason)
+	{
 		switch (reason)
 		{
 		case Poco::WebTunnel::RemotePortForwarder::RPF_CLOSE_GRACEFUL:
-			message = "WebTunnel connection gracefully closed.";
-			break;
+			return "WebTunnel connection gracefully closed.";
 		case Poco::WebTunnel::RemotePortForwarder::RPF_CLOSE_UNEXPECTED:
-			message = "WebTunnel connection unexpectedly closed.";
-			break;
+			return "WebTunnel connection unexpectedly closed.";
 		case Poco::WebTunnel::RemotePortForwarder::RPF_CLOSE_ERROR:
-			message = "WebTunnel connection closed due to error.";
-			break;
+			return "WebTunnel connection closed due to error.";
 		case Poco::WebTunnel::RemotePortForwarder::RPF_CLOSE_TIMEOUT:
-			message = "WebTunnel connection closed due to timeout.";
-			break;
+			return "WebTunnel connection closed due to timeout.";
+		default:
+			return std::string();
 		}
-		logger().information(message);
-
-		statusChanged(STATUS_DISCONNECTED);
-		scheduleReconnect();
 	}
 
 	void reconnectTask(Poco::Util::TimerTask&)
@@ -581,8 +828,7 @@ protected:
 	{
 		if (!_stopped.tryWait(1))
 		{
-			Poco::Clock::ClockDiff retryDelay(static_cast<Poco::Clock::ClockDiff>(_retryDelay)*1000);
-			retryDelay += _random.next(500*_retryDelay);
+			Poco::Clock::ClockDiff retryDelay = randomizeRetryDelay(_retryDelay);
 			Poco::Clock nextClock;
 			nextClock += retryDelay;
 			logger().information(Poco::format("Will reconnect in %.2f seconds."s, retryDelay/1000000.0));
@@ -590,6 +836,32 @@ protected:
 		}
 	}
 
+	void scheduleStripeReconnect(int index)
+	{
+		if (!_stopped.tryWait(1))
+		{
+			Poco::Clock::ClockDiff retryDelay = randomizeRetryDelay(_stripeRetryDelays[index - 1]);
+			Poco::Clock nextClock;
+			nextClock += retryDelay;
+			logger().information(Poco::format("Will reconnect additional connection %d in %.2f seconds."s, index + 1, retryDelay/1000000.0));
+			int generation = _tunnelGeneration;
+			_pTimer->schedule(Poco::Util::Timer::func(
+				[this, index, generation]()
+				{
+					reconnectStripe(index, generation);
+				}), nextClock);
+		}
+	}
+
+	Poco::Clock::ClockDiff randomizeRetryDelay(int retryDelay)
+		/// Returns the given retry delay (in milliseconds) plus up to 50 %
+		/// random jitter, in microseconds.
+	{
+		Poco::Clock::ClockDiff delay(static_cast<Poco::Clock::ClockDiff>(retryDelay)*1000);
+		delay += _random.next(500*retryDelay);
+		return delay;
+	}
+
 	void scheduleDisconnect()
 	{
 		_pTimer->schedule(new Poco::Util::TimerTaskAdapter<WebTunnelAgent>(*this, &WebTunnelAgent::disconnectTask), Poco::Clock());
@@ -680,6 +952,51 @@ protected:
 		}
 	}
 
+	void startMetricsTask()
+	{
+		_pMetricsTask = new Poco::Util::TimerTaskAdapter<WebTunnelAgent>(*this, &WebTunnelAgent::dumpMetrics);
+		_pTimer->scheduleAtFixedRate(_pMetricsTask, static_cast<long>(_metricsInterval.totalMilliseconds()), static_cast<long>(_metricsInterval.totalMilliseconds()));
+	}
+
+	void stopMetricsTask()
+	{
+		if (_pMetricsTask)
+		{
+			_pMetricsTask->cancel();
+			_pMetricsTask.reset();
+		}
+	}
+
+	void dumpMetrics(Poco::Util::TimerTask&)
+	{
+		Poco::SharedPtr<Poco::WebTunnel::SocketDispatcher> pDispatcher = _pDispatcher;
+		if (!pDispatcher) return;
+
+		for (const auto& m: pDispatcher->metrics())
+		{
+			logger().information("Dispatcher shard %d: %z sockets, %z queued commands, %Lu iterations, %Lu commands; "
+				"received %Lu bytes in %Lu frames, sent %Lu bytes in %Lu frames"s,
+				m.shard, m.sockets, m.queuedCommands, m.iterations, m.commands,
+				m.bytesReceived, m.framesReceived, m.bytesSent, m.framesSent);
+			logger().information("Dispatcher shard %d latencies [us] (p50/p99/max): loop %s, poll wait %s, command wait %s; pending send bytes %s"s,
+				m.shard, formatHistogram(m.loopTime), formatHistogram(m.pollWait), formatHistogram(m.commandWait), formatHistogram(m.pendingSendBytes));
+		}
+		if (logger().debug())
+		{
+			for (const auto& m: pDispatcher->socketMetrics())
+			{
+				logger().debug("Socket %?d (shard %d, mode %d): received %Lu bytes in %Lu frames, sent %Lu bytes in %Lu frames, %z bytes in %z sends pending%s, idle %Ld ms"s,
+					m.sockfd, m.shard, m.mode, m.bytesReceived, m.framesReceived, m.bytesSent, m.framesSent,
+					m.pendingBytes, m.pendingSends, std::string(m.throttled ? ", throttled" : ""), m.idle.totalMilliseconds());
+			}
+		}
+	}
+
+	static std::string formatHistogram(const Poco::WebTunnel::Histogram::Snapshot& histogram)
+	{
+		return Poco::format("%Lu/%Lu/%Lu"s, histogram.percentile(50), histogram.percentile(99), histogram.max);
+	}
+
 	void collectProperties(std::map<std::string, std::string>& props)
 	{
 		std::vector<std::string> keys;
@@ -780,6 +1097,41 @@ protected:
 
 #endif // WEBTUNNEL_ENABLE_TLS
 
+	void loadSessionCache()
+	{
+#if defined(WEBTUNNEL_ENABLE_TLS) && !defined(POCO_NETSSL_WIN)
+		if (!_sessionCacheFile.empty() && Poco::File(_sessionCacheFile).exists())
+		{
+			try
+			{
+				Poco::Net::ClientSessionCache::defaultCache().load(_sessionCacheFile);
+				logger().debug("Loaded %z TLS session(s) from %s."s, Poco::Net::ClientSessionCache::defaultCache().size(), _sessionCacheFile);
+			}
+			catch (Poco::Exception& exc)
+			{
+				logger().warning("Failed to load TLS session cache from %s: %s"s, _sessionCacheFile, exc.displayText());
+			}
+		}
+#endif
+	}
+
+	void saveSessionCache()
+	{
+#if defined(WEBTUNNEL_ENABLE_TLS) && !defined(POCO_NETSSL_WIN)
+		if (!_sessionCacheFile.empty())
+		{
+			try
+			{
+				Poco::Net::ClientSessionCache::defaultCache().save(_sessionCacheFile);
+			}
+			catch (Poco::Exception& exc)
+			{
+				logger().warning("Failed to save TLS session cache to %s: %s"s, _sessionCacheFile, exc.displayText());
+			}
+		}
+#endif
+	}
+
 	int main(const std::vector<std::string>& args)
 	{
 		if (_helpRequested || !config().has("webtunnel.reflectorURI"s))
@@ -824,6 +1176,40 @@ protected:
 				_localTimeout = Poco::Timespan(config().getInt("webtunnel.localTimeout"s, 7200), 0);
 				_connectTimeout = Poco::Timespan(config().getInt("webtunnel.connectTimeout"s, 10), 0);
 				_remoteTimeout = Poco::Timespan(config().getInt("webtunnel.remoteTimeout"s, 300), 0);
+				_dispatcherThreads = config().getInt("webtunnel.dispatcherThreads"s, 1);
+				_connections = std::max(1, std::min(config().getInt("webtunnel.connections"s, 1), static_cast<int>(MAX_CONNECTIONS)));
+				_highWatermark = config().getUInt64("webtunnel.highWatermark"s, 256*1024);
+				_lowWatermark = config().getUInt64("webtunnel.lowWatermark"s, 64*1024);
+				_tunnelHighWatermark = config().getUInt64("webtunnel.tunnelHighWatermark"s, 1024*1024);
+				_tunnelLowWatermark = config().getUInt64("webtunnel.tunnelLowWatermark"s, 256*1024);
+				_readBudget = config().getUInt64("webtunnel.readBudget"s, 0);
+				_maxFrameSize = Poco::WebTunnel::Protocol::offeredFrameSize(config().getUInt64("webtunnel.maxFrameSize"s, Poco::WebTunnel::Protocol::WT_FRAME_PREFERRED_SIZE));
+				_batchEnabled = config().getBool("webtunnel.batch.enable"s, true);
+				_batchDelay = Poco::Timespan(config().getInt64("webtunnel.batch.delay"s, 0));
+				_flowControlEnabled = config().getBool("webtunnel.flowControl.enable"s, true);
+				if (config().getBool("webtunnel.compression.enable"s, false))
+				{
+					_compressionLevel = config().getInt("webtunnel.compression.level"s, 1);
+				}
+				_webSocketDeflate = config().getBool("webtunnel.websocket.deflate.enable"s, false);
+				_deflateParams.compressionLevel = config().getInt("webtunnel.websocket.deflate.level"s, Z_BEST_SPEED);
+				_deflateParams.clientMaxWindowBits = config().getInt("webtunnel.websocket.deflate.windowBits"s, Poco::Net::WebSocketDeflate::MAX_WINDOW_BITS);
+				_deflateParams.serverMaxWindowBits = _deflateParams.clientMaxWindowBits;
+				Poco::Util::AbstractConfiguration::Keys priorityKeys;
+				config().keys("webtunnel.priority"s, priorityKeys);
+				for (const auto& key: priorityKeys)
+				{
+					unsigned port;
+					unsigned weight;
+					if (Poco::NumberParser::tryParseUnsigned(key, port) && port > 0 && port <= 65535 && Poco::NumberParser::tryParseUnsigned(config().getString("webtunnel.priority."s + key), weight))
+					{
+						_portWeights[static_cast<Poco::UInt16>(port)] = weight;
+					}
+					else
+					{
+						logger().warning("Ignoring invalid channel priority setting webtunnel.priority.%s."s, key);
+					}
+				}
 				_httpPath = config().getString("webtunnel.httpPath"s, ""s);
 				_httpPort = config().getUInt16("webtunnel.httpPort"s, 0);
 				_httpsRequired = config().getBool("webtunnel.https.enable"s, false);
@@ -834,6 +1220,7 @@ protected:
 				_userAgent = config().getString("webtunnel.userAgent"s, ""s);
 				_httpTimeout = Poco::Timespan(config().getInt("http.timeout"s, 30), 0);
 				_propertiesUpdateInterval = Poco::Timespan(config().getInt("webtunnel.propertiesUpdateInterval"s, 0), 0);
+				_metricsInterval = Poco::Timespan(config().getInt("webtunnel.metricsInterval"s, 0), 0);
 
 				_useProxy = config().getBool("http.proxy.enable"s, false);
 				_proxyHost = config().getString("http.proxy.host"s, ""s);
@@ -908,6 +1295,14 @@ protected:
 				else
 					pCertificateHandler = new Poco::Net::RejectCertificateHandler(false);
 				Poco::Net::SSLManager::instance().initializeClient(0, pCertificateHandler, pContext);
+#if !defined(POCO_NETSSL_WIN)
+				if (config().getBool("tls.sessionCache.enable"s, true))
+				{
+					Poco::Net::ClientSessionCache::defaultCache().attach(pContext);
+					_sessionCacheFile = config().getString("tls.sessionCache.file"s, ""s);
+					loadSessionCache();
+				}
+#endif // POCO_NETSSL_WIN
 
 				if (_httpsRequired)
 				{
@@ -920,6 +1315,28 @@ protected:
 					_pSocketFactory = new Poco::WebTunnel::SocketFactory;
 				}
 
+				std::size_t poolSize = config().getUInt("webtunnel.socketPool.size"s, 0);
+				if (poolSize > 0)
+				{
+					std::set<Poco::UInt16> poolPorts;
+					std::string poolPortList = config().getString("webtunnel.socketPool.ports"s, _httpPort != 0 ? Poco::NumberFormatter::format(_httpPort) : ""s);
+					Poco::StringTokenizer poolTok(poolPortList, ";,"s, Poco::StringTokenizer::TOK_TRIM | Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+					for (const auto& token: poolTok)
+					{
+						Poco::UInt16 port = static_cast<Poco::UInt16>(Poco::NumberParser::parseUnsigned(token));
+						if (_ports.find(port) != _ports.end())
+							poolPorts.insert(port);
+						else
+							logger().warning("Socket pool port (%hu) not in list of forwarded ports."s, port);
+					}
+					if (!poolPorts.empty())
+					{
+						Poco::Timespan idleTimeout(config().getInt("webtunnel.socketPool.idleTimeout"s, 30), 0);
+						_pSocketPool = new Poco::WebTunnel::PooledSocketFactory(_pSocketFactory, _host, poolPorts, poolSize, idleTimeout, _connectTimeout);
+						_pSocketFactory = _pSocketPool;
+					}
+				}
+
 				_pTimer->schedule(new Poco::Util::TimerTaskAdapter<WebTunnelAgent>(*this, &WebTunnelAgent::reconnectTask), Poco::Clock());
 
 				waitForTerminationRequest();
@@ -944,6 +1361,11 @@ protected:
 	static const std::string X_PTTH_SET_PROPERTY;
 	static const std::string X_PTTH_ERROR;
 	static const std::string X_WEBTUNNEL_KEEPALIVE;
+	static const std::string X_WEBTUNNEL_MAXFRAMESIZE;
+	static const std::string X_WEBTUNNEL_CAPABILITIES;
+	static const std::string X_WEBTUNNEL_CONNECTIONS;
+	static const std::string X_WEBTUNNEL_CONNECTION;
+	static const std::string X_WEBTUNNEL_TUNNEL;
 
 private:
 	bool _helpRequested;
@@ -972,19 +1394,44 @@ private:
 	Poco::Timespan _remoteTimeout;
 	Poco::Timespan _httpTimeout;
 	Poco::Timespan _propertiesUpdateInterval;
+	Poco::Timespan _metricsInterval;
 	std::string _notifyExec;
+	int _dispatcherThreads;
+	int _connections;
+	std::size_t _highWatermark;
+	std::size_t _lowWatermark;
+	std::size_t _tunnelHighWatermark;
+	std::size_t _tunnelLowWatermark;
+	std::size_t _readBudget;
+	std::size_t _maxFrameSize;
+	bool _batchEnabled;
+	Poco::Timespan _batchDelay;
+	bool _flowControlEnabled;
+	int _compressionLevel;
+	bool _webSocketDeflate;
+	Poco::Net::WebSocketDeflate::Params _deflateParams;
+	std::map<Poco::UInt16, unsigned> _portWeights;
 	Poco::SharedPtr<Poco::WebTunnel::SocketDispatcher> _pDispatcher;
 	Poco::SharedPtr<Poco::WebTunnel::RemotePortForwarder> _pForwarder;
+	std::vector<Poco::SharedPtr<Poco::WebTunnel::RemotePortForwarder>> _stripes; // additional connections, null while reconnecting
+	std::vector<int> _stripeRetryDelays;
+	Poco::URI _tunnelURI;
+	std::string _tunnelPath;
+	std::string _tunnelId;
+	std::atomic<int> _tunnelGeneration{0};
 	Poco::SharedPtr<Poco::Net::HTTPClientSession> _pHTTPClientSession;
 	Poco::Event _stopped;
 	Poco::Event _disconnected;
 	int _retryDelay;
 	Poco::SharedPtr<Poco::Util::Timer> _pTimer;
 	Poco::Util::TimerTask::Ptr _pPropertiesUpdateTask;
+	Poco::Util::TimerTask::Ptr _pMetricsTask;
 	SSLInitializer _sslInitializer;
 	Status _status;
 	Poco::Random _random;
 	Poco::WebTunnel::SocketFactory::Ptr _pSocketFactory;
+	Poco::WebTunnel::PooledSocketFactory::Ptr _pSocketPool;
+	std::string _sessionCacheFile;
 };
 
 
@@ -994,6 +1441,11 @@ const std::string WebTunnelAgent::WEBTUNNEL_AGENT("WebTunnelAgent/" WEBTUNNEL_VE
 const std::string WebTunnelAgent::X_PTTH_SET_PROPERTY("X-PTTH-Set-Property");
 const std::string WebTunnelAgent::X_PTTH_ERROR("X-PTTH-Error");
 const std::string WebTunnelAgent::X_WEBTUNNEL_KEEPALIVE("X-WebTunnel-KeepAlive");
+const std::string WebTunnelAgent::X_WEBTUNNEL_MAXFRAMESIZE("X-WebTunnel-MaxFrameSize");
+const std::string WebTunnelAgent::X_WEBTUNNEL_CAPABILITIES("X-WebTunnel-Capabilities");
+const std::string WebTunnelAgent::X_WEBTUNNEL_CONNECTIONS("X-WebTunnel-Connections");
+const std::string WebTunnelAgent::X_WEBTUNNEL_CONNECTION("X-WebTunnel-Connection");
+const std::string WebTunnelAgent::X_WEBTUNNEL_TUNNEL("X-WebTunnel-Tunnel");
 
 
 POCO_SERVER_MAIN(WebTunnelAgent)
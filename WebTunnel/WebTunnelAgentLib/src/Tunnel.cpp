@@ -38,6 +38,8 @@ const std::string Tunnel::WEBTUNNEL_AGENT("WebTunnelAgentLib/1.0.0");
 const std::string Tunnel::X_PTTH_SET_PROPERTY("X-PTTH-Set-Property");
 const std::string Tunnel::X_PTTH_ERROR("X-PTTH-Error");
 const std::string Tunnel::X_WEBTUNNEL_KEEPALIVE("X-WebTunnel-KeepAlive");
+const std::string Tunnel::X_WEBTUNNEL_MAXFRAMESIZE("X-WebTunnel-MaxFrameSize");
+const std::string Tunnel::X_WEBTUNNEL_CAPABILITIES("X-WebTunnel-Capabilities");
 
 
 class ReconnectTask: public Poco::Util::TimerTask
@@ -87,6 +89,14 @@ Tunnel::Tunnel(const std::string& deviceId, Poco::SharedPtr<Poco::Util::Timer> p
 	_rdpPort(0),
 	_useProxy(false),
 	_proxyPort(0),
+	_tunnelHighWatermark(0),
+	_tunnelLowWatermark(0),
+	_readBudget(0),
+	_maxFrameSize(Poco::WebTunnel::Protocol::WT_FRAME_PREFERRED_SIZE),
+	_batchEnabled(true),
+	_flowControlEnabled(true),
+	_compressionLevel(0),
+	_webSocketDeflate(false),
 	_retryDelay(MIN_RETRY_DELAY),
 	_pTimer(pTimer),
 	_pDispatcher(pDispatcher),
@@ -161,6 +171,17 @@ void Tunnel::addProperties(Poco::Net::HTTPRequest& request, const std::map<std::
 	}
 	request.set("User-Agent"s, _userAgent);
 	request.set(X_WEBTUNNEL_KEEPALIVE, Poco::NumberFormatter::format(_remoteTimeout.totalSeconds()));
+	if (_maxFrameSize > Poco::WebTunnel::Protocol::WT_FRAME_MAX_SIZE)
+	{
+		request.set(X_WEBTUNNEL_MAXFRAMESIZE, Poco::NumberFormatter::format(_maxFrameSize));
+	}
+	int offeredCapabilities = Poco::WebTunnel::Protocol::WT_CAP_BATCH;
+	if (_flowControlEnabled) offeredCapabilities |= Poco::WebTunnel::Protocol::WT_CAP_FLOW_CONTROL;
+	request.set(X_WEBTUNNEL_CAPABILITIES, Poco::WebTunnel::Protocol::formatCapabilities(offeredCapabilities));
+	if (_webSocketDeflate)
+	{
+		Poco::Net::WebSocket::offerDeflate(request, _deflateParams);
+	}
 }
 
 
@@ -275,9 +296,37 @@ void Tunnel::connect()
 					_remoteTimeout.assign(keepAlive, 0);
 					_logger.debug("Server has requested a keep-alive timeout (remoteTimeout) of %d seconds."s, keepAlive);
 				}
+				std::size_t maxFrameSize = Poco::WebTunnel::Protocol::negotiatedFrameSize(response.get(X_WEBTUNNEL_MAXFRAMESIZE, ""s), _maxFrameSize);
+				_logger.debug("Using a maximum frame size of %z bytes."s, maxFrameSize);
+				if (pWebSocket->deflateEnabled())
+				{
+					_logger.debug("Using permessage-deflate WebSocket compression."s);
+					pWebSocket->setCompressionLevel(_deflateParams.compressionLevel);
+				}
 				pWebSocket->setNoDelay(true);
 				_retryDelay = MIN_RETRY_DELAY;
-				_pForwarder = new Poco::WebTunnel::RemotePortForwarder(*_pDispatcher, pWebSocket, _host, _ports, _remoteTimeout, _pSocketFactory);
+				_pForwarder = new Poco::WebTunnel::RemotePortForwarder(*_pDispatcher, pWebSocket, _host, _ports, _remoteTimeout, _pSocketFactory, maxFrameSize);
+				_pDispatcher->setWatermarks(*pWebSocket, _tunnelHighWatermark, _tunnelLowWatermark);
+				if (_readBudget > 0) _pForwarder->setReadBudget(_readBudget);
+				int peerCapabilities = Poco::WebTunnel::Protocol::parseCapabilities(response.get(X_WEBTUNNEL_CAPABILITIES, ""s));
+				if (_batchEnabled && (peerCapabilities & Poco::WebTunnel::Protocol::WT_CAP_BATCH))
+				{
+					_logger.debug("Batching of small frames enabled."s);
+					_pForwarder->enableBatching(_batchDelay);
+				}
+				if (_flowControlEnabled && (peerCapabilities & Poco::WebTunnel::Protocol::WT_CAP_FLOW_CONTROL))
+				{
+					_logger.debug("Per-channel flow control enabled."s);
+					_pForwarder->enableFlowControl();
+				}
+				if (_compressionLevel > 0)
+				{
+					_pForwarder->enableCompression(_compressionLevel);
+				}
+				for (const auto& p: _portWeights)
+				{
+					_pForwarder->setPortWeight(p.first, p.second);
+				}
 				_pForwarder->setConnectTimeout(_connectTimeout);
 				_pForwarder->setLocalTimeout(_localTimeout);
 				_pForwarder->webSocketClosed += Poco::delegate(this, &Tunnel::onClose);
@@ -498,6 +547,36 @@ void Tunnel::init()
 	_connectTimeout = Poco::Timespan(_pConfig->getInt("webtunnel.connectTimeout"s, 10), 0);
 	_remoteTimeout = Poco::Timespan(_pConfig->getInt("webtunnel.remoteTimeout"s, 300), 0);
 	_propertiesUpdateInterval = Poco::Timespan(_pConfig->getInt("webtunnel.propertiesUpdateInterval"s, 0), 0);
+	_tunnelHighWatermark = _pConfig->getUInt64("webtunnel.tunnelHighWatermark"s, 1024*1024);
+	_tunnelLowWatermark = _pConfig->getUInt64("webtunnel.tunnelLowWatermark"s, 256*1024);
+	_readBudget = _pConfig->getUInt64("webtunnel.readBudget"s, 0);
+	_maxFrameSize = Poco::WebTunnel::Protocol::offeredFrameSize(_pConfig->getUInt64("webtunnel.maxFrameSize"s, Poco::WebTunnel::Protocol::WT_FRAME_PREFERRED_SIZE));
+	_batchEnabled = _pConfig->getBool("webtunnel.batch.enable"s, true);
+	_batchDelay = Poco::Timespan(_pConfig->getInt64("webtunnel.batch.delay"s, 0));
+	_flowControlEnabled = _pConfig->getBool("webtunnel.flowControl.enable"s, true);
+	if (_pConfig->getBool("webtunnel.compression.enable"s, false))
+	{
+		_compressionLevel = _pConfig->getInt("webtunnel.compression.level"s, 1);
+	}
+	_webSocketDeflate = _pConfig->getBool("webtunnel.websocket.deflate.enable"s, false);
+	_deflateParams.compressionLevel = _pConfig->getInt("webtunnel.websocket.deflate.level"s, Z_BEST_SPEED);
+	_deflateParams.clientMaxWindowBits = _pConfig->getInt("webtunnel.websocket.deflate.windowBits"s, Poco::Net::WebSocketDeflate::MAX_WINDOW_BITS);
+	_deflateParams.serverMaxWindowBits = _deflateParams.clientMaxWindowBits;
+	Poco::Util::AbstractConfiguration::Keys priorityKeys;
+	_pConfig->keys("webtunnel.priority"s, priorityKeys);
+	for (const auto& key: priorityKeys)
+	{
+		unsigned port;
+		unsigned weight;
+		if (Poco::NumberParser::tryParseUnsigned(key, port) && port > 0 && port <= 65535 && Poco::NumberParser::tryParseUnsigned(_pConfig->getString("webtunnel.priority."s + key), weight))
+		{
+			_portWeights[static_cast<Poco::UInt16>(port)] = weight;
+		}
+		else
+		{
+			_logger.warning("Ignoring invalid channel priority setting webtunnel.priority.%s."s, key);
+		}
+	}
 	_httpPath = _pConfig->getString("webtunnel.httpPath"s, ""s);
 	_httpPort = loadPort("http"s);
 	_sshPort = loadPort("ssh"s);
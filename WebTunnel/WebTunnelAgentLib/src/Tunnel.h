@@ -98,6 +98,8 @@ protected:
 	static const std::string X_PTTH_SET_PROPERTY;
 	static const std::string X_PTTH_ERROR;
 	static const std::string X_WEBTUNNEL_KEEPALIVE;
+	static const std::string X_WEBTUNNEL_MAXFRAMESIZE;
+	static const std::string X_WEBTUNNEL_CAPABILITIES;
 
 private:
 	std::string _id;
@@ -129,6 +131,17 @@ private:
 	Poco::Timespan _remoteTimeout;
 	Poco::Timespan _httpTimeout;
 	Poco::Timespan _propertiesUpdateInterval;
+	std::size_t _tunnelHighWatermark;
+	std::size_t _tunnelLowWatermark;
+	std::size_t _readBudget;
+	std::size_t _maxFrameSize;
+	bool _batchEnabled;
+	Poco::Timespan _batchDelay;
+	bool _flowControlEnabled;
+	int _compressionLevel;
+	bool _webSocketDeflate;
+	Poco::Net::WebSocketDeflate::Params _deflateParams;
+	std::map<Poco::UInt16, unsigned> _portWeights;
 	int _retryDelay;
 	Poco::SharedPtr<Poco::Util::Timer> _pTimer;
 	Poco::SharedPtr<Poco::WebTunnel::SocketDispatcher> _pDispatcher;
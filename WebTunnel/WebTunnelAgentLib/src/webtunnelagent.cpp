@@ -69,6 +69,7 @@ webtunnel.password =
 webtunnel.connectTimeout = 10
 webtunnel.localTimeout = 7200
 webtunnel.remoteTimeout = 900
+webtunnel.dispatcherThreads = 1
 http.timeout = 30
 tls.acceptUnknownCertificate = false
 tls.ciphers = HIGH:!DSS:!aNULL@STRENGTH
@@ -413,7 +414,8 @@ webtunnel_agent WebTunnelAgent_API webtunnel_agent_create(const char* reflector_
 			pConfig->setString("webtunnel.ports"s, portsList);
 		}
 
-		Poco::SharedPtr<Poco::WebTunnel::SocketDispatcher> pDispatcher = new Poco::WebTunnel::SocketDispatcher;
+		Poco::SharedPtr<Poco::WebTunnel::SocketDispatcher> pDispatcher = new Poco::WebTunnel::SocketDispatcher(pConfig->getInt("webtunnel.dispatcherThreads"s, 1));
+		pDispatcher->setWatermarks(pConfig->getUInt64("webtunnel.highWatermark"s, 256*1024), pConfig->getUInt64("webtunnel.lowWatermark"s, 64*1024));
 		Poco::WebTunnel::SocketFactory::Ptr pSocketFactory;
 #if defined(WEBTUNNEL_ENABLE_TLS)
 		if (pConfig->getBool("webtunnel.https.enable"s, false))
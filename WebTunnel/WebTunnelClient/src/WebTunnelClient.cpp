@@ -15,11 +15,15 @@
 #include "Poco/Net/HTTPSessionInstantiator.h"
 #if defined(WEBTUNNEL_ENABLE_TLS)
 #include "Poco/Net/HTTPSSessionInstantiator.h"
+#include "Poco/Net/SecureStreamSocket.h"
 #include "Poco/Net/Context.h"
 #include "Poco/Net/PrivateKeyPassphraseHandler.h"
 #include "Poco/Net/AcceptCertificateHandler.h"
 #include "Poco/Net/RejectCertificateHandler.h"
 #include "Poco/Net/SSLManager.h"
+#if !defined(POCO_NETSSL_WIN)
+#include "Poco/Net/ClientSessionCache.h"
+#endif
 #endif
 #include "Poco/Util/ServerApplication.h"
 #include "Poco/Util/Option.h"
@@ -66,6 +70,35 @@ public:
 };
 
 
+Poco::Net::StreamSocket* createForwardingSocket(const Poco::URI& uri)
+	/// Creates the socket for opening a forwarding connection
+	/// without blocking a thread, including secure sockets,
+	/// which resume a cached TLS session if available.
+{
+#if defined(WEBTUNNEL_ENABLE_TLS)
+	if (uri.getScheme() == "https"s || uri.getScheme() == "wss"s)
+	{
+		Poco::Net::Context::Ptr pContext = Poco::Net::SSLManager::instance().defaultClientContext();
+		Poco::Net::SecureStreamSocket* pSocket = new Poco::Net::SecureStreamSocket(pContext);
+		pSocket->setPeerHostName(uri.getHost());
+#if !defined(POCO_NETSSL_WIN)
+		Poco::Net::ClientSessionCache* pCache = Poco::Net::ClientSessionCache::attachedCache(pContext);
+		if (pCache)
+		{
+			Poco::Net::Session::Ptr pSession = pCache->find(uri.getHost());
+			if (pSession) pSocket->useSession(pSession);
+		}
+#endif
+		return pSocket;
+	}
+#endif
+	if (uri.getScheme() == "http"s || uri.getScheme() == "ws"s)
+		return new Poco::Net::StreamSocket;
+	else
+		return nullptr;
+}
+
+
 class JWTWebSocketFactory: public Poco::WebTunnel::WebSocketFactory
 {
 public:
@@ -79,11 +112,22 @@ public:
 	{
 		Poco::SharedPtr<Poco::Net::HTTPClientSession> pSession = Poco::Net::HTTPSessionFactory::defaultFactory().createClientSession(uri);
 		pSession->setTimeout(_timeout);
+		prepareRequest(uri, request);
+		return new Poco::Net::WebSocket(*pSession, request, response);
+	}
+
+	bool prepareRequest(const Poco::URI& uri, Poco::Net::HTTPRequest& request)
+	{
 		if (!_jwt.empty())
 		{
 			request.set(Poco::Net::HTTPRequest::AUTHORIZATION, Poco::format("bearer %s", _jwt));
 		}
-		return new Poco::Net::WebSocket(*pSession, request, response);
+		return true;
+	}
+
+	Poco::Net::StreamSocket* createSocket(const Poco::URI& uri)
+	{
+		return createForwardingSocket(uri);
 	}
 
 private:
@@ -92,6 +136,21 @@ private:
 };
 
 
+class BasicWebSocketFactory: public Poco::WebTunnel::DefaultWebSocketFactory
+{
+public:
+	BasicWebSocketFactory(const std::string& username, const std::string& password, Poco::Timespan timeout = Poco::Timespan(30, 0)):
+		Poco::WebTunnel::DefaultWebSocketFactory(username, password, timeout)
+	{
+	}
+
+	Poco::Net::StreamSocket* createSocket(const Poco::URI& uri)
+	{
+		return createForwardingSocket(uri);
+	}
+};
+
+
 class WebTunnelClient: public Poco::Util::ServerApplication
 {
 public:
@@ -432,6 +491,14 @@ protected:
 			pContext->requireMinimumProtocol(minProto);
 			pContext->enableExtendedCertificateVerification(extendedVerification);
 			Poco::Net::SSLManager::instance().initializeClient(0, pCertificateHandler, pContext);
+#if !defined(POCO_NETSSL_WIN)
+			if (config().getBool("tls.sessionCache.enable"s, true))
+			{
+				Poco::Net::ClientSessionCache::defaultCache().attach(pContext);
+				_sessionCacheFile = config().getString("tls.sessionCache.file"s, ""s);
+				loadSessionCache();
+			}
+#endif
 #endif
 
 			if (config().getBool("http.proxy.enable"s, false))
@@ -468,12 +535,29 @@ protected:
 			}
 			else
 			{
-				pWSF = new Poco::WebTunnel::DefaultWebSocketFactory(_username, _password, connectTimeout);
+				pWSF = new BasicWebSocketFactory(_username, _password, connectTimeout);
 			}
 			Poco::Net::SocketAddress localAddr(_bindAddress, _localPort);
 			Poco::WebTunnel::LocalPortForwarder forwarder(localAddr, _remotePort, uri, 0, pWSF);
 			forwarder.setRemoteTimeout(remoteTimeout);
 			forwarder.setLocalTimeout(localTimeout);
+			forwarder.setConnectTimeout(connectTimeout);
+			if (config().getBool("webtunnel.websocket.deflate.enable"s, false))
+			{
+				Poco::Net::WebSocketDeflate::Params deflateParams;
+				deflateParams.compressionLevel = config().getInt("webtunnel.websocket.deflate.level"s, Z_BEST_SPEED);
+				deflateParams.clientMaxWindowBits = config().getInt("webtunnel.websocket.deflate.windowBits"s, Poco::Net::WebSocketDeflate::MAX_WINDOW_BITS);
+				deflateParams.serverMaxWindowBits = deflateParams.clientMaxWindowBits;
+				forwarder.enableWebSocketDeflate(deflateParams);
+			}
+			forwarder.enableMultiplexing(config().getBool("webtunnel.multiplex"s, false));
+			std::size_t poolSize = static_cast<std::size_t>(config().getInt("webtunnel.websocketPool.size"s, 0));
+			if (poolSize > 0)
+			{
+				Poco::Timespan poolIdleTimeout(config().getInt("webtunnel.websocketPool.idleTimeout"s, 120), 0);
+				Poco::Timespan poolPingInterval(config().getInt("webtunnel.websocketPool.pingInterval"s, 30), 0);
+				forwarder.enableWebSocketPool(poolSize, poolIdleTimeout, poolPingInterval);
+			}
 
 			if (_command.empty())
 			{
@@ -485,10 +569,45 @@ protected:
 				Poco::ProcessHandle ph = Poco::Process::launch(_command, commandArgs);
 				rc = ph.wait();
 			}
+			saveSessionCache();
 		}
 		return rc;
 	}
 
+	void loadSessionCache()
+	{
+#if defined(WEBTUNNEL_ENABLE_TLS) && !defined(POCO_NETSSL_WIN)
+		if (!_sessionCacheFile.empty() && Poco::File(_sessionCacheFile).exists())
+		{
+			try
+			{
+				Poco::Net::ClientSessionCache::defaultCache().load(_sessionCacheFile);
+			}
+			catch (Poco::Exception& exc)
+			{
+				logger().warning("Failed to load TLS session cache from %s: %s"s, _sessionCacheFile, exc.displayText());
+			}
+		}
+#endif
+	}
+
+	void saveSessionCache()
+	{
+#if defined(WEBTUNNEL_ENABLE_TLS) && !defined(POCO_NETSSL_WIN)
+		if (!_sessionCacheFile.empty())
+		{
+			try
+			{
+				Poco::Net::ClientSessionCache::defaultCache().save(_sessionCacheFile);
+			}
+			catch (Poco::Exception& exc)
+			{
+				logger().warning("Failed to save TLS session cache to %s: %s"s, _sessionCacheFile, exc.displayText());
+			}
+		}
+#endif
+	}
+
 private:
 	bool _helpRequested;
 	Poco::UInt16 _localPort;
@@ -498,6 +617,7 @@ private:
 	std::string _password;
 	std::string _token;
 	std::string _command;
+	std::string _sessionCacheFile;
 	SSLInitializer _sslInitializer;
 };
 
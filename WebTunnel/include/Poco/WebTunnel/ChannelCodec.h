@@ -0,0 +1,124 @@
+//
+// ChannelCodec.h
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  ChannelCodec
+//
+// Definition of the ChannelCodec class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef WebTunnel_ChannelCodec_INCLUDED
+#define WebTunnel_ChannelCodec_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "Poco/SharedPtr.h"
+#include "Poco/Buffer.h"
+#if defined(POCO_UNBUNDLED)
+#include <zlib.h>
+#else
+#include "Poco/zlib.h"
+#endif
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+class WebTunnel_API ChannelCodec
+	/// Compresses and decompresses the payload of data frames
+	/// sent over a channel, if compression has been negotiated
+	/// for the channel with the Protocol::WT_FLAG_DEFLATE flag.
+	///
+	/// Every direction of a channel uses a single raw deflate
+	/// (RFC 1951) stream, so that the compression context is kept
+	/// across frames. Every compressed frame ends with a sync flush,
+	/// so it can be fully decompressed as soon as it has been received.
+	///
+	/// Small frames, as well as frames following a frame that
+	/// did not compress well (e.g., TLS or already compressed data),
+	/// are sent uncompressed. Such frames bypass the deflate stream,
+	/// so the compression contexts of both peers stay in sync.
+	/// The number of frames bypassing compression doubles with every
+	/// frame that does not compress, up to MAX_BYPASS_FRAMES.
+	///
+	/// Compression and decompression are independent of each other
+	/// and may be used by different threads, but each one must only be
+	/// used by a single thread at a time.
+{
+public:
+	using Ptr = Poco::SharedPtr<ChannelCodec>;
+
+	enum
+	{
+		MIN_COMPRESS_SIZE = 64,  /// Smaller frames are always sent uncompressed.
+		MAX_BYPASS_FRAMES = 64,  /// Maximum number of frames sent uncompressed after a frame did not compress.
+		WINDOW_BITS = 15         /// Size of the deflate window (32 KB).
+	};
+
+	explicit ChannelCodec(int level = Z_BEST_SPEED);
+		/// Creates the ChannelCodec, using the given
+		/// compression level (1 - 9).
+
+	~ChannelCodec();
+		/// Destroys the ChannelCodec.
+
+	bool compress(const char* pData, std::size_t size);
+		/// Compresses the given data, which is then available
+		/// from compressed().
+		///
+		/// Returns false, without passing the data through the
+		/// deflate stream, if the data should be sent uncompressed.
+
+	const Poco::Buffer<char>& compressed() const;
+		/// Returns the data compressed by the last call to compress().
+
+	void decompress(const char* pData, std::size_t size, std::size_t maxSize);
+		/// Decompresses the given data, which is then available
+		/// from decompressed().
+		///
+		/// Throws a Poco::DataFormatException if the data is corrupt,
+		/// or if it decompresses to more than maxSize bytes.
+
+	const Poco::Buffer<char>& decompressed() const;
+		/// Returns the data decompressed by the last call to decompress().
+
+private:
+	ChannelCodec(const ChannelCodec&) = delete;
+	ChannelCodec& operator = (const ChannelCodec&) = delete;
+
+	z_stream _deflater;
+	z_stream _inflater;
+	Poco::Buffer<char> _compressed;
+	Poco::Buffer<char> _decompressed;
+	unsigned _bypassFrames = 0;
+	unsigned _backoff = 1;
+};
+
+
+//
+// inlines
+//
+inline const Poco::Buffer<char>& ChannelCodec::compressed() const
+{
+	return _compressed;
+}
+
+
+inline const Poco::Buffer<char>& ChannelCodec::decompressed() const
+{
+	return _decompressed;
+}
+
+
+} } // namespace Poco::WebTunnel
+
+
+#endif // WebTunnel_ChannelCodec_INCLUDED
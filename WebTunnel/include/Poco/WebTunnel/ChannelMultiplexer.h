@@ -0,0 +1,285 @@
+//
+// ChannelMultiplexer.h
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  ChannelMultiplexer
+//
+// Definition of the ChannelMultiplexer class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef WebTunnel_ChannelMultiplexer_INCLUDED
+#define WebTunnel_ChannelMultiplexer_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "Poco/WebTunnel/SocketDispatcher.h"
+#include "Poco/WebTunnel/Protocol.h"
+#include "Poco/Net/StreamSocket.h"
+#include "Poco/Net/WebSocket.h"
+#include "Poco/SharedPtr.h"
+#include "Poco/AutoPtr.h"
+#include "Poco/RefCountedObject.h"
+#include "Poco/Buffer.h"
+#include "Poco/Mutex.h"
+#include "Poco/Logger.h"
+#include <atomic>
+#include <map>
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+class WebTunnel_API ChannelMultiplexer: public Poco::RefCountedObject
+	/// ChannelMultiplexer forwards multiple local connections over
+	/// a single WebSocket connection, using the channel frames of the
+	/// WebTunnel protocol (see Protocol, Multiplexed Client Connections).
+	///
+	/// It is the client-side counterpart of RemotePortForwarder, and
+	/// used by LocalPortForwarder in multiplexed mode. For every local
+	/// connection, a channel is opened with an Open Channel Request.
+	/// Data is read from the local socket only after the server has
+	/// confirmed the channel.
+	///
+	/// If flow control has been negotiated with the server (see
+	/// enableFlowControl()), a stalled local connection only blocks
+	/// its own channel. Otherwise, data received for a local connection
+	/// that cannot keep up is queued by the SocketDispatcher, and once
+	/// the local socket's high watermark has been reached, reading from
+	/// the WebSocket is suspended, which stalls all channels.
+	///
+	/// Once the WebSocket has been closed, either by the server, due
+	/// to an error, or because the server did not respond to a keep-alive
+	/// PING, all local connections are closed and no further channels
+	/// can be opened.
+{
+public:
+	using Ptr = Poco::AutoPtr<ChannelMultiplexer>;
+
+	ChannelMultiplexer(Poco::SharedPtr<SocketDispatcher> pDispatcher, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, std::size_t maxFrameSize = Protocol::WT_FRAME_MAX_SIZE, Poco::Timespan remoteTimeout = Poco::Timespan(300, 0));
+		/// Creates the ChannelMultiplexer, using the given socket dispatcher
+		/// and web socket, which must have already been connected to the
+		/// server, with the "multiplex" capability accepted by the server.
+		///
+		/// The maxFrameSize is the maximum payload size of a frame, excluding
+		/// the protocol header, as negotiated with the server.
+
+	~ChannelMultiplexer();
+		/// Destroys the ChannelMultiplexer.
+
+	void start();
+		/// Adds the WebSocket to the SocketDispatcher.
+		/// Must be called before opening channels.
+
+	void enableFlowControl();
+		/// Enables credit-based flow control for all channels
+		/// (see Protocol).
+		///
+		/// Reading from a local socket is suspended when its channel
+		/// has run out of send credit, and credit is granted to the
+		/// server only after received data has been written to the
+		/// local socket.
+		///
+		/// Must only be enabled if the server has accepted the
+		/// Protocol::WT_CAP_FLOW_CONTROL capability. Must be called
+		/// before start().
+
+	bool flowControlEnabled() const;
+		/// Returns true if flow control has been enabled.
+
+	bool openChannel(const Poco::Net::StreamSocket& socket, Poco::UInt16 port);
+		/// Opens a channel to the given remote port for the given
+		/// local socket, which is added to the SocketDispatcher.
+		///
+		/// Returns false if the WebSocket has been closed, or if no
+		/// channel number is available. The caller is responsible for
+		/// closing the socket in this case.
+
+	void close();
+		/// Closes all local connections and the WebSocket.
+
+	bool isOpen() const;
+		/// Returns true if the WebSocket has not been closed yet.
+
+	std::size_t channelCount() const;
+		/// Returns the number of open channels.
+
+	void setLocalTimeout(Poco::Timespan timeout);
+		/// Sets the timeout for local connections.
+
+	Poco::Timespan getLocalTimeout() const;
+		/// Returns the timeout for local connections.
+
+	void setCloseTimeout(Poco::Timespan timeout);
+		/// Sets the timeout for closing a connection.
+
+	Poco::Timespan getCloseTimeout() const;
+		/// Returns the timeout for closing a connection.
+
+protected:
+	int multiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer);
+	void multiplexError(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel);
+	void multiplexTimeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel);
+	void demultiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer);
+	void demultiplexError(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket);
+	void demultiplexTimeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket);
+	void processFrame(const char* buffer, std::size_t size, bool allowBatch);
+	void confirmChannel(Poco::UInt16 channel);
+	void forwardData(const char* buffer, std::size_t size, Poco::UInt16 channel);
+	void dataSent(Poco::UInt16 channel, std::size_t bytes);
+	void updateWindow(Poco::UInt16 channel, Poco::UInt32 credit);
+	void removeChannel(Poco::UInt16 channel);
+	int setChannelFlag(Poco::UInt16 channel, int flag);
+	int getChannelFlags(Poco::UInt16 channel) const;
+	void sendResponse(Poco::UInt16 channel, Poco::UInt8 opcode, Poco::UInt16 errorCode);
+	void sendFrame(const char* buffer, std::size_t size);
+	void closeWebSocket(bool graceful);
+
+private:
+	class ChannelHandler: public SocketDispatcher::SocketHandler
+	{
+	public:
+		ChannelHandler(ChannelMultiplexer::Ptr pMultiplexer, Poco::UInt16 channel):
+			_pMultiplexer(pMultiplexer),
+			_channel(channel),
+			_buffer(pMultiplexer->_maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE)
+		{
+		}
+
+		void readable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+			_pMultiplexer->multiplex(dispatcher, socket, _channel, _buffer);
+		}
+
+		void writable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+		}
+
+		void exception(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+			_pMultiplexer->multiplexError(dispatcher, socket, _channel);
+		}
+
+		void timeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+			_pMultiplexer->multiplexTimeout(dispatcher, socket, _channel);
+		}
+
+		void sent(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, std::size_t bytes)
+		{
+			if (_pMultiplexer->_flowControl)
+			{
+				_pMultiplexer->dataSent(_channel, bytes);
+			}
+		}
+
+	private:
+		ChannelMultiplexer::Ptr _pMultiplexer;
+		Poco::UInt16 _channel;
+		Poco::Buffer<char> _buffer;
+	};
+
+	class WebSocketHandler: public SocketDispatcher::SocketHandler
+	{
+	public:
+		WebSocketHandler(ChannelMultiplexer::Ptr pMultiplexer):
+			_pMultiplexer(pMultiplexer),
+			_buffer(pMultiplexer->_maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE)
+		{
+		}
+
+		void readable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+			_pMultiplexer->demultiplex(dispatcher, socket, _buffer);
+		}
+
+		void writable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+		}
+
+		void exception(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+			_pMultiplexer->demultiplexError(dispatcher, socket);
+		}
+
+		void timeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+		{
+			_pMultiplexer->demultiplexTimeout(dispatcher, socket);
+		}
+
+	private:
+		ChannelMultiplexer::Ptr _pMultiplexer;
+		Poco::Buffer<char> _buffer;
+	};
+
+	enum ChannelFlags
+	{
+		CF_CONFIRMED     = 0x01, /// channel has been confirmed by the server
+		CF_CLOSED_LOCAL  = 0x02, /// local connection has been closed
+		CF_CLOSED_REMOTE = 0x04, /// channel has been closed by the server
+		CF_SUSPENDED     = 0x08  /// reading suspended, waiting for send credit
+	};
+
+	struct ChannelInfo
+	{
+		Poco::Net::StreamSocket socket;
+		int flags = 0;
+		std::size_t sendCredit = Protocol::WT_CHANNEL_WINDOW_SIZE; // bytes that may still be sent to the server
+		std::size_t unacknowledged = 0; // bytes written to the local socket, but not yet granted as credit
+	};
+
+	Poco::SharedPtr<SocketDispatcher> _pDispatcher;
+	Poco::SharedPtr<Poco::Net::WebSocket> _pWebSocket;
+	std::size_t _maxFrameSize;
+	Poco::Timespan _remoteTimeout;
+	Poco::Timespan _localTimeout;
+	Poco::Timespan _closeTimeout;
+	std::atomic<bool> _flowControl{false};
+	std::map<Poco::UInt16, ChannelInfo> _channels;
+	Poco::UInt16 _nextChannel = 1;
+	bool _closed = false;
+	int _timeoutCount = 0;
+	mutable Poco::FastMutex _mutex;
+	Poco::Logger& _logger;
+
+	ChannelMultiplexer() = delete;
+	ChannelMultiplexer(const ChannelMultiplexer&) = delete;
+	ChannelMultiplexer& operator = (const ChannelMultiplexer&) = delete;
+
+	friend class ChannelHandler;
+	friend class WebSocketHandler;
+};
+
+
+//
+// inlines
+//
+inline bool ChannelMultiplexer::flowControlEnabled() const
+{
+	return _flowControl;
+}
+
+
+inline Poco::Timespan ChannelMultiplexer::getLocalTimeout() const
+{
+	return _localTimeout;
+}
+
+
+inline Poco::Timespan ChannelMultiplexer::getCloseTimeout() const
+{
+	return _closeTimeout;
+}
+
+
+} } // namespace Poco::WebTunnel
+
+
+#endif // WebTunnel_ChannelMultiplexer_INCLUDED
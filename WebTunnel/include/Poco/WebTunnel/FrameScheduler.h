@@ -0,0 +1,125 @@
+//
+// FrameScheduler.h
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  FrameScheduler
+//
+// Definition of the FrameScheduler class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef WebTunnel_FrameScheduler_INCLUDED
+#define WebTunnel_FrameScheduler_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "Poco/Buffer.h"
+#include <deque>
+#include <map>
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+class WebTunnel_API FrameScheduler
+	/// A deficit round robin (DRR) scheduler for frames of
+	/// multiple channels sharing a single WebSocket.
+	///
+	/// Every channel has its own queue of frames, and a weight.
+	/// Channels with queued frames are visited in round robin
+	/// order. On each visit, a channel may send frames up to
+	/// quantum * weight bytes (plus any unused amount carried
+	/// over from previous visits), so the available bandwidth is
+	/// shared in proportion to the weights, independently of
+	/// frame sizes.
+	///
+	/// In addition, there is a single urgent queue for control
+	/// frames, which is always served first.
+	///
+	/// The FrameScheduler is not thread-safe.
+{
+public:
+	FrameScheduler(std::size_t quantum);
+		/// Creates the FrameScheduler with the given quantum (bytes),
+		/// which should be at least the maximum frame size.
+
+	~FrameScheduler() = default;
+		/// Destroys the FrameScheduler.
+
+	void enqueue(Poco::UInt16 channel, unsigned weight, Poco::Buffer<char>&& frame);
+		/// Adds a frame to the queue of the given channel.
+		/// The weight (at least 1) is used if the channel does
+		/// not already have queued frames.
+
+	void enqueueUrgent(Poco::Buffer<char>&& frame);
+		/// Adds a frame to the urgent queue.
+
+	bool dequeue(Poco::Buffer<char>& frame, Poco::UInt16& channel, bool& urgent);
+		/// Removes the next frame to be sent and stores it, together
+		/// with its channel, in frame and channel. urgent is set to true
+		/// if the frame has been taken from the urgent queue.
+		///
+		/// Returns false if no frames are queued.
+
+	void remove(Poco::UInt16 channel);
+		/// Discards all queued frames of the given channel.
+
+	void clear();
+		/// Discards all queued frames.
+
+	bool empty() const;
+		/// Returns true if no frames are queued.
+
+	std::size_t queuedBytes(Poco::UInt16 channel) const;
+		/// Returns the number of bytes queued for the given channel.
+
+	std::size_t queuedBytes() const;
+		/// Returns the total number of bytes queued.
+
+private:
+	struct Queue
+	{
+		std::deque<Poco::Buffer<char>> frames;
+		std::size_t bytes = 0;
+		std::size_t deficit = 0;
+		unsigned weight = 1;
+		bool visited = false;
+	};
+
+	FrameScheduler(const FrameScheduler&) = delete;
+	FrameScheduler& operator = (const FrameScheduler&) = delete;
+
+	std::size_t _quantum;
+	std::map<Poco::UInt16, Queue> _queues;
+	std::deque<Poco::UInt16> _active;
+	std::deque<Poco::Buffer<char>> _urgent;
+	std::size_t _bytes = 0;
+};
+
+
+//
+// inlines
+//
+inline bool FrameScheduler::empty() const
+{
+	return _bytes == 0 && _urgent.empty();
+}
+
+
+inline std::size_t FrameScheduler::queuedBytes() const
+{
+	return _bytes;
+}
+
+
+} } // namespace Poco::WebTunnel
+
+
+#endif // WebTunnel_FrameScheduler_INCLUDED
@@ -0,0 +1,142 @@
+//
+// Histogram.h
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  Histogram
+//
+// Definition of the Histogram class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef WebTunnel_Histogram_INCLUDED
+#define WebTunnel_Histogram_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include <atomic>
+#include <vector>
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+class WebTunnel_API Histogram
+	/// A histogram with logarithmic buckets, similar to an
+	/// HDR histogram, for recording latencies and sizes.
+	///
+	/// Every power of two range [2^n, 2^(n+1)) is split into
+	/// SUB_BUCKETS linear sub-buckets, so the whole range of
+	/// 64-bit values is covered by less than two thousand counters,
+	/// with a relative error of at most 1/SUB_BUCKETS (about 3%).
+	///
+	/// Values must be recorded by a single thread only (e.g., the
+	/// SocketDispatcher thread owning the histogram), so recording
+	/// is just a few relaxed atomic loads and stores. A snapshot can
+	/// be obtained from any thread at any time.
+{
+public:
+	enum
+	{
+		SUB_BUCKET_BITS = 5,
+		SUB_BUCKETS = 1 << SUB_BUCKET_BITS,
+		BUCKETS = (64 - SUB_BUCKET_BITS + 1)*SUB_BUCKETS
+	};
+
+	struct WebTunnel_API Snapshot
+		/// A copy of the histogram's counters.
+	{
+		Poco::UInt64 count = 0;
+		Poco::UInt64 sum = 0;
+		Poco::UInt64 max = 0;
+		std::vector<Poco::UInt64> buckets;
+
+		double mean() const;
+			/// Returns the mean of all recorded values.
+
+		Poco::UInt64 percentile(double p) const;
+			/// Returns an upper bound for the value at the given
+			/// percentile (0 - 100) of all recorded values.
+
+		void merge(const Snapshot& other);
+			/// Adds the counters of another snapshot.
+	};
+
+	Histogram();
+		/// Creates an empty Histogram.
+
+	~Histogram() = default;
+		/// Destroys the Histogram.
+
+	void record(Poco::UInt64 value);
+		/// Records a value.
+
+	Snapshot snapshot() const;
+		/// Returns a copy of the current counters.
+
+	static std::size_t bucketIndex(Poco::UInt64 value);
+		/// Returns the index of the bucket counting the given value.
+
+	static Poco::UInt64 bucketLimit(std::size_t index);
+		/// Returns the largest value counted in the given bucket.
+
+private:
+	Histogram(const Histogram&) = delete;
+	Histogram& operator = (const Histogram&) = delete;
+
+	static void add(std::atomic<Poco::UInt64>& counter, Poco::UInt64 value);
+
+	std::atomic<Poco::UInt64> _buckets[BUCKETS];
+	std::atomic<Poco::UInt64> _count;
+	std::atomic<Poco::UInt64> _sum;
+	std::atomic<Poco::UInt64> _max;
+};
+
+
+//
+// inlines
+//
+inline void Histogram::add(std::atomic<Poco::UInt64>& counter, Poco::UInt64 value)
+{
+	// single writer, so no read-modify-write operation needed
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+inline std::size_t Histogram::bucketIndex(Poco::UInt64 value)
+{
+	if (value < SUB_BUCKETS) return static_cast<std::size_t>(value);
+
+	unsigned msb = 0;
+#if defined(__GNUC__)
+	msb = 63 - __builtin_clzll(value);
+#else
+	for (Poco::UInt64 v = value >> 1; v; v >>= 1) msb++;
+#endif
+	unsigned shift = msb - SUB_BUCKET_BITS;
+	return (msb - SUB_BUCKET_BITS + 1)*SUB_BUCKETS + static_cast<std::size_t>((value >> shift) & (SUB_BUCKETS - 1));
+}
+
+
+inline void Histogram::record(Poco::UInt64 value)
+{
+	add(_buckets[bucketIndex(value)], 1);
+	add(_count, 1);
+	add(_sum, value);
+	if (value > _max.load(std::memory_order_relaxed))
+	{
+		_max.store(value, std::memory_order_relaxed);
+	}
+}
+
+
+} } // namespace Poco::WebTunnel
+
+
+#endif // WebTunnel_Histogram_INCLUDED
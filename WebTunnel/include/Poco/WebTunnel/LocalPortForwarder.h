@@ -20,16 +20,22 @@
 
 #include "Poco/WebTunnel/WebTunnel.h"
 #include "Poco/WebTunnel/SocketDispatcher.h"
+#include "Poco/WebTunnel/Protocol.h"
+#include "Poco/WebTunnel/ChannelMultiplexer.h"
 #include "Poco/Net/TCPServer.h"
 #include "Poco/Net/TCPServerParams.h"
 #include "Poco/Net/ServerSocket.h"
 #include "Poco/Net/StreamSocket.h"
 #include "Poco/Net/SocketAddress.h"
 #include "Poco/Net/WebSocket.h"
+#include "Poco/Net/HTTPResponse.h"
 #include "Poco/URI.h"
 #include "Poco/SharedPtr.h"
 #include "Poco/Mutex.h"
+#include "Poco/Condition.h"
+#include "Poco/Clock.h"
 #include "Poco/Logger.h"
+#include <atomic>
 
 
 namespace Poco {
@@ -57,6 +63,31 @@ public:
 	virtual Poco::Net::WebSocket* createWebSocket(const Poco::URI& uri, Poco::Net::HTTPRequest& request, Poco::Net::HTTPResponse& response) = 0;
 		/// Creates and returns a Poco::Net::WebSocket connected to
 		/// the given URI, using the given request and response objects.
+
+	virtual bool prepareRequest(const Poco::URI& uri, Poco::Net::HTTPRequest& request);
+		/// Sets up the credentials for connecting to the given URI
+		/// in the given request, without sending the request.
+		///
+		/// Returns true if the request has been prepared. In this case,
+		/// LocalPortForwarder may send the request itself over a socket
+		/// obtained from createSocket(), without blocking a thread while
+		/// the connection is being opened.
+		///
+		/// The default implementation returns false, so that
+		/// createWebSocket() is always used.
+
+	virtual Poco::Net::StreamSocket* createSocket(const Poco::URI& uri);
+		/// Creates and returns a new, unconnected socket for
+		/// connecting to the given URI, or null if the URI's
+		/// scheme is not supported.
+		///
+		/// The socket is connected with connectNB(). For "https" and
+		/// "wss" URIs, the socket must be a secure socket that performs
+		/// the TLS handshake when data is sent for the first time, as
+		/// Poco::Net::SecureStreamSocket does.
+		///
+		/// The default implementation returns a Poco::Net::StreamSocket
+		/// for "http" and "ws" URIs, and null otherwise.
 };
 
 
@@ -80,6 +111,7 @@ public:
 
 	// WebSocketFactory
 	Poco::Net::WebSocket* createWebSocket(const Poco::URI& uri, Poco::Net::HTTPRequest& request, Poco::Net::HTTPResponse& response);
+	bool prepareRequest(const Poco::URI& uri, Poco::Net::HTTPRequest& request);
 
 private:
 	std::string _username;
@@ -91,6 +123,17 @@ private:
 class WebTunnel_API LocalPortForwarder
 	/// This class forwards a local port to a remote host, using a
 	/// WebSocket tunnel connection.
+	///
+	/// If the WebSocketFactory supports it (see WebSocketFactory::prepareRequest()
+	/// and WebSocketFactory::createSocket()), the forwarding WebSocket connection
+	/// for a local connection is opened without blocking a thread. Connecting,
+	/// the TLS handshake and the HTTP upgrade are driven by the SocketDispatcher,
+	/// so that many connections can be opened simultaneously. The remote host
+	/// name is resolved when the first connection is opened, and the address
+	/// is re-used for ADDRESS_CACHE_TTL seconds.
+	/// Otherwise, and if a global HTTP proxy has been configured, the WebSocket
+	/// connection is created by the WebSocketFactory in the thread handling the
+	/// local connection.
 {
 public:
 	LocalPortForwarder(Poco::UInt16 localPort, Poco::UInt16 remotePort, const Poco::URI& remoteURI, WebSocketFactory::Ptr pWebSocketFactory);
@@ -152,6 +195,89 @@ public:
 	Poco::Timespan getCloseTimeout() const;
 		/// Returns the timeout for closing a connection.
 
+	void setConnectTimeout(Poco::Timespan timeout);
+		/// Sets the timeout for opening a forwarding connection
+		/// without blocking a thread. Every step (connecting,
+		/// sending the request, receiving the response) must complete
+		/// within the timeout. Defaults to 30 seconds.
+
+	Poco::Timespan getConnectTimeout() const;
+		/// Returns the timeout for opening a forwarding connection.
+
+	void setMaxFrameSize(std::size_t size);
+		/// Sets the maximum WebSocket frame payload size offered to the
+		/// server when creating a forwarding connection. The actual size
+		/// is negotiated with the server for every connection, and will
+		/// be Protocol::WT_FRAME_MAX_SIZE if the server does not support
+		/// larger frames. Defaults to Protocol::WT_FRAME_PREFERRED_SIZE.
+
+	std::size_t getMaxFrameSize() const;
+		/// Returns the maximum WebSocket frame payload size offered to the server.
+
+	void enableWebSocketDeflate(const Poco::Net::WebSocketDeflate::Params& params = Poco::Net::WebSocketDeflate::Params());
+		/// Offers the permessage-deflate WebSocket extension (RFC 7692),
+		/// with the given parameters, to the server when creating a
+		/// forwarding connection. If the server accepts the offer, all
+		/// data sent over the connection is compressed. The server may
+		/// also decline the offer, in which case data is sent uncompressed.
+		/// Disabled by default.
+
+	bool webSocketDeflateEnabled() const;
+		/// Returns true if the permessage-deflate WebSocket extension
+		/// is offered to the server.
+
+	void enableMultiplexing(bool enable = true);
+		/// Enables or disables multiplexed mode. Disabled by default.
+		///
+		/// In multiplexed mode, all local connections are forwarded
+		/// over a single, long-lived WebSocket connection, using a
+		/// ChannelMultiplexer, if supported by the server (see Protocol,
+		/// Multiplexed Client Connections). The WebSocket connection is
+		/// created when the first local connection is accepted, and
+		/// re-created for the next local connection if it has been closed.
+		/// Opening further local connections does not require a new
+		/// HTTP upgrade (including TCP connect, TLS handshake and
+		/// authentication), but only an Open Channel Request.
+		/// Flow control is used if the server supports it, so that
+		/// a slow local connection does not stall the others.
+		///
+		/// If the server does not support multiplexing, the WebSocket
+		/// is used for the local connection it has been created for,
+		/// and every further local connection uses its own WebSocket
+		/// connection, as without multiplexing.
+
+	bool multiplexingEnabled() const;
+		/// Returns true if multiplexed mode has been enabled.
+
+	void enableWebSocketPool(std::size_t size, Poco::Timespan idleTimeout = Poco::Timespan(120, 0), Poco::Timespan pingInterval = Poco::Timespan(30, 0));
+		/// Keeps up to the given number of forwarding WebSocket connections
+		/// established in advance, so that a local connection can be
+		/// forwarded without waiting for the WebSocket connection
+		/// (including TCP connect, TLS handshake and authentication)
+		/// to be created.
+		///
+		/// The pool is filled by a background thread, using the
+		/// WebSocketFactory. Pooled WebSocket connections are kept alive
+		/// with a PING sent every pingInterval, and are replaced after the
+		/// idleTimeout has expired, if they have been closed by the server,
+		/// or if the server did not respond to a PING. Data received from the
+		/// server while a WebSocket connection is pooled (e.g., the greeting
+		/// of an SSH server) is passed on to the local connection.
+		///
+		/// Note that the server connects to the remote port for every
+		/// pooled WebSocket connection.
+		///
+		/// The pool is not used in multiplexed mode, unless the server
+		/// does not support multiplexing.
+
+	std::size_t webSocketPoolSize() const;
+		/// Returns the size of the WebSocket pool, or 0 if the
+		/// WebSocket pool has not been enabled.
+
+	std::size_t pooledWebSockets() const;
+		/// Returns the number of WebSocket connections currently
+		/// available in the WebSocket pool.
+
 	enum ConnectionFlags
 	{
 		CF_CLOSED_LOCAL = 0x01,
@@ -173,18 +299,52 @@ public:
 		Poco::Net::StreamSocket streamSocket;
 		int streamSocketFlags = 0;
 		Poco::Timespan closeTimeout;
+		std::size_t maxFrameSize = Protocol::WT_FRAME_MAX_SIZE;
+	};
+
+	enum
+	{
+		ADDRESS_CACHE_TTL = 60 /// seconds to re-use the resolved address of the remote host
 	};
 
 protected:
 	void forward(Poco::Net::StreamSocket& socket);
+	bool forwardMultiplexed(Poco::Net::StreamSocket& socket);
+	bool forwardAsync(Poco::Net::StreamSocket& socket);
+	void forwardWebSocket(Poco::Net::StreamSocket& socket, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, std::size_t maxFrameSize);
+	Poco::SharedPtr<Poco::Net::WebSocket> createWebSocket(int capabilities, Poco::Net::HTTPResponse& response, std::size_t& maxFrameSize);
+	void prepareUpgradeRequest(Poco::Net::HTTPRequest& request, int capabilities, std::size_t& maxFrameSize);
+	bool processUpgradeResponse(const Poco::Net::HTTPResponse& response, std::size_t& maxFrameSize);
+	void configureWebSocket(Poco::Net::WebSocket& webSocket);
+	Poco::Net::SocketAddress remoteAddress();
+	void resetRemoteAddress();
+	bool multiplexed();
 
 private:
+	class WebSocketPool;
+	class AsyncConnector;
+
 	Poco::Net::SocketAddress _localAddr;
 	Poco::UInt16 _remotePort;
 	Poco::URI _remoteURI;
 	Poco::Timespan _localTimeout;
-	Poco::Timespan _remoteTimeout;
+	std::atomic<Poco::Timespan::TimeDiff> _remoteTimeout; // updated by processUpgradeResponse()
 	Poco::Timespan _closeTimeout;
+	Poco::Timespan _connectTimeout;
+	std::size_t _maxFrameSize;
+	bool _webSocketDeflate;
+	Poco::Net::WebSocketDeflate::Params _deflateParams;
+	std::atomic<bool> _multiplexing;
+	std::atomic<bool> _multiplexSupported;
+	ChannelMultiplexer::Ptr _pMultiplexer;
+	bool _multiplexerConnecting;
+	Poco::Condition _multiplexerReady;
+	Poco::FastMutex _multiplexerMutex;
+	Poco::SharedPtr<WebSocketPool> _pWebSocketPool;
+	Poco::Net::SocketAddress _remoteAddress;
+	Poco::Clock _remoteAddressResolved;
+	bool _remoteAddressValid;
+	Poco::FastMutex _remoteAddressMutex;
 	WebSocketFactory::Ptr _pWebSocketFactory;
 	Poco::Net::ServerSocket _serverSocket;
 	Poco::Net::TCPServer _tcpServer;
@@ -198,6 +358,8 @@ private:
 	static const std::string SEC_WEBSOCKET_PROTOCOL;
 	static const std::string X_WEBTUNNEL_REMOTEPORT;
 	static const std::string X_WEBTUNNEL_KEEPALIVE;
+	static const std::string X_WEBTUNNEL_MAXFRAMESIZE;
+	static const std::string X_WEBTUNNEL_CAPABILITIES;
 	static const std::string WEBTUNNEL_PROTOCOL;
 
 	friend class LocalPortForwarderConnection;
@@ -233,7 +395,7 @@ inline Poco::Timespan LocalPortForwarder::getLocalTimeout() const
 
 inline Poco::Timespan LocalPortForwarder::getRemoteTimeout() const
 {
-	return _remoteTimeout;
+	return Poco::Timespan(_remoteTimeout.load());
 }
 
 
@@ -243,6 +405,30 @@ inline Poco::Timespan LocalPortForwarder::getCloseTimeout() const
 }
 
 
+inline Poco::Timespan LocalPortForwarder::getConnectTimeout() const
+{
+	return _connectTimeout;
+}
+
+
+inline std::size_t LocalPortForwarder::getMaxFrameSize() const
+{
+	return _maxFrameSize;
+}
+
+
+inline bool LocalPortForwarder::webSocketDeflateEnabled() const
+{
+	return _webSocketDeflate;
+}
+
+
+inline bool LocalPortForwarder::multiplexingEnabled() const
+{
+	return _multiplexing;
+}
+
+
 } } // namespace Poco::WebTunnel
 
 
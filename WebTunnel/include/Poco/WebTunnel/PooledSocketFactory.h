@@ -0,0 +1,137 @@
+//
+// PooledSocketFactory.h
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  PooledSocketFactory
+//
+// Definition of the PooledSocketFactory class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef WebTunnel_PooledSocketFactory_INCLUDED
+#define WebTunnel_PooledSocketFactory_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "Poco/WebTunnel/RemotePortForwarder.h"
+#include "Poco/Net/StreamSocket.h"
+#include "Poco/Net/IPAddress.h"
+#include "Poco/Runnable.h"
+#include "Poco/Thread.h"
+#include "Poco/Event.h"
+#include "Poco/Mutex.h"
+#include "Poco/Clock.h"
+#include "Poco/Logger.h"
+#include <map>
+#include <set>
+#include <deque>
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+class WebTunnel_API PooledSocketFactory: public SocketFactory, public Poco::Runnable
+	/// A SocketFactory that keeps a pool of connected sockets for
+	/// each of the given ports, so that a channel to one of these ports
+	/// can be opened without waiting for the connection (and, e.g., a
+	/// TLS handshake) to the target server.
+	///
+	/// Pooled sockets are created with createConnectedSocket() of the
+	/// given SocketFactory by a background thread, which keeps the pools
+	/// filled while the factory is started. Sockets that have been idle for
+	/// longer than the idle timeout are closed and replaced, so they are
+	/// not closed by the server while waiting in the pool. Sockets that have
+	/// become readable while idle (e.g., because the server has closed the
+	/// connection) are never handed out.
+	///
+	/// Pooling is only useful for protocols where the client sends first,
+	/// such as HTTP. If a server sends data on an idle pooled socket
+	/// (e.g., the greeting of an SSH or VNC server), pooling is disabled
+	/// for the port.
+	///
+	/// If no pooled socket is available, or for ports that are not pooled,
+	/// createSocket() of the given SocketFactory is used.
+{
+public:
+	using Ptr = Poco::AutoPtr<PooledSocketFactory>;
+
+	PooledSocketFactory(SocketFactory::Ptr pFactory, const Poco::Net::IPAddress& host, const std::set<Poco::UInt16>& ports, std::size_t poolSize, Poco::Timespan idleTimeout = Poco::Timespan(30, 0), Poco::Timespan connectTimeout = Poco::Timespan(10, 0));
+		/// Creates the PooledSocketFactory, keeping up to poolSize
+		/// connected sockets to each of the given ports on the given host.
+
+	~PooledSocketFactory();
+		/// Stops the PooledSocketFactory and destroys it.
+
+	void start();
+		/// Starts filling the pools.
+
+	void stop();
+		/// Stops filling the pools and closes all pooled sockets.
+
+	std::size_t available(Poco::UInt16 port) const;
+		/// Returns the number of pooled sockets for the given port.
+
+	// SocketFactory
+	Poco::Net::StreamSocket createSocket(const Poco::Net::SocketAddress& addr);
+
+protected:
+	void run();
+	bool refill(Poco::UInt16 port);
+
+private:
+	enum
+	{
+		RETRY_DELAY = 5000 /// milliseconds to wait before connecting again after a failed connection
+	};
+
+	enum SocketState
+	{
+		SS_USABLE,   /// idle and connected
+		SS_EXPIRED,  /// idle timeout expired, or closed by server
+		SS_GREETING  /// server has sent data
+	};
+
+	struct PooledSocket
+	{
+		Poco::Net::StreamSocket socket;
+		Poco::Clock created;
+	};
+
+	struct Pool
+	{
+		std::deque<PooledSocket> sockets;
+		bool enabled = true;
+	};
+
+	SocketState socketState(PooledSocket& pooled) const;
+	void disable(Poco::UInt16 port, Pool& pool);
+
+	SocketFactory::Ptr _pFactory;
+	Poco::Net::IPAddress _host;
+	std::map<Poco::UInt16, Pool> _pools;
+	std::size_t _poolSize;
+	Poco::Timespan _idleTimeout;
+	Poco::Timespan _connectTimeout;
+	Poco::Thread _thread;
+	Poco::Event _wakeUp;
+	bool _stopped = true;
+	mutable Poco::FastMutex _mutex;
+	Poco::Logger& _logger;
+
+	PooledSocketFactory() = delete;
+	PooledSocketFactory(const PooledSocketFactory&) = delete;
+	PooledSocketFactory& operator = (const PooledSocketFactory&) = delete;
+};
+
+
+} } // namespace Poco::WebTunnel
+
+
+#endif // WebTunnel_PooledSocketFactory_INCLUDED
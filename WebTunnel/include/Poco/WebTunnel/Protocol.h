@@ -19,7 +19,9 @@
 
 
 #include "Poco/WebTunnel/WebTunnel.h"
+#include "Poco/Bugcheck.h"
 #include <cstdlib>
+#include <string>
 
 
 namespace Poco {
@@ -114,6 +116,127 @@ class WebTunnel_API Protocol
 	///     +--------+--------+--------+--------+
 	///     | Error Code      |
 	///     +-----------------+
+	///
+	/// 8. Batch
+	///
+	/// Contains multiple complete frames (e.g., data, close or
+	/// open confirmation frames for different channels), each one
+	/// preceded by its size (UInt16, network byte order). Frames
+	/// are processed in order, as if they had been received in
+	/// separate WebSocket messages. Batches cannot be nested.
+	///
+	///     0        1        2        3
+	///     +--------+--------+--------+--------+
+	///     | 0x20   | 0x00   | 0x00            |
+	///     +--------+--------+--------+--------+
+	///     | Frame Size      | Frame           |
+	///     +-----------------+                 |
+	///     |                                   |
+	///     +-----------------------------------+
+	///     | ...                               |
+	///     +-----------------------------------+
+	///
+	/// A batch must only be sent to a peer that has announced
+	/// support for it (see Capability Negotiation).
+	///
+	/// 9. Window Update
+	///
+	/// Grants the peer additional credit (UInt32, network byte order)
+	/// for sending data on a channel, after data received on the
+	/// channel has been delivered to the local connection.
+	///
+	///     0        1        2        3
+	///     +--------+--------+--------+--------+
+	///     | 0x03   | 0x00   | Channel Number  |
+	///     +--------+--------+--------+--------+
+	///     | Credit (bytes)                    |
+	///     +-----------------------------------+
+	///
+	/// Flow Control
+	///
+	/// If both peers have announced the "flow-control" capability,
+	/// every channel starts with a credit of WT_CHANNEL_WINDOW_SIZE
+	/// bytes in each direction. Every data frame sent on a channel
+	/// consumes credit in the size of its payload, and no data must
+	/// be sent on a channel without remaining credit. Credit is
+	/// replenished with Window Update frames. Thus, a stalled
+	/// connection only blocks its own channel, but not the other
+	/// channels sharing the WebSocket.
+	///
+	/// Compression
+	///
+	/// The peer opening a channel can request compression of the
+	/// data sent over the channel by setting the WT_FLAG_DEFLATE flag
+	/// in the Open Channel Request. If the other peer supports and
+	/// accepts compression, it sets the same flag in the Open Channel
+	/// Confirmation. Otherwise, the flag is not set (peers not supporting
+	/// compression ignore and never set flags), and no compressed frames
+	/// must be sent over the channel.
+	///
+	/// With compression, each direction of a channel uses a single
+	/// raw deflate stream (RFC 1951), with a window size of at most
+	/// 32 KB. A data frame with the WT_FLAG_DEFLATE flag set contains
+	/// the next part of the stream, which must end with a sync flush,
+	/// unless the part is continued in the next data frame of the channel.
+	/// Data frames without the flag contain uncompressed data, which is
+	/// not passed through the deflate stream. This allows a peer to send
+	/// data that does not compress well (e.g., because it is already
+	/// compressed or encrypted) uncompressed. The receiving peer must
+	/// treat a compressed frame that does not decompress, or that
+	/// decompresses to more than the maximum frame size, as a
+	/// protocol error.
+	///
+	/// Frame Size Negotiation
+	///
+	/// Unless negotiated otherwise, the payload of a WebSocket frame
+	/// (including the protocol header) must not exceed WT_FRAME_MAX_SIZE
+	/// (plus WT_FRAME_HEADER_SIZE) bytes. The client can offer a larger
+	/// maximum payload size, up to WT_FRAME_MAX_SIZE_LIMIT, with the
+	/// X-WebTunnel-MaxFrameSize header in the WebSocket upgrade request.
+	/// A server supporting larger frames returns the size to be used in
+	/// both directions, which must not exceed the offered size, in the
+	/// same header of the upgrade response. If the response does
+	/// not contain the header, WT_FRAME_MAX_SIZE is used.
+	///
+	/// Multiple Connections
+	///
+	/// A client can offer to use multiple WebSocket connections for a
+	/// single tunnel by sending the desired number of connections in
+	/// the X-WebTunnel-Connections header of the upgrade request.
+	/// A server supporting this returns the number of connections to use,
+	/// which must not exceed the offered number, in the same header of
+	/// the upgrade response, together with an identifier for the tunnel
+	/// in the X-WebTunnel-Tunnel header. The client then opens the
+	/// additional connections, sending the tunnel identifier in the
+	/// X-WebTunnel-Tunnel header and the index (starting at 1) of
+	/// the connection in the X-WebTunnel-Connection header.
+	///
+	/// Channel numbers are unique within the tunnel. All frames for a
+	/// channel are sent over the connection the channel has been opened
+	/// on, so they are received in order. If a connection is lost, only
+	/// its channels are closed.
+	///
+	/// Multiplexed Client Connections
+	///
+	/// Normally, a client (e.g., LocalPortForwarder) opens a separate
+	/// WebSocket connection for every forwarded connection, and the
+	/// WebSocket carries the forwarded data without any framing.
+	/// A client can instead announce the "multiplex" capability in
+	/// its upgrade request. If the server also announces it in the
+	/// response, the WebSocket carries channels, using the frames described
+	/// above, with the client sending the Open Channel Requests (to the
+	/// port given in the X-WebTunnel-RemotePort header), and the
+	/// server responding with Open Channel Confirmation or Fault frames.
+	/// A server not supporting this ignores the capability and uses the
+	/// WebSocket for a single, unframed connection.
+	///
+	/// Capability Negotiation
+	///
+	/// Optional protocol features a peer is able to receive are
+	/// announced in the X-WebTunnel-Capabilities header (a comma-separated
+	/// list of names, see formatCapabilities()) of the WebSocket upgrade
+	/// request and response. A feature must only be used when sending
+	/// to a peer that has announced it.
 {
 public:
 	enum Opcodes
@@ -124,6 +247,8 @@ public:
 		WT_OP_OPEN_FAULT      = 0x81,  /// Error opening a channel.
 		WT_OP_CLOSE           = 0x02,  /// Close a channel (uncomfirmed).
 		WT_OP_PROP_UPDATE     = 0x40,  /// Properties update
+		WT_OP_WINDOW_UPDATE   = 0x03,  /// Additional send credit for a channel.
+		WT_OP_BATCH           = 0x20,  /// Multiple frames in a single WebSocket message.
 		WT_OP_ERROR           = 0x80   /// General error notification, closes a channel.
 	};
 
@@ -139,27 +264,245 @@ public:
 		WT_ERR_CHANNEL_IN_USE = 0x07   /// Channel is already in use.
 	};
 
+	enum Flags
+	{
+		WT_FLAG_DEFLATE       = 0x01   /// Open request/confirmation: compression requested/accepted. Data: payload is compressed.
+	};
+
+	enum Capabilities
+	{
+		WT_CAP_BATCH          = 0x01,  /// Peer accepts WT_OP_BATCH frames ("batch").
+		WT_CAP_FLOW_CONTROL   = 0x02,  /// Peer supports per-channel flow control ("flow-control").
+		WT_CAP_MULTIPLEX      = 0x04   /// Client connection carries multiple channels ("multiplex").
+	};
+
 	enum
 	{
-		WT_FRAME_MAX_SIZE = 2048,
-		WT_FRAME_HEADER_SIZE = 4
+		WT_FRAME_MAX_SIZE = 2048,          /// Maximum frame payload size, unless negotiated otherwise.
+		WT_FRAME_HEADER_SIZE = 4,
+		WT_BATCH_ENTRY_HEADER_SIZE = 2,    /// Size of the frame size preceding every frame in a batch.
+		WT_FRAME_PREFERRED_SIZE = 16384,   /// Default maximum frame payload size offered in negotiation.
+		WT_FRAME_MAX_SIZE_LIMIT = 65536,   /// Largest maximum frame payload size that can be negotiated.
+		WT_WINDOW_UPDATE_SIZE = 8,         /// Size of a Window Update frame.
+		WT_CHANNEL_WINDOW_SIZE = 262144    /// Initial send credit of a channel, if flow control is used.
 	};
 
+	class BatchReader
+		/// Walks the frames contained in a Batch frame.
+		///
+		/// Usage:
+		///     Protocol::BatchReader reader(pBatch, batchSize);
+		///     const char* pFrame;
+		///     std::size_t frameSize;
+		///     while (reader.next(pFrame, frameSize))
+		///     {
+		///         // process frame
+		///     }
+		///     if (reader.malformed())
+		///     {
+		///         // protocol error
+		///     }
+	{
+	public:
+		BatchReader(const char* pBatch, std::size_t batchSize);
+			/// Creates the BatchReader for the given Batch frame,
+			/// including its protocol header.
+
+		bool next(const char*& pFrame, std::size_t& frameSize);
+			/// Stores the position and size of the next frame in the batch
+			/// in pFrame and frameSize and returns true, or returns false
+			/// if the end of the batch has been reached, or if the batch is
+			/// malformed (a frame is truncated or shorter than a header).
+
+		bool malformed() const;
+			/// Returns true if the batch is malformed. Frames preceding
+			/// the malformed frame have already been returned by next().
+
+	private:
+		const char* _pNext;
+		const char* _pEnd;
+		bool _malformed;
+	};
+
+	static constexpr std::size_t headerSize(Poco::UInt8 opcode);
+		/// Returns the size of the protocol header of a frame
+		/// with the given opcode (4 or 6 bytes).
+
 	static std::size_t writeHeader(char* pBuffer, std::size_t bufferSize, Poco::UInt8 opcode, Poco::UInt8 flags, Poco::UInt16 channel, Poco::UInt16 portOrErrorCode = 0);
 		/// Writes the protocol header to the given buffer, which must be of sufficient size
-		/// (at least 4 or 6 bytes, depending on opcode).
+		/// (at least 4 or 6 bytes, depending on opcode, see headerSize()).
 		///
-		/// Flags are currently unused and should be 0.
+		/// Flags (WT_FLAG_*) must be 0, unless specified otherwise
+		/// for the opcode.
 		///
 		/// Returns the size of the header in bytes.
 
 	static std::size_t readHeader(const char* pBuffer, std::size_t bufferSize, Poco::UInt8& opcode, Poco::UInt8& flags, Poco::UInt16& channel, Poco::UInt16* pPortOrErrorCode = 0);
 		/// Reads the protocol header from the given buffer.
 		///
-		/// Returns the size of the header in bytes.
+		/// The port number or error code is only read if pPortOrErrorCode
+		/// is given, and the opcode has one.
+		///
+		/// Returns the size of the header in bytes, or 0 if the
+		/// buffer is too small to contain the header.
+
+	static std::size_t writeBatchEntryHeader(char* pBuffer, std::size_t bufferSize, std::size_t frameSize);
+		/// Writes the size of a frame contained in a batch to the given buffer.
+		///
+		/// Returns the size of the batch entry header in bytes, or 0
+		/// if the buffer is too small.
+
+	static std::size_t readBatchEntryHeader(const char* pBuffer, std::size_t bufferSize, std::size_t& frameSize);
+		/// Reads the size of a frame contained in a batch from the given buffer.
+		///
+		/// Returns the size of the batch entry header in bytes, or 0
+		/// if the buffer does not contain a complete batch entry.
+
+	static std::size_t writeWindowUpdate(char* pBuffer, std::size_t bufferSize, Poco::UInt16 channel, Poco::UInt32 credit);
+		/// Writes a Window Update frame to the given buffer, which
+		/// must be at least WT_WINDOW_UPDATE_SIZE bytes.
+		///
+		/// Returns the size of the frame in bytes.
+
+	static bool readWindowUpdate(const char* pBuffer, std::size_t bufferSize, Poco::UInt32& credit);
+		/// Reads the credit from a Window Update frame.
+		///
+		/// Returns false if the frame is too short.
+
+	static std::string formatCapabilities(int capabilities);
+		/// Formats the given capabilities (WT_CAP_*) for the
+		/// X-WebTunnel-Capabilities header.
+
+	static int parseCapabilities(const std::string& capabilities);
+		/// Parses the value of a X-WebTunnel-Capabilities header.
+		/// Unknown capabilities are ignored.
+
+	static std::size_t offeredFrameSize(std::size_t frameSize);
+		/// Returns the given maximum frame payload size, limited
+		/// to the range from WT_FRAME_MAX_SIZE to WT_FRAME_MAX_SIZE_LIMIT.
+
+	static std::size_t negotiatedFrameSize(const std::string& response, std::size_t offered);
+		/// Returns the maximum frame payload size to be used, given the value
+		/// of the X-WebTunnel-MaxFrameSize response header (empty if the server
+		/// did not send it) and the size offered in the request.
+		///
+		/// Returns WT_FRAME_MAX_SIZE if the server did not accept the offer.
+
+private:
+	static void storeUInt16(char* pBuffer, Poco::UInt16 value);
+	static Poco::UInt16 loadUInt16(const char* pBuffer);
 };
 
 
+//
+// inlines
+//
+inline void Protocol::storeUInt16(char* pBuffer, Poco::UInt16 value)
+{
+	pBuffer[0] = static_cast<char>(value >> 8);
+	pBuffer[1] = static_cast<char>(value);
+}
+
+
+inline Poco::UInt16 Protocol::loadUInt16(const char* pBuffer)
+{
+	return static_cast<Poco::UInt16>((static_cast<unsigned char>(pBuffer[0]) << 8) | static_cast<unsigned char>(pBuffer[1]));
+}
+
+
+inline constexpr std::size_t Protocol::headerSize(Poco::UInt8 opcode)
+{
+	// WT_OP_OPEN_REQUEST, WT_OP_OPEN_FAULT and WT_OP_ERROR carry a port number or error code.
+	return WT_FRAME_HEADER_SIZE + 2*((opcode == WT_OP_OPEN_REQUEST) | ((opcode & 0xFE) == WT_OP_ERROR));
+}
+
+
+inline std::size_t Protocol::writeHeader(char* pBuffer, std::size_t bufferSize, Poco::UInt8 opcode, Poco::UInt8 flags, Poco::UInt16 channel, Poco::UInt16 portOrErrorCode)
+{
+	const std::size_t size = headerSize(opcode);
+	poco_assert_dbg (bufferSize >= size);
+	(void) bufferSize;
+
+	pBuffer[0] = static_cast<char>(opcode);
+	pBuffer[1] = static_cast<char>(flags);
+	storeUInt16(pBuffer + 2, channel);
+	if (size > WT_FRAME_HEADER_SIZE) storeUInt16(pBuffer + 4, portOrErrorCode);
+	return size;
+}
+
+
+inline std::size_t Protocol::readHeader(const char* pBuffer, std::size_t bufferSize, Poco::UInt8& opcode, Poco::UInt8& flags, Poco::UInt16& channel, Poco::UInt16* pPortOrErrorCode)
+{
+	if (bufferSize < WT_FRAME_HEADER_SIZE) return 0;
+
+	opcode = static_cast<Poco::UInt8>(pBuffer[0]);
+	flags = static_cast<Poco::UInt8>(pBuffer[1]);
+	channel = loadUInt16(pBuffer + 2);
+	if (pPortOrErrorCode)
+	{
+		const std::size_t size = headerSize(opcode);
+		if (size > WT_FRAME_HEADER_SIZE)
+		{
+			if (bufferSize < size) return 0;
+			*pPortOrErrorCode = loadUInt16(pBuffer + 4);
+		}
+		return size;
+	}
+	return WT_FRAME_HEADER_SIZE;
+}
+
+
+inline std::size_t Protocol::writeBatchEntryHeader(char* pBuffer, std::size_t bufferSize, std::size_t frameSize)
+{
+	poco_assert (frameSize <= 0xFFFF);
+
+	if (bufferSize < WT_BATCH_ENTRY_HEADER_SIZE) return 0;
+
+	storeUInt16(pBuffer, static_cast<Poco::UInt16>(frameSize));
+	return WT_BATCH_ENTRY_HEADER_SIZE;
+}
+
+
+inline std::size_t Protocol::readBatchEntryHeader(const char* pBuffer, std::size_t bufferSize, std::size_t& frameSize)
+{
+	if (bufferSize < WT_BATCH_ENTRY_HEADER_SIZE) return 0;
+
+	frameSize = loadUInt16(pBuffer);
+	if (frameSize > bufferSize - WT_BATCH_ENTRY_HEADER_SIZE) return 0;
+	return WT_BATCH_ENTRY_HEADER_SIZE;
+}
+
+
+inline Protocol::BatchReader::BatchReader(const char* pBatch, std::size_t batchSize):
+	_pNext(pBatch + (batchSize < WT_FRAME_HEADER_SIZE ? batchSize : static_cast<std::size_t>(WT_FRAME_HEADER_SIZE))),
+	_pEnd(pBatch + batchSize),
+	_malformed(batchSize < WT_FRAME_HEADER_SIZE)
+{
+}
+
+
+inline bool Protocol::BatchReader::next(const char*& pFrame, std::size_t& frameSize)
+{
+	if (_pNext == _pEnd || _malformed) return false;
+
+	std::size_t en = readBatchEntryHeader(_pNext, static_cast<std::size_t>(_pEnd - _pNext), frameSize);
+	if (en == 0 || frameSize < WT_FRAME_HEADER_SIZE)
+	{
+		_malformed = true;
+		return false;
+	}
+	pFrame = _pNext + en;
+	_pNext = pFrame + frameSize;
+	return true;
+}
+
+
+inline bool Protocol::BatchReader::malformed() const
+{
+	return _malformed;
+}
+
+
 } } // namespace Poco::WebTunnel
 
 
@@ -21,6 +21,8 @@
 #include "Poco/WebTunnel/WebTunnel.h"
 #include "Poco/WebTunnel/SocketDispatcher.h"
 #include "Poco/WebTunnel/Protocol.h"
+#include "Poco/WebTunnel/FrameScheduler.h"
+#include "Poco/WebTunnel/ChannelCodec.h"
 #include "Poco/Net/StreamSocket.h"
 #include "Poco/Net/SocketAddress.h"
 #include "Poco/Net/WebSocket.h"
@@ -33,6 +35,9 @@
 #include "Poco/Logger.h"
 #include <map>
 #include <set>
+#include <vector>
+#include <atomic>
+#include <algorithm>
 
 
 namespace Poco {
@@ -58,6 +63,16 @@ public:
 		/// throws a Poco::TimeoutException.
 		///
 		/// The default implementation always creates a Poco::Net::StreamSocket.
+
+	virtual Poco::Net::StreamSocket createConnectedSocket(const Poco::Net::SocketAddress& addr, Poco::Timespan timeout);
+		/// Creates a socket and connects it to the given address, waiting
+		/// at most for the given timeout until the connection has been
+		/// established. The returned socket must be in non-blocking mode.
+		/// Used by PooledSocketFactory for creating pooled sockets.
+		///
+		/// The default implementation always creates a Poco::Net::StreamSocket.
+		/// Implementations creating secure sockets should also complete
+		/// the TLS handshake.
 };
 
 
@@ -81,11 +96,15 @@ public:
 		/// reason for the close. See the CloseReason
 		/// enum for values and their meanings.
 
-	RemotePortForwarder(SocketDispatcher& dispatcher, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, const Poco::Net::IPAddress& host, const std::set<Poco::UInt16>& ports, Poco::Timespan remoteTimeout = Poco::Timespan(300, 0), SocketFactory::Ptr pSocketFactory = new SocketFactory);
+	RemotePortForwarder(SocketDispatcher& dispatcher, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, const Poco::Net::IPAddress& host, const std::set<Poco::UInt16>& ports, Poco::Timespan remoteTimeout = Poco::Timespan(300, 0), SocketFactory::Ptr pSocketFactory = new SocketFactory, std::size_t maxFrameSize = Protocol::WT_FRAME_MAX_SIZE);
 		/// Creates the RemotePortForwarder, using the given socket dispatcher and web socket,
 		/// which is used for tunneling data. Only the port numbers given in ports will
 		/// be forwarded. The web socket must have already been connected to the
 		/// reflector server.
+		///
+		/// The maxFrameSize is the maximum payload size of a frame, excluding the
+		/// protocol header, as negotiated with the reflector server when establishing
+		/// the web socket connection (see Protocol::negotiatedFrameSize()).
 
 	~RemotePortForwarder();
 		/// Destroys the RemotePortForwarder and closes the web socket connection.
@@ -114,27 +133,134 @@ public:
 	const Poco::Timespan& remoteTimeout() const;
 		/// Returns the timeout for the remote connection.
 
+	std::size_t maxFrameSize() const;
+		/// Returns the maximum frame payload size.
+
+	void setReadBudget(std::size_t budget);
+		/// Sets the number of bytes that will be read from a socket
+		/// in a single readable event.
+		///
+		/// If budget is greater than zero, the web socket and all
+		/// subsequently connected local sockets are registered with
+		/// the SocketDispatcher in edge-triggered mode (POLL_EDGE),
+		/// and data is read from a readable socket until the socket
+		/// would block, or the budget has been used up.
+		///
+		/// If budget is zero (default), sockets are level-triggered
+		/// and a single read is performed per readable event.
+		///
+		/// Should be called immediately after constructing the
+		/// RemotePortForwarder.
+
+	std::size_t getReadBudget() const;
+		/// Returns the read budget.
+
+	void enableBatching(Poco::Timespan delay = 0);
+		/// Enables coalescing of small frames (e.g., data frames
+		/// for interactive sessions, close frames or open confirmations)
+		/// sent to the remote peer into WT_OP_BATCH frames.
+		///
+		/// A batch is sent when it is full, when a frame too large for
+		/// batching is sent, or at the latest after the given delay.
+		/// With a delay of zero, all small frames produced while handling
+		/// a single round of socket events are sent together.
+		///
+		/// Must only be enabled if the remote peer has announced
+		/// the Protocol::WT_CAP_BATCH capability. Should be called
+		/// immediately after constructing the RemotePortForwarder.
+
+	bool batchingEnabled() const;
+		/// Returns true if batching has been enabled.
+
+	void enableFlowControl();
+		/// Enables credit-based flow control for all channels
+		/// (see Protocol).
+		///
+		/// Reading from a local socket is suspended when its channel
+		/// has run out of send credit, and credit is granted to the
+		/// remote peer only after received data has been written to
+		/// the local socket. A stalled local or remote connection
+		/// therefore only blocks its own channel, instead of
+		/// throttling the WebSocket shared by all channels.
+		///
+		/// Must only be enabled if the remote peer has announced
+		/// the Protocol::WT_CAP_FLOW_CONTROL capability. Must be called
+		/// immediately after constructing the RemotePortForwarder.
+
+	bool flowControlEnabled() const;
+		/// Returns true if flow control has been enabled.
+
+	void enableCompression(int level = 1);
+		/// Accepts requests from the remote peer to compress the data
+		/// sent over a channel (see Protocol), using the given deflate
+		/// compression level (1 - 9).
+		///
+		/// Compression is only used for channels for which the remote
+		/// peer has requested it in the Open Channel Request. Data that
+		/// does not compress well is sent uncompressed.
+		///
+		/// Should be called immediately after constructing the
+		/// RemotePortForwarder.
+
+	bool compressionEnabled() const;
+		/// Returns true if compression has been enabled.
+
+	void setPortWeight(Poco::UInt16 port, unsigned weight);
+		/// Sets the scheduling weight (default 1) for channels
+		/// forwarded to the given port.
+		///
+		/// When the WebSocket cannot keep up with the data read from
+		/// the local sockets, frames are queued per channel and sent
+		/// in deficit round robin order, with every channel receiving
+		/// a share of the bandwidth proportional to its weight.
+		/// Control frames are always sent first, so interactive channels
+		/// (e.g., SSH or VNC) remain responsive while bulk transfers
+		/// use the remaining bandwidth.
+		///
+		/// Must be called before channels to the port are opened.
+
+	unsigned getPortWeight(Poco::UInt16 port) const;
+		/// Returns the scheduling weight for the given port.
+
 	void updateProperties(const std::map<std::string, std::string>& props);
 		/// Transmits properties (key-value pairs) to the remote peer.
 
 protected:
-	void multiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer);
+	int multiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer);
 	void multiplexError(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer);
 	void multiplexTimeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer);
-	void demultiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer);
+	int demultiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer);
 	void demultiplexError(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer);
 	void demultiplexTimeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer);
 	void connect(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel);
 	void connectError(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel);
 	void connectTimeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel);
-	void forwardData(const char* buffer, int size, Poco::UInt16 channel);
-	void openChannel(Poco::UInt16 channel, Poco::UInt16 port);
+	void forwardData(const char* buffer, int size, Poco::UInt16 channel, bool compressed);
+	void dataSent(Poco::UInt16 channel, std::size_t bytes);
+	void updateWindow(Poco::UInt16 channel, Poco::UInt32 credit);
+	std::size_t sendCredit(Poco::UInt16 channel) const;
+	bool consumeSendCredit(Poco::UInt16 channel, std::size_t bytes);
+	void openChannel(Poco::UInt16 channel, Poco::UInt16 port, bool compress);
 	void shutdownSendChannel(Poco::UInt16 channel);
 	void removeChannel(Poco::UInt16 channel);
-	void sendResponse(Poco::UInt16 channel, Poco::UInt8 opcode, Poco::UInt16 errorCode);
+	void discardChannelFrames(Poco::UInt16 channel);
+	ChannelCodec::Ptr channelCodec(Poco::UInt16 channel) const;
+	void sendResponse(Poco::UInt16 channel, Poco::UInt8 opcode, Poco::UInt16 errorCode, Poco::UInt8 flags = 0);
+	void sendFrame(const char* buffer, std::size_t size);
+	bool sendChannelFrame(Poco::UInt16 channel, const char* buffer, std::size_t size);
+	void transmit(const char* buffer, std::size_t size);
+	void sendDirect(const char* buffer, std::size_t size);
+	bool dequeueFrame(Poco::Buffer<char>& frame, Poco::UInt16& channel, bool& urgent);
+	void drainScheduler();
+	void drainScheduler(Poco::Buffer<char>& frame, Poco::UInt16 channel, bool urgent);
+	void channelDequeued(Poco::UInt16 channel, std::size_t size);
+	void webSocketSent(std::size_t bytes);
+	void flushBatch();
+	void processFrame(const char* buffer, std::size_t size, bool allowBatch);
 	void closeWebSocket(CloseReason reason, bool active);
 	int setChannelFlag(Poco::UInt16 channel, int flag);
 	int getChannelFlags(Poco::UInt16 channel) const;
+	int edgeMode() const;
 
 private:
 	class TunnelMultiplexer: public SocketDispatcher::SocketHandler
@@ -143,13 +269,29 @@ private:
 		TunnelMultiplexer(RemotePortForwarder& forwarder, Poco::UInt16 channel):
 			_forwarder(forwarder),
 			_channel(channel),
-			_buffer(Protocol::WT_FRAME_MAX_SIZE + Protocol::WT_FRAME_HEADER_SIZE)
+			_buffer(forwarder._maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE)
 		{
 		}
 
 		void readable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
 		{
-			_forwarder.multiplex(dispatcher, socket, _channel, _buffer);
+			std::size_t budget = _forwarder._readBudget;
+			if (budget == 0)
+			{
+				_forwarder.multiplex(dispatcher, socket, _channel, _buffer);
+				return;
+			}
+			for (;;)
+			{
+				int n = _forwarder.multiplex(dispatcher, socket, _channel, _buffer);
+				if (n <= 0 || dispatcher.readSuspended()) break;
+				if (static_cast<std::size_t>(n) >= budget)
+				{
+					dispatcher.markReadable(socket);
+					break;
+				}
+				budget -= n;
+			}
 		}
 
 		void writable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
@@ -166,6 +308,14 @@ private:
 			_forwarder.multiplexTimeout(dispatcher, socket, _channel, _buffer);
 		}
 
+		void sent(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, std::size_t bytes)
+		{
+			if (_forwarder._flowControl)
+			{
+				_forwarder.dataSent(_channel, bytes);
+			}
+		}
+
 	private:
 		RemotePortForwarder& _forwarder;
 		Poco::UInt16 _channel;
@@ -177,13 +327,29 @@ private:
 	public:
 		TunnelDemultiplexer(RemotePortForwarder& forwarder):
 			_forwarder(forwarder),
-			_buffer(Protocol::WT_FRAME_MAX_SIZE + Protocol::WT_FRAME_HEADER_SIZE)
+			_buffer(forwarder._maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE)
 		{
 		}
 
 		void readable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
 		{
-			_forwarder.demultiplex(dispatcher, socket, _buffer);
+			std::size_t budget = _forwarder._readBudget;
+			if (budget == 0)
+			{
+				_forwarder.demultiplex(dispatcher, socket, _buffer);
+				return;
+			}
+			for (;;)
+			{
+				int n = _forwarder.demultiplex(dispatcher, socket, _buffer);
+				if (n < 0 || dispatcher.readSuspended()) break;
+				if (static_cast<std::size_t>(n) >= budget)
+				{
+					dispatcher.markReadable(socket);
+					break;
+				}
+				budget -= (std::max)(n, 1);
+			}
 		}
 
 		void writable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
@@ -200,6 +366,11 @@ private:
 			_forwarder.demultiplexTimeout(dispatcher, socket, _buffer);
 		}
 
+		void sent(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, std::size_t bytes)
+		{
+			_forwarder.webSocketSent(bytes);
+		}
+
 	private:
 		RemotePortForwarder& _forwarder;
 		Poco::Buffer<char> _buffer;
@@ -241,15 +412,97 @@ private:
 	enum ConnectionFlags
 	{
 		CF_CLOSED_LOCAL  = 0x01,
-		CF_CLOSED_REMOTE = 0x02
+		CF_CLOSED_REMOTE = 0x02,
+		CF_SUSPENDED     = 0x04, /// reading suspended, waiting for send credit
+		CF_BACKLOGGED    = 0x08  /// reading suspended, too many frames queued in scheduler
+	};
+
+	enum
+	{
+		SEND_QUEUE_FRAMES = 4,   /// frames passed to the SocketDispatcher before further frames are scheduled
+		CHANNEL_QUEUE_FRAMES = 16 /// frames scheduled for a channel before reading from its socket is suspended
 	};
 
-	struct ChannelInfo
+	struct ChannelInfo: public Poco::RefCountedObject
+		/// The state of an open channel.
+		///
+		/// The socket, weight and codec are set before the record is
+		/// inserted into the ChannelTable and never change afterwards.
+		/// All other members may be updated by any thread.
 	{
+		using Ptr = Poco::AutoPtr<ChannelInfo>;
+
 		Poco::Net::StreamSocket socket;
-		int flags = 0;
+		std::atomic<int> flags{0};
+		std::atomic<std::size_t> sendCredit{Protocol::WT_CHANNEL_WINDOW_SIZE}; // bytes that may still be sent to the peer
+		std::atomic<std::size_t> unacknowledged{0}; // bytes written to the local socket, but not yet granted as credit
+		std::atomic<std::size_t> queued{0}; // bytes queued in the scheduler
+		unsigned weight = 1;
+		ChannelCodec::Ptr pCodec; // set if compression has been negotiated
+	};
+
+	class ChannelTable
+		/// A table of ChannelInfo records, indexed by channel number.
+		///
+		/// The table consists of up to PAGE_COUNT pages of PAGE_SIZE
+		/// slots, which are allocated when first used and only released
+		/// when the table is destroyed. Looking up a channel therefore
+		/// takes two array accesses and no lock, and can be done
+		/// from any thread.
+		///
+		/// A removed record is only released once no concurrent lookup
+		/// is reading its slot. Lookups return a reference to the record,
+		/// which stays valid after the channel has been removed.
+	{
+	public:
+		ChannelTable();
+			/// Creates an empty ChannelTable.
+
+		~ChannelTable();
+			/// Destroys the ChannelTable and releases all records.
+
+		ChannelInfo::Ptr find(Poco::UInt16 channel) const;
+			/// Returns the record for the given channel, or null
+			/// if the channel is not open.
+
+		bool insert(Poco::UInt16 channel, ChannelInfo::Ptr pInfo);
+			/// Inserts the record for the given channel.
+			/// Returns false if the channel is already in use.
+
+		ChannelInfo::Ptr remove(Poco::UInt16 channel);
+			/// Removes and returns the record for the given channel,
+			/// or returns null if the channel is not open.
+
+		std::vector<ChannelInfo::Ptr> removeAll();
+			/// Removes and returns all records.
+
+	private:
+		enum
+		{
+			PAGE_SHIFT = 8,
+			PAGE_SIZE  = 1 << PAGE_SHIFT,
+			PAGE_COUNT = 65536/PAGE_SIZE
+		};
+
+		struct Slot
+		{
+			std::atomic<ChannelInfo*> pInfo{nullptr};
+			mutable std::atomic<int> readers{0}; // lookups in progress
+		};
+
+		struct Page
+		{
+			Slot slots[PAGE_SIZE];
+		};
+
+		Slot& slot(Poco::UInt16 channel);
+		ChannelInfo::Ptr remove(Slot& slot);
+
+		std::atomic<Page*> _pages[PAGE_COUNT];
+
+		ChannelTable(const ChannelTable&) = delete;
+		ChannelTable& operator = (const ChannelTable&) = delete;
 	};
-	using ChannelMap = std::map<Poco::UInt16, ChannelInfo>;
 
 	SocketDispatcher& _dispatcher;
 	SocketFactory::Ptr _pSocketFactory;
@@ -257,13 +510,29 @@ private:
 	int _webSocketFlags = 0;
 	Poco::Net::IPAddress _host;
 	std::set<Poco::UInt16> _ports;
-	ChannelMap _channelMap;
+	ChannelTable _channels;
 	Poco::Timespan _connectTimeout;
 	Poco::Timespan _localTimeout;
 	Poco::Timespan _closeTimeout;
 	Poco::Timespan _remoteTimeout;
+	std::size_t _maxFrameSize;
 	int _timeoutCount = 0;
-	mutable Poco::FastMutex _mutex;
+	std::size_t _readBudget = 0;
+	bool _batchEnabled = false;
+	Poco::Timespan _batchDelay;
+	Poco::Buffer<char> _batch;
+	std::size_t _batchLength = 0;
+	std::size_t _batchFrames = 0;
+	bool _batchScheduled = false;
+	bool _flowControl = false;
+	int _compressionLevel = 0;
+	std::map<Poco::UInt16, unsigned> _portWeights;
+	FrameScheduler _scheduler;
+	std::size_t _sendQueueLimit;
+	std::size_t _inFlight = 0;
+	bool _draining = false;
+	Poco::FastMutex _schedulerMutex;
+	Poco::FastMutex _batchMutex;
 	Poco::Logger& _logger;
 
 	RemotePortForwarder() = delete;
@@ -19,19 +19,27 @@
 
 
 #include "Poco/WebTunnel/WebTunnel.h"
+#include "Poco/WebTunnel/Histogram.h"
 #include "Poco/Net/StreamSocket.h"
 #include "Poco/Net/PollSet.h"
-#include "Poco/NotificationQueue.h"
+#include "Poco/Notification.h"
+#include "Poco/Event.h"
+#include "Poco/Buffer.h"
 #include "Poco/Thread.h"
 #include "Poco/Runnable.h"
 #include "Poco/RefCountedObject.h"
 #include "Poco/AutoPtr.h"
 #include "Poco/SharedPtr.h"
 #include "Poco/Clock.h"
+#include "Poco/Mutex.h"
 #include "Poco/Logger.h"
 #include <atomic>
+#include <memory>
+#include <vector>
 #include <map>
 #include <deque>
+#include <functional>
+#include <cstdint>
 
 
 namespace Poco {
@@ -63,16 +71,24 @@ private:
 };
 
 
-class WebTunnel_API SocketDispatcher: public Poco::Runnable
+class WebTunnel_API SocketDispatcher
 	/// SocketDispatcher implements a multi-threaded variant of the
 	/// Reactor pattern, optimized for forwarding data from one
 	/// socket to another.
 	///
-	/// The SocketDispatcher runs a select() loop in a separate thread.
-	/// As soon as a socket becomes readable, it will be put into a work
-	/// queue. A number of worker threads dequeue work queue items and
-	/// process the data received over the socket, using registered
-	/// SocketHandler instances.
+	/// The SocketDispatcher runs one or more event loops (shards),
+	/// each one in its own thread and with its own PollSet.
+	/// Every socket is assigned to exactly one shard when it is added,
+	/// and all events for that socket are handled by the shard's thread,
+	/// using the registered SocketHandler instance.
+	///
+	/// A socket added from within a shard's thread (e.g., from a
+	/// SocketHandler) is assigned to the same shard. A socket can also
+	/// be explicitly assigned to the shard of another socket.
+	/// This way, sockets forwarding data to each other (e.g., a WebSocket
+	/// and its channel sockets) are handled by the same thread and
+	/// can directly exchange data without going through a task queue.
+	/// Otherwise, the shard with the least number of sockets is used.
 {
 public:
 	class SocketHandler: public Poco::RefCountedObject
@@ -84,20 +100,42 @@ public:
 		virtual void writable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket) = 0;
 		virtual void exception(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket) = 0;
 		virtual void timeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket) = 0;
+
+		virtual void sent(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, std::size_t bytes);
+			/// Called after data passed to sendBytes() or sendBytesAsync()
+			/// has been written to the socket, either immediately or from
+			/// the pending sends queue. The default implementation does nothing.
 	};
 
 	explicit SocketDispatcher(Poco::Timespan timeout = Poco::Timespan(5000));
-		/// Creates the SocketDispatcher.
+		/// Creates the SocketDispatcher with a single event loop thread.
+		///
+		/// The main poll loop waits until the next socket timeout
+		/// is due. On platforms where PollSet::wakeUp() is not supported,
+		/// the given timeout limits the time spent waiting in the poll loop.
+
+	SocketDispatcher(int threads, Poco::Timespan timeout = Poco::Timespan(5000));
+		/// Creates the SocketDispatcher with the given number of
+		/// event loop threads (shards).
 		///
-		/// The given timeout is used for the main select loop, as well as
-		/// by workers to poll if more reads are possible, up to the given
-		/// maximum number of reads per worker.
+		/// The main poll loop waits until the next socket timeout
+		/// is due. On platforms where PollSet::wakeUp() is not supported,
+		/// the given timeout limits the time spent waiting in the poll loop.
 
 	~SocketDispatcher();
 		/// Destroys the SocketDispatcher.
 
 	void addSocket(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout = 0);
 		/// Adds a socket and its handler to the SocketDispatcher.
+		///
+		/// If called from one of the SocketDispatcher's threads, the socket
+		/// is assigned to the calling thread's shard. Otherwise, the
+		/// shard with the least number of sockets is chosen.
+
+	void addSocket(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout, const Poco::Net::StreamSocket& peer);
+		/// Adds a socket and its handler to the SocketDispatcher,
+		/// assigning it to the same shard as the given peer socket,
+		/// which must already have been added.
 
 	void updateSocket(const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout = 0);
 		/// Updates the socket's poll mode.
@@ -130,6 +168,210 @@ public:
 		/// Shuts down the sending direction of the socket, but only after
 		/// all pending sends has been sent.
 
+	int threads() const;
+		/// Returns the number of event loop threads (shards).
+
+	void setWatermarks(std::size_t high, std::size_t low);
+		/// Sets the default high and low watermarks (in bytes) for
+		/// pending sends, for all sockets added afterwards.
+		///
+		/// If more than high bytes are pending for a socket after data
+		/// has been sent to it from a SocketHandler handling another
+		/// (source) socket becoming readable, the dispatcher stops
+		/// polling the source socket for readability. Polling is resumed
+		/// after the number of pending bytes has dropped to low or below.
+		/// A high watermark of 0 disables backpressure.
+
+	void setWatermarks(const Poco::Net::StreamSocket& socket, std::size_t high, std::size_t low);
+		/// Sets the high and low watermarks for the given socket,
+		/// which must already have been added.
+		///
+		/// Typically used to set a larger limit for a tunnel's WebSocket,
+		/// which receives data from all channels of the tunnel.
+
+	class WebTunnel_API Completion: public Poco::RefCountedObject
+		/// A Completion can be used to wait for an operation
+		/// executed asynchronously by a dispatcher thread,
+		/// and to obtain its result.
+	{
+	public:
+		using Ptr = Poco::AutoPtr<Completion>;
+
+		enum
+		{
+			TASK_WAIT_TIMEOUT = 30000
+		};
+
+		Completion();
+			/// Creates the Completion.
+
+		~Completion() = default;
+			/// Destroys the Completion.
+
+		void wait();
+			/// Waits until the operation has completed,
+			/// but at most TASK_WAIT_TIMEOUT milliseconds.
+
+		bool tryWait(long milliseconds);
+			/// Waits until the operation has completed,
+			/// but at most the given number of milliseconds.
+			///
+			/// Returns true if the operation has completed, otherwise false.
+
+		bool done() const;
+			/// Returns true if the operation has completed.
+
+		bool result() const;
+			/// Returns the result of the operation.
+			/// Only valid after the operation has completed.
+
+		void complete(bool result = true);
+			/// Marks the operation as completed, with the given result.
+
+	private:
+		Poco::Event _event;
+		std::atomic<bool> _done;
+		std::atomic<bool> _result;
+	};
+
+	void addSocketAsync(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout = 0);
+		/// Adds a socket and its handler to the SocketDispatcher,
+		/// without waiting for the operation to complete.
+		///
+		/// Commands sent to the dispatcher from the same thread
+		/// are executed in order, so it's safe to call updateSocketAsync(),
+		/// sendBytesAsync(), etc. for the socket immediately afterwards.
+
+	void addSocketAsync(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout, const Poco::Net::StreamSocket& peer);
+		/// Adds a socket and its handler to the SocketDispatcher,
+		/// assigning it to the same shard as the given peer socket,
+		/// without waiting for the operation to complete.
+
+	void updateSocketAsync(const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout = 0);
+		/// Updates the socket's poll mode, without waiting for
+		/// the operation to complete.
+
+	void removeSocketAsync(const Poco::Net::StreamSocket& socket);
+		/// Removes a socket and its associated handler from the SocketDispatcher,
+		/// without waiting for the operation to complete.
+
+	void closeSocketAsync(const Poco::Net::StreamSocket& socket);
+		/// Closes and removes a socket and its associated handler from the
+		/// SocketDispatcher, without waiting for the operation to complete.
+
+	Completion::Ptr hasSocketAsync(const Poco::Net::StreamSocket& socket);
+		/// Checks whether the socket is active in the SocketDispatcher.
+		/// Returns a Completion that can be used to obtain the result.
+
+	void sendBytesAsync(Poco::Net::StreamSocket& socket, Poco::Buffer<char>&& buffer, int options);
+		/// Writes the contents of the given buffer to the socket, without
+		/// waiting for the operation to complete. See sendBytes() for
+		/// a description of how partial writes are handled.
+
+	void shutdownSendAsync(Poco::Net::StreamSocket& socket);
+		/// Shuts down the sending direction of the socket, after all
+		/// pending sends have been sent, without waiting for the
+		/// operation to complete.
+
+	void markReadable(const Poco::Net::StreamSocket& socket);
+		/// Marks a socket registered with POLL_EDGE as still readable.
+		///
+		/// With edge-triggered polling, the PollSet reports a socket
+		/// only once until new data arrives. A handler that stops
+		/// reading before the socket has been drained (e.g., because
+		/// it has used up its read budget) must call markReadable()
+		/// so that readable() is called again in the next iteration
+		/// of the dispatcher loop, after other sockets have been served.
+		///
+		/// Must be called from the dispatcher thread handling the socket,
+		/// i.e., from within a SocketHandler callback.
+
+	bool readSuspended() const;
+		/// Returns true if reading from the socket currently being handled
+		/// by SocketHandler::readable() has been suspended, either because a
+		/// destination socket has reached its high watermark, or because
+		/// POLL_READ has been removed from the socket's mode with updateSocket().
+		///
+		/// Handlers that read from a socket in a loop (e.g., with POLL_EDGE)
+		/// should stop reading if this returns true. Reading will be
+		/// resumed automatically once the destination has been drained,
+		/// or when POLL_READ is enabled again.
+
+	using DeferredTask = std::function<void(SocketDispatcher&)>;
+
+	bool scheduleTask(const Poco::Net::StreamSocket& socket, Poco::Timespan delay, DeferredTask&& task);
+		/// Schedules a task for execution by the dispatcher thread handling
+		/// the given socket, after the given delay has elapsed. With a delay
+		/// of 0, the task is executed after all pending socket events
+		/// have been handled in the current iteration of the dispatcher loop.
+		///
+		/// The task is discarded if the socket is removed before the
+		/// delay has elapsed. As poll() has a resolution of milliseconds,
+		/// a non-zero delay is effectively rounded up to full milliseconds.
+		///
+		/// Must be called from the dispatcher thread handling the socket,
+		/// i.e., from within a SocketHandler callback. Returns false,
+		/// without scheduling the task, if this is not the case.
+
+	void countReceived(const Poco::Net::StreamSocket& socket, std::size_t bytes);
+		/// Adds a frame (or chunk) of the given number of bytes,
+		/// received from the socket by a SocketHandler, to the
+		/// socket's and the shard's metrics.
+		///
+		/// Must be called from the dispatcher thread handling the socket,
+		/// i.e., from within a SocketHandler callback.
+
+	struct ShardMetrics
+		/// Metrics of a single event loop (shard).
+		///
+		/// Counters and histograms are cumulative since the
+		/// SocketDispatcher has been created. Times are in microseconds.
+	{
+		int shard = 0;
+		std::size_t sockets = 0;
+		std::size_t queuedCommands = 0;
+		Poco::UInt64 iterations = 0;
+		Poco::UInt64 commands = 0;
+		Poco::UInt64 bytesReceived = 0;
+		Poco::UInt64 framesReceived = 0;
+		Poco::UInt64 bytesSent = 0;
+		Poco::UInt64 framesSent = 0;
+		Histogram::Snapshot loopTime; // time per loop iteration, excluding waiting in poll()
+		Histogram::Snapshot pollWait; // time spent waiting in poll()
+		Histogram::Snapshot commandWait; // time from enqueueing to executing a command or task
+		Histogram::Snapshot pendingSendBytes; // bytes pending for a socket whenever a send could not be completed
+	};
+
+	struct SocketMetrics
+		/// Metrics of a single socket.
+	{
+		poco_socket_t sockfd = POCO_INVALID_SOCKET;
+		int shard = 0;
+		int mode = 0;
+		Poco::UInt64 bytesReceived = 0;
+		Poco::UInt64 framesReceived = 0;
+		Poco::UInt64 bytesSent = 0;
+		Poco::UInt64 framesSent = 0;
+		std::size_t pendingBytes = 0;
+		std::size_t pendingSends = 0;
+		bool throttled = false;
+		Poco::Timespan idle; // time since last activity
+	};
+
+	std::vector<ShardMetrics> metrics() const;
+		/// Returns a snapshot of the metrics of all shards.
+		///
+		/// Can be called from any thread, and never blocks,
+		/// not even if a shard is busy or stuck.
+
+	std::vector<SocketMetrics> socketMetrics();
+		/// Returns a snapshot of the metrics of all sockets.
+		///
+		/// The metrics are collected by every shard's thread, so this
+		/// waits for each shard to process its queued commands, but at
+		/// most SOCKET_METRICS_TIMEOUT milliseconds per shard.
+		/// Sockets of a shard not responding in time are omitted.
+
 	class WebTunnel_API TaskNotification: public Poco::Notification
 	{
 	public:
@@ -184,28 +426,40 @@ public:
 
 	template <class Fn>
 	void queueTask(Fn&& fn)
-		/// Enqueues a task for execution in the dispatcher thread.
+		/// Enqueues a task for execution in a dispatcher thread.
 		/// The task is given as a lambda expression or functor.
+		///
+		/// If called from one of the dispatcher's threads, the task
+		/// is executed by the calling thread's shard, otherwise by
+		/// the first shard.
 	{
-		typename FunctorTaskNotification<Fn>::Ptr pTask = new FunctorTaskNotification<Fn>(*this, std::move(fn));
-		_queue.enqueueNotification(pTask);
-		_pollSet.wakeUp();
-		if (!inDispatcherThread())
-		{
-			pTask->wait();
-		}
+		Shard* pShard = currentShard();
+		queueTask(pShard ? *pShard : *_shards[0], std::move(fn));
+	}
+
+	template <class Fn>
+	void queueTask(const Poco::Net::Socket& socket, Fn&& fn)
+		/// Enqueues a task for execution in the dispatcher thread
+		/// handling the given socket.
+		/// The task is given as a lambda expression or functor.
+	{
+		Shard* pShard = findShard(socket);
+		queueTask(pShard ? *pShard : *_shards[0], std::move(fn));
 	}
 
 protected:
 	struct PendingSend
+		/// A buffer waiting to be sent. After a partial write,
+		/// offset is advanced instead of moving the remaining data.
 	{
 		enum
 		{
 			OPT_SHUTDOWN = 0x0FFFA01
 		};
 
-		PendingSend(Poco::Buffer<char>&& buf, int opt):
+		PendingSend(Poco::Buffer<char>&& buf, int opt, std::size_t off = 0):
 			buffer(std::move(buf)),
+			offset(off),
 			options(opt)
 		{
 		}
@@ -221,86 +475,477 @@ protected:
 		{
 		}
 
+		char* begin()
+		{
+			return buffer.begin() + offset;
+		}
+
+		std::size_t size() const
+		{
+			return buffer.size() - offset;
+		}
+
 		Poco::Buffer<char> buffer{0};
+		std::size_t offset{0};
 		int options{0};
 	};
 
-	struct SocketInfo: public Poco::RefCountedObject
+	struct SocketInfo;
+
+	class TimerQueue
+		/// A min-heap of socket timeouts, ordered by deadline.
+		///
+		/// Each SocketInfo knows its position in the heap, so its
+		/// entry can be rescheduled or cancelled in O(log n).
+		/// Socket activity does not touch the TimerQueue. Instead,
+		/// when an entry expires, the actual deadline is computed
+		/// from the socket's last activity, and the entry is
+		/// rescheduled if the deadline has not been reached yet.
 	{
-		using Ptr = Poco::AutoPtr<SocketInfo>;
+	public:
+		static constexpr std::size_t NO_INDEX = ~std::size_t(0);
 
-		SocketInfo(SocketHandler::Ptr pHnd, int m, Poco::Timespan tmo):
-			pHandler(pHnd),
-			mode(m),
-			timeout(tmo)
+		struct Entry
 		{
-		}
+			Poco::Net::Socket socket;
+			SocketInfo* pInfo;
+		};
+
+		void schedule(const Poco::Net::Socket& socket, SocketInfo& info);
+			/// Schedules (or reschedules) the timeout of the given socket,
+			/// based on its last activity. If the socket has no timeout,
+			/// any existing entry is cancelled.
+
+		void cancel(SocketInfo& info);
+			/// Removes the entry for the given socket, if there is one.
+
+		const Entry& top() const;
+			/// Returns the entry with the earliest deadline.
+
+		bool empty() const;
+			/// Returns true if the TimerQueue is empty.
+
+		std::size_t size() const;
+			/// Returns the number of entries in the TimerQueue.
+
+		void clear();
+			/// Removes all entries.
+
+	private:
+		void siftUp(std::size_t index);
+		void siftDown(std::size_t index);
+		void swap(std::size_t i, std::size_t j);
 
+		std::vector<Entry> _heap;
+	};
+
+	struct SocketInfo
+		/// A record in the SocketTable.
+	{
+		Poco::AutoPtr<Poco::Net::SocketImpl> pSocket; // null while the record is not in use
 		SocketHandler::Ptr pHandler;
-		int mode;
+		int mode = 0;
+		int pollMode = 0; // mode last applied to the PollSet
 		Poco::Timespan timeout;
 		Poco::Clock activity;
+		Poco::Clock deadline;
+		std::size_t timerIndex = TimerQueue::NO_INDEX; // position in the shard's TimerQueue
+		bool gatherWrites = false; // pending sends can be written with a single writev()
+		std::size_t pendingBytes = 0;
+		std::size_t highWatermark = 0;
+		std::size_t lowWatermark = 0;
+		bool throttled = false; // reading suspended due to backpressure
+		std::vector<Poco::Net::Socket> throttledSources; // sockets suspended due to our pending sends
 		std::deque<PendingSend> pendingSends;
+		Poco::UInt64 bytesReceived = 0;
+		Poco::UInt64 framesReceived = 0;
+		Poco::UInt64 bytesSent = 0;
+		Poco::UInt64 framesSent = 0;
+		std::size_t index = 0; // position in the SocketTable
+		Poco::UInt32 generation = 0; // incremented when the record is released
+		bool used = false;
 	};
 
-	using SocketMap = std::map<Poco::Net::Socket, SocketInfo::Ptr>;
+	class SocketTable
+		/// A table of SocketInfo records, indexed by socket descriptor.
+		///
+		/// Records are stored inline in fixed-size blocks that are
+		/// allocated on demand, so the address of a record never changes.
+		/// Every record has a generation counter that is incremented
+		/// when the record is released. Together with the index, it forms
+		/// a handle that can be stored (e.g., as PollSet user data) and
+		/// safely resolved later, even if the socket has been removed and
+		/// its descriptor reused for another socket in the meantime.
+	{
+	public:
+		using Handle = void*;
+
+		SocketInfo* find(const Poco::Net::Socket& socket);
+			/// Returns the record for the given socket, or nullptr
+			/// if the socket is not in the table.
+
+		SocketInfo* find(Handle handle);
+			/// Returns the record identified by the given handle, or nullptr
+			/// if the record has been released since the handle was obtained.
+
+		SocketInfo* at(const Poco::Net::Socket& socket);
+			/// Returns the record in use at the given socket's descriptor,
+			/// which may belong to a different socket if a socket has been
+			/// closed without removing it, or nullptr if there is none.
+
+		SocketInfo& insert(const Poco::Net::Socket& socket);
+			/// Allocates the record for the given socket. The record
+			/// at the socket's descriptor must not be in use.
+
+		void release(SocketInfo& info);
+			/// Releases the given record.
+
+		static Handle handle(const SocketInfo& info);
+			/// Returns the handle for the given record.
+
+		template <class Fn>
+		void forEach(Fn&& fn)
+			/// Calls fn(SocketInfo&) for every record in use.
+		{
+			for (auto& pBlock: _blocks)
+			{
+				if (!pBlock) continue;
+				for (std::size_t i = 0; i < BLOCK_SIZE; i++)
+				{
+					if (pBlock[i].used) fn(pBlock[i]);
+				}
+			}
+		}
+
+		std::size_t size() const;
+			/// Returns the number of records in use.
+
+		bool empty() const;
+			/// Returns true if no records are in use.
+
+		void clear();
+			/// Releases all records.
+
+	private:
+		static constexpr std::size_t BLOCK_SIZE = 64;
+		static constexpr unsigned GENERATION_SHIFT = sizeof(void*) >= 8 ? 32 : 24;
+		static constexpr std::uintptr_t INDEX_MASK = (std::uintptr_t(1) << GENERATION_SHIFT) - 1;
+
+		SocketInfo* slot(std::size_t index);
+
+		std::vector<std::unique_ptr<SocketInfo[]>> _blocks;
+		std::size_t _size = 0;
+	};
+
+	enum
+	{
+		MAIN_QUEUE_TIMEOUT = 1000,
+		COMMAND_QUEUE_CAPACITY = 1024,
+		MAX_GATHER_BUFFERS = 64,
+		SOCKET_METRICS_TIMEOUT = 5000
+	};
 
 	enum
 	{
-		MAIN_QUEUE_TIMEOUT = 1000
+		DEFAULT_HIGH_WATERMARK = 256*1024,
+		DEFAULT_LOW_WATERMARK = 64*1024
+	};
+
+	struct Command
+		/// A request to a shard's event loop.
+	{
+		enum Type
+		{
+			CMD_NONE,
+			CMD_ADD,
+			CMD_UPDATE,
+			CMD_REMOVE,
+			CMD_CLOSE,
+			CMD_HAS,
+			CMD_SEND,
+			CMD_SHUTDOWN,
+			CMD_RESET,
+			CMD_TASK
+		};
+
+		Command() = default;
+
+		explicit Command(Type t):
+			type(t)
+		{
+		}
+
+		Command(Type t, const Poco::Net::Socket& socket):
+			type(t),
+			pSocket(socket.impl(), true)
+		{
+		}
+
+		Type type = CMD_NONE;
+		Poco::AutoPtr<Poco::Net::SocketImpl> pSocket;
+		SocketHandler::Ptr pHandler;
+		int mode = 0;
+		Poco::Timespan timeout;
+		int options = 0;
+		Poco::Buffer<char> buffer{0};
+		TaskNotification::Ptr pTask;
+		Completion::Ptr pCompletion;
+		Poco::Clock::ClockVal enqueued = 0;
 	};
 
-	void run();
-	void readable(const Poco::Net::Socket& socket, SocketInfo::Ptr pInfo);
-	void writable(const Poco::Net::Socket& socket, SocketInfo::Ptr pInfo);
-	void exception(const Poco::Net::Socket& socket, SocketInfo::Ptr pInfo);
-	void timeout(const Poco::Net::Socket& socket, SocketInfo::Ptr pInfo);
-	void addSocketImpl(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout);
-	void updateSocketImpl(const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout);
-	void removeSocketImpl(const Poco::Net::StreamSocket& socket);
-	void closeSocketImpl(Poco::Net::StreamSocket& socket);
-	bool hasSocketImpl(const Poco::Net::StreamSocket& socket) const;
-	void resetImpl();
-	void sendBytesImpl(Poco::Net::StreamSocket& socket, Poco::Buffer<char>&& buffer, int flags);
-	void shutdownSendImpl(Poco::Net::StreamSocket& socket);
+	class CommandQueue
+		/// A bounded, lock-free, multiple-producer, single-consumer
+		/// queue of Commands, implemented as a ring buffer with
+		/// pre-allocated slots.
+	{
+	public:
+		explicit CommandQueue(std::size_t capacity);
+			/// Creates the CommandQueue. Capacity must be a power of two.
+
+		bool tryEnqueue(Command&& command);
+			/// Appends the command to the queue.
+			/// Returns false if the queue is full.
+			/// Can be called from any thread.
+
+		bool tryDequeue(Command& command);
+			/// Removes the first command from the queue.
+			/// Returns false if the queue is empty.
+			/// Must only be called from the consumer thread.
+
+		bool empty() const;
+			/// Returns true if the queue is empty.
+
+		std::size_t size() const;
+			/// Returns the approximate number of commands in the queue.
+			/// Can be called from any thread.
+
+	private:
+		struct Slot
+		{
+			std::atomic<std::size_t> sequence;
+			Command command;
+		};
+
+		std::unique_ptr<Slot[]> _pSlots;
+		std::size_t _mask;
+		alignas(64) std::atomic<std::size_t> _enqueuePos;
+		alignas(64) std::atomic<std::size_t> _dequeuePos;
+	};
+
+	struct ScheduledTask
+		/// A task scheduled with scheduleTask().
+	{
+		Poco::Clock due;
+		SocketTable::Handle handle;
+		DeferredTask task;
+	};
+
+	struct Shard: public Poco::Runnable
+		/// The state of a single event loop.
+	{
+		Shard(SocketDispatcher& d, int i):
+			dispatcher(d),
+			index(i)
+		{
+		}
+
+		void run()
+		{
+			dispatcher.run(*this);
+		}
+
+		SocketDispatcher& dispatcher;
+		int index;
+		SocketTable socketTable;
+		TimerQueue timerQueue;
+		Poco::Net::SocketBufVec gatherBuffers;
+		Poco::Net::Socket activeSocket; // socket currently being handled as readable
+		SocketInfo* pActiveInfo = nullptr;
+		std::vector<SocketTable::Handle> readyList; // edge-triggered sockets with unread data
+		std::vector<SocketHandler::Ptr> retiredHandlers; // handlers of removed sockets, released at the end of the loop iteration
+		std::vector<ScheduledTask> scheduledTasks;
+		Poco::Net::PollSet pollSet;
+		Poco::Net::PollSet::SocketEventList events;
+		Poco::Thread thread;
+		CommandQueue commandQueue{COMMAND_QUEUE_CAPACITY};
+		std::deque<Command> overflowCommands; // commands from the dispatcher thread that did not fit into commandQueue
+		Poco::Event commandsAvailable;
+		std::atomic<bool> waiting{false};
+		std::atomic<std::size_t> load{0};
+		std::atomic<Poco::UInt64> iterations{0};
+		std::atomic<Poco::UInt64> commands{0};
+		std::atomic<Poco::UInt64> bytesReceived{0};
+		std::atomic<Poco::UInt64> framesReceived{0};
+		std::atomic<Poco::UInt64> bytesSent{0};
+		std::atomic<Poco::UInt64> framesSent{0};
+		Histogram loopTime;
+		Histogram pollWait;
+		Histogram commandWait;
+		Histogram pendingSendBytes;
+	};
+
+	using ShardMap = std::map<Poco::Net::Socket, Shard*>;
+
+	template <class Fn>
+	void queueTask(Shard& shard, Fn&& fn)
+	{
+		typename FunctorTaskNotification<Fn>::Ptr pTask = new FunctorTaskNotification<Fn>(*this, std::move(fn));
+		Command command(Command::CMD_TASK);
+		command.pTask = pTask;
+		enqueueCommand(shard, std::move(command));
+		if (!inDispatcherThread(shard))
+		{
+			pTask->wait();
+		}
+	}
+
+	void start(int threads);
+	void run(Shard& shard);
+	void readable(Shard& shard, SocketInfo* pInfo);
+	void collectSocketMetrics(Shard& shard, std::vector<SocketMetrics>& metrics);
+	static void count(std::atomic<Poco::UInt64>& counter, Poco::UInt64 value);
+	static bool readEnabled(const SocketInfo& info);
+	void handleReadyList(Shard& shard);
+	void runScheduledTasks(Shard& shard);
+	Poco::Timespan scheduledTasksTimeout(Shard& shard, Poco::Timespan timeout) const;
+	void writable(Shard& shard, SocketInfo* pInfo);
+	void exception(SocketInfo* pInfo);
+	void timeout(SocketInfo* pInfo);
+	void retireSocket(Shard& shard, SocketInfo& info);
+	void updatePollMode(Shard& shard, const Poco::Net::Socket& socket, SocketInfo& info);
+	bool sendPendingGathered(Shard& shard, Poco::Net::StreamSocket& socket, SocketInfo& info);
+	void throttleSource(Shard& shard, SocketInfo& info);
+	void resumeSources(Shard& shard, SocketInfo& info);
+	Poco::Timespan handleTimeouts(Shard& shard);
+	void addSocket(Shard& shard, const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout, Completion::Ptr pCompletion);
+	void enqueueCommand(Shard& shard, Command&& command);
+	void executeCommand(Shard& shard, Command& command);
+	void executeCommands(Shard& shard);
+	void waitForCommands(Shard& shard);
+	void addSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout);
+	void updateSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout);
+	void removeSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket);
+	void closeSocketImpl(Shard& shard, Poco::Net::StreamSocket& socket);
+	bool hasSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket) const;
+	void resetImpl(Shard& shard);
+	void sendBytesImpl(Shard& shard, Poco::Net::StreamSocket& socket, Poco::Buffer<char>&& buffer, int flags);
+	void shutdownSendImpl(Shard& shard, Poco::Net::StreamSocket& socket);
+	Shard* findShard(const Poco::Net::Socket& socket) const;
+	Shard& selectShard();
+	void assignShard(const Poco::Net::Socket& socket, Shard& shard);
+	void unassignShard(const Poco::Net::Socket& socket, Shard& shard);
+	Shard* currentShard() const;
 	bool stopped();
-	bool inDispatcherThread() const;
+	bool inDispatcherThread(const Shard& shard) const;
 
 private:
 	Poco::Timespan _timeout;
-	SocketMap _socketMap;
-	Poco::Net::PollSet _pollSet;
-	Poco::Thread _thread;
-	Poco::NotificationQueue _queue;
+	std::atomic<std::size_t> _highWatermark;
+	std::atomic<std::size_t> _lowWatermark;
+	std::vector<std::unique_ptr<Shard>> _shards;
+	ShardMap _shardMap;
+	mutable Poco::FastMutex _shardMapMutex;
+	static thread_local Shard* _pCurrentShard;
 	std::atomic<bool> _stopped;
 	Poco::Logger& _logger;
-
-	friend class ReadableNotification;
-	friend class ExceptionNotification;
-	friend class TimeoutNotification;
-	friend class AddSocketNotification;
-	friend class UpdateSocketNotification;
-	friend class RemoveSocketNotification;
-	friend class CloseSocketNotification;
-	friend class HasSocketNotification;
-	friend class ResetNotification;
-	friend class SendBytesNotification;
-	friend class ShutdownSendNotification;
 };
 
 
 //
 // inlines
 //
+inline const SocketDispatcher::TimerQueue::Entry& SocketDispatcher::TimerQueue::top() const
+{
+	return _heap.front();
+}
+
+
+inline bool SocketDispatcher::TimerQueue::empty() const
+{
+	return _heap.empty();
+}
+
+
+inline std::size_t SocketDispatcher::TimerQueue::size() const
+{
+	return _heap.size();
+}
+
+
+inline SocketDispatcher::SocketInfo* SocketDispatcher::SocketTable::slot(std::size_t index)
+{
+	std::size_t block = index/BLOCK_SIZE;
+	if (block < _blocks.size() && _blocks[block])
+		return &_blocks[block][index % BLOCK_SIZE];
+	else
+		return nullptr;
+}
+
+
+inline SocketDispatcher::SocketInfo* SocketDispatcher::SocketTable::find(Handle handle)
+{
+	SocketInfo* pInfo = slot(reinterpret_cast<std::uintptr_t>(handle) & INDEX_MASK);
+	if (pInfo && pInfo->used && SocketTable::handle(*pInfo) == handle)
+		return pInfo;
+	else
+		return nullptr;
+}
+
+
+inline SocketDispatcher::SocketTable::Handle SocketDispatcher::SocketTable::handle(const SocketInfo& info)
+{
+	return reinterpret_cast<Handle>((static_cast<std::uintptr_t>(info.generation) << GENERATION_SHIFT) | info.index);
+}
+
+
+inline std::size_t SocketDispatcher::SocketTable::size() const
+{
+	return _size;
+}
+
+
+inline bool SocketDispatcher::SocketTable::empty() const
+{
+	return _size == 0;
+}
+
+
+inline std::size_t SocketDispatcher::CommandQueue::size() const
+{
+	std::size_t dequeuePos = _dequeuePos.load(std::memory_order_relaxed);
+	std::size_t enqueuePos = _enqueuePos.load(std::memory_order_relaxed);
+	return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+}
+
+
+inline void SocketDispatcher::count(std::atomic<Poco::UInt64>& counter, Poco::UInt64 value)
+{
+	// Shard counters are only updated by the shard's thread.
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+
+inline bool SocketDispatcher::readEnabled(const SocketInfo& info)
+{
+	return (info.mode & Poco::Net::PollSet::POLL_READ) && !info.throttled;
+}
+
+
 inline bool SocketDispatcher::stopped()
 {
 	return _stopped;
 }
 
 
-inline bool SocketDispatcher::inDispatcherThread() const
+inline bool SocketDispatcher::inDispatcherThread(const Shard& shard) const
+{
+	return Poco::Thread::current() == &shard.thread;
+}
+
+
+inline int SocketDispatcher::threads() const
 {
-	return Poco::Thread::current() == &_thread;
+	return static_cast<int>(_shards.size());
 }
 
 
@@ -0,0 +1,152 @@
+//
+// ProtocolBenchmark.cpp
+//
+// This sample shows a benchmark of the WebTunnel protocol header codec.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/WebTunnel/Protocol.h"
+#include "Poco/MemoryStream.h"
+#include "Poco/BinaryWriter.h"
+#include "Poco/BinaryReader.h"
+#include "Poco/Stopwatch.h"
+#include "Poco/NumberParser.h"
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+
+using Poco::WebTunnel::Protocol;
+
+
+namespace
+{
+	// The stream-based codec previously used by Protocol, for comparison.
+
+	std::size_t streamWriteHeader(char* pBuffer, std::size_t bufferSize, Poco::UInt8 opcode, Poco::UInt8 flags, Poco::UInt16 channel, Poco::UInt16 portOrErrorCode)
+	{
+		Poco::MemoryOutputStream ostr(pBuffer, bufferSize);
+		Poco::BinaryWriter writer(ostr, Poco::BinaryWriter::NETWORK_BYTE_ORDER);
+		writer << opcode << flags << channel;
+		if (opcode == Protocol::WT_OP_OPEN_REQUEST || opcode == Protocol::WT_OP_OPEN_FAULT || opcode == Protocol::WT_OP_ERROR)
+		{
+			writer << portOrErrorCode;
+		}
+		return static_cast<std::size_t>(ostr.charsWritten());
+	}
+
+	std::size_t streamReadHeader(const char* pBuffer, std::size_t bufferSize, Poco::UInt8& opcode, Poco::UInt8& flags, Poco::UInt16& channel, Poco::UInt16* pPortOrErrorCode)
+	{
+		Poco::MemoryInputStream istr(pBuffer, bufferSize);
+		Poco::BinaryReader reader(istr, Poco::BinaryReader::NETWORK_BYTE_ORDER);
+		reader >> opcode >> flags >> channel;
+		std::size_t size = Protocol::WT_FRAME_HEADER_SIZE;
+		if (opcode == Protocol::WT_OP_OPEN_REQUEST || opcode == Protocol::WT_OP_OPEN_FAULT || opcode == Protocol::WT_OP_ERROR)
+		{
+			Poco::UInt16 portOrErrorCode;
+			reader >> portOrErrorCode;
+			if (pPortOrErrorCode) *pPortOrErrorCode = portOrErrorCode;
+			size += 2;
+		}
+		return size;
+	}
+
+	void report(const std::string& name, const Poco::Stopwatch& sw, int frames)
+	{
+		std::cout
+			<< std::left << std::setw(32) << name
+			<< std::right << std::setw(10) << std::fixed << std::setprecision(2)
+			<< (1000.0*sw.elapsed())/frames << " [ns/frame]" << std::endl;
+	}
+}
+
+
+int main(int argc, char** argv)
+{
+	int iterations = 10000000;
+	if (argc > 1) iterations = Poco::NumberParser::parse(argv[1]);
+
+	static const Poco::UInt8 opcodes[] =
+	{
+		Protocol::WT_OP_DATA,
+		Protocol::WT_OP_DATA,
+		Protocol::WT_OP_WINDOW_UPDATE,
+		Protocol::WT_OP_DATA,
+		Protocol::WT_OP_OPEN_REQUEST,
+		Protocol::WT_OP_DATA,
+		Protocol::WT_OP_CLOSE,
+		Protocol::WT_OP_ERROR
+	};
+	const int nOpcodes = sizeof(opcodes)/sizeof(opcodes[0]);
+
+	char buffer[16];
+	Poco::UInt32 checksum = 0;
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+	Poco::UInt16 portOrErrorCode = 0;
+	Poco::Stopwatch sw;
+
+	std::cout << "WebTunnel Protocol Benchmark" << std::endl;
+	std::cout << "============================" << std::endl;
+	std::cout << iterations << " frames" << std::endl << std::endl;
+
+	sw.start();
+	for (int i = 0; i < iterations; i++)
+	{
+		std::size_t n = streamWriteHeader(buffer, sizeof(buffer), opcodes[i % nOpcodes], 0, static_cast<Poco::UInt16>(i), 22);
+		streamReadHeader(buffer, n, opcode, flags, channel, &portOrErrorCode);
+		checksum += channel + portOrErrorCode;
+	}
+	sw.stop();
+	report("stream write/read header", sw, iterations);
+
+	sw.restart();
+	for (int i = 0; i < iterations; i++)
+	{
+		std::size_t n = Protocol::writeHeader(buffer, sizeof(buffer), opcodes[i % nOpcodes], 0, static_cast<Poco::UInt16>(i), 22);
+		Protocol::readHeader(buffer, n, opcode, flags, channel, &portOrErrorCode);
+		checksum += channel + portOrErrorCode;
+	}
+	sw.stop();
+	report("inline write/read header", sw, iterations);
+
+	// A batch of small data frames, as sent by a RemotePortForwarder
+	// coalescing frames for many channels.
+	const int batchFrames = 64;
+	const std::size_t payloadSize = 16;
+	std::vector<char> batch(Protocol::WT_FRAME_HEADER_SIZE + batchFrames*(Protocol::WT_BATCH_ENTRY_HEADER_SIZE + Protocol::WT_FRAME_HEADER_SIZE + payloadSize));
+	std::size_t pos = Protocol::writeHeader(batch.data(), batch.size(), Protocol::WT_OP_BATCH, 0, 0);
+	for (int i = 0; i < batchFrames; i++)
+	{
+		pos += Protocol::writeBatchEntryHeader(batch.data() + pos, batch.size() - pos, Protocol::WT_FRAME_HEADER_SIZE + payloadSize);
+		pos += Protocol::writeHeader(batch.data() + pos, batch.size() - pos, Protocol::WT_OP_DATA, 0, static_cast<Poco::UInt16>(i + 1));
+		pos += payloadSize;
+	}
+
+	const int batches = (iterations + batchFrames - 1)/batchFrames;
+	sw.restart();
+	for (int i = 0; i < batches; i++)
+	{
+		batch[Protocol::WT_FRAME_HEADER_SIZE + Protocol::WT_BATCH_ENTRY_HEADER_SIZE + 3] = static_cast<char>(i);
+		Protocol::BatchReader reader(batch.data() + Protocol::WT_FRAME_HEADER_SIZE, batch.size() - Protocol::WT_FRAME_HEADER_SIZE);
+		const char* pFrame;
+		std::size_t frameSize;
+		while (reader.next(pFrame, frameSize))
+		{
+			Protocol::readHeader(pFrame, frameSize, opcode, flags, channel);
+			checksum += channel;
+		}
+	}
+	sw.stop();
+	report("batch decode", sw, batches*batchFrames);
+
+	std::cout << std::endl << "(checksum " << checksum << ")" << std::endl;
+
+	return 0;
+}
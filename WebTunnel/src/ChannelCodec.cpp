@@ -0,0 +1,122 @@
+//
+// ChannelCodec.cpp
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  ChannelCodec
+//
+// Definition of the ChannelCodec class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/WebTunnel/ChannelCodec.h"
+#include "Poco/Exception.h"
+#include <algorithm>
+#include <cstring>
+
+
+using namespace std::string_literals;
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+ChannelCodec::ChannelCodec(int level):
+	_compressed(0),
+	_decompressed(0)
+{
+	std::memset(&_deflater, 0, sizeof(_deflater));
+	std::memset(&_inflater, 0, sizeof(_inflater));
+
+	int rc = deflateInit2(&_deflater, level, Z_DEFLATED, -WINDOW_BITS, 8, Z_DEFAULT_STRATEGY);
+	if (rc != Z_OK) throw Poco::IOException(zError(rc));
+	rc = inflateInit2(&_inflater, -WINDOW_BITS);
+	if (rc != Z_OK)
+	{
+		deflateEnd(&_deflater);
+		throw Poco::IOException(zError(rc));
+	}
+}
+
+
+ChannelCodec::~ChannelCodec()
+{
+	inflateEnd(&_inflater);
+	deflateEnd(&_deflater);
+}
+
+
+bool ChannelCodec::compress(const char* pData, std::size_t size)
+{
+	if (size < MIN_COMPRESS_SIZE) return false;
+	if (_bypassFrames > 0)
+	{
+		_bypassFrames--;
+		return false;
+	}
+
+	// Room for the data plus stored block and sync flush overhead,
+	// so the data can almost always be compressed in a single call.
+	std::size_t capacity = deflateBound(&_deflater, static_cast<uLong>(size)) + 16;
+	_compressed.resize(capacity, false);
+	_deflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pData));
+	_deflater.avail_in = static_cast<uInt>(size);
+	std::size_t used = 0;
+	for (;;)
+	{
+		_deflater.next_out = reinterpret_cast<Bytef*>(_compressed.begin() + used);
+		_deflater.avail_out = static_cast<uInt>(_compressed.size() - used);
+		int rc = deflate(&_deflater, Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_BUF_ERROR) throw Poco::IOException(zError(rc));
+		used = _compressed.size() - _deflater.avail_out;
+		if (_deflater.avail_out > 0) break;
+		_compressed.resize(2*_compressed.size(), true);
+	}
+	_compressed.resize(used, true);
+
+	// Less than 1/8 saved: not worth the effort for the next frames.
+	if (used > size - size/8)
+	{
+		_bypassFrames = _backoff;
+		_backoff = (std::min)(2*_backoff, static_cast<unsigned>(MAX_BYPASS_FRAMES));
+	}
+	else _backoff = 1;
+
+	return true;
+}
+
+
+void ChannelCodec::decompress(const char* pData, std::size_t size, std::size_t maxSize)
+{
+	_decompressed.resize((std::min)(4*size + 256, maxSize + 1), false);
+	_inflater.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(pData));
+	_inflater.avail_in = static_cast<uInt>(size);
+	std::size_t used = 0;
+	for (;;)
+	{
+		_inflater.next_out = reinterpret_cast<Bytef*>(_decompressed.begin() + used);
+		_inflater.avail_out = static_cast<uInt>(_decompressed.size() - used);
+		int rc = inflate(&_inflater, Z_SYNC_FLUSH);
+		if (rc != Z_OK && rc != Z_BUF_ERROR && rc != Z_STREAM_END)
+		{
+			throw Poco::DataFormatException("Cannot decompress frame"s, zError(rc));
+		}
+		used = _decompressed.size() - _inflater.avail_out;
+		if (used > maxSize)
+		{
+			throw Poco::DataFormatException("Decompressed frame exceeds maximum size"s);
+		}
+		if (_inflater.avail_out > 0 || rc == Z_STREAM_END) break;
+		_decompressed.resize((std::min)(2*_decompressed.size(), maxSize + 1), true);
+	}
+	_decompressed.resize(used, true);
+}
+
+
+} } // namespace Poco::WebTunnel
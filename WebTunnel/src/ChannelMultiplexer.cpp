@@ -0,0 +1,636 @@
+//
+// ChannelMultiplexer.cpp
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  ChannelMultiplexer
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/WebTunnel/ChannelMultiplexer.h"
+#include "Poco/Net/NetException.h"
+#include "Poco/Format.h"
+#include <vector>
+#include <algorithm>
+
+
+using namespace std::string_literals;
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+ChannelMultiplexer::ChannelMultiplexer(Poco::SharedPtr<SocketDispatcher> pDispatcher, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, std::size_t maxFrameSize, Poco::Timespan remoteTimeout):
+	_pDispatcher(pDispatcher),
+	_pWebSocket(pWebSocket),
+	_maxFrameSize(maxFrameSize),
+	_remoteTimeout(remoteTimeout),
+	_localTimeout(0),
+	_closeTimeout(30, 0),
+	_logger(Poco::Logger::get("WebTunnel.ChannelMultiplexer"s))
+{
+	poco_check_ptr (pDispatcher);
+	poco_check_ptr (pWebSocket);
+}
+
+
+ChannelMultiplexer::~ChannelMultiplexer()
+{
+}
+
+
+void ChannelMultiplexer::start()
+{
+	_pWebSocket->setNoDelay(true);
+	_pWebSocket->setBlocking(false);
+	_pDispatcher->addSocketAsync(*_pWebSocket, new WebSocketHandler(ChannelMultiplexer::Ptr(this, true)), Poco::Net::PollSet::POLL_READ, _remoteTimeout);
+}
+
+
+void ChannelMultiplexer::enableFlowControl()
+{
+	_flowControl = true;
+}
+
+
+bool ChannelMultiplexer::openChannel(const Poco::Net::StreamSocket& socket, Poco::UInt16 port)
+{
+	Poco::UInt16 channel = 0;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		if (_closed) return false;
+		for (int i = 0; i < 65535 && channel == 0; i++)
+		{
+			if (_channels.find(_nextChannel) == _channels.end())
+			{
+				channel = _nextChannel;
+			}
+			if (++_nextChannel == 0) _nextChannel = 1;
+		}
+		if (channel == 0)
+		{
+			_logger.error("No channel available for forwarding local connection."s);
+			return false;
+		}
+		_channels[channel].socket = socket;
+	}
+
+	if (_logger.debug())
+	{
+		_logger.debug("Opening channel %hu to remote port %hu."s, channel, port);
+	}
+
+	// The local socket is handled by the same thread as the WebSocket. Until the
+	// channel has been confirmed, it is only polled for its timeout.
+	Poco::Net::StreamSocket localSocket(socket);
+	localSocket.setNoDelay(true);
+	localSocket.setBlocking(false);
+	_pDispatcher->addSocketAsync(localSocket, new ChannelHandler(ChannelMultiplexer::Ptr(this, true), channel), 0, _localTimeout, *_pWebSocket);
+
+	Poco::Buffer<char> request(Protocol::headerSize(Protocol::WT_OP_OPEN_REQUEST));
+	Protocol::writeHeader(request.begin(), request.size(), Protocol::WT_OP_OPEN_REQUEST, 0, channel, port);
+	_pDispatcher->sendBytesAsync(*_pWebSocket, std::move(request), Poco::Net::WebSocket::FRAME_BINARY);
+	return true;
+}
+
+
+void ChannelMultiplexer::close()
+{
+	closeWebSocket(true);
+}
+
+
+bool ChannelMultiplexer::isOpen() const
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	return !_closed;
+}
+
+
+std::size_t ChannelMultiplexer::channelCount() const
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	return _channels.size();
+}
+
+
+void ChannelMultiplexer::setLocalTimeout(Poco::Timespan timeout)
+{
+	_localTimeout = timeout;
+}
+
+
+void ChannelMultiplexer::setCloseTimeout(Poco::Timespan timeout)
+{
+	_closeTimeout = timeout;
+}
+
+
+int ChannelMultiplexer::multiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer)
+{
+	// The channel may have been removed by a previous event in the same dispatcher
+	// loop iteration, before the socket has actually been closed.
+	int flags = getChannelFlags(channel);
+	if (!(flags & CF_CONFIRMED) || (flags & CF_CLOSED_LOCAL)) return -1;
+
+	std::size_t hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_DATA, 0, channel);
+	std::size_t maxSize = buffer.size() - hn;
+	if (_flowControl)
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		auto it = _channels.find(channel);
+		if (it == _channels.end() || it->second.sendCredit == 0) return -1;
+		maxSize = (std::min)(maxSize, it->second.sendCredit);
+	}
+	int n = 0;
+	try
+	{
+		n = socket.receiveBytes(buffer.begin() + hn, static_cast<int>(maxSize));
+		if (n < 0) return -1;
+		if (n > 0)
+		{
+			dispatcher.countReceived(socket, n);
+		}
+		else
+		{
+			if (_logger.debug())
+			{
+				_logger.debug("Local peer shutting down channel %hu."s, channel);
+			}
+			if (setChannelFlag(channel, CF_CLOSED_LOCAL) & CF_CLOSED_REMOTE)
+			{
+				removeChannel(channel);
+			}
+			else
+			{
+				dispatcher.updateSocket(socket, 0, _closeTimeout);
+			}
+			hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_CLOSE, 0, channel);
+		}
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.error("Error reading from local socket for channel %hu: %s"s, channel, exc.displayText());
+		removeChannel(channel);
+		n = 0;
+		hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_ERROR, 0, channel, Protocol::WT_ERR_SOCKET);
+	}
+	sendFrame(buffer.begin(), hn + n);
+	if (_flowControl && n > 0)
+	{
+		bool suspend = false;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			auto it = _channels.find(channel);
+			if (it != _channels.end())
+			{
+				it->second.sendCredit -= (std::min)(static_cast<std::size_t>(n), it->second.sendCredit);
+				if (it->second.sendCredit == 0)
+				{
+					it->second.flags |= CF_SUSPENDED;
+					suspend = true;
+				}
+			}
+		}
+		if (suspend)
+		{
+			if (_logger.debug())
+			{
+				_logger.debug("Channel %hu is out of send credit, suspending."s, channel);
+			}
+			dispatcher.updateSocket(socket, 0, _localTimeout);
+		}
+	}
+	return n;
+}
+
+
+void ChannelMultiplexer::multiplexError(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel)
+{
+	_logger.error("Error reading from local socket for channel %hu."s, channel);
+	removeChannel(channel);
+	sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_SOCKET);
+}
+
+
+void ChannelMultiplexer::multiplexTimeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel)
+{
+	int flags = getChannelFlags(channel);
+	removeChannel(channel);
+	if (!(flags & CF_CLOSED_LOCAL))
+	{
+		_logger.error("Timeout reading from local socket for channel %hu."s, channel);
+		sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_TIMEOUT);
+	}
+}
+
+
+void ChannelMultiplexer::demultiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer)
+{
+	int wsFlags;
+	int n = 0;
+	try
+	{
+		n = _pWebSocket->receiveFrame(buffer.begin(), static_cast<int>(buffer.size()), wsFlags);
+		if (n < 0) return;
+		if (n > 0) dispatcher.countReceived(socket, n);
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.error("Error receiving WebSocket frame: %s"s, exc.displayText());
+		closeWebSocket(false);
+		_pDispatcher->removeSocket(*_pWebSocket);
+		return;
+	}
+	int opcode = wsFlags & Poco::Net::WebSocket::FRAME_OP_BITMASK;
+	if (opcode == Poco::Net::WebSocket::FRAME_OP_PONG)
+	{
+		_logger.debug("PONG received."s);
+		_timeoutCount = 0;
+	}
+	else if (n > 0 && opcode == Poco::Net::WebSocket::FRAME_OP_BINARY)
+	{
+		processFrame(buffer.begin(), n, true);
+	}
+	else if (n == 0 && (wsFlags == 0 || opcode == Poco::Net::WebSocket::FRAME_OP_CLOSE))
+	{
+		if (isOpen())
+		{
+			_logger.debug("WebSocket connection %s closed by peer."s, std::string(wsFlags == 0 ? "ungracefully" : "gracefully"));
+			closeWebSocket(wsFlags != 0);
+		}
+		if (wsFlags == 0)
+		{
+			_pDispatcher->removeSocket(*_pWebSocket);
+		}
+	}
+	else
+	{
+		_logger.debug("Ignoring unsupported frame opcode."s);
+	}
+}
+
+
+void ChannelMultiplexer::demultiplexError(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+{
+	_logger.error("Error reading from WebSocket."s);
+	closeWebSocket(false);
+	_pDispatcher->removeSocket(*_pWebSocket);
+}
+
+
+void ChannelMultiplexer::demultiplexTimeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+{
+	if (!isOpen())
+	{
+		_pDispatcher->removeSocket(*_pWebSocket);
+	}
+	else if (_timeoutCount == 0)
+	{
+		_timeoutCount = 1;
+		try
+		{
+			_logger.debug("Sending PING."s);
+			dispatcher.sendBytes(*_pWebSocket, 0, 0, Poco::Net::WebSocket::FRAME_FLAG_FIN | Poco::Net::WebSocket::FRAME_OP_PING);
+		}
+		catch (Poco::Exception&)
+		{
+			closeWebSocket(false);
+		}
+	}
+	else
+	{
+		_logger.error("Timeout reading from WebSocket."s);
+		closeWebSocket(false);
+	}
+}
+
+
+void ChannelMultiplexer::processFrame(const char* buffer, std::size_t size, bool allowBatch)
+{
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+	Poco::UInt16 portOrErrorCode;
+	std::size_t hn = Protocol::readHeader(buffer, size, opcode, flags, channel, &portOrErrorCode);
+	if (hn == 0)
+	{
+		_logger.error("Invalid WebSocket frame received (truncated header)."s);
+		sendResponse(0, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+		return;
+	}
+	switch (opcode)
+	{
+	case Protocol::WT_OP_DATA:
+		if (flags & Protocol::WT_FLAG_DEFLATE)
+		{
+			// Compression is never requested for a channel.
+			_logger.error("Invalid compressed frame received for channel %hu."s, channel);
+			removeChannel(channel);
+			sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+		}
+		else
+		{
+			forwardData(buffer + hn, size - hn, channel);
+		}
+		break;
+
+	case Protocol::WT_OP_OPEN_CONFIRM:
+		confirmChannel(channel);
+		break;
+
+	case Protocol::WT_OP_OPEN_FAULT:
+		_logger.error("Failed to open channel %hu, status %hu reported by peer."s, channel, portOrErrorCode);
+		removeChannel(channel);
+		break;
+
+	case Protocol::WT_OP_CLOSE:
+		if (_logger.debug())
+		{
+			_logger.debug("Remote peer shutting down channel %hu."s, channel);
+		}
+		if (setChannelFlag(channel, CF_CLOSED_REMOTE) & CF_CLOSED_LOCAL)
+		{
+			removeChannel(channel);
+		}
+		else
+		{
+			Poco::Net::StreamSocket socket;
+			{
+				Poco::FastMutex::ScopedLock lock(_mutex);
+
+				auto it = _channels.find(channel);
+				if (it == _channels.end()) break;
+				socket = it->second.socket;
+			}
+			_pDispatcher->shutdownSend(socket);
+		}
+		break;
+
+	case Protocol::WT_OP_ERROR:
+		_logger.error("Status %hu reported by peer. Closing channel %hu."s, portOrErrorCode, channel);
+		removeChannel(channel);
+		break;
+
+	case Protocol::WT_OP_WINDOW_UPDATE:
+		{
+			Poco::UInt32 credit;
+			if (Protocol::readWindowUpdate(buffer, size, credit))
+			{
+				// Window updates are ignored if flow control has not been negotiated.
+				if (_flowControl) updateWindow(channel, credit);
+			}
+			else
+			{
+				_logger.error("Invalid WebSocket frame received (truncated window update)."s);
+				sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+			}
+		}
+		break;
+
+	case Protocol::WT_OP_PROP_UPDATE:
+		// Properties are only sent by devices.
+		break;
+
+	case Protocol::WT_OP_BATCH:
+		if (allowBatch)
+		{
+			Protocol::BatchReader reader(buffer, size);
+			const char* pFrame;
+			std::size_t frameSize;
+			while (reader.next(pFrame, frameSize))
+			{
+				processFrame(pFrame, frameSize, false);
+			}
+			if (reader.malformed())
+			{
+				_logger.error("Invalid WebSocket frame received (malformed batch)."s);
+				sendResponse(0, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+			}
+			break;
+		}
+		// fallthrough
+
+	default:
+		_logger.error("Invalid WebSocket frame received (bad opcode: %hu)."s, static_cast<Poco::UInt16>(opcode));
+		sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+		break;
+	}
+}
+
+
+void ChannelMultiplexer::confirmChannel(Poco::UInt16 channel)
+{
+	Poco::Net::StreamSocket socket;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		auto it = _channels.find(channel);
+		if (it == _channels.end() || (it->second.flags & CF_CONFIRMED)) return;
+		it->second.flags |= CF_CONFIRMED;
+		socket = it->second.socket;
+	}
+
+	if (_logger.debug())
+	{
+		_logger.debug("Channel %hu has been confirmed."s, channel);
+	}
+	_pDispatcher->updateSocket(socket, Poco::Net::PollSet::POLL_READ, _localTimeout);
+	if (_flowControl)
+	{
+		// The amount of data queued for the local socket is limited by the
+		// channel window, so it must not throttle the shared WebSocket.
+		_pDispatcher->setWatermarks(socket, 0, 0);
+	}
+}
+
+
+void ChannelMultiplexer::forwardData(const char* buffer, std::size_t size, Poco::UInt16 channel)
+{
+	Poco::Net::StreamSocket socket;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		auto it = _channels.find(channel);
+		if (it == _channels.end() || (it->second.flags & CF_CLOSED_REMOTE))
+		{
+			_logger.debug("Discarding data for closed channel %hu."s, channel);
+			return;
+		}
+		socket = it->second.socket;
+	}
+	try
+	{
+		_pDispatcher->sendBytes(socket, buffer, size, 0);
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.error("Error sending data to local socket for channel %hu: %s"s, channel, exc.displayText());
+		removeChannel(channel);
+		sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_SOCKET);
+	}
+}
+
+
+void ChannelMultiplexer::dataSent(Poco::UInt16 channel, std::size_t bytes)
+{
+	// Credit is granted in chunks, to avoid sending a window update
+	// for every single write to the local socket.
+	const std::size_t GRANT_THRESHOLD = Protocol::WT_CHANNEL_WINDOW_SIZE/4;
+
+	Poco::UInt32 credit = 0;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		auto it = _channels.find(channel);
+		if (it == _channels.end()) return;
+		it->second.unacknowledged += bytes;
+		if (it->second.unacknowledged < GRANT_THRESHOLD) return;
+		credit = static_cast<Poco::UInt32>(it->second.unacknowledged);
+		it->second.unacknowledged = 0;
+	}
+
+	char buffer[Protocol::WT_WINDOW_UPDATE_SIZE];
+	std::size_t n = Protocol::writeWindowUpdate(buffer, sizeof(buffer), channel, credit);
+	sendFrame(buffer, n);
+}
+
+
+void ChannelMultiplexer::updateWindow(Poco::UInt16 channel, Poco::UInt32 credit)
+{
+	Poco::Net::StreamSocket socket;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		auto it = _channels.find(channel);
+		if (it == _channels.end() || credit == 0) return;
+		it->second.sendCredit += credit;
+		if (!(it->second.flags & CF_SUSPENDED)) return;
+		it->second.flags &= ~CF_SUSPENDED;
+		if (it->second.flags & CF_CLOSED_LOCAL) return;
+		socket = it->second.socket;
+	}
+
+	if (_logger.debug())
+	{
+		_logger.debug("Channel %hu has received send credit, resuming."s, channel);
+	}
+	_pDispatcher->updateSocket(socket, Poco::Net::PollSet::POLL_READ, _localTimeout);
+}
+
+
+void ChannelMultiplexer::removeChannel(Poco::UInt16 channel)
+{
+	Poco::Net::StreamSocket socket;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		auto it = _channels.find(channel);
+		if (it == _channels.end()) return;
+		socket = it->second.socket;
+		_channels.erase(it);
+	}
+	_pDispatcher->closeSocketAsync(socket);
+}
+
+
+int ChannelMultiplexer::setChannelFlag(Poco::UInt16 channel, int flag)
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	auto it = _channels.find(channel);
+	if (it != _channels.end())
+	{
+		return it->second.flags |= flag;
+	}
+	else return 0;
+}
+
+
+int ChannelMultiplexer::getChannelFlags(Poco::UInt16 channel) const
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	auto it = _channels.find(channel);
+	if (it != _channels.end())
+	{
+		return it->second.flags;
+	}
+	else return 0;
+}
+
+
+void ChannelMultiplexer::sendResponse(Poco::UInt16 channel, Poco::UInt8 opcode, Poco::UInt16 errorCode)
+{
+	char buffer[6];
+	std::size_t hn = Protocol::writeHeader(buffer, sizeof(buffer), opcode, 0, channel, errorCode);
+	sendFrame(buffer, hn);
+}
+
+
+void ChannelMultiplexer::sendFrame(const char* buffer, std::size_t size)
+{
+	try
+	{
+		_pDispatcher->sendBytes(*_pWebSocket, buffer, size, Poco::Net::WebSocket::FRAME_BINARY);
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.error("Error sending WebSocket frame: %s"s, exc.displayText());
+		closeWebSocket(false);
+	}
+}
+
+
+void ChannelMultiplexer::closeWebSocket(bool graceful)
+{
+	std::vector<Poco::Net::StreamSocket> sockets;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		if (_closed) return;
+		_closed = true;
+		sockets.reserve(_channels.size());
+		for (const auto& p: _channels)
+		{
+			sockets.push_back(p.second.socket);
+		}
+		_channels.clear();
+	}
+
+	_logger.debug("Closing WebSocket, closing %z channel(s)."s, sockets.size());
+	for (const auto& socket: sockets)
+	{
+		_pDispatcher->closeSocketAsync(socket);
+	}
+	try
+	{
+		if (graceful)
+		{
+			Poco::Buffer<char> buffer(2);
+			buffer[0] = static_cast<char>(Poco::Net::WebSocket::WS_NORMAL_CLOSE >> 8);
+			buffer[1] = static_cast<char>(Poco::Net::WebSocket::WS_NORMAL_CLOSE & 0xFF);
+			_pDispatcher->sendBytesAsync(*_pWebSocket, std::move(buffer), Poco::Net::WebSocket::FRAME_FLAG_FIN | Poco::Net::WebSocket::FRAME_OP_CLOSE);
+		}
+		_pDispatcher->shutdownSendAsync(*_pWebSocket);
+		_pDispatcher->updateSocketAsync(*_pWebSocket, Poco::Net::PollSet::POLL_READ, _closeTimeout);
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.log(exc);
+	}
+}
+
+
+} } // namespace Poco::WebTunnel
@@ -0,0 +1,130 @@
+//
+// FrameScheduler.cpp
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  FrameScheduler
+//
+// Definition of the FrameScheduler class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/WebTunnel/FrameScheduler.h"
+#include <algorithm>
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+FrameScheduler::FrameScheduler(std::size_t quantum):
+	_quantum(quantum)
+{
+}
+
+
+void FrameScheduler::enqueue(Poco::UInt16 channel, unsigned weight, Poco::Buffer<char>&& frame)
+{
+	Queue& queue = _queues[channel];
+	if (queue.frames.empty())
+	{
+		queue.weight = (std::max)(weight, 1U);
+		queue.deficit = 0;
+		queue.visited = false;
+		_active.push_back(channel);
+	}
+	queue.bytes += frame.size();
+	_bytes += frame.size();
+	queue.frames.push_back(std::move(frame));
+}
+
+
+void FrameScheduler::enqueueUrgent(Poco::Buffer<char>&& frame)
+{
+	_urgent.push_back(std::move(frame));
+}
+
+
+bool FrameScheduler::dequeue(Poco::Buffer<char>& frame, Poco::UInt16& channel, bool& urgent)
+{
+	if (!_urgent.empty())
+	{
+		frame = std::move(_urgent.front());
+		_urgent.pop_front();
+		channel = 0;
+		urgent = true;
+		return true;
+	}
+
+	while (!_active.empty())
+	{
+		Poco::UInt16 current = _active.front();
+		Queue& queue = _queues[current];
+		if (!queue.visited)
+		{
+			queue.deficit += _quantum*queue.weight;
+			queue.visited = true;
+		}
+		std::size_t size = queue.frames.front().size();
+		if (size <= queue.deficit)
+		{
+			queue.deficit -= size;
+			queue.bytes -= size;
+			_bytes -= size;
+			frame = std::move(queue.frames.front());
+			queue.frames.pop_front();
+			if (queue.frames.empty())
+			{
+				_active.pop_front();
+				_queues.erase(current);
+			}
+			channel = current;
+			urgent = false;
+			return true;
+		}
+		// end of this channel's turn; unused deficit carries over
+		queue.visited = false;
+		_active.pop_front();
+		_active.push_back(current);
+	}
+	return false;
+}
+
+
+void FrameScheduler::remove(Poco::UInt16 channel)
+{
+	auto it = _queues.find(channel);
+	if (it != _queues.end())
+	{
+		_bytes -= it->second.bytes;
+		_queues.erase(it);
+		_active.erase(std::remove(_active.begin(), _active.end(), channel), _active.end());
+	}
+}
+
+
+void FrameScheduler::clear()
+{
+	_queues.clear();
+	_active.clear();
+	_urgent.clear();
+	_bytes = 0;
+}
+
+
+std::size_t FrameScheduler::queuedBytes(Poco::UInt16 channel) const
+{
+	auto it = _queues.find(channel);
+	if (it != _queues.end())
+		return it->second.bytes;
+	else
+		return 0;
+}
+
+
+} } // namespace Poco::WebTunnel
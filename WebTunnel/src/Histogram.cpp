@@ -0,0 +1,103 @@
+//
+// Histogram.cpp
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  Histogram
+//
+// Definition of the Histogram class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/WebTunnel/Histogram.h"
+#include <algorithm>
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+Histogram::Histogram():
+	_count(0),
+	_sum(0),
+	_max(0)
+{
+	for (auto& bucket: _buckets)
+	{
+		bucket.store(0, std::memory_order_relaxed);
+	}
+}
+
+
+Histogram::Snapshot Histogram::snapshot() const
+{
+	Snapshot snapshot;
+	snapshot.buckets.reserve(BUCKETS);
+	for (const auto& bucket: _buckets)
+	{
+		snapshot.buckets.push_back(bucket.load(std::memory_order_relaxed));
+	}
+	// Counters are read individually while values may still be recorded,
+	// so count is derived from the buckets to keep percentiles consistent.
+	for (auto n: snapshot.buckets) snapshot.count += n;
+	snapshot.sum = _sum.load(std::memory_order_relaxed);
+	snapshot.max = _max.load(std::memory_order_relaxed);
+	return snapshot;
+}
+
+
+Poco::UInt64 Histogram::bucketLimit(std::size_t index)
+{
+	if (index < SUB_BUCKETS) return index;
+
+	unsigned shift = static_cast<unsigned>(index/SUB_BUCKETS - 1);
+	Poco::UInt64 lower = static_cast<Poco::UInt64>(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+	return lower + ((Poco::UInt64(1) << shift) - 1);
+}
+
+
+double Histogram::Snapshot::mean() const
+{
+	return count > 0 ? static_cast<double>(sum)/count : 0.0;
+}
+
+
+Poco::UInt64 Histogram::Snapshot::percentile(double p) const
+{
+	if (count == 0) return 0;
+
+	Poco::UInt64 rank = static_cast<Poco::UInt64>(p*count/100.0 + 0.5);
+	if (rank < 1) rank = 1;
+	if (rank > count) rank = count;
+	Poco::UInt64 seen = 0;
+	for (std::size_t i = 0; i < buckets.size(); i++)
+	{
+		seen += buckets[i];
+		if (seen >= rank) return (std::min)(bucketLimit(i), max);
+	}
+	return max;
+}
+
+
+void Histogram::Snapshot::merge(const Snapshot& other)
+{
+	if (buckets.size() < other.buckets.size())
+	{
+		buckets.resize(other.buckets.size(), 0);
+	}
+	for (std::size_t i = 0; i < other.buckets.size(); i++)
+	{
+		buckets[i] += other.buckets[i];
+	}
+	count += other.count;
+	sum += other.sum;
+	max = (std::max)(max, other.max);
+}
+
+
+} } // namespace Poco::WebTunnel
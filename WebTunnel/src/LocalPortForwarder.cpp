@@ -22,11 +22,25 @@
 #include "Poco/Net/HTTPClientSession.h"
 #include "Poco/Net/HTTPSessionFactory.h"
 #include "Poco/Net/HTTPBasicCredentials.h"
+#include "Poco/Net/WebSocketImpl.h"
 #include "Poco/Net/NetException.h"
+#if defined(WEBTUNNEL_ENABLE_TLS)
+#include "Poco/Net/SecureStreamSocket.h"
+#endif
 #include "Poco/NumberFormatter.h"
 #include "Poco/NumberParser.h"
 #include "Poco/Format.h"
 #include "Poco/Buffer.h"
+#include "Poco/Runnable.h"
+#include "Poco/Thread.h"
+#include "Poco/Event.h"
+#include "Poco/Clock.h"
+#include "Poco/Error.h"
+#include "Poco/String.h"
+#include <deque>
+#include <iterator>
+#include <memory>
+#include <sstream>
 
 
 using namespace std::string_literals;
@@ -98,6 +112,21 @@ WebSocketFactory::~WebSocketFactory()
 }
 
 
+bool WebSocketFactory::prepareRequest(const Poco::URI& uri, Poco::Net::HTTPRequest& request)
+{
+	return false;
+}
+
+
+Poco::Net::StreamSocket* WebSocketFactory::createSocket(const Poco::URI& uri)
+{
+	if (uri.getScheme() == "http"s || uri.getScheme() == "ws"s)
+		return new Poco::Net::StreamSocket;
+	else
+		return nullptr;
+}
+
+
 //
 // DefaultWebSocketFactory
 //
@@ -125,12 +154,19 @@ Poco::Net::WebSocket* DefaultWebSocketFactory::createWebSocket(const Poco::URI&
 {
 	Poco::SharedPtr<Poco::Net::HTTPClientSession> pSession = Poco::Net::HTTPSessionFactory::defaultFactory().createClientSession(uri);
 	pSession->setTimeout(_timeout);
+	prepareRequest(uri, request);
+	return new Poco::Net::WebSocket(*pSession, request, response);
+}
+
+
+bool DefaultWebSocketFactory::prepareRequest(const Poco::URI& uri, Poco::Net::HTTPRequest& request)
+{
 	if (!_username.empty())
 	{
 		Poco::Net::HTTPBasicCredentials creds(_username, _password);
 		creds.authenticate(request);
 	}
-	return new Poco::Net::WebSocket(*pSession, request, response);
+	return true;
 }
 
 
@@ -142,9 +178,9 @@ Poco::Net::WebSocket* DefaultWebSocketFactory::createWebSocket(const Poco::URI&
 class BasicSocketForwarder: public SocketDispatcher::SocketHandler
 {
 public:
-	BasicSocketForwarder(Poco::SharedPtr<SocketDispatcher> pDispatcher):
+	BasicSocketForwarder(Poco::SharedPtr<SocketDispatcher> pDispatcher, std::size_t bufferSize):
 		_pDispatcher(pDispatcher),
-		_buffer(Protocol::WT_FRAME_MAX_SIZE)
+		_buffer(bufferSize)
 	{
 	}
 
@@ -190,7 +226,7 @@ class StreamSocketToWebSocketForwarder: public BasicSocketForwarder
 {
 public:
 	StreamSocketToWebSocketForwarder(Poco::SharedPtr<SocketDispatcher> pDispatcher, Poco::SharedPtr<LocalPortForwarder::ConnectionPair> pConnectionPair):
-		BasicSocketForwarder(pDispatcher),
+		BasicSocketForwarder(pDispatcher, pConnectionPair->maxFrameSize),
 		_pConnectionPair(pConnectionPair),
 		_logger(Poco::Logger::get("WebTunnel.StreamSocketToWebSocketForwarder"s))
 	{
@@ -205,6 +241,7 @@ public:
 		{
 			n = _pConnectionPair->streamSocket.receiveBytes(_buffer.begin(), static_cast<int>(_buffer.size()));
 			if (n < 0) return;
+			if (n > 0) dispatcher.countReceived(socket, n);
 		}
 		catch (Poco::Net::ConnectionResetException& exc)
 		{
@@ -301,7 +338,7 @@ class WebSocketToStreamSocketForwarder: public BasicSocketForwarder
 {
 public:
 	WebSocketToStreamSocketForwarder(Poco::SharedPtr<SocketDispatcher> pDispatcher, Poco::SharedPtr<LocalPortForwarder::ConnectionPair> pConnectionPair):
-		BasicSocketForwarder(pDispatcher),
+		BasicSocketForwarder(pDispatcher, pConnectionPair->maxFrameSize),
 		_pConnectionPair(pConnectionPair),
 		_logger(Poco::Logger::get("WebTunnel.WebSocketToStreamSocketForwarder"s))
 	{
@@ -317,6 +354,7 @@ public:
 		{
 			n = _pConnectionPair->webSocket.receiveFrame(_buffer.begin(), static_cast<int>(_buffer.size()), flags);
 			if (n < 0) return;
+			if (n > 0) dispatcher.countReceived(socket, n);
 		}
 		catch (Poco::Net::ConnectionResetException& exc)
 		{
@@ -427,6 +465,559 @@ private:
 };
 
 
+//
+// LocalPortForwarder::WebSocketPool
+//
+
+
+class LocalPortForwarder::WebSocketPool: public Poco::Runnable
+{
+public:
+	struct Entry
+	{
+		Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket;
+		std::size_t maxFrameSize = Protocol::WT_FRAME_MAX_SIZE;
+		std::string pending; // data received while pooled
+		Poco::Clock created;
+		Poco::Clock lastPing;
+		bool pingSent = false;
+	};
+
+	WebSocketPool(LocalPortForwarder& forwarder, std::size_t size, Poco::Timespan idleTimeout, Poco::Timespan pingInterval):
+		_forwarder(forwarder),
+		_size(size),
+		_idleTimeout(idleTimeout),
+		_pingInterval(pingInterval),
+		_logger(Poco::Logger::get("WebTunnel.LocalPortForwarder.WebSocketPool"s))
+	{
+		_thread.setName("WebSocketPool"s);
+	}
+
+	~WebSocketPool()
+	{
+		try
+		{
+			stop();
+		}
+		catch (...)
+		{
+			poco_unexpected();
+		}
+	}
+
+	void start()
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		if (!_stopped || _size == 0) return;
+		_stopped = false;
+		_thread.start(*this);
+	}
+
+	void stop()
+	{
+		std::deque<Entry> entries;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			if (_stopped) return;
+			_stopped = true;
+			entries.swap(_entries);
+		}
+		for (auto& entry: entries)
+		{
+			discard(entry);
+		}
+		_wakeUp.set();
+		_thread.join();
+	}
+
+	std::size_t size() const
+	{
+		return _size;
+	}
+
+	std::size_t available() const
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		return _entries.size();
+	}
+
+	bool take(Entry& entry)
+	{
+		for (;;)
+		{
+			{
+				Poco::FastMutex::ScopedLock lock(_mutex);
+
+				if (_entries.empty()) break;
+				// The most recently created WebSocket is the least likely
+				// to have been closed by the server in the meantime.
+				entry = std::move(_entries.back());
+				_entries.pop_back();
+			}
+			if (check(entry))
+			{
+				_wakeUp.set();
+				return true;
+			}
+			discard(entry);
+		}
+		_wakeUp.set();
+		return false;
+	}
+
+	void run()
+	{
+		const long checkInterval = static_cast<long>((std::max)(_pingInterval.totalMilliseconds()/4, Poco::Timespan::TimeDiff(100)));
+
+		for (;;)
+		{
+			bool ok = refill();
+			if (!checkEntries()) return;
+			_wakeUp.tryWait(ok ? checkInterval : static_cast<long>(RETRY_DELAY));
+		}
+	}
+
+protected:
+	bool refill()
+	{
+		// The pool is not needed while local connections are multiplexed.
+		if (_forwarder.multiplexed()) return true;
+
+		std::size_t missing;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			if (_stopped) return true;
+			missing = _size - (std::min)(_entries.size(), _size);
+		}
+		while (missing-- > 0)
+		{
+			try
+			{
+				Entry entry;
+				Poco::Net::HTTPResponse response;
+				entry.pWebSocket = _forwarder.createWebSocket(0, response, entry.maxFrameSize);
+				if (!entry.pWebSocket) return false;
+				entry.pWebSocket->setReceiveTimeout(RECEIVE_TIMEOUT*1000);
+
+				{
+					Poco::FastMutex::ScopedLock lock(_mutex);
+					if (!_stopped)
+					{
+						_entries.push_back(std::move(entry));
+						continue;
+					}
+				}
+				discard(entry);
+				return true;
+			}
+			catch (Poco::Exception& exc)
+			{
+				_logger.debug("Failed to create pooled WebSocket: %s"s, exc.displayText());
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool checkEntries()
+		/// Checks all pooled WebSockets and discards those no longer usable.
+		/// The WebSockets are removed from the pool while being checked,
+		/// so that take() never uses a WebSocket concurrently.
+		/// Returns false if the pool has been stopped.
+	{
+		std::deque<Entry> entries;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			if (_stopped) return false;
+			entries.swap(_entries);
+		}
+		for (auto it = entries.begin(); it != entries.end();)
+		{
+			if (check(*it))
+			{
+				++it;
+			}
+			else
+			{
+				discard(*it);
+				it = entries.erase(it);
+			}
+		}
+		bool stopped;
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			stopped = _stopped;
+			if (!stopped)
+			{
+				// WebSockets added in the meantime are newer and stay at the back.
+				_entries.insert(_entries.begin(), std::make_move_iterator(entries.begin()), std::make_move_iterator(entries.end()));
+				entries.clear();
+			}
+		}
+		for (auto& entry: entries)
+		{
+			discard(entry);
+		}
+		return !stopped;
+	}
+
+	bool check(Entry& entry)
+		/// Receives any frames sent by the server, and sends a PING if due.
+		/// Returns false if the WebSocket must be discarded.
+	{
+		if (entry.created.isElapsed(_idleTimeout.totalMicroseconds())) return false;
+		try
+		{
+			while (entry.pWebSocket->poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_ERROR))
+			{
+				Poco::Buffer<char> buffer(0);
+				int flags;
+				int n = entry.pWebSocket->receiveFrame(buffer, flags);
+				int opcode = flags & Poco::Net::WebSocket::FRAME_OP_BITMASK;
+				if (n == 0 && flags == 0) return false;
+				if (opcode == Poco::Net::WebSocket::FRAME_OP_CLOSE) return false;
+				if (opcode == Poco::Net::WebSocket::FRAME_OP_PONG)
+				{
+					entry.pingSent = false;
+				}
+				else if (n > 0 && opcode == Poco::Net::WebSocket::FRAME_OP_BINARY)
+				{
+					entry.pending.append(buffer.begin(), n);
+					if (entry.pending.size() > MAX_PENDING) return false;
+				}
+			}
+			if (entry.lastPing.isElapsed(_pingInterval.totalMicroseconds()))
+			{
+				if (entry.pingSent) return false;
+				entry.pWebSocket->sendFrame(0, 0, Poco::Net::WebSocket::FRAME_FLAG_FIN | Poco::Net::WebSocket::FRAME_OP_PING);
+				entry.pingSent = true;
+				entry.lastPing.update();
+			}
+			return true;
+		}
+		catch (Poco::Exception& exc)
+		{
+			_logger.debug("Discarding pooled WebSocket: %s"s, exc.displayText());
+			return false;
+		}
+	}
+
+	void discard(Entry& entry)
+	{
+		try
+		{
+			entry.pWebSocket->shutdown(Poco::Net::WebSocket::WS_NORMAL_CLOSE);
+		}
+		catch (Poco::Exception&)
+		{
+		}
+		entry.pWebSocket->close();
+	}
+
+private:
+	enum
+	{
+		RETRY_DELAY = 5000,      /// milliseconds to wait before creating a WebSocket again after a failure
+		RECEIVE_TIMEOUT = 5000,  /// milliseconds to wait for the rest of a partially received frame
+		MAX_PENDING = 65536      /// maximum number of bytes received while pooled
+	};
+
+	LocalPortForwarder& _forwarder;
+	std::size_t _size;
+	Poco::Timespan _idleTimeout;
+	Poco::Timespan _pingInterval;
+	std::deque<Entry> _entries;
+	Poco::Thread _thread;
+	Poco::Event _wakeUp;
+	bool _stopped = true;
+	mutable Poco::FastMutex _mutex;
+	Poco::Logger& _logger;
+};
+
+
+//
+// WebSocketHandshake
+//
+
+
+class WebSocketHandshake: public Poco::Net::WebSocket
+	/// Makes the client handshake helpers of Poco::Net::WebSocket
+	/// available to LocalPortForwarder::AsyncConnector.
+{
+public:
+	using Poco::Net::WebSocket::createKey;
+	using Poco::Net::WebSocket::computeAccept;
+};
+
+
+//
+// LocalPortForwarder::AsyncConnector
+//
+
+
+class LocalPortForwarder::AsyncConnector: public SocketDispatcher::SocketHandler
+	/// Opens the forwarding WebSocket connection for a local connection,
+	/// driven by the SocketDispatcher, without blocking a thread.
+	///
+	/// The connector waits for the non-blocking connect() to complete,
+	/// then sends the HTTP upgrade request (for a secure socket, this
+	/// also performs the TLS handshake) and receives the response.
+	/// Afterwards, the local socket and the WebSocket are passed to
+	/// LocalPortForwarder::forwardWebSocket().
+{
+public:
+	AsyncConnector(LocalPortForwarder& forwarder, const Poco::Net::StreamSocket& localSocket, const Poco::Net::StreamSocket& remoteSocket, bool secure, Poco::Net::HTTPRequest& request, std::size_t maxFrameSize):
+		_forwarder(forwarder),
+		_localSocket(localSocket),
+		_remoteSocket(remoteSocket),
+		_secure(secure),
+		_maxFrameSize(maxFrameSize),
+		_key(WebSocketHandshake::createKey())
+	{
+		request.set("Connection"s, "Upgrade"s);
+		request.set("Upgrade"s, "websocket"s);
+		request.set("Sec-WebSocket-Version"s, Poco::Net::WebSocket::WEBSOCKET_VERSION);
+		request.set("Sec-WebSocket-Key"s, _key);
+		_offeredExtensions = request.get(SEC_WEBSOCKET_EXTENSIONS, ""s);
+
+		std::ostringstream ostr;
+		request.write(ostr);
+		_request = ostr.str();
+	}
+
+	void readable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+	{
+		if (_state == ST_SENDING)
+			run(dispatcher, &AsyncConnector::sendRequest);
+		else if (_state == ST_RECEIVING)
+			run(dispatcher, &AsyncConnector::receiveResponse);
+	}
+
+	void writable(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+	{
+		if (_state == ST_CONNECTING)
+			run(dispatcher, &AsyncConnector::connected);
+		else if (_state == ST_SENDING)
+			run(dispatcher, &AsyncConnector::sendRequest);
+		else if (_state == ST_RECEIVING)
+			run(dispatcher, &AsyncConnector::receiveResponse);
+	}
+
+	void exception(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+	{
+		if (_state == ST_CONNECTING)
+			run(dispatcher, &AsyncConnector::connected);
+		else if (_state != ST_DONE)
+			fail(dispatcher, "Connection to remote host failed"s);
+	}
+
+	void timeout(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket)
+	{
+		if (_state != ST_DONE)
+		{
+			if (_state == ST_CONNECTING) _forwarder.resetRemoteAddress();
+			fail(dispatcher, "Timeout while opening connection to remote host"s);
+		}
+	}
+
+protected:
+	using Step = void (AsyncConnector::*)(SocketDispatcher&);
+
+	void run(SocketDispatcher& dispatcher, Step step)
+	{
+		try
+		{
+			(this->*step)(dispatcher);
+		}
+		catch (Poco::Exception& exc)
+		{
+			fail(dispatcher, exc.displayText());
+		}
+	}
+
+	void connected(SocketDispatcher& dispatcher)
+	{
+		int error = _remoteSocket.impl()->socketError();
+		if (error != 0)
+		{
+			_forwarder.resetRemoteAddress();
+			throw Poco::Net::NetException(Poco::format("Cannot connect to %s"s, _forwarder._remoteURI.getAuthority()), Poco::Error::getMessage(error));
+		}
+		_state = ST_SENDING;
+		sendRequest(dispatcher);
+	}
+
+	void sendRequest(SocketDispatcher& dispatcher)
+	{
+		while (_sent < _request.size())
+		{
+			int n = _remoteSocket.sendBytes(_request.data() + _sent, static_cast<int>(_request.size() - _sent));
+			if (n < 0)
+			{
+				waitFor(dispatcher, n, Poco::Net::PollSet::POLL_WRITE);
+				return;
+			}
+			_sent += n;
+		}
+		_state = ST_RECEIVING;
+		waitFor(dispatcher, 0, Poco::Net::PollSet::POLL_READ);
+	}
+
+	void receiveResponse(SocketDispatcher& dispatcher)
+	{
+		// Data following the response header already belongs to the
+		// WebSocket connection, so the header is first peeked at,
+		// and then only the part belonging to the header is received.
+		char buffer[RECEIVE_BUFFER_SIZE];
+		int n = _remoteSocket.receiveBytes(buffer, sizeof(buffer), MSG_PEEK);
+		if (n < 0)
+		{
+			waitFor(dispatcher, n, Poco::Net::PollSet::POLL_READ);
+			return;
+		}
+		if (n == 0) throw Poco::Net::WebSocketException("Connection closed by remote host during WebSocket handshake"s, Poco::Net::WebSocket::WS_ERR_NO_HANDSHAKE);
+
+		static const char HEADER_END[] = "\r\n\r\n";
+		int length = 0;
+		while (length < n && _matched < 4)
+		{
+			char c = buffer[length++];
+			if (c == HEADER_END[_matched])
+				_matched++;
+			else
+				_matched = c == '\r' ? 1 : 0;
+		}
+		if (_remoteSocket.receiveBytes(buffer, length) != length)
+			throw Poco::IOException("Cannot receive WebSocket handshake response"s);
+		_response.append(buffer, length);
+
+		if (_matched == 4)
+			completeHandshake(dispatcher);
+		else if (_response.size() > MAX_RESPONSE_SIZE)
+			throw Poco::Net::WebSocketException("WebSocket handshake response too large"s, Poco::Net::WebSocket::WS_ERR_NO_HANDSHAKE);
+	}
+
+	void completeHandshake(SocketDispatcher& dispatcher)
+	{
+		Poco::Net::HTTPResponse response;
+		std::istringstream istr(_response);
+		response.read(istr);
+		if (response.getStatus() == Poco::Net::HTTPResponse::HTTP_UNAUTHORIZED)
+			throw Poco::Net::WebSocketException("Not authorized"s, Poco::Net::WebSocket::WS_ERR_UNAUTHORIZED);
+		else if (response.getStatus() == Poco::Net::HTTPResponse::HTTP_OK)
+			throw Poco::Net::WebSocketException("The server does not understand the WebSocket protocol"s, Poco::Net::WebSocket::WS_ERR_NO_HANDSHAKE);
+		else if (response.getStatus() != Poco::Net::HTTPResponse::HTTP_SWITCHING_PROTOCOLS)
+			throw Poco::Net::WebSocketException("Cannot upgrade to WebSocket connection"s, response.getReason(), Poco::Net::WebSocket::WS_ERR_NO_HANDSHAKE);
+		if (Poco::icompare(response.get("Connection"s, ""s), "Upgrade"s) != 0)
+			throw Poco::Net::WebSocketException("No Connection: Upgrade header in handshake response"s, Poco::Net::WebSocket::WS_ERR_NO_HANDSHAKE);
+		if (Poco::icompare(response.get("Upgrade"s, ""s), "websocket"s) != 0)
+			throw Poco::Net::WebSocketException("No Upgrade: websocket header in handshake response"s, Poco::Net::WebSocket::WS_ERR_NO_HANDSHAKE);
+		if (response.get("Sec-WebSocket-Accept"s, ""s) != WebSocketHandshake::computeAccept(_key))
+			throw Poco::Net::WebSocketException("Invalid or missing Sec-WebSocket-Accept header in handshake response"s, Poco::Net::WebSocket::WS_ERR_HANDSHAKE_ACCEPT);
+
+		if (!_forwarder.processUpgradeResponse(response, _maxFrameSize))
+		{
+			close(dispatcher);
+			return;
+		}
+
+		// The WebSocket shares the socket descriptor with the
+		// remote socket, which therefore must be removed first.
+		_state = ST_DONE;
+		dispatcher.removeSocket(_remoteSocket);
+
+		Poco::Net::HTTPClientSession session(_remoteSocket);
+		Poco::Net::WebSocketImpl* pImpl = new Poco::Net::WebSocketImpl(static_cast<Poco::Net::StreamSocketImpl*>(session.detachSocket().impl()), session, true);
+		Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket = new Poco::Net::WebSocket(Poco::Net::StreamSocket(pImpl));
+		Poco::Net::WebSocketDeflate::Params deflateParams;
+		if (Poco::Net::WebSocketDeflate::accept(response.get(SEC_WEBSOCKET_EXTENSIONS, ""s), _offeredExtensions, deflateParams))
+		{
+			pImpl->enableDeflate(deflateParams);
+		}
+		_forwarder.configureWebSocket(*pWebSocket);
+		_forwarder.forwardWebSocket(_localSocket, pWebSocket, _maxFrameSize);
+	}
+
+	void waitFor(SocketDispatcher& dispatcher, int rc, int mode)
+	{
+		// A secure socket reports whether the TLS layer must
+		// receive or send data before the operation can continue.
+		if (_secure && rc == TLS_WANT_READ)
+			mode = Poco::Net::PollSet::POLL_READ;
+		else if (_secure && rc == TLS_WANT_WRITE)
+			mode = Poco::Net::PollSet::POLL_WRITE;
+		if (mode != _mode)
+		{
+			_mode = mode;
+			dispatcher.updateSocket(_remoteSocket, mode, _forwarder._connectTimeout);
+		}
+	}
+
+	void fail(SocketDispatcher& dispatcher, const std::string& message)
+	{
+		_forwarder._logger.error("Failed to open forwarding connection: %s"s, message);
+		close(dispatcher);
+	}
+
+	void close(SocketDispatcher& dispatcher)
+	{
+		_state = ST_DONE;
+		dispatcher.closeSocket(_remoteSocket);
+		_localSocket.close();
+	}
+
+private:
+	enum State
+	{
+		ST_CONNECTING,
+		ST_SENDING,
+		ST_RECEIVING,
+		ST_DONE
+	};
+
+	enum
+	{
+#if defined(WEBTUNNEL_ENABLE_TLS)
+		TLS_WANT_READ = Poco::Net::SecureStreamSocket::ERR_SSL_WANT_READ,
+		TLS_WANT_WRITE = Poco::Net::SecureStreamSocket::ERR_SSL_WANT_WRITE,
+#else
+		// Secure sockets can still be created by a SocketFactory
+		// provided by the application, which must use the same
+		// values as Poco::Net::SecureStreamSocket.
+		TLS_WANT_READ = -1,
+		TLS_WANT_WRITE = -2,
+#endif
+		RECEIVE_BUFFER_SIZE = 1024,
+		MAX_RESPONSE_SIZE = 16384    /// maximum size of the response header
+	};
+
+	static const std::string SEC_WEBSOCKET_EXTENSIONS;
+
+	LocalPortForwarder& _forwarder;
+	Poco::Net::StreamSocket _localSocket;
+	Poco::Net::StreamSocket _remoteSocket;
+	bool _secure;
+	std::size_t _maxFrameSize;
+	std::string _key;
+	std::string _offeredExtensions;
+	std::string _request;
+	std::size_t _sent = 0;
+	std::string _response;
+	int _matched = 0;
+	State _state = ST_CONNECTING;
+	int _mode = Poco::Net::PollSet::POLL_WRITE;
+};
+
+
+const std::string LocalPortForwarder::AsyncConnector::SEC_WEBSOCKET_EXTENSIONS("Sec-WebSocket-Extensions");
+
+
 //
 // LocalPortForwarder
 //
@@ -435,6 +1026,8 @@ private:
 const std::string LocalPortForwarder::SEC_WEBSOCKET_PROTOCOL("Sec-WebSocket-Protocol");
 const std::string LocalPortForwarder::X_WEBTUNNEL_REMOTEPORT("X-WebTunnel-RemotePort");
 const std::string LocalPortForwarder::X_WEBTUNNEL_KEEPALIVE("X-WebTunnel-KeepAlive");
+const std::string LocalPortForwarder::X_WEBTUNNEL_MAXFRAMESIZE("X-WebTunnel-MaxFrameSize");
+const std::string LocalPortForwarder::X_WEBTUNNEL_CAPABILITIES("X-WebTunnel-Capabilities");
 const std::string LocalPortForwarder::WEBTUNNEL_PROTOCOL("com.appinf.webtunnel.client/1.0");
 
 
@@ -443,7 +1036,14 @@ LocalPortForwarder::LocalPortForwarder(Poco::UInt16 localPort, Poco::UInt16 remo
 	_remotePort(remotePort),
 	_remoteURI(remoteURI),
 	_localTimeout(0),
-	_remoteTimeout(300, 0),
+	_remoteTimeout(300*Poco::Timespan::SECONDS),
+	_connectTimeout(30, 0),
+	_maxFrameSize(Protocol::WT_FRAME_PREFERRED_SIZE),
+	_webSocketDeflate(false),
+	_multiplexing(false),
+	_multiplexSupported(true),
+	_multiplexerConnecting(false),
+	_remoteAddressValid(false),
 	_pWebSocketFactory(pWebSocketFactory),
 	_serverSocket(_localAddr),
 	_tcpServer(new LocalPortForwarderConnectionFactory(*this), _serverSocket),
@@ -460,7 +1060,14 @@ LocalPortForwarder::LocalPortForwarder(const Poco::Net::SocketAddress& localAddr
 	_remotePort(remotePort),
 	_remoteURI(remoteURI),
 	_localTimeout(0),
-	_remoteTimeout(300, 0),
+	_remoteTimeout(300*Poco::Timespan::SECONDS),
+	_connectTimeout(30, 0),
+	_maxFrameSize(Protocol::WT_FRAME_PREFERRED_SIZE),
+	_webSocketDeflate(false),
+	_multiplexing(false),
+	_multiplexSupported(true),
+	_multiplexerConnecting(false),
+	_remoteAddressValid(false),
 	_pWebSocketFactory(pWebSocketFactory),
 	_serverSocket(_localAddr),
 	_tcpServer(new LocalPortForwarderConnectionFactory(*this), _serverSocket, pServerParams),
@@ -477,6 +1084,15 @@ LocalPortForwarder::~LocalPortForwarder()
 	try
 	{
 		_tcpServer.stop();
+		if (_pWebSocketPool) _pWebSocketPool->stop();
+		{
+			Poco::FastMutex::ScopedLock lock(_multiplexerMutex);
+			while (_multiplexerConnecting)
+			{
+				_multiplexerReady.wait(_multiplexerMutex);
+			}
+			if (_pMultiplexer) _pMultiplexer->close();
+		}
 		_pDispatcher->stop();
 	}
 	catch (...)
@@ -494,7 +1110,7 @@ void LocalPortForwarder::setLocalTimeout(Poco::Timespan timeout)
 
 void LocalPortForwarder::setRemoteTimeout(Poco::Timespan timeout)
 {
-	_remoteTimeout = timeout;
+	_remoteTimeout = timeout.totalMicroseconds();
 }
 
 
@@ -504,6 +1120,51 @@ void LocalPortForwarder::setCloseTimeout(Poco::Timespan timeout)
 }
 
 
+void LocalPortForwarder::setConnectTimeout(Poco::Timespan timeout)
+{
+	_connectTimeout = timeout;
+}
+
+
+void LocalPortForwarder::setMaxFrameSize(std::size_t size)
+{
+	_maxFrameSize = Protocol::offeredFrameSize(size);
+}
+
+
+void LocalPortForwarder::enableWebSocketDeflate(const Poco::Net::WebSocketDeflate::Params& params)
+{
+	_webSocketDeflate = true;
+	_deflateParams = params;
+}
+
+
+void LocalPortForwarder::enableMultiplexing(bool enable)
+{
+	_multiplexing = enable;
+}
+
+
+void LocalPortForwarder::enableWebSocketPool(std::size_t size, Poco::Timespan idleTimeout, Poco::Timespan pingInterval)
+{
+	if (_pWebSocketPool) _pWebSocketPool->stop();
+	_pWebSocketPool = new WebSocketPool(*this, size, idleTimeout, pingInterval);
+	_pWebSocketPool->start();
+}
+
+
+std::size_t LocalPortForwarder::webSocketPoolSize() const
+{
+	return _pWebSocketPool ? _pWebSocketPool->size() : 0;
+}
+
+
+std::size_t LocalPortForwarder::pooledWebSockets() const
+{
+	return _pWebSocketPool ? _pWebSocketPool->available() : 0;
+}
+
+
 void LocalPortForwarder::forward(Poco::Net::StreamSocket& socket)
 {
 	if (_logger.debug())
@@ -512,65 +1173,305 @@ void LocalPortForwarder::forward(Poco::Net::StreamSocket& socket)
 	}
 	try
 	{
-		std::string path(_remoteURI.getPathEtc());
-		if (path.empty()) path = "/";
-		Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, path, Poco::Net::HTTPRequest::HTTP_1_1);
-		request.set(SEC_WEBSOCKET_PROTOCOL, WEBTUNNEL_PROTOCOL);
-		request.set(X_WEBTUNNEL_REMOTEPORT, Poco::NumberFormatter::format(_remotePort));
-		request.set(X_WEBTUNNEL_KEEPALIVE, Poco::NumberFormatter::format(_remoteTimeout.totalSeconds()));
+		if (_multiplexing && forwardMultiplexed(socket)) return;
+
+		WebSocketPool::Entry entry;
+		if (_pWebSocketPool && _pWebSocketPool->take(entry))
+		{
+			_logger.debug("Using pooled WebSocket."s);
+			if (!entry.pending.empty())
+			{
+				socket.sendBytes(entry.pending.data(), static_cast<int>(entry.pending.size()));
+			}
+			forwardWebSocket(socket, entry.pWebSocket, entry.maxFrameSize);
+			return;
+		}
+
+		if (forwardAsync(socket)) return;
+
+		Poco::Net::HTTPResponse response;
+		std::size_t maxFrameSize;
+		Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket = createWebSocket(0, response, maxFrameSize);
+		if (pWebSocket)
+		{
+			forwardWebSocket(socket, pWebSocket, maxFrameSize);
+		}
+		else
+		{
+			socket.close();
+		}
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.error("Failed to open forwarding connection: %s"s, exc.displayText());
+		socket.close();
+	}
+}
+
+
+bool LocalPortForwarder::forwardMultiplexed(Poco::Net::StreamSocket& socket)
+{
+	ChannelMultiplexer::Ptr pMultiplexer;
+	{
+		Poco::FastMutex::ScopedLock lock(_multiplexerMutex);
+
+		for (;;)
+		{
+			if (!_multiplexSupported) return false;
+			if (_pMultiplexer && _pMultiplexer->isOpen())
+			{
+				pMultiplexer = _pMultiplexer;
+				break;
+			}
+			if (!_multiplexerConnecting)
+			{
+				_pMultiplexer.reset();
+				_multiplexerConnecting = true;
+				break;
+			}
+			// Local connections accepted while the WebSocket is being created
+			// wait for it, instead of creating WebSockets of their own.
+			_multiplexerReady.wait(_multiplexerMutex);
+		}
+	}
+
+	if (!pMultiplexer)
+	{
+		// The WebSocket is created without holding the mutex, so that
+		// multiplexed() and the destructor do not block while connecting.
+		Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket;
 		Poco::Net::HTTPResponse response;
-		Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket = _pWebSocketFactory->createWebSocket(_remoteURI, request, response);
-		if (response.get(SEC_WEBSOCKET_PROTOCOL, ""s) != WEBTUNNEL_PROTOCOL)
-		{
-			_logger.error("The remote host does not support the WebTunnel protocol."s);
-			pWebSocket->shutdown(Poco::Net::WebSocket::WS_PROTOCOL_ERROR);
-			pWebSocket->shutdownSend();
-			pWebSocket->setBlocking(false);
-			if (pWebSocket->poll(_closeTimeout, Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_WRITE))
+		std::size_t maxFrameSize;
+		bool supported = true;
+		try
+		{
+			pWebSocket = createWebSocket(Protocol::WT_CAP_MULTIPLEX | Protocol::WT_CAP_BATCH | Protocol::WT_CAP_FLOW_CONTROL, response, maxFrameSize);
+			if (pWebSocket)
 			{
-				try
+				int peerCapabilities = Protocol::parseCapabilities(response.get(X_WEBTUNNEL_CAPABILITIES, ""s));
+				if (peerCapabilities & Protocol::WT_CAP_MULTIPLEX)
 				{
-					Poco::Buffer<char> buffer(0);
-					int flags;
-					int n = pWebSocket->receiveFrame(buffer, flags);
-					if (n > 0 && (flags & Poco::Net::WebSocket::FRAME_OP_CLOSE) == 0)
+					_logger.debug("Created multiplexed WebSocket connection."s);
+					pMultiplexer = new ChannelMultiplexer(_pDispatcher, pWebSocket, maxFrameSize, getRemoteTimeout());
+					pMultiplexer->setLocalTimeout(_localTimeout);
+					pMultiplexer->setCloseTimeout(_closeTimeout);
+					if (peerCapabilities & Protocol::WT_CAP_FLOW_CONTROL)
 					{
-						_logger.warning("Unexpected data frame received after closing WebSocket connection."s);
+						_logger.debug("Using flow control for multiplexed connections."s);
+						pMultiplexer->enableFlowControl();
 					}
+					pMultiplexer->start();
 				}
-				catch (Poco::Exception&)
+				else
 				{
+					_logger.information("The remote host does not support multiplexing, using a separate WebSocket for every connection."s);
+					supported = false;
 				}
 			}
-			pWebSocket->close();
+		}
+		catch (...)
+		{
+			Poco::FastMutex::ScopedLock lock(_multiplexerMutex);
+			_multiplexerConnecting = false;
+			_multiplexerReady.broadcast();
+			throw;
+		}
+		{
+			Poco::FastMutex::ScopedLock lock(_multiplexerMutex);
+			_pMultiplexer = pMultiplexer;
+			if (!supported) _multiplexSupported = false;
+			_multiplexerConnecting = false;
+			_multiplexerReady.broadcast();
+		}
+		if (!supported)
+		{
+			forwardWebSocket(socket, pWebSocket, maxFrameSize);
+			return true;
+		}
+		if (!pMultiplexer)
+		{
 			socket.close();
-			return;
+			return true;
 		}
+	}
+	if (!pMultiplexer->openChannel(socket, _remotePort))
+	{
+		_logger.error("Failed to open channel for forwarding connection."s);
+		socket.close();
+	}
+	return true;
+}
+
+
+bool LocalPortForwarder::forwardAsync(Poco::Net::StreamSocket& socket)
+{
+	// Connections through a proxy server are always
+	// created by the WebSocketFactory.
+	if (!Poco::Net::HTTPClientSession::getGlobalProxyConfig().host.empty()) return false;
+
+	Poco::Net::HTTPRequest request;
+	std::size_t maxFrameSize;
+	prepareUpgradeRequest(request, 0, maxFrameSize);
+	if (!_pWebSocketFactory->prepareRequest(_remoteURI, request)) return false;
+	std::unique_ptr<Poco::Net::StreamSocket> pRemoteSocket(_pWebSocketFactory->createSocket(_remoteURI));
+	if (!pRemoteSocket) return false;
+
+	const bool secure = _remoteURI.getScheme() == "https"s || _remoteURI.getScheme() == "wss"s;
+	request.setHost(_remoteURI.getHost(), _remoteURI.getPort());
+	try
+	{
+		pRemoteSocket->connectNB(remoteAddress());
+	}
+	catch (Poco::Exception&)
+	{
+		resetRemoteAddress();
+		throw;
+	}
+	_pDispatcher->addSocketAsync(*pRemoteSocket, new AsyncConnector(*this, socket, *pRemoteSocket, secure, request, maxFrameSize), Poco::Net::PollSet::POLL_WRITE, _connectTimeout);
+	return true;
+}
 
-		if (response.has(X_WEBTUNNEL_KEEPALIVE))
+
+bool LocalPortForwarder::multiplexed()
+{
+	return _multiplexing && _multiplexSupported;
+}
+
+
+Poco::SharedPtr<Poco::Net::WebSocket> LocalPortForwarder::createWebSocket(int capabilities, Poco::Net::HTTPResponse& response, std::size_t& maxFrameSize)
+{
+	Poco::Net::HTTPRequest request;
+	prepareUpgradeRequest(request, capabilities, maxFrameSize);
+	Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket = _pWebSocketFactory->createWebSocket(_remoteURI, request, response);
+	if (!processUpgradeResponse(response, maxFrameSize))
+	{
+		pWebSocket->shutdown(Poco::Net::WebSocket::WS_PROTOCOL_ERROR);
+		pWebSocket->shutdownSend();
+		pWebSocket->setBlocking(false);
+		if (pWebSocket->poll(_closeTimeout, Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_WRITE))
 		{
-			int keepAlive = Poco::NumberParser::parse(response.get(X_WEBTUNNEL_KEEPALIVE));
-			_remoteTimeout.assign(keepAlive, 0);
-			_logger.debug("Server has requested a keep-alive timeout (remoteTimeout) of %d seconds."s, keepAlive);
+			try
+			{
+				Poco::Buffer<char> buffer(0);
+				int flags;
+				int n = pWebSocket->receiveFrame(buffer, flags);
+				if (n > 0 && (flags & Poco::Net::WebSocket::FRAME_OP_CLOSE) == 0)
+				{
+					_logger.warning("Unexpected data frame received after closing WebSocket connection."s);
+				}
+			}
+			catch (Poco::Exception&)
+			{
+			}
 		}
+		pWebSocket->close();
+		return Poco::SharedPtr<Poco::Net::WebSocket>();
+	}
+	configureWebSocket(*pWebSocket);
+	return pWebSocket;
+}
 
-		Poco::SharedPtr<ConnectionPair> pConnectionPair = new ConnectionPair(*pWebSocket, socket, _closeTimeout);
 
-		socket.setNoDelay(true);
-		socket.setBlocking(false);
-		_pDispatcher->addSocket(socket, new StreamSocketToWebSocketForwarder(_pDispatcher, pConnectionPair), 0, _localTimeout);
+void LocalPortForwarder::prepareUpgradeRequest(Poco::Net::HTTPRequest& request, int capabilities, std::size_t& maxFrameSize)
+{
+	std::string path(_remoteURI.getPathEtc());
+	if (path.empty()) path = "/";
+	request.setMethod(Poco::Net::HTTPRequest::HTTP_POST);
+	request.setURI(path);
+	request.setVersion(Poco::Net::HTTPRequest::HTTP_1_1);
+	request.set(SEC_WEBSOCKET_PROTOCOL, WEBTUNNEL_PROTOCOL);
+	request.set(X_WEBTUNNEL_REMOTEPORT, Poco::NumberFormatter::format(_remotePort));
+	request.set(X_WEBTUNNEL_KEEPALIVE, Poco::NumberFormatter::format(getRemoteTimeout().totalSeconds()));
+	if (capabilities)
+	{
+		request.set(X_WEBTUNNEL_CAPABILITIES, Protocol::formatCapabilities(capabilities));
+	}
+	maxFrameSize = _maxFrameSize;
+	if (maxFrameSize > Protocol::WT_FRAME_MAX_SIZE)
+	{
+		request.set(X_WEBTUNNEL_MAXFRAMESIZE, Poco::NumberFormatter::format(maxFrameSize));
+	}
+	if (_webSocketDeflate)
+	{
+		Poco::Net::WebSocket::offerDeflate(request, _deflateParams);
+	}
+}
 
-		pWebSocket->setNoDelay(true);
-		pWebSocket->setBlocking(false);
-		_pDispatcher->addSocket(*pWebSocket, new WebSocketToStreamSocketForwarder(_pDispatcher, pConnectionPair), Poco::Net::PollSet::POLL_READ, _remoteTimeout);
 
-		_pDispatcher->updateSocket(socket, Poco::Net::PollSet::POLL_READ);
+bool LocalPortForwarder::processUpgradeResponse(const Poco::Net::HTTPResponse& response, std::size_t& maxFrameSize)
+{
+	if (response.get(SEC_WEBSOCKET_PROTOCOL, ""s) != WEBTUNNEL_PROTOCOL)
+	{
+		_logger.error("The remote host does not support the WebTunnel protocol."s);
+		return false;
 	}
-	catch (Poco::Exception& exc)
+
+	if (response.has(X_WEBTUNNEL_KEEPALIVE))
 	{
-		_logger.error("Failed to open forwarding connection: %s"s, exc.displayText());
-		socket.close();
+		int keepAlive = Poco::NumberParser::parse(response.get(X_WEBTUNNEL_KEEPALIVE));
+		_remoteTimeout = Poco::Timespan(keepAlive, 0).totalMicroseconds();
+		_logger.debug("Server has requested a keep-alive timeout (remoteTimeout) of %d seconds."s, keepAlive);
 	}
+
+	maxFrameSize = Protocol::negotiatedFrameSize(response.get(X_WEBTUNNEL_MAXFRAMESIZE, ""s), maxFrameSize);
+	if (maxFrameSize > Protocol::WT_FRAME_MAX_SIZE)
+	{
+		_logger.debug("Using a maximum frame size of %z bytes."s, maxFrameSize);
+	}
+	return true;
+}
+
+
+void LocalPortForwarder::configureWebSocket(Poco::Net::WebSocket& webSocket)
+{
+	if (webSocket.deflateEnabled())
+	{
+		webSocket.setCompressionLevel(_deflateParams.compressionLevel);
+		_logger.debug("Using permessage-deflate WebSocket compression."s);
+	}
+	else if (_webSocketDeflate)
+	{
+		_logger.debug("The remote host does not support permessage-deflate WebSocket compression."s);
+	}
+}
+
+
+Poco::Net::SocketAddress LocalPortForwarder::remoteAddress()
+{
+	Poco::FastMutex::ScopedLock lock(_remoteAddressMutex);
+
+	if (!_remoteAddressValid || _remoteAddressResolved.isElapsed(Poco::Clock::ClockDiff(ADDRESS_CACHE_TTL)*Poco::Clock::resolution()))
+	{
+		_remoteAddress = Poco::Net::SocketAddress(_remoteURI.getHost(), _remoteURI.getPort());
+		_remoteAddressResolved.update();
+		_remoteAddressValid = true;
+	}
+	return _remoteAddress;
+}
+
+
+void LocalPortForwarder::resetRemoteAddress()
+{
+	Poco::FastMutex::ScopedLock lock(_remoteAddressMutex);
+
+	_remoteAddressValid = false;
+}
+
+
+void LocalPortForwarder::forwardWebSocket(Poco::Net::StreamSocket& socket, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, std::size_t maxFrameSize)
+{
+	Poco::SharedPtr<ConnectionPair> pConnectionPair = new ConnectionPair(*pWebSocket, socket, _closeTimeout);
+	pConnectionPair->maxFrameSize = maxFrameSize;
+
+	socket.setNoDelay(true);
+	socket.setBlocking(false);
+	_pDispatcher->addSocketAsync(socket, new StreamSocketToWebSocketForwarder(_pDispatcher, pConnectionPair), 0, _localTimeout);
+
+	pWebSocket->setNoDelay(true);
+	pWebSocket->setBlocking(false);
+	_pDispatcher->addSocketAsync(*pWebSocket, new WebSocketToStreamSocketForwarder(_pDispatcher, pConnectionPair), Poco::Net::PollSet::POLL_READ, getRemoteTimeout(), socket);
+
+	_pDispatcher->updateSocketAsync(socket, Poco::Net::PollSet::POLL_READ);
 }
 
 
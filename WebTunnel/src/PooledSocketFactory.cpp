@@ -0,0 +1,261 @@
+//
+// PooledSocketFactory.cpp
+//
+// Library: WebTunnel
+// Package: WebTunnel
+// Module:  PooledSocketFactory
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// All rights reserved.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "Poco/WebTunnel/PooledSocketFactory.h"
+#include "Poco/Net/SocketAddress.h"
+#include "Poco/Exception.h"
+#include <algorithm>
+#include <iterator>
+
+
+using namespace std::string_literals;
+
+
+namespace Poco {
+namespace WebTunnel {
+
+
+PooledSocketFactory::PooledSocketFactory(SocketFactory::Ptr pFactory, const Poco::Net::IPAddress& host, const std::set<Poco::UInt16>& ports, std::size_t poolSize, Poco::Timespan idleTimeout, Poco::Timespan connectTimeout):
+	_pFactory(pFactory),
+	_host(host),
+	_poolSize(poolSize),
+	_idleTimeout(idleTimeout),
+	_connectTimeout(connectTimeout),
+	_logger(Poco::Logger::get("WebTunnel.PooledSocketFactory"s))
+{
+	poco_check_ptr (pFactory);
+
+	for (auto port: ports)
+	{
+		_pools[port];
+	}
+	_thread.setName("PooledSocketFactory"s);
+}
+
+
+PooledSocketFactory::~PooledSocketFactory()
+{
+	try
+	{
+		stop();
+	}
+	catch (...)
+	{
+		poco_unexpected();
+	}
+}
+
+
+void PooledSocketFactory::start()
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	if (!_stopped || _poolSize == 0) return;
+	_stopped = false;
+	_thread.start(*this);
+}
+
+
+void PooledSocketFactory::stop()
+{
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		if (_stopped) return;
+		_stopped = true;
+		for (auto& p: _pools)
+		{
+			p.second.sockets.clear();
+		}
+	}
+	_wakeUp.set();
+	_thread.join();
+}
+
+
+std::size_t PooledSocketFactory::available(Poco::UInt16 port) const
+{
+	Poco::FastMutex::ScopedLock lock(_mutex);
+
+	auto it = _pools.find(port);
+	if (it != _pools.end())
+		return it->second.sockets.size();
+	else
+		return 0;
+}
+
+
+Poco::Net::StreamSocket PooledSocketFactory::createSocket(const Poco::Net::SocketAddress& addr)
+{
+	if (addr.host() == _host)
+	{
+		// The set of pooled ports never changes, so it can be searched without a lock.
+		auto it = _pools.find(addr.port());
+		if (it != _pools.end())
+		{
+			Pool& pool = it->second;
+			for (;;)
+			{
+				PooledSocket pooled;
+				{
+					Poco::FastMutex::ScopedLock lock(_mutex);
+
+					if (!pool.enabled || pool.sockets.empty()) break;
+					// The most recently connected socket is the least likely
+					// to have been closed by the server in the meantime.
+					pooled = pool.sockets.back();
+					pool.sockets.pop_back();
+				}
+				// Checking the socket needs system calls, so the lock is not held.
+				SocketState state = socketState(pooled);
+				if (state == SS_USABLE)
+				{
+					_wakeUp.set();
+					return pooled.socket;
+				}
+				else if (state == SS_GREETING)
+				{
+					Poco::FastMutex::ScopedLock lock(_mutex);
+
+					disable(addr.port(), pool);
+					break;
+				}
+			}
+			_wakeUp.set();
+		}
+	}
+	return _pFactory->createSocket(addr);
+}
+
+
+void PooledSocketFactory::run()
+{
+	const long checkInterval = static_cast<long>((std::max)(_idleTimeout.totalMilliseconds()/4, Poco::Timespan::TimeDiff(100)));
+
+	for (;;)
+	{
+		bool ok = true;
+		for (const auto& p: _pools)
+		{
+			// The set of pooled ports never changes, so it can be iterated without a lock.
+			if (!refill(p.first)) ok = false;
+		}
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			if (_stopped) return;
+		}
+		_wakeUp.tryWait(ok ? checkInterval : static_cast<long>(RETRY_DELAY));
+	}
+}
+
+
+bool PooledSocketFactory::refill(Poco::UInt16 port)
+{
+	std::deque<PooledSocket> sockets;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		Pool& pool = _pools[port];
+		if (_stopped || !pool.enabled) return true;
+		sockets.swap(pool.sockets);
+	}
+
+	// Checking the sockets needs system calls, so the lock is not held.
+	// In the meantime, createSocket() finds the pool empty and connects
+	// a new socket instead.
+	bool greeting = false;
+	for (auto it = sockets.begin(); it != sockets.end() && !greeting;)
+	{
+		SocketState state = socketState(*it);
+		if (state == SS_USABLE)
+			++it;
+		else if (state == SS_EXPIRED)
+			it = sockets.erase(it);
+		else
+			greeting = true;
+	}
+
+	std::size_t missing;
+	{
+		Poco::FastMutex::ScopedLock lock(_mutex);
+
+		Pool& pool = _pools[port];
+		if (_stopped || !pool.enabled) return true;
+		if (greeting)
+		{
+			disable(port, pool);
+			return true;
+		}
+		// Only this thread adds sockets, so the checked ones are the oldest.
+		pool.sockets.insert(pool.sockets.begin(), std::make_move_iterator(sockets.begin()), std::make_move_iterator(sockets.end()));
+		missing = _poolSize - (std::min)(pool.sockets.size(), _poolSize);
+	}
+
+	while (missing-- > 0)
+	{
+		try
+		{
+			PooledSocket pooled;
+			pooled.socket = _pFactory->createConnectedSocket(Poco::Net::SocketAddress(_host, port), _connectTimeout);
+
+			Poco::FastMutex::ScopedLock lock(_mutex);
+			if (_stopped) return true;
+			_pools[port].sockets.push_back(pooled);
+		}
+		catch (Poco::Exception& exc)
+		{
+			_logger.debug("Failed to connect pooled socket to port %hu: %s"s, port, exc.displayText());
+			return false;
+		}
+	}
+	return true;
+}
+
+
+PooledSocketFactory::SocketState PooledSocketFactory::socketState(PooledSocket& pooled) const
+{
+	if (pooled.created.isElapsed(_idleTimeout.totalMicroseconds())) return SS_EXPIRED;
+	try
+	{
+		if (!pooled.socket.poll(Poco::Timespan(0), Poco::Net::Socket::SELECT_READ | Poco::Net::Socket::SELECT_ERROR))
+		{
+			return SS_USABLE;
+		}
+		// Readable: the server has either closed the connection or sent data.
+		// Nothing is received with TLS if only a session ticket has arrived.
+		char ch;
+		int n = pooled.socket.receiveBytes(&ch, 1, MSG_PEEK);
+		if (n > 0)
+			return SS_GREETING;
+		else if (n == 0)
+			return SS_EXPIRED;
+		else
+			return SS_USABLE;
+	}
+	catch (Poco::Exception&)
+	{
+		return SS_EXPIRED;
+	}
+}
+
+
+void PooledSocketFactory::disable(Poco::UInt16 port, Pool& pool)
+{
+	_logger.warning("Server at port %hu sends data before the client, disabling socket pool for this port."s, port);
+	pool.enabled = false;
+	pool.sockets.clear();
+}
+
+
+} } // namespace Poco::WebTunnel
@@ -15,49 +15,85 @@
 
 
 #include "Poco/WebTunnel/Protocol.h"
-#include "Poco/BinaryWriter.h"
-#include "Poco/BinaryReader.h"
-#include "Poco/MemoryStream.h"
+#include "Poco/NumberParser.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/ByteOrder.h"
+#include <cstring>
+#include <algorithm>
+
+
+using namespace std::string_literals;
 
 
 namespace Poco {
 namespace WebTunnel {
 
 
-std::size_t Protocol::writeHeader(char* pBuffer, std::size_t bufferSize, Poco::UInt8 opcode, Poco::UInt8 flags, Poco::UInt16 channel, Poco::UInt16 portOrErrorCode)
+std::size_t Protocol::writeWindowUpdate(char* pBuffer, std::size_t bufferSize, Poco::UInt16 channel, Poco::UInt32 credit)
 {
-	Poco::MemoryOutputStream mos(pBuffer, static_cast<std::streamsize>(bufferSize));
-	Poco::BinaryWriter writer(mos, Poco::BinaryWriter::NETWORK_BYTE_ORDER);
-	writer << opcode << flags << channel;
-	switch (opcode)
+	poco_assert (bufferSize >= WT_WINDOW_UPDATE_SIZE);
+
+	std::size_t hn = writeHeader(pBuffer, bufferSize, WT_OP_WINDOW_UPDATE, 0, channel);
+	Poco::UInt32 value = Poco::ByteOrder::toNetwork(credit);
+	std::memcpy(pBuffer + hn, &value, sizeof(value));
+	return hn + sizeof(value);
+}
+
+
+bool Protocol::readWindowUpdate(const char* pBuffer, std::size_t bufferSize, Poco::UInt32& credit)
+{
+	if (bufferSize < WT_WINDOW_UPDATE_SIZE) return false;
+
+	Poco::UInt32 value;
+	std::memcpy(&value, pBuffer + WT_FRAME_HEADER_SIZE, sizeof(value));
+	credit = Poco::ByteOrder::fromNetwork(value);
+	return true;
+}
+
+
+std::string Protocol::formatCapabilities(int capabilities)
+{
+	std::string result;
+	const auto append = [&result](const std::string& name)
+	{
+		if (!result.empty()) result += ", ";
+		result += name;
+	};
+	if (capabilities & WT_CAP_BATCH) append("batch"s);
+	if (capabilities & WT_CAP_FLOW_CONTROL) append("flow-control"s);
+	if (capabilities & WT_CAP_MULTIPLEX) append("multiplex"s);
+	return result;
+}
+
+
+int Protocol::parseCapabilities(const std::string& capabilities)
+{
+	int result = 0;
+	Poco::StringTokenizer tok(capabilities, ","s, Poco::StringTokenizer::TOK_TRIM | Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+	for (const auto& capability: tok)
 	{
-	case WT_OP_OPEN_REQUEST:
-	case WT_OP_OPEN_FAULT:
-	case WT_OP_ERROR:
-		writer << portOrErrorCode;
-		break;
+		if (capability == "batch") result |= WT_CAP_BATCH;
+		else if (capability == "flow-control") result |= WT_CAP_FLOW_CONTROL;
+		else if (capability == "multiplex") result |= WT_CAP_MULTIPLEX;
 	}
-	return static_cast<std::size_t>(mos.charsWritten());
+	return result;
+}
+
+
+std::size_t Protocol::offeredFrameSize(std::size_t frameSize)
+{
+	return (std::min)((std::max)(frameSize, static_cast<std::size_t>(WT_FRAME_MAX_SIZE)), static_cast<std::size_t>(WT_FRAME_MAX_SIZE_LIMIT));
 }
 
 
-std::size_t Protocol::readHeader(const char* pBuffer, std::size_t bufferSize, Poco::UInt8& opcode, Poco::UInt8& flags, Poco::UInt16& channel, Poco::UInt16* pPortOrErrorCode)
+std::size_t Protocol::negotiatedFrameSize(const std::string& response, std::size_t offered)
 {
-	Poco::MemoryInputStream mis(pBuffer, static_cast<std::streamsize>(bufferSize));
-	Poco::BinaryReader reader(mis, Poco::BinaryReader::NETWORK_BYTE_ORDER);
-	reader >> opcode >> flags >> channel;
-	if (pPortOrErrorCode)
+	unsigned frameSize;
+	if (!response.empty() && Poco::NumberParser::tryParseUnsigned(response, frameSize))
 	{
-		switch (opcode)
-		{
-		case WT_OP_OPEN_REQUEST:
-		case WT_OP_OPEN_FAULT:
-		case WT_OP_ERROR:
-			reader >> *pPortOrErrorCode;
-			return 6;
-		}
+		return (std::min)(offeredFrameSize(frameSize), offeredFrameSize(offered));
 	}
-	return 4;
+	else return WT_FRAME_MAX_SIZE;
 }
 
 
@@ -19,8 +19,10 @@
 #include "Poco/BinaryWriter.h"
 #include "Poco/MemoryStream.h"
 #include "Poco/CountingStream.h"
+#include "Poco/Thread.h"
 #include <algorithm>
 #include <cstring>
+#include <vector>
 
 
 using namespace std::string_literals;
@@ -53,12 +55,131 @@ Poco::Net::StreamSocket SocketFactory::createSocket(const Poco::Net::SocketAddre
 }
 
 
+Poco::Net::StreamSocket SocketFactory::createConnectedSocket(const Poco::Net::SocketAddress& addr, Poco::Timespan timeout)
+{
+	Poco::Net::StreamSocket streamSocket;
+	streamSocket.connect(addr, timeout);
+	streamSocket.setBlocking(false);
+	return streamSocket;
+}
+
+
+//
+// RemotePortForwarder::ChannelTable
+//
+
+
+RemotePortForwarder::ChannelTable::ChannelTable()
+{
+	for (auto& page: _pages)
+	{
+		page.store(nullptr, std::memory_order_relaxed);
+	}
+}
+
+
+RemotePortForwarder::ChannelTable::~ChannelTable()
+{
+	removeAll();
+	for (auto& page: _pages)
+	{
+		delete page.load(std::memory_order_relaxed);
+	}
+}
+
+
+RemotePortForwarder::ChannelInfo::Ptr RemotePortForwarder::ChannelTable::find(Poco::UInt16 channel) const
+{
+	const Page* pPage = _pages[channel >> PAGE_SHIFT].load(std::memory_order_acquire);
+	if (!pPage) return ChannelInfo::Ptr();
+
+	// While readers is non-zero, remove() will not release the record,
+	// so its reference count can safely be incremented.
+	const Slot& slot = pPage->slots[channel & (PAGE_SIZE - 1)];
+	slot.readers.fetch_add(1);
+	ChannelInfo::Ptr pInfo(slot.pInfo.load(), true);
+	slot.readers.fetch_sub(1, std::memory_order_release);
+	return pInfo;
+}
+
+
+bool RemotePortForwarder::ChannelTable::insert(Poco::UInt16 channel, ChannelInfo::Ptr pInfo)
+{
+	poco_check_ptr (pInfo);
+
+	ChannelInfo* pExpected = nullptr;
+	if (slot(channel).pInfo.compare_exchange_strong(pExpected, pInfo.get()))
+	{
+		pInfo->duplicate(); // reference now owned by the slot
+		return true;
+	}
+	else return false;
+}
+
+
+RemotePortForwarder::ChannelInfo::Ptr RemotePortForwarder::ChannelTable::remove(Poco::UInt16 channel)
+{
+	Page* pPage = _pages[channel >> PAGE_SHIFT].load(std::memory_order_acquire);
+	if (!pPage) return ChannelInfo::Ptr();
+
+	return remove(pPage->slots[channel & (PAGE_SIZE - 1)]);
+}
+
+
+std::vector<RemotePortForwarder::ChannelInfo::Ptr> RemotePortForwarder::ChannelTable::removeAll()
+{
+	std::vector<ChannelInfo::Ptr> infos;
+	for (auto& page: _pages)
+	{
+		Page* pPage = page.load(std::memory_order_acquire);
+		if (!pPage) continue;
+		for (auto& slot: pPage->slots)
+		{
+			ChannelInfo::Ptr pInfo = remove(slot);
+			if (pInfo) infos.push_back(pInfo);
+		}
+	}
+	return infos;
+}
+
+
+RemotePortForwarder::ChannelTable::Slot& RemotePortForwarder::ChannelTable::slot(Poco::UInt16 channel)
+{
+	std::atomic<Page*>& page = _pages[channel >> PAGE_SHIFT];
+	Page* pPage = page.load(std::memory_order_acquire);
+	if (!pPage)
+	{
+		Page* pNewPage = new Page;
+		if (page.compare_exchange_strong(pPage, pNewPage))
+			pPage = pNewPage;
+		else
+			delete pNewPage;
+	}
+	return pPage->slots[channel & (PAGE_SIZE - 1)];
+}
+
+
+RemotePortForwarder::ChannelInfo::Ptr RemotePortForwarder::ChannelTable::remove(Slot& slot)
+{
+	ChannelInfo* pInfo = slot.pInfo.exchange(nullptr);
+	if (!pInfo) return ChannelInfo::Ptr();
+
+	// A concurrent find() may have loaded the pointer, but not yet
+	// incremented the reference count. This only takes a few instructions.
+	while (slot.readers.load() != 0)
+	{
+		Poco::Thread::yield();
+	}
+	return ChannelInfo::Ptr(pInfo); // takes over the slot's reference
+}
+
+
 //
 // RemotePortForwarder
 //
 
 
-RemotePortForwarder::RemotePortForwarder(SocketDispatcher& dispatcher, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, const Poco::Net::IPAddress& host, const std::set<Poco::UInt16>& ports, Poco::Timespan remoteTimeout, SocketFactory::Ptr pSocketFactory):
+RemotePortForwarder::RemotePortForwarder(SocketDispatcher& dispatcher, Poco::SharedPtr<Poco::Net::WebSocket> pWebSocket, const Poco::Net::IPAddress& host, const std::set<Poco::UInt16>& ports, Poco::Timespan remoteTimeout, SocketFactory::Ptr pSocketFactory, std::size_t maxFrameSize):
 	_dispatcher(dispatcher),
 	_pSocketFactory(pSocketFactory),
 	_pWebSocket(pWebSocket),
@@ -68,6 +189,10 @@ RemotePortForwarder::RemotePortForwarder(SocketDispatcher& dispatcher, Poco::Sha
 	_localTimeout(7200, 0),
 	_closeTimeout(2, 0),
 	_remoteTimeout(remoteTimeout),
+	_maxFrameSize(Protocol::offeredFrameSize(maxFrameSize)),
+	_batch(0),
+	_scheduler(_maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE),
+	_sendQueueLimit(SEND_QUEUE_FRAMES*(_maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE)),
 	_logger(Poco::Logger::get("WebTunnel.RemotePortForwarder"s))
 {
 	pWebSocket->setBlocking(false);
@@ -94,7 +219,7 @@ void RemotePortForwarder::stop()
 
 	if (_dispatcher.hasSocket(*_pWebSocket))
 	{
-		_dispatcher.queueTask(
+		_dispatcher.queueTask(*_pWebSocket,
 			[pSelf=this](SocketDispatcher& dispatcher)
 			{
 				pSelf->closeWebSocket(RPF_CLOSE_GRACEFUL, true);
@@ -154,13 +279,95 @@ const Poco::Timespan& RemotePortForwarder::remoteTimeout() const
 }
 
 
-void RemotePortForwarder::multiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer)
+std::size_t RemotePortForwarder::maxFrameSize() const
+{
+	return _maxFrameSize;
+}
+
+
+void RemotePortForwarder::setReadBudget(std::size_t budget)
+{
+	_readBudget = budget;
+	_dispatcher.updateSocket(*_pWebSocket, Poco::Net::PollSet::POLL_READ | edgeMode(), _remoteTimeout);
+}
+
+
+std::size_t RemotePortForwarder::getReadBudget() const
+{
+	return _readBudget;
+}
+
+
+void RemotePortForwarder::enableBatching(Poco::Timespan delay)
+{
+	Poco::FastMutex::ScopedLock lock(_batchMutex);
+
+	_batch.resize(_maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE, false);
+	_batchDelay = delay;
+	_batchEnabled = true;
+}
+
+
+bool RemotePortForwarder::batchingEnabled() const
+{
+	return _batchEnabled;
+}
+
+
+void RemotePortForwarder::enableFlowControl()
+{
+	_flowControl = true;
+}
+
+
+bool RemotePortForwarder::flowControlEnabled() const
+{
+	return _flowControl;
+}
+
+
+void RemotePortForwarder::enableCompression(int level)
+{
+	_compressionLevel = (std::min)((std::max)(level, 1), 9);
+}
+
+
+bool RemotePortForwarder::compressionEnabled() const
+{
+	return _compressionLevel > 0;
+}
+
+
+void RemotePortForwarder::setPortWeight(Poco::UInt16 port, unsigned weight)
+{
+	_portWeights[port] = (std::max)(weight, 1U);
+}
+
+
+unsigned RemotePortForwarder::getPortWeight(Poco::UInt16 port) const
+{
+	auto it = _portWeights.find(port);
+	if (it != _portWeights.end())
+		return it->second;
+	else
+		return 1;
+}
+
+
+int RemotePortForwarder::multiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::UInt16 channel, Poco::Buffer<char>& buffer)
 {
 	std::size_t hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_DATA, 0, channel);
+	std::size_t maxSize = buffer.size() - hn;
+	if (_flowControl)
+	{
+		maxSize = (std::min)(maxSize, sendCredit(channel));
+		if (maxSize == 0) return -1;
+	}
 	int n = 0;
 	try
 	{
-		n = socket.receiveBytes(buffer.begin() + hn, static_cast<int>(buffer.size() - hn));
+		n = socket.receiveBytes(buffer.begin() + hn, static_cast<int>(maxSize));
+		if (n > 0) dispatcher.countReceived(socket, n);
 		if (_logger.trace() && n >= 0)
 		{
 			_logger.dump(Poco::format("Received frame from device, channel=%hu, size=%d"s, channel, n), buffer.begin() + hn, (std::min)(n, 256), Poco::Message::PRIO_TRACE);
@@ -185,7 +392,7 @@ void RemotePortForwarder::multiplex(SocketDispatcher& dispatcher, Poco::Net::Str
 		else if (n < 0)
 		{
 			// polled readable, but no payload data received, as may happen with TLS
-			return;
+			return -1;
 		}
 	}
 	catch (Poco::Exception& exc)
@@ -200,18 +407,54 @@ void RemotePortForwarder::multiplex(SocketDispatcher& dispatcher, Poco::Net::Str
 		else
 		{
 			_logger.error("Error reading from locally forwarded socket for channel %hu: %s"s, channel, exc.displayText());
+			discardChannelFrames(channel);
 			hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_ERROR, 0, channel, Protocol::WT_ERR_SOCKET);
 		}
 	}
+	bool suspend = false;
 	try
 	{
-		dispatcher.sendBytes(*_pWebSocket, buffer.begin(), static_cast<int>(n + hn), Poco::Net::WebSocket::FRAME_BINARY);
+		ChannelCodec::Ptr pCodec;
+		if (n > 0 && _compressionLevel > 0) pCodec = channelCodec(channel);
+		if (pCodec && pCodec->compress(buffer.begin() + hn, n))
+		{
+			// In the rare case the compressed data does not fit into
+			// a single frame, the deflate stream continues in the next one.
+			const Poco::Buffer<char>& compressed = pCodec->compressed();
+			std::size_t offset = 0;
+			while (offset < compressed.size())
+			{
+				hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_DATA, Protocol::WT_FLAG_DEFLATE, channel);
+				std::size_t size = (std::min)(compressed.size() - offset, buffer.size() - hn);
+				std::memcpy(buffer.begin() + hn, compressed.begin() + offset, size);
+				if (!sendChannelFrame(channel, buffer.begin(), size + hn)) suspend = true;
+				offset += size;
+			}
+		}
+		else
+		{
+			suspend = !sendChannelFrame(channel, buffer.begin(), n + hn);
+		}
 	}
 	catch (Poco::Exception& exc)
 	{
 		_logger.error("Error sending WebSocket frame for channel %hu: %s"s, channel, exc.displayText());
 		closeWebSocket(RPF_CLOSE_ERROR, false);
+		return -1;
 	}
+	if (_flowControl && n > 0 && !consumeSendCredit(channel, n))
+	{
+		if (_logger.debug())
+		{
+			_logger.debug("Channel %hu is out of send credit, suspending."s, channel);
+		}
+		suspend = true;
+	}
+	if (suspend && n > 0)
+	{
+		dispatcher.updateSocket(socket, 0, _localTimeout);
+	}
+	return n;
 }
 
 
@@ -219,10 +462,11 @@ void RemotePortForwarder::multiplexError(SocketDispatcher& dispatcher, Poco::Net
 {
 	_logger.error("Error reading from local socket for channel %hu"s, channel);
 	removeChannel(channel);
+	discardChannelFrames(channel);
 	std::size_t hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_ERROR, 0, channel, Protocol::WT_ERR_SOCKET);
 	try
 	{
-		dispatcher.sendBytes(*_pWebSocket, buffer.begin(), static_cast<int>(hn), Poco::Net::WebSocket::FRAME_BINARY);
+		sendChannelFrame(channel, buffer.begin(), hn);
 	}
 	catch (Poco::Exception& exc)
 	{
@@ -237,10 +481,11 @@ void RemotePortForwarder::multiplexTimeout(SocketDispatcher& dispatcher, Poco::N
 	if (!(getChannelFlags(channel) & CF_CLOSED_LOCAL))
 	{
 		_logger.error("Timeout reading from local socket for channel %hu"s, channel);
+		discardChannelFrames(channel);
 		std::size_t hn = Protocol::writeHeader(buffer.begin(), buffer.size(), Protocol::WT_OP_ERROR, 0, channel, Protocol::WT_ERR_TIMEOUT);
 		try
 		{
-			dispatcher.sendBytes(*_pWebSocket, buffer.begin(), static_cast<int>(hn), Poco::Net::WebSocket::FRAME_BINARY);
+			sendChannelFrame(channel, buffer.begin(), hn);
 		}
 		catch (Poco::Exception& exc)
 		{
@@ -252,74 +497,35 @@ void RemotePortForwarder::multiplexTimeout(SocketDispatcher& dispatcher, Poco::N
 }
 
 
-void RemotePortForwarder::demultiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer)
+int RemotePortForwarder::demultiplex(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, Poco::Buffer<char>& buffer)
 {
 	int wsFlags;
 	int n = 0;
 	try
 	{
 		n = _pWebSocket->receiveFrame(buffer.begin(), static_cast<int>(buffer.size()), wsFlags);
+		if (n > 0) dispatcher.countReceived(socket, n);
 		if (_logger.trace() && n >= 0)
 		{
 			_logger.dump(Poco::format("Received WebSocket frame, size=%d, flags=%d"s, n, wsFlags), buffer.begin(), (std::min)(n, 256), Poco::Message::PRIO_TRACE);
 		}
-		if (n < 0) return;
+		if (n < 0) return -1;
 	}
 	catch (Poco::Exception& exc)
 	{
 		_logger.error("Error receiving WebSocket frame: %s"s, exc.displayText());
 		closeWebSocket(RPF_CLOSE_ERROR, false);
-		return;
+		return -1;
 	}
 	if ((wsFlags & Poco::Net::WebSocket::FRAME_OP_BITMASK) == Poco::Net::WebSocket::FRAME_OP_PONG)
 	{
 		_logger.debug("PONG received"s);
 		_timeoutCount = 0;
-		return;
+		return n;
 	}
 	if (n > 0 && (wsFlags & Poco::Net::WebSocket::FRAME_OP_BITMASK) == Poco::Net::WebSocket::FRAME_OP_BINARY)
 	{
-		Poco::UInt8 opcode;
-		Poco::UInt8 flags;
-		Poco::UInt16 channel;
-		Poco::UInt16 portOrErrorCode;
-		std::size_t hn = Protocol::readHeader(buffer.begin(), buffer.size(), opcode, flags, channel, &portOrErrorCode);
-		switch (opcode)
-		{
-		case Protocol::WT_OP_DATA:
-			forwardData(buffer.begin() + hn, static_cast<int>(n - hn), channel);
-			break;
-
-		case Protocol::WT_OP_OPEN_REQUEST:
-			openChannel(channel, portOrErrorCode);
-			break;
-
-		case Protocol::WT_OP_CLOSE:
-			if (_logger.debug())
-			{
-				_logger.debug("Remote peer shutting down channel %hu."s, channel);
-			}
-			if (setChannelFlag(channel, CF_CLOSED_REMOTE) & CF_CLOSED_LOCAL)
-			{
-				_logger.debug("Channel %hu also already been shut down by local peer."s, channel);
-				removeChannel(channel);
-			}
-			else
-			{
-				shutdownSendChannel(channel);
-			}
-			break;
-
-		case Protocol::WT_OP_ERROR:
-			_logger.error("Status %hu reported by peer. Closing channel %hu."s, portOrErrorCode, channel);
-			removeChannel(channel);
-			break;
-
-		default:
-			_logger.error("Invalid WebSocket frame received (bad opcode: %hu)."s, static_cast<Poco::UInt16>(opcode));
-			sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
-			break;
-		}
+		processFrame(buffer.begin(), n, true);
 	}
 	else if (n == 0 && wsFlags == 0)
 	{
@@ -336,6 +542,7 @@ void RemotePortForwarder::demultiplex(SocketDispatcher& dispatcher, Poco::Net::S
 		{
 			closeWebSocket(RPF_CLOSE_ERROR, false);
 		}
+		return -1;
 	}
 	else if (n == 0 && (wsFlags & Poco::Net::WebSocket::FRAME_OP_BITMASK) == Poco::Net::WebSocket::FRAME_OP_CLOSE)
 	{
@@ -349,11 +556,100 @@ void RemotePortForwarder::demultiplex(SocketDispatcher& dispatcher, Poco::Net::S
 		{
 			closeWebSocket(RPF_CLOSE_GRACEFUL, true);
 		}
+		return -1;
 	}
 	else
 	{
 		_logger.debug("Ignoring unsupported frame opcode."s);
 	}
+	return n;
+}
+
+
+void RemotePortForwarder::processFrame(const char* buffer, std::size_t size, bool allowBatch)
+{
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+	Poco::UInt16 portOrErrorCode;
+	std::size_t hn = Protocol::readHeader(buffer, size, opcode, flags, channel, &portOrErrorCode);
+	if (hn == 0)
+	{
+		_logger.error("Invalid WebSocket frame received (truncated header)."s);
+		sendResponse(0, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+		return;
+	}
+	switch (opcode)
+	{
+	case Protocol::WT_OP_DATA:
+		forwardData(buffer + hn, static_cast<int>(size - hn), channel, (flags & Protocol::WT_FLAG_DEFLATE) != 0);
+		break;
+
+	case Protocol::WT_OP_OPEN_REQUEST:
+		openChannel(channel, portOrErrorCode, (flags & Protocol::WT_FLAG_DEFLATE) != 0);
+		break;
+
+	case Protocol::WT_OP_CLOSE:
+		if (_logger.debug())
+		{
+			_logger.debug("Remote peer shutting down channel %hu."s, channel);
+		}
+		if (setChannelFlag(channel, CF_CLOSED_REMOTE) & CF_CLOSED_LOCAL)
+		{
+			_logger.debug("Channel %hu also already been shut down by local peer."s, channel);
+			removeChannel(channel);
+		}
+		else
+		{
+			shutdownSendChannel(channel);
+		}
+		break;
+
+	case Protocol::WT_OP_ERROR:
+		_logger.error("Status %hu reported by peer. Closing channel %hu."s, portOrErrorCode, channel);
+		removeChannel(channel);
+		discardChannelFrames(channel);
+		break;
+
+	case Protocol::WT_OP_WINDOW_UPDATE:
+		{
+			Poco::UInt32 credit;
+			if (Protocol::readWindowUpdate(buffer, size, credit))
+			{
+				updateWindow(channel, credit);
+			}
+			else
+			{
+				_logger.error("Invalid WebSocket frame received (truncated window update)."s);
+				sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+			}
+		}
+		break;
+
+	case Protocol::WT_OP_BATCH:
+		if (allowBatch)
+		{
+			Protocol::BatchReader reader(buffer, size);
+			const char* pFrame;
+			std::size_t frameSize;
+			while (reader.next(pFrame, frameSize))
+			{
+				processFrame(pFrame, frameSize, false);
+			}
+			if (reader.malformed())
+			{
+				_logger.error("Invalid WebSocket frame received (malformed batch)."s);
+				sendResponse(0, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+			}
+			break;
+		}
+		// fallthrough
+
+	default:
+		_logger.error("Invalid WebSocket frame received (bad opcode: %hu)."s, static_cast<Poco::UInt16>(opcode));
+		sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+		break;
+	}
 }
 
 
@@ -400,7 +696,7 @@ void RemotePortForwarder::connect(SocketDispatcher& dispatcher, Poco::Net::Strea
 	try
 	{
 		_logger.debug("Socket for channel %hu is connected."s, channel);
-		sendResponse(channel, Protocol::WT_OP_OPEN_CONFIRM, 0);
+		sendResponse(channel, Protocol::WT_OP_OPEN_CONFIRM, 0, channelCodec(channel) ? Protocol::WT_FLAG_DEFLATE : 0);
 	}
 	catch (Poco::Exception& exc)
 	{
@@ -410,7 +706,13 @@ void RemotePortForwarder::connect(SocketDispatcher& dispatcher, Poco::Net::Strea
 
 	_dispatcher.removeSocket(socket);
 	SocketDispatcher::SocketHandler::Ptr pMultiplexer = new TunnelMultiplexer(*this, channel);
-	_dispatcher.addSocket(socket, pMultiplexer, Poco::Net::PollSet::POLL_READ, _localTimeout);
+	_dispatcher.addSocket(socket, pMultiplexer, Poco::Net::PollSet::POLL_READ | edgeMode(), _localTimeout);
+	if (_flowControl)
+	{
+		// The amount of data queued for the local socket is limited by the
+		// channel window, so it must not throttle the shared WebSocket.
+		_dispatcher.setWatermarks(socket, 0, 0);
+	}
 }
 
 
@@ -434,34 +736,131 @@ void RemotePortForwarder::connectTimeout(SocketDispatcher& dispatcher, Poco::Net
 }
 
 
-void RemotePortForwarder::forwardData(const char* buffer, int size, Poco::UInt16 channel)
+void RemotePortForwarder::forwardData(const char* buffer, int size, Poco::UInt16 channel, bool compressed)
 {
-	Poco::ScopedLockWithUnlock<Poco::FastMutex> lock(_mutex);
-	ChannelMap::iterator it = _channelMap.find(channel);
-	if (it != _channelMap.end())
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
 	{
-		Poco::Net::StreamSocket streamSocket = it->second.socket;
-		lock.unlock();
+		if (compressed)
+		{
+			try
+			{
+				if (!pInfo->pCodec) throw Poco::DataFormatException("Compression has not been negotiated"s);
+				pInfo->pCodec->decompress(buffer, size, _maxFrameSize);
+				buffer = pInfo->pCodec->decompressed().begin();
+				size = static_cast<int>(pInfo->pCodec->decompressed().size());
+			}
+			catch (Poco::DataFormatException& exc)
+			{
+				_logger.error("Invalid compressed frame received for channel %hu: %s"s, channel, exc.displayText());
+				removeChannel(channel);
+				discardChannelFrames(channel);
+				sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_PROTOCOL);
+				return;
+			}
+		}
 		try
 		{
-			_dispatcher.sendBytes(streamSocket, buffer, size, 0);
+			_dispatcher.sendBytes(pInfo->socket, buffer, size, 0);
 		}
 		catch (Poco::Exception&)
 		{
 			removeChannel(channel);
+			discardChannelFrames(channel);
 			sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_SOCKET);
 		}
 	}
 	else
 	{
 		_logger.warning("Forwarding request for invalid channel: %hu."s, channel);
-		lock.unlock();
 		sendResponse(channel, Protocol::WT_OP_ERROR, Protocol::WT_ERR_BAD_CHANNEL);
 	}
 }
 
 
-void RemotePortForwarder::openChannel(Poco::UInt16 channel, Poco::UInt16 port)
+void RemotePortForwarder::dataSent(Poco::UInt16 channel, std::size_t bytes)
+{
+	// Credit is granted in chunks, to avoid sending a window update
+	// for every single write to the local socket.
+	const std::size_t GRANT_THRESHOLD = Protocol::WT_CHANNEL_WINDOW_SIZE/4;
+
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo && pInfo->unacknowledged.fetch_add(bytes) + bytes >= GRANT_THRESHOLD)
+	{
+		Poco::UInt32 credit = static_cast<Poco::UInt32>(pInfo->unacknowledged.exchange(0));
+		if (credit == 0) return;
+
+		char buffer[Protocol::WT_WINDOW_UPDATE_SIZE];
+		std::size_t n = Protocol::writeWindowUpdate(buffer, sizeof(buffer), channel, credit);
+		try
+		{
+			sendFrame(buffer, n);
+		}
+		catch (Poco::Exception& exc)
+		{
+			_logger.error("Error sending window update for channel %hu: %s"s, channel, exc.displayText());
+			closeWebSocket(RPF_CLOSE_ERROR, false);
+		}
+	}
+}
+
+
+void RemotePortForwarder::updateWindow(Poco::UInt16 channel, Poco::UInt32 credit)
+{
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo && credit > 0)
+	{
+		pInfo->sendCredit += credit;
+		// Whichever of updateWindow() and consumeSendCredit() clears
+		// the flag is responsible for resuming the channel.
+		int flags = pInfo->flags.fetch_and(~CF_SUSPENDED);
+		if ((flags & CF_SUSPENDED) && !(flags & (CF_CLOSED_LOCAL | CF_BACKLOGGED)))
+		{
+			if (_logger.debug())
+			{
+				_logger.debug("Channel %hu has received send credit, resuming."s, channel);
+			}
+			_dispatcher.updateSocketAsync(pInfo->socket, Poco::Net::PollSet::POLL_READ | edgeMode(), _localTimeout);
+		}
+	}
+}
+
+
+std::size_t RemotePortForwarder::sendCredit(Poco::UInt16 channel) const
+{
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
+	{
+		return pInfo->sendCredit;
+	}
+	else return 0;
+}
+
+
+bool RemotePortForwarder::consumeSendCredit(Poco::UInt16 channel, std::size_t bytes)
+{
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
+	{
+		// Credit is only consumed by the thread reading from the
+		// local socket, while updateWindow() may add credit at any time.
+		bytes = (std::min)(bytes, pInfo->sendCredit.load());
+		if (pInfo->sendCredit.fetch_sub(bytes) == bytes)
+		{
+			pInfo->flags |= CF_SUSPENDED;
+			// Credit granted in the meantime may not have seen the flag.
+			if (pInfo->sendCredit > 0 && (pInfo->flags.fetch_and(~CF_SUSPENDED) & CF_SUSPENDED))
+			{
+				return true;
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+
+void RemotePortForwarder::openChannel(Poco::UInt16 channel, Poco::UInt16 port, bool compress)
 {
 	if (_ports.find(port) == _ports.end())
 	{
@@ -471,9 +870,7 @@ void RemotePortForwarder::openChannel(Poco::UInt16 channel, Poco::UInt16 port)
 		return;
 	}
 
-	Poco::ScopedLockWithUnlock<Poco::FastMutex> lock(_mutex);
-	ChannelMap::iterator it = _channelMap.find(channel);
-	if (it == _channelMap.end())
+	if (!_channels.find(channel))
 	{
 		if (_logger.debug())
 		{
@@ -482,59 +879,78 @@ void RemotePortForwarder::openChannel(Poco::UInt16 channel, Poco::UInt16 port)
 		try
 		{
 			Poco::Net::SocketAddress addr(_host, port);
-			Poco::Net::StreamSocket streamSocket(_pSocketFactory->createSocket(addr));
-			SocketDispatcher::SocketHandler::Ptr pMultiplexer = new TunnelConnector(*this, channel);
-			_dispatcher.addSocket(streamSocket, pMultiplexer, Poco::Net::PollSet::POLL_WRITE, _connectTimeout);
-			_channelMap[channel] = {streamSocket, 0};
+			ChannelInfo::Ptr pInfo = new ChannelInfo;
+			pInfo->socket = _pSocketFactory->createSocket(addr);
+			pInfo->weight = getPortWeight(port);
+			if (compress && _compressionLevel > 0)
+			{
+				pInfo->pCodec = new ChannelCodec(_compressionLevel);
+			}
+			// The channel must be in the table before the connector can run.
+			if (_channels.insert(channel, pInfo))
+			{
+				try
+				{
+					SocketDispatcher::SocketHandler::Ptr pMultiplexer = new TunnelConnector(*this, channel);
+					_dispatcher.addSocket(pInfo->socket, pMultiplexer, Poco::Net::PollSet::POLL_WRITE, _connectTimeout);
+				}
+				catch (...)
+				{
+					_channels.remove(channel);
+					throw;
+				}
+				return;
+			}
+			pInfo->socket.close();
 		}
 		catch (Poco::Exception& exc)
 		{
-			lock.unlock();
 			_logger.error("Failed to open channel %hu to port %hu at %s: %s"s, channel, port, _host.toString(), exc.displayText());
 			sendResponse(channel, Protocol::WT_OP_OPEN_FAULT, Protocol::WT_ERR_SOCKET);
+			return;
 		}
 	}
-	else
-	{
-		_logger.warning("Open request for existing channel %hu to port %hu."s, channel, port);
-		lock.unlock();
-		sendResponse(channel, Protocol::WT_OP_OPEN_FAULT, Protocol::WT_ERR_CHANNEL_IN_USE);
-	}
+	_logger.warning("Open request for existing channel %hu to port %hu."s, channel, port);
+	sendResponse(channel, Protocol::WT_OP_OPEN_FAULT, Protocol::WT_ERR_CHANNEL_IN_USE);
 }
 
 
 void RemotePortForwarder::shutdownSendChannel(Poco::UInt16 channel)
 {
-	Poco::FastMutex::ScopedLock lock(_mutex);
-	ChannelMap::iterator it = _channelMap.find(channel);
-	if (it != _channelMap.end())
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
 	{
 		_logger.debug("Shutting down channel %hu"s, channel);
-		_dispatcher.shutdownSend(it->second.socket);
+		_dispatcher.shutdownSend(pInfo->socket);
 	}
 }
 
 
 void RemotePortForwarder::removeChannel(Poco::UInt16 channel)
 {
-	Poco::FastMutex::ScopedLock lock(_mutex);
-	ChannelMap::iterator it = _channelMap.find(channel);
-	if (it != _channelMap.end())
+	ChannelInfo::Ptr pInfo = _channels.remove(channel);
+	if (pInfo)
 	{
-		_dispatcher.closeSocket(it->second.socket);
-		_channelMap.erase(it);
+		_dispatcher.closeSocket(pInfo->socket);
 	}
 }
 
 
+void RemotePortForwarder::discardChannelFrames(Poco::UInt16 channel)
+{
+	// Frames of an aborted channel must not be sent after the error
+	// response, or to a new channel reusing the channel number.
+	Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+	_scheduler.remove(channel);
+}
+
+
 int RemotePortForwarder::setChannelFlag(Poco::UInt16 channel, int flag)
 {
-	Poco::FastMutex::ScopedLock lock(_mutex);
-	auto it = _channelMap.find(channel);
-	if (it != _channelMap.end())
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
 	{
-		it->second.flags |= flag;
-		return it->second.flags;
+		return pInfo->flags.fetch_or(flag) | flag;
 	}
 	else return 0;
 }
@@ -542,23 +958,39 @@ int RemotePortForwarder::setChannelFlag(Poco::UInt16 channel, int flag)
 
 int RemotePortForwarder::getChannelFlags(Poco::UInt16 channel) const
 {
-	Poco::FastMutex::ScopedLock lock(_mutex);
-	auto it = _channelMap.find(channel);
-	if (it != _channelMap.end())
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
 	{
-		return it->second.flags;
+		return pInfo->flags;
 	}
 	else return 0;
 }
 
 
-void RemotePortForwarder::sendResponse(Poco::UInt16 channel, Poco::UInt8 opcode, Poco::UInt16 errorCode)
+int RemotePortForwarder::edgeMode() const
+{
+	return _readBudget > 0 ? Poco::Net::PollSet::POLL_EDGE : 0;
+}
+
+
+ChannelCodec::Ptr RemotePortForwarder::channelCodec(Poco::UInt16 channel) const
+{
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
+	{
+		return pInfo->pCodec;
+	}
+	else return ChannelCodec::Ptr();
+}
+
+
+void RemotePortForwarder::sendResponse(Poco::UInt16 channel, Poco::UInt8 opcode, Poco::UInt16 errorCode, Poco::UInt8 flags)
 {
 	char buffer[6];
-	std::size_t hn = Protocol::writeHeader(buffer, sizeof(buffer), opcode, 0, channel, errorCode);
+	std::size_t hn = Protocol::writeHeader(buffer, sizeof(buffer), opcode, flags, channel, errorCode);
 	try
 	{
-		_dispatcher.sendBytes(*_pWebSocket, buffer, hn, Poco::Net::WebSocket::FRAME_BINARY);
+		sendFrame(buffer, hn);
 	}
 	catch (Poco::Exception&)
 	{
@@ -567,6 +999,299 @@ void RemotePortForwarder::sendResponse(Poco::UInt16 channel, Poco::UInt8 opcode,
 }
 
 
+void RemotePortForwarder::sendFrame(const char* buffer, std::size_t size)
+{
+	if (!_batchEnabled)
+	{
+		transmit(buffer, size);
+		return;
+	}
+
+	Poco::FastMutex::ScopedLock lock(_batchMutex);
+
+	// Only small frames are batched. Bulk data is sent directly, so that
+	// it remains subject to the WebSocket's send backpressure.
+	if (size > _maxFrameSize/4)
+	{
+		flushBatch();
+		transmit(buffer, size);
+		return;
+	}
+	if (_batchLength + Protocol::WT_BATCH_ENTRY_HEADER_SIZE + size > _batch.size())
+	{
+		flushBatch();
+	}
+	if (_batchLength == 0)
+	{
+		if (!_batchScheduled)
+		{
+			// The flush can only be scheduled from the thread handling the WebSocket.
+			// Frames sent from other threads are only added to a pending batch.
+			_batchScheduled = _dispatcher.scheduleTask(*_pWebSocket, _batchDelay,
+				[pSelf=this](SocketDispatcher& dispatcher)
+				{
+					Poco::ScopedLockWithUnlock<Poco::FastMutex> lock(pSelf->_batchMutex);
+					pSelf->_batchScheduled = false;
+					try
+					{
+						pSelf->flushBatch();
+					}
+					catch (Poco::Exception& exc)
+					{
+						lock.unlock();
+						pSelf->_logger.error("Error sending WebSocket batch frame: %s"s, exc.displayText());
+						pSelf->closeWebSocket(RPF_CLOSE_ERROR, false);
+					}
+				}
+			);
+			if (!_batchScheduled)
+			{
+				transmit(buffer, size);
+				return;
+			}
+		}
+		_batchLength = Protocol::writeHeader(_batch.begin(), _batch.size(), Protocol::WT_OP_BATCH, 0, 0);
+	}
+	_batchLength += Protocol::writeBatchEntryHeader(_batch.begin() + _batchLength, _batch.size() - _batchLength, size);
+	std::memcpy(_batch.begin() + _batchLength, buffer, size);
+	_batchLength += size;
+	_batchFrames++;
+}
+
+
+bool RemotePortForwarder::sendChannelFrame(Poco::UInt16 channel, const char* buffer, std::size_t size)
+{
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (_batchEnabled)
+	{
+		if (size <= _maxFrameSize/4)
+		{
+			// Small frames are batched, unless frames of the channel
+			// are already waiting in the scheduler.
+			if (!pInfo || pInfo->queued == 0)
+			{
+				sendFrame(buffer, size);
+				return true;
+			}
+		}
+		else
+		{
+			// Frames already in the batch must be sent first.
+			Poco::FastMutex::ScopedLock lock(_batchMutex);
+			flushBatch();
+		}
+	}
+
+	// The frame is either sent directly, or enqueued and, if no other
+	// thread is draining the scheduler, the next frame is dequeued in
+	// the same critical section.
+	const std::size_t channelQueueLimit = CHANNEL_QUEUE_FRAMES*(_maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE);
+	bool backlogged = false;
+	bool direct = false;
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 nextChannel;
+	bool urgent;
+	{
+		Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+		if (!_draining && _scheduler.empty() && _inFlight < _sendQueueLimit)
+		{
+			_inFlight += size;
+			_draining = true;
+			direct = true;
+		}
+		else
+		{
+			unsigned weight = 1;
+			if (pInfo)
+			{
+				weight = pInfo->weight;
+				if (pInfo->queued.fetch_add(size) + size > channelQueueLimit)
+				{
+					backlogged = !(pInfo->flags.fetch_or(CF_BACKLOGGED) & CF_BACKLOGGED);
+				}
+			}
+			frame.assign(buffer, size);
+			_scheduler.enqueue(channel, weight, std::move(frame));
+			if (_draining) return !backlogged;
+			_draining = true;
+			if (!dequeueFrame(frame, nextChannel, urgent)) return !backlogged;
+		}
+	}
+	if (direct)
+	{
+		sendDirect(buffer, size);
+		drainScheduler();
+	}
+	else
+	{
+		drainScheduler(frame, nextChannel, urgent);
+	}
+	return !backlogged;
+}
+
+
+void RemotePortForwarder::transmit(const char* buffer, std::size_t size)
+{
+	bool direct = false;
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	{
+		Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+		if (_draining || !_scheduler.empty() || _inFlight >= _sendQueueLimit)
+		{
+			frame.assign(buffer, size);
+			_scheduler.enqueueUrgent(std::move(frame));
+			if (_draining) return;
+			_draining = true;
+			if (!dequeueFrame(frame, channel, urgent)) return;
+		}
+		else
+		{
+			_inFlight += size;
+			_draining = true;
+			direct = true;
+		}
+	}
+	if (direct)
+	{
+		sendDirect(buffer, size);
+		drainScheduler();
+	}
+	else
+	{
+		drainScheduler(frame, channel, urgent);
+	}
+}
+
+
+void RemotePortForwarder::sendDirect(const char* buffer, std::size_t size)
+{
+	try
+	{
+		_dispatcher.sendBytes(*_pWebSocket, buffer, size, Poco::Net::WebSocket::FRAME_BINARY);
+	}
+	catch (...)
+	{
+		Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+		_draining = false;
+		throw;
+	}
+}
+
+
+bool RemotePortForwarder::dequeueFrame(Poco::Buffer<char>& frame, Poco::UInt16& channel, bool& urgent)
+{
+	if (_inFlight >= _sendQueueLimit || !_scheduler.dequeue(frame, channel, urgent))
+	{
+		_draining = false;
+		return false;
+	}
+	_inFlight += frame.size();
+	return true;
+}
+
+
+void RemotePortForwarder::drainScheduler()
+{
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	{
+		Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+		if (!dequeueFrame(frame, channel, urgent)) return;
+	}
+	drainScheduler(frame, channel, urgent);
+}
+
+
+void RemotePortForwarder::drainScheduler(Poco::Buffer<char>& frame, Poco::UInt16 channel, bool urgent)
+{
+	for (;;)
+	{
+		if (!urgent) channelDequeued(channel, frame.size());
+		sendDirect(frame.begin(), frame.size());
+
+		Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+		if (!dequeueFrame(frame, channel, urgent)) return;
+	}
+}
+
+
+void RemotePortForwarder::channelDequeued(Poco::UInt16 channel, std::size_t size)
+{
+	const std::size_t channelResumeLimit = CHANNEL_QUEUE_FRAMES*(_maxFrameSize + Protocol::WT_FRAME_HEADER_SIZE)/2;
+
+	ChannelInfo::Ptr pInfo = _channels.find(channel);
+	if (pInfo)
+	{
+		// Frames of a previous channel with the same number may still be
+		// dequeued after the channel has been reopened.
+		std::size_t queued = pInfo->queued;
+		std::size_t remaining;
+		do
+		{
+			remaining = queued - (std::min)(size, queued);
+		}
+		while (!pInfo->queued.compare_exchange_weak(queued, remaining));
+
+		if (remaining <= channelResumeLimit && (pInfo->flags & CF_BACKLOGGED))
+		{
+			int flags = pInfo->flags.fetch_and(~CF_BACKLOGGED);
+			if ((flags & CF_BACKLOGGED) && !(flags & (CF_CLOSED_LOCAL | CF_SUSPENDED)))
+			{
+				_dispatcher.updateSocketAsync(pInfo->socket, Poco::Net::PollSet::POLL_READ | edgeMode(), _localTimeout);
+			}
+		}
+	}
+}
+
+
+void RemotePortForwarder::webSocketSent(std::size_t bytes)
+{
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	{
+		Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+		_inFlight -= (std::min)(bytes, _inFlight);
+		if (_draining || _scheduler.empty() || _inFlight >= _sendQueueLimit) return;
+		_draining = true;
+		if (!dequeueFrame(frame, channel, urgent)) return;
+	}
+	try
+	{
+		drainScheduler(frame, channel, urgent);
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.error("Error sending WebSocket frame: %s"s, exc.displayText());
+		closeWebSocket(RPF_CLOSE_ERROR, false);
+	}
+}
+
+
+void RemotePortForwarder::flushBatch()
+{
+	if (_batchLength == 0) return;
+
+	std::size_t length = _batchLength;
+	std::size_t frames = _batchFrames;
+	_batchLength = 0;
+	_batchFrames = 0;
+	if (frames == 1)
+	{
+		// no need to wrap a single frame
+		const std::size_t offset = Protocol::WT_FRAME_HEADER_SIZE + Protocol::WT_BATCH_ENTRY_HEADER_SIZE;
+		transmit(_batch.begin() + offset, length - offset);
+	}
+	else
+	{
+		transmit(_batch.begin(), length);
+	}
+}
+
+
 void RemotePortForwarder::closeWebSocket(CloseReason reason, bool active)
 {
 	if (_webSocketFlags & CF_CLOSED_LOCAL) return;
@@ -581,6 +1306,27 @@ void RemotePortForwarder::closeWebSocket(CloseReason reason, bool active)
 		{
 			try
 			{
+				if (_batchEnabled)
+				{
+					Poco::FastMutex::ScopedLock lock(_batchMutex);
+					flushBatch();
+				}
+				// send all scheduled frames before the close frame
+				std::vector<Poco::Buffer<char>> frames;
+				{
+					Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+					Poco::Buffer<char> frame(0);
+					Poco::UInt16 channel;
+					bool urgent;
+					while (_scheduler.dequeue(frame, channel, urgent))
+					{
+						frames.push_back(std::move(frame));
+					}
+				}
+				for (auto& frame: frames)
+				{
+					_dispatcher.sendBytes(*_pWebSocket, frame.begin(), frame.size(), Poco::Net::WebSocket::FRAME_BINARY);
+				}
 				if (active)
 				{
 					char buffer[2];
@@ -594,11 +1340,14 @@ void RemotePortForwarder::closeWebSocket(CloseReason reason, bool active)
 			{
 			}
 		}
-		for (ChannelMap::iterator it = _channelMap.begin(); it != _channelMap.end(); ++it)
+		for (auto& pInfo: _channels.removeAll())
+		{
+			_dispatcher.removeSocket(pInfo->socket);
+		}
 		{
-			_dispatcher.removeSocket(it->second.socket);
+			Poco::FastMutex::ScopedLock lock(_schedulerMutex);
+			_scheduler.clear();
 		}
-		_channelMap.clear();
 		_dispatcher.shutdownSend(*_pWebSocket);
 	}
 	catch (Poco::Exception& exc)
@@ -606,7 +1355,7 @@ void RemotePortForwarder::closeWebSocket(CloseReason reason, bool active)
 		_logger.log(exc);
 	}
 
-	_dispatcher.updateSocket(*_pWebSocket, Poco::Net::PollSet::POLL_READ, _closeTimeout);
+	_dispatcher.updateSocket(*_pWebSocket, Poco::Net::PollSet::POLL_READ | edgeMode(), _closeTimeout);
 	_webSocketFlags |= CF_CLOSED_LOCAL;
 	int eventArg = reason;
 	webSocketClosed(this, eventArg);
@@ -641,7 +1390,7 @@ void RemotePortForwarder::updateProperties(const std::map<std::string, std::stri
 	Poco::BinaryWriter bufferWriter(bufferStream, Poco::BinaryWriter::NETWORK_BYTE_ORDER);
 	writeProperties(bufferWriter, props);
 
-	_dispatcher.sendBytes(*_pWebSocket, buffer.begin(), static_cast<int>(payloadSize + Protocol::WT_FRAME_HEADER_SIZE), Poco::Net::WebSocket::FRAME_BINARY);
+	_dispatcher.sendBytesAsync(*_pWebSocket, std::move(buffer), Poco::Net::WebSocket::FRAME_BINARY);
 }
 
 
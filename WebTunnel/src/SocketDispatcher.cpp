@@ -15,8 +15,13 @@
 
 
 #include "Poco/WebTunnel/SocketDispatcher.h"
+#include "Poco/Net/StreamSocketImpl.h"
 #include "Poco/Net/NetException.h"
 #include "Poco/Event.h"
+#include "Poco/Format.h"
+#include <algorithm>
+#include <iterator>
+#include <typeinfo>
 
 
 using namespace std::string_literals;
@@ -26,592 +31,1474 @@ namespace Poco {
 namespace WebTunnel {
 
 
-class AddSocketNotification: public SocketDispatcher::TaskNotification
+thread_local SocketDispatcher::Shard* SocketDispatcher::_pCurrentShard = nullptr;
+
+
+void SocketDispatcher::SocketHandler::sent(SocketDispatcher& dispatcher, Poco::Net::StreamSocket& socket, std::size_t bytes)
+{
+}
+
+
+SocketDispatcher::SocketDispatcher(Poco::Timespan timeout):
+	_timeout(timeout),
+	_highWatermark(DEFAULT_HIGH_WATERMARK),
+	_lowWatermark(DEFAULT_LOW_WATERMARK),
+	_stopped(false),
+	_logger(Poco::Logger::get("WebTunnel.SocketDispatcher"s))
 {
-public:
-	using Ptr = Poco::AutoPtr<AddSocketNotification>;
+	start(1);
+}
+
+
+SocketDispatcher::SocketDispatcher(int threads, Poco::Timespan timeout):
+	_timeout(timeout),
+	_highWatermark(DEFAULT_HIGH_WATERMARK),
+	_lowWatermark(DEFAULT_LOW_WATERMARK),
+	_stopped(false),
+	_logger(Poco::Logger::get("WebTunnel.SocketDispatcher"s))
+{
+	start(threads);
+}
+
+
+SocketDispatcher::~SocketDispatcher()
+{
+	try
+	{
+		stop();
+	}
+	catch (...)
+	{
+		poco_unexpected();
+	}
+}
 
-	AddSocketNotification(SocketDispatcher& dispatcher, const Poco::Net::StreamSocket& socket, const SocketDispatcher::SocketHandler::Ptr& pHandler, int mode, Poco::Timespan timeout):
-		TaskNotification(dispatcher),
-		_socket(socket),
-		_pHandler(pHandler),
-		_mode(mode),
-		_timeout(timeout)
+
+void SocketDispatcher::start(int threads)
+{
+	if (threads < 1) threads = 1;
+	_shards.reserve(threads);
+	for (int i = 0; i < threads; i++)
+	{
+		_shards.push_back(std::make_unique<Shard>(*this, i));
+	}
+	for (auto& pShard: _shards)
 	{
+		pShard->thread.setName(Poco::format("SocketDispatcher[%d]"s, pShard->index));
+		pShard->thread.start(*pShard);
 	}
+}
 
-	void execute()
+
+void SocketDispatcher::stop()
+{
+	if (!stopped())
 	{
-		AutoSetEvent ase(_done);
+		_stopped = true;
+		for (auto& pShard: _shards)
+		{
+			pShard->commandsAvailable.set();
+			pShard->pollSet.wakeUp();
+		}
+		for (auto& pShard: _shards)
+		{
+			pShard->thread.join();
+			Command command;
+			while (pShard->commandQueue.tryDequeue(command))
+			{
+				if (command.pCompletion) command.pCompletion->complete(false);
+			}
+			for (auto& overflowCommand: pShard->overflowCommands)
+			{
+				if (overflowCommand.pCompletion) overflowCommand.pCompletion->complete(false);
+			}
+			pShard->overflowCommands.clear();
+			pShard->readyList.clear();
+			pShard->scheduledTasks.clear();
+			pShard->timerQueue.clear();
+			pShard->socketTable.clear();
+			pShard->retiredHandlers.clear();
+			pShard->pollSet.clear();
+			pShard->load = 0;
+		}
+		Poco::FastMutex::ScopedLock lock(_shardMapMutex);
+		_shardMap.clear();
+	}
+}
 
-		_dispatcher.addSocketImpl(_socket, _pHandler, _mode, _timeout);
+
+void SocketDispatcher::reset()
+{
+	for (auto& pShard: _shards)
+	{
+		Command command(Command::CMD_RESET);
+		Completion::Ptr pCompletion = command.pCompletion = new Completion;
+		enqueueCommand(*pShard, std::move(command));
+		if (!inDispatcherThread(*pShard))
+		{
+			pCompletion->wait();
+		}
 	}
+}
 
-private:
-	Poco::Net::StreamSocket _socket;
-	SocketDispatcher::SocketHandler::Ptr _pHandler;
-	int _mode;
-	Poco::Timespan _timeout;
-};
+
+void SocketDispatcher::addSocket(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout)
+{
+	Shard* pShard = currentShard();
+	addSocket(pShard ? *pShard : selectShard(), socket, pHandler, mode, timeout, new Completion);
+}
 
 
-class UpdateSocketNotification: public SocketDispatcher::TaskNotification
+void SocketDispatcher::addSocket(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout, const Poco::Net::StreamSocket& peer)
 {
-public:
-	using Ptr = Poco::AutoPtr<UpdateSocketNotification>;
+	Shard* pShard = findShard(peer);
+	if (!pShard)
+	{
+		_logger.warning("addSocket() called with unknown peer socket."s);
+		pShard = &selectShard();
+	}
+	addSocket(*pShard, socket, pHandler, mode, timeout, new Completion);
+}
 
-	UpdateSocketNotification(SocketDispatcher& dispatcher, const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout):
-		TaskNotification(dispatcher),
-		_socket(socket),
-		_mode(mode),
-		_timeout(timeout)
+
+void SocketDispatcher::addSocketAsync(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout)
+{
+	Shard* pShard = currentShard();
+	addSocket(pShard ? *pShard : selectShard(), socket, pHandler, mode, timeout, nullptr);
+}
+
+
+void SocketDispatcher::addSocketAsync(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout, const Poco::Net::StreamSocket& peer)
+{
+	Shard* pShard = findShard(peer);
+	if (!pShard)
 	{
+		_logger.warning("addSocketAsync() called with unknown peer socket."s);
+		pShard = &selectShard();
 	}
+	addSocket(*pShard, socket, pHandler, mode, timeout, nullptr);
+}
 
-	void execute()
+
+void SocketDispatcher::addSocket(Shard& shard, const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout, Completion::Ptr pCompletion)
+{
+	assignShard(socket, shard);
+	Command command(Command::CMD_ADD, socket);
+	command.pHandler = pHandler;
+	command.mode = mode;
+	command.timeout = timeout;
+	command.pCompletion = pCompletion;
+	enqueueCommand(shard, std::move(command));
+	if (pCompletion && !inDispatcherThread(shard))
 	{
-		AutoSetEvent ase(_done);
+		pCompletion->wait();
+	}
+}
+
+
+void SocketDispatcher::updateSocket(const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard) return;
 
-		_dispatcher.updateSocketImpl(_socket, _mode, _timeout);
+	if (inDispatcherThread(*pShard))
+	{
+		updateSocketImpl(*pShard, socket, mode, timeout);
 	}
+	else
+	{
+		Command command(Command::CMD_UPDATE, socket);
+		command.mode = mode;
+		command.timeout = timeout;
+		Completion::Ptr pCompletion = command.pCompletion = new Completion;
+		enqueueCommand(*pShard, std::move(command));
+		pCompletion->wait();
+	}
+}
+
+
+void SocketDispatcher::updateSocketAsync(const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard) return;
 
-private:
-	Poco::Net::StreamSocket _socket;
-	int _mode;
-	Poco::Timespan _timeout;
-};
+	Command command(Command::CMD_UPDATE, socket);
+	command.mode = mode;
+	command.timeout = timeout;
+	enqueueCommand(*pShard, std::move(command));
+}
 
 
-class RemoveSocketNotification: public SocketDispatcher::TaskNotification
+void SocketDispatcher::removeSocket(const Poco::Net::StreamSocket& socket)
 {
-public:
-	using Ptr = Poco::AutoPtr<RemoveSocketNotification>;
+	Shard* pShard = findShard(socket);
+	if (!pShard) return;
 
-	RemoveSocketNotification(SocketDispatcher& dispatcher, const Poco::Net::StreamSocket& socket):
-		TaskNotification(dispatcher),
-		_socket(socket)
+	Command command(Command::CMD_REMOVE, socket);
+	Completion::Ptr pCompletion = command.pCompletion = new Completion;
+	enqueueCommand(*pShard, std::move(command));
+	if (!inDispatcherThread(*pShard))
 	{
+		pCompletion->wait();
 	}
+}
+
 
-	void execute()
+void SocketDispatcher::removeSocketAsync(const Poco::Net::StreamSocket& socket)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard) return;
+
+	enqueueCommand(*pShard, Command(Command::CMD_REMOVE, socket));
+}
+
+
+void SocketDispatcher::closeSocket(const Poco::Net::StreamSocket& socket)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard)
 	{
-		AutoSetEvent ase(_done);
+		Poco::Net::StreamSocket(socket).close();
+		return;
+	}
 
-		_dispatcher.removeSocketImpl(_socket);
+	Command command(Command::CMD_CLOSE, socket);
+	Completion::Ptr pCompletion = command.pCompletion = new Completion;
+	enqueueCommand(*pShard, std::move(command));
+	if (!inDispatcherThread(*pShard))
+	{
+		pCompletion->wait();
 	}
+}
 
-private:
-	Poco::Net::StreamSocket _socket;
-};
+
+void SocketDispatcher::closeSocketAsync(const Poco::Net::StreamSocket& socket)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard)
+	{
+		Poco::Net::StreamSocket(socket).close();
+		return;
+	}
+
+	enqueueCommand(*pShard, Command(Command::CMD_CLOSE, socket));
+}
 
 
-class CloseSocketNotification: public SocketDispatcher::TaskNotification
+bool SocketDispatcher::hasSocket(const Poco::Net::StreamSocket& socket)
 {
-public:
-	using Ptr = Poco::AutoPtr<CloseSocketNotification>;
+	Shard* pShard = findShard(socket);
+	if (!pShard) return false;
 
-	CloseSocketNotification(SocketDispatcher& dispatcher, const Poco::Net::StreamSocket& socket):
-		TaskNotification(dispatcher),
-		_socket(socket)
+	if (inDispatcherThread(*pShard))
+	{
+		return hasSocketImpl(*pShard, socket);
+	}
+	else
 	{
+		Completion::Ptr pCompletion = hasSocketAsync(socket);
+		pCompletion->wait();
+		return pCompletion->result();
 	}
+}
+
 
-	void execute()
+SocketDispatcher::Completion::Ptr SocketDispatcher::hasSocketAsync(const Poco::Net::StreamSocket& socket)
+{
+	Completion::Ptr pCompletion = new Completion;
+	Shard* pShard = findShard(socket);
+	if (pShard)
 	{
-		AutoSetEvent ase(_done);
+		Command command(Command::CMD_HAS, socket);
+		command.pCompletion = pCompletion;
+		enqueueCommand(*pShard, std::move(command));
+	}
+	else
+	{
+		pCompletion->complete(false);
+	}
+	return pCompletion;
+}
+
 
-		_dispatcher.closeSocketImpl(_socket);
+void SocketDispatcher::sendBytes(Poco::Net::StreamSocket& socket, const void* buffer, std::size_t length, int options)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard)
+	{
+		_logger.error("sendBytes() called with unknown socket."s);
+		return;
 	}
 
-private:
-	Poco::Net::StreamSocket _socket;
-};
+	if (inDispatcherThread(*pShard))
+	{
+		sendBytesImpl(*pShard, socket, Poco::Buffer<char>(reinterpret_cast<const char*>(buffer), length), options);
+	}
+	else
+	{
+		Command command(Command::CMD_SEND, socket);
+		command.buffer.assign(reinterpret_cast<const char*>(buffer), length);
+		command.options = options;
+		Completion::Ptr pCompletion = command.pCompletion = new Completion;
+		enqueueCommand(*pShard, std::move(command));
+		pCompletion->wait();
+	}
+}
 
 
-class HasSocketNotification: public SocketDispatcher::TaskNotification
+void SocketDispatcher::sendBytesAsync(Poco::Net::StreamSocket& socket, Poco::Buffer<char>&& buffer, int options)
 {
-public:
-	using Ptr = Poco::AutoPtr<HasSocketNotification>;
+	Shard* pShard = findShard(socket);
+	if (!pShard)
+	{
+		_logger.error("sendBytesAsync() called with unknown socket."s);
+		return;
+	}
 
-	HasSocketNotification(SocketDispatcher& dispatcher, const Poco::Net::StreamSocket& socket):
-		TaskNotification(dispatcher),
-		_socket(socket)
+	if (inDispatcherThread(*pShard))
+	{
+		sendBytesImpl(*pShard, socket, std::move(buffer), options);
+	}
+	else
 	{
+		Command command(Command::CMD_SEND, socket);
+		command.buffer = std::move(buffer);
+		command.options = options;
+		enqueueCommand(*pShard, std::move(command));
 	}
+}
 
-	void execute()
+
+void SocketDispatcher::shutdownSend(Poco::Net::StreamSocket& socket)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard) return;
+
+	if (inDispatcherThread(*pShard))
+	{
+		shutdownSendImpl(*pShard, socket);
+	}
+	else
 	{
-		AutoSetEvent ase(_done);
+		Command command(Command::CMD_SHUTDOWN, socket);
+		Completion::Ptr pCompletion = command.pCompletion = new Completion;
+		enqueueCommand(*pShard, std::move(command));
+		pCompletion->wait();
+	}
+}
+
+
+void SocketDispatcher::shutdownSendAsync(Poco::Net::StreamSocket& socket)
+{
+	Shard* pShard = findShard(socket);
+	if (!pShard) return;
 
-		_result = _dispatcher.hasSocketImpl(_socket);
+	if (inDispatcherThread(*pShard))
+	{
+		shutdownSendImpl(*pShard, socket);
 	}
-	
-	bool result() const
+	else
 	{
-		return _result;
+		enqueueCommand(*pShard, Command(Command::CMD_SHUTDOWN, socket));
 	}
+}
 
-private:
-	Poco::Net::StreamSocket _socket;
-	bool _result = false;
-};
 
+void SocketDispatcher::markReadable(const Poco::Net::StreamSocket& socket)
+{
+	Shard* pShard = currentShard();
+	poco_assert_dbg (pShard);
 
-class ResetNotification: public SocketDispatcher::TaskNotification
+	if (pShard)
+	{
+		SocketInfo* pInfo = pShard->socketTable.find(socket);
+		if (pInfo)
+		{
+			pShard->readyList.push_back(SocketTable::handle(*pInfo));
+		}
+	}
+}
+
+
+bool SocketDispatcher::readSuspended() const
 {
-public:
-	using Ptr = Poco::AutoPtr<ResetNotification>;
+	Shard* pShard = currentShard();
+	return pShard && pShard->pActiveInfo && !readEnabled(*pShard->pActiveInfo);
+}
+
+
+bool SocketDispatcher::scheduleTask(const Poco::Net::StreamSocket& socket, Poco::Timespan delay, DeferredTask&& task)
+{
+	Shard* pShard = currentShard();
+	if (pShard)
+	{
+		SocketInfo* pInfo = pShard->socketTable.find(socket);
+		if (pInfo)
+		{
+			Poco::Clock due;
+			due += delay.totalMicroseconds();
+			pShard->scheduledTasks.push_back(ScheduledTask{due, SocketTable::handle(*pInfo), std::move(task)});
+			return true;
+		}
+	}
+	return false;
+}
+
+
+void SocketDispatcher::countReceived(const Poco::Net::StreamSocket& socket, std::size_t bytes)
+{
+	Shard* pShard = currentShard();
+	poco_assert_dbg (pShard);
+
+	if (pShard)
+	{
+		SocketInfo* pInfo = pShard->pActiveInfo;
+		if (!pInfo || !pInfo->used || pInfo->pSocket != socket.impl())
+		{
+			pInfo = pShard->socketTable.find(socket);
+		}
+		if (pInfo)
+		{
+			pInfo->bytesReceived += bytes;
+			pInfo->framesReceived++;
+		}
+		count(pShard->bytesReceived, bytes);
+		count(pShard->framesReceived, 1);
+	}
+}
+
+
+std::vector<SocketDispatcher::ShardMetrics> SocketDispatcher::metrics() const
+{
+	std::vector<ShardMetrics> result;
+	result.reserve(_shards.size());
+	for (const auto& pShard: _shards)
+	{
+		ShardMetrics metrics;
+		metrics.shard = pShard->index;
+		metrics.sockets = pShard->load.load(std::memory_order_relaxed);
+		metrics.queuedCommands = pShard->commandQueue.size();
+		metrics.iterations = pShard->iterations.load(std::memory_order_relaxed);
+		metrics.commands = pShard->commands.load(std::memory_order_relaxed);
+		metrics.bytesReceived = pShard->bytesReceived.load(std::memory_order_relaxed);
+		metrics.framesReceived = pShard->framesReceived.load(std::memory_order_relaxed);
+		metrics.bytesSent = pShard->bytesSent.load(std::memory_order_relaxed);
+		metrics.framesSent = pShard->framesSent.load(std::memory_order_relaxed);
+		metrics.loopTime = pShard->loopTime.snapshot();
+		metrics.pollWait = pShard->pollWait.snapshot();
+		metrics.commandWait = pShard->commandWait.snapshot();
+		metrics.pendingSendBytes = pShard->pendingSendBytes.snapshot();
+		result.push_back(std::move(metrics));
+	}
+	return result;
+}
+
+
+std::vector<SocketDispatcher::SocketMetrics> SocketDispatcher::socketMetrics()
+{
+	std::vector<SocketMetrics> result;
+	if (stopped()) return result;
+
+	for (auto& pShard: _shards)
+	{
+		if (inDispatcherThread(*pShard))
+		{
+			collectSocketMetrics(*pShard, result);
+			continue;
+		}
+
+		// The task may still be executed after we have given up waiting
+		// for it, so it must not refer to anything on our stack.
+		Shard* pTaskShard = pShard.get();
+		auto pMetrics = std::make_shared<std::vector<SocketMetrics>>();
+		auto collect = [pTaskShard, pMetrics](SocketDispatcher& dispatcher)
+		{
+			dispatcher.collectSocketMetrics(*pTaskShard, *pMetrics);
+		};
+		Command command(Command::CMD_TASK);
+		command.pTask = new FunctorTaskNotification<decltype(collect)>(*this, std::move(collect));
+		Completion::Ptr pCompletion = command.pCompletion = new Completion;
+		enqueueCommand(*pShard, std::move(command));
+		if (pCompletion->tryWait(SOCKET_METRICS_TIMEOUT) && pCompletion->result())
+		{
+			result.insert(result.end(), pMetrics->begin(), pMetrics->end());
+		}
+		else
+		{
+			_logger.warning("Shard %d did not provide socket metrics in time."s, pShard->index);
+		}
+	}
+	return result;
+}
+
+
+void SocketDispatcher::collectSocketMetrics(Shard& shard, std::vector<SocketMetrics>& metrics)
+{
+	shard.socketTable.forEach(
+		[&shard, &metrics](SocketInfo& info)
+		{
+			SocketMetrics socketMetrics;
+			socketMetrics.sockfd = info.pSocket->sockfd();
+			socketMetrics.shard = shard.index;
+			socketMetrics.mode = info.mode;
+			socketMetrics.bytesReceived = info.bytesReceived;
+			socketMetrics.framesReceived = info.framesReceived;
+			socketMetrics.bytesSent = info.bytesSent;
+			socketMetrics.framesSent = info.framesSent;
+			socketMetrics.pendingBytes = info.pendingBytes;
+			socketMetrics.pendingSends = info.pendingSends.size();
+			socketMetrics.throttled = info.throttled;
+			socketMetrics.idle = info.activity.elapsed();
+			metrics.push_back(socketMetrics);
+		}
+	);
+}
+
+
+void SocketDispatcher::enqueueCommand(Shard& shard, Command&& command)
+{
+	bool inThread = inDispatcherThread(shard);
+	command.enqueued = Poco::Clock().raw();
+	if (inThread && !shard.overflowCommands.empty())
+	{
+		// Earlier commands are already waiting in the overflow queue,
+		// so this one must go there as well to keep the order.
+		shard.overflowCommands.push_back(std::move(command));
+		return;
+	}
+	while (!shard.commandQueue.tryEnqueue(std::move(command)))
+	{
+		if (inThread)
+		{
+			// The queue is full and we are its consumer, so we
+			// cannot wait for it to drain. The overflow queue is
+			// executed after everything in the ring buffer.
+			shard.overflowCommands.push_back(std::move(command));
+			return;
+		}
+		else if (stopped())
+		{
+			if (command.pCompletion) command.pCompletion->complete(false);
+			return;
+		}
+		Poco::Thread::yield();
+	}
 
-	ResetNotification(SocketDispatcher& dispatcher):
-		TaskNotification(dispatcher)
+	if (!inThread)
 	{
+		shard.pollSet.wakeUp();
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (shard.waiting.exchange(false))
+		{
+			shard.commandsAvailable.set();
+		}
 	}
+}
 
-	void execute()
+
+void SocketDispatcher::executeCommand(Shard& shard, Command& command)
+{
+	bool result = true;
+	try
+	{
+		switch (command.type)
+		{
+		case Command::CMD_ADD:
+			addSocketImpl(shard, Poco::Net::StreamSocket(command.pSocket.duplicate()), command.pHandler, command.mode, command.timeout);
+			break;
+		case Command::CMD_UPDATE:
+			updateSocketImpl(shard, Poco::Net::StreamSocket(command.pSocket.duplicate()), command.mode, command.timeout);
+			break;
+		case Command::CMD_REMOVE:
+			removeSocketImpl(shard, Poco::Net::StreamSocket(command.pSocket.duplicate()));
+			break;
+		case Command::CMD_CLOSE:
+			{
+				Poco::Net::StreamSocket socket(command.pSocket.duplicate());
+				closeSocketImpl(shard, socket);
+			}
+			break;
+		case Command::CMD_HAS:
+			result = hasSocketImpl(shard, Poco::Net::StreamSocket(command.pSocket.duplicate()));
+			break;
+		case Command::CMD_SEND:
+			{
+				Poco::Net::StreamSocket socket(command.pSocket.duplicate());
+				sendBytesImpl(shard, socket, std::move(command.buffer), command.options);
+			}
+			break;
+		case Command::CMD_SHUTDOWN:
+			{
+				Poco::Net::StreamSocket socket(command.pSocket.duplicate());
+				shutdownSendImpl(shard, socket);
+			}
+			break;
+		case Command::CMD_RESET:
+			resetImpl(shard);
+			break;
+		case Command::CMD_TASK:
+			command.pTask->execute();
+			break;
+		case Command::CMD_NONE:
+			break;
+		}
+	}
+	catch (...)
+	{
+		if (command.pCompletion) command.pCompletion->complete(false);
+		throw;
+	}
+	if (command.pCompletion) command.pCompletion->complete(result);
+}
+
+
+void SocketDispatcher::executeCommands(Shard& shard)
+{
+	Command command;
+	Poco::Clock::ClockVal now = 0;
+	while (shard.commandQueue.tryDequeue(command))
 	{
-		AutoSetEvent ase(_done);
+		// Commands enqueued while we're executing the batch appear
+		// to have been waiting for no time at all, which is close enough.
+		if (now == 0) now = Poco::Clock().raw();
+		shard.commandWait.record(now > command.enqueued ? now - command.enqueued : 0);
+		count(shard.commands, 1);
+		executeCommand(shard, command);
+		command = Command();
+	}
+	while (!shard.overflowCommands.empty())
+	{
+		command = std::move(shard.overflowCommands.front());
+		shard.overflowCommands.pop_front();
+		if (now == 0) now = Poco::Clock().raw();
+		shard.commandWait.record(now > command.enqueued ? now - command.enqueued : 0);
+		count(shard.commands, 1);
+		executeCommand(shard, command);
+		command = Command();
+	}
+}
 
-		_dispatcher.resetImpl();
+
+void SocketDispatcher::waitForCommands(Shard& shard)
+{
+	shard.waiting = true;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (shard.commandQueue.empty() && shard.overflowCommands.empty() && !stopped())
+	{
+		shard.commandsAvailable.tryWait(MAIN_QUEUE_TIMEOUT);
 	}
-};
+	shard.waiting = false;
+}
 
 
-class SendBytesNotification: public SocketDispatcher::TaskNotification
+void SocketDispatcher::run(Shard& shard)
 {
-public:
-	using Ptr = Poco::AutoPtr<SendBytesNotification>;
+	_pCurrentShard = &shard;
 
-	SendBytesNotification(SocketDispatcher& dispatcher, const Poco::Net::StreamSocket& socket, const void* pBuffer, std::size_t length, int options):
-		TaskNotification(dispatcher),
-		_socket(socket),
-		_buffer(reinterpret_cast<const char*>(pBuffer), length),
-		_options(options)
+	Poco::Timestamp lastSocketDump;
+	Poco::Clock iterationStart;
+	while (!stopped())
 	{
+		try
+		{
+			if (_logger.trace() && lastSocketDump.isElapsed(30*Poco::Timestamp::resolution()))
+			{
+				_logger.trace("Have %z sockets in dispatcher shard %d, %z in PollSet, %z timers."s, shard.socketTable.size(), shard.index, shard.pollSet.size(), shard.timerQueue.size());
+				shard.socketTable.forEach(
+					[this](SocketInfo& info)
+					{
+						_logger.trace("Socket %8?d -> %4d; %8Ld; %2z"s, info.pSocket->sockfd(), info.mode, info.timeout.totalMilliseconds(), info.pendingSends.size());
+					}
+				);
+				lastSocketDump.update();
+			}
+
+			Poco::Timespan pollTimeout = handleTimeouts(shard);
+			if (!shard.readyList.empty())
+				pollTimeout = 0;
+			else if (!shard.scheduledTasks.empty())
+				pollTimeout = scheduledTasksTimeout(shard, pollTimeout);
+			Poco::Clock pollStart;
+			shard.pollSet.poll(pollTimeout, shard.events);
+			Poco::Clock pollEnd;
+			shard.pollWait.record(pollEnd - pollStart);
+			for (const auto& event: shard.events)
+			{
+				// A handler may remove (and even re-add) sockets while we're
+				// still processing events, so the handle must be resolved again
+				// after every callback.
+				SocketInfo* pInfo = shard.socketTable.find(event.pUserData);
+				if (!pInfo) continue;
+
+				pInfo->activity.update();
+				if (event.mode & Poco::Net::PollSet::POLL_READ)
+				{
+					readable(shard, pInfo);
+				}
+				if ((event.mode & Poco::Net::PollSet::POLL_WRITE) && shard.socketTable.find(event.pUserData))
+				{
+					writable(shard, pInfo);
+				}
+				if ((event.mode & Poco::Net::PollSet::POLL_ERROR) && shard.socketTable.find(event.pUserData))
+				{
+					exception(pInfo);
+				}
+			}
+			if (!shard.readyList.empty())
+			{
+				handleReadyList(shard);
+			}
+			if (!shard.scheduledTasks.empty())
+			{
+				runScheduledTasks(shard);
+			}
+
+			executeCommands(shard);
+			shard.retiredHandlers.clear();
+
+			Poco::Clock iterationEnd;
+			shard.loopTime.record((pollStart - iterationStart) + (iterationEnd - pollEnd));
+			count(shard.iterations, 1);
+			iterationStart = iterationEnd;
+			if (shard.socketTable.empty())
+			{
+				waitForCommands(shard);
+				iterationStart.update();
+			}
+		}
+		catch (Poco::Net::NetException& exc)
+		{
+			if (exc.code() == POCO_ENOTCONN)
+			{
+				_logger.debug("A socket is no longer connected."s);
+			}
+			else
+			{
+				_logger.error("Network exception in socket dispatcher: %s"s, exc.displayText());
+			}
+		}
+		catch (Poco::Exception& exc)
+		{
+			_logger.error("Exception in socket dispatcher: %s"s, exc.displayText());
+		}
 	}
 
-	void execute()
+	_pCurrentShard = nullptr;
+}
+
+
+SocketDispatcher::Completion::Completion():
+	_done(false),
+	_result(false)
+{
+}
+
+
+void SocketDispatcher::Completion::wait()
+{
+	_event.tryWait(TASK_WAIT_TIMEOUT);
+}
+
+
+bool SocketDispatcher::Completion::tryWait(long milliseconds)
+{
+	if (_done) return true;
+	_event.tryWait(milliseconds);
+	return _done;
+}
+
+
+bool SocketDispatcher::Completion::done() const
+{
+	return _done;
+}
+
+
+bool SocketDispatcher::Completion::result() const
+{
+	return _result;
+}
+
+
+void SocketDispatcher::Completion::complete(bool result)
+{
+	_result = result;
+	_done = true;
+	_event.set();
+}
+
+
+SocketDispatcher::CommandQueue::CommandQueue(std::size_t capacity):
+	_pSlots(new Slot[capacity]),
+	_mask(capacity - 1),
+	_enqueuePos(0),
+	_dequeuePos(0)
+{
+	poco_assert ((capacity & _mask) == 0);
+
+	for (std::size_t i = 0; i < capacity; i++)
 	{
-		AutoSetEvent ase(_done);
+		_pSlots[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
 
-		_dispatcher.sendBytesImpl(_socket, std::move(_buffer), _options);
+bool SocketDispatcher::CommandQueue::tryEnqueue(Command&& command)
+{
+	std::size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		Slot& slot = _pSlots[pos & _mask];
+		std::size_t seq = slot.sequence.load(std::memory_order_acquire);
+		std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+		if (diff == 0)
+		{
+			if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				slot.command = std::move(command);
+				slot.sequence.store(pos + 1, std::memory_order_release);
+				return true;
+			}
+		}
+		else if (diff < 0)
+		{
+			return false;
+		}
+		else
+		{
+			pos = _enqueuePos.load(std::memory_order_relaxed);
+		}
 	}
+}
 
-private:
-	Poco::Net::StreamSocket _socket;
-	Poco::Buffer<char> _buffer;
-	int _options;
-};
 
+bool SocketDispatcher::CommandQueue::tryDequeue(Command& command)
+{
+	std::size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+	Slot& slot = _pSlots[pos & _mask];
+	std::size_t seq = slot.sequence.load(std::memory_order_acquire);
+	if (static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1) < 0)
+	{
+		return false;
+	}
+	command = std::move(slot.command);
+	slot.command = Command();
+	_dequeuePos.store(pos + 1, std::memory_order_relaxed);
+	slot.sequence.store(pos + _mask + 1, std::memory_order_release);
+	return true;
+}
 
-class ShutdownSendNotification: public SocketDispatcher::TaskNotification
+
+bool SocketDispatcher::CommandQueue::empty() const
 {
-public:
-	using Ptr = Poco::AutoPtr<ShutdownSendNotification>;
+	std::size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+	std::size_t seq = _pSlots[pos & _mask].sequence.load(std::memory_order_acquire);
+	return static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1) < 0;
+}
+
 
-	ShutdownSendNotification(SocketDispatcher& dispatcher, const Poco::Net::StreamSocket& socket):
-		TaskNotification(dispatcher),
-		_socket(socket)
+void SocketDispatcher::readable(Shard& shard, SocketDispatcher::SocketInfo* pInfo)
+{
+	Poco::Net::StreamSocket ss(pInfo->pSocket.duplicate());
+	shard.activeSocket = ss;
+	shard.pActiveInfo = pInfo;
+	try
+	{
+		if (pInfo->mode & Poco::Net::PollSet::POLL_EDGE)
+		{
+			// With edge-triggered polling, the handler is responsible for
+			// reading until the socket would block, or for calling markReadable().
+			pInfo->pHandler->readable(*this, ss);
+		}
+		else
+		{
+			SocketTable::Handle handle = SocketTable::handle(*pInfo);
+			do
+			{
+				pInfo->pHandler->readable(*this, ss);
+			}
+			while (shard.socketTable.find(handle) && readEnabled(*pInfo) && ss.available() > 0 && !ss.poll(0, Poco::Net::PollSet::POLL_READ));
+			// Need to loop here as there could still be buffered data in an internal socket 
+			// buffer (especially with SecureStreamSocket) that would not be indicated by PollSet.
+			// However, we don't want to be stuck handling just that one
+			// socket if a peer drowns us in data. 
+		}
+	}
+	catch (Poco::Exception& exc)
 	{
+		_logger.log(exc);
 	}
+	shard.pActiveInfo = nullptr;
+}
 
-	void execute()
+
+void SocketDispatcher::handleReadyList(Shard& shard)
+{
+	std::vector<SocketTable::Handle> readyList;
+	readyList.swap(shard.readyList);
+	for (auto handle: readyList)
 	{
-		AutoSetEvent ase(_done);
+		SocketInfo* pInfo = shard.socketTable.find(handle);
+		if (pInfo && (pInfo->pollMode & Poco::Net::PollSet::POLL_READ) && !pInfo->throttled)
+		{
+			readable(shard, pInfo);
+		}
+	}
+	readyList.clear();
+	if (shard.readyList.empty()) readyList.swap(shard.readyList);
+}
+
+
+void SocketDispatcher::runScheduledTasks(Shard& shard)
+{
+	Poco::Clock now;
+	auto it = std::partition(shard.scheduledTasks.begin(), shard.scheduledTasks.end(),
+		[&now](const ScheduledTask& scheduled)
+		{
+			return now < scheduled.due;
+		}
+	);
+	if (it == shard.scheduledTasks.end()) return;
+
+	std::vector<ScheduledTask> dueTasks;
+	std::move(it, shard.scheduledTasks.end(), std::back_inserter(dueTasks));
+	shard.scheduledTasks.erase(it, shard.scheduledTasks.end());
 
-		_dispatcher.shutdownSendImpl(_socket);
+	// Tasks may schedule new tasks, so shard.scheduledTasks must not be iterated here.
+	for (auto& scheduled: dueTasks)
+	{
+		if (shard.socketTable.find(scheduled.handle))
+		{
+			try
+			{
+				scheduled.task(*this);
+			}
+			catch (Poco::Exception& exc)
+			{
+				_logger.log(exc);
+			}
+		}
 	}
+}
 
-private:
-	Poco::Net::StreamSocket _socket;
-};
 
+Poco::Timespan SocketDispatcher::scheduledTasksTimeout(Shard& shard, Poco::Timespan timeout) const
+{
+	Poco::Clock now;
+	for (const auto& scheduled: shard.scheduledTasks)
+	{
+		if (scheduled.due <= now) return 0;
 
-SocketDispatcher::SocketDispatcher(Poco::Timespan timeout):
-	_timeout(timeout),
-	_stopped(false),
-	_logger(Poco::Logger::get("WebTunnel.SocketDispatcher"s))
+		// round up to full milliseconds, as that's the resolution of poll()
+		Poco::Timespan remaining(((scheduled.due - now + 999)/1000)*1000);
+		if (remaining < timeout) timeout = remaining;
+	}
+	return timeout;
+}
+
+
+void SocketDispatcher::writable(Shard& shard, SocketDispatcher::SocketInfo* pInfo)
 {
-	_thread.start(*this);
+	try
+	{
+		Poco::Net::StreamSocket ss(pInfo->pSocket.duplicate());
+		if (pInfo->pendingSends.empty())
+		{
+			pInfo->pHandler->writable(*this, ss);
+		}
+		else
+		{
+			std::size_t written = 0;
+			while (!pInfo->pendingSends.empty())
+			{
+				PendingSend& pending = *pInfo->pendingSends.begin();
+				if (pending.options == PendingSend::OPT_SHUTDOWN)
+				{
+					_logger.debug("Shutting down socket %?d..."s, ss.impl()->sockfd());
+					if (ss.shutdownSend() >= 0)
+					{
+						_logger.debug("Shut down socket %?d."s, ss.impl()->sockfd());
+						if (pInfo->pendingSends.size() > 1)
+						{
+							_logger.debug("Discarding pending writes after shutdown."s);
+						}
+						pInfo->pendingSends.clear();
+						pInfo->pendingBytes = 0;
+					}
+					else break;
+				}
+				else if (pInfo->gatherWrites && pending.options == 0 && pInfo->pendingSends.size() > 1)
+				{
+					std::size_t pendingBytes = pInfo->pendingBytes;
+					bool complete = sendPendingGathered(shard, ss, *pInfo);
+					written += pendingBytes - pInfo->pendingBytes;
+					if (!complete) break;
+				}
+				else
+				{
+					int sent = ss.sendBytes(pending.begin(), static_cast<int>(pending.size()), pending.options);
+					if (sent > 0)
+					{
+						pending.offset += sent;
+						pInfo->pendingBytes -= sent;
+						written += sent;
+						if (pending.size() > 0) break;
+						pInfo->pendingSends.pop_front();
+					}
+					else break;
+				}
+			}
+			updatePollMode(shard, ss, *pInfo);
+			if (!pInfo->throttledSources.empty() && pInfo->pendingBytes <= pInfo->lowWatermark)
+			{
+				resumeSources(shard, *pInfo);
+			}
+			if (written > 0)
+			{
+				SocketHandler::Ptr pHandler = pInfo->pHandler;
+				pHandler->sent(*this, ss, written);
+			}
+		}
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.log(exc);
+	}
 }
 
 
-SocketDispatcher::~SocketDispatcher()
+bool SocketDispatcher::sendPendingGathered(Shard& shard, Poco::Net::StreamSocket& socket, SocketInfo& info)
 {
-	try
+	Poco::Net::SocketBufVec& buffers = shard.gatherBuffers;
+	buffers.clear();
+	for (auto& pending: info.pendingSends)
 	{
-		stop();
+		if (pending.options != 0 || buffers.size() == MAX_GATHER_BUFFERS) break;
+		buffers.push_back(Poco::Net::Socket::makeBuffer(pending.begin(), pending.size()));
 	}
-	catch (...)
+
+	int sent = socket.sendBytes(buffers);
+	if (sent <= 0) return false;
+
+	std::size_t remaining = static_cast<std::size_t>(sent);
+	info.pendingBytes -= remaining;
+	while (remaining > 0)
 	{
-		poco_unexpected();
+		PendingSend& pending = info.pendingSends.front();
+		if (remaining < pending.size())
+		{
+			pending.offset += remaining;
+			return false;
+		}
+		remaining -= pending.size();
+		info.pendingSends.pop_front();
 	}
+	return true;
 }
 
 
-void SocketDispatcher::stop()
+void SocketDispatcher::exception(SocketDispatcher::SocketInfo* pInfo)
 {
-	if (!stopped())
-	{	
-		_stopped = true;
-		_queue.wakeUpAll();
-		_thread.join();
-		_socketMap.clear();
-		_pollSet.clear();
+	try
+	{
+		Poco::Net::StreamSocket ss(pInfo->pSocket.duplicate());
+		pInfo->pHandler->exception(*this, ss);
+	}
+	catch (Poco::Exception& exc)
+	{
+		_logger.log(exc);
 	}
 }
 
 
-void SocketDispatcher::reset()
+void SocketDispatcher::timeout(SocketDispatcher::SocketInfo* pInfo)
 {
-	ResetNotification::Ptr pNf = new ResetNotification(*this);
-	_queue.enqueueNotification(pNf);
-	_pollSet.wakeUp();
-	if (!inDispatcherThread())
+	try
+	{
+		Poco::Net::StreamSocket ss(pInfo->pSocket.duplicate());
+		pInfo->pHandler->timeout(*this, ss);
+	}
+	catch (Poco::Exception& exc)
 	{
-		pNf->wait();
+		_logger.log(exc);
 	}
 }
 
 
-void SocketDispatcher::addSocket(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout)
+Poco::Timespan SocketDispatcher::handleTimeouts(Shard& shard)
 {
-	AddSocketNotification::Ptr pNf = new AddSocketNotification(*this, socket, pHandler, mode, timeout);
-	_queue.enqueueNotification(pNf);
-	_pollSet.wakeUp();
-	if (!inDispatcherThread())
+#if defined(POCO_HAVE_FD_EPOLL)
+	// PollSet::wakeUp() interrupts poll(), so we can wait until the next timeout is due.
+	Poco::Timespan maxTimeout(MAIN_QUEUE_TIMEOUT*Poco::Timespan::MILLISECONDS);
+#else
+	// PollSet::wakeUp() is not supported, so we must check the queue periodically.
+	Poco::Timespan maxTimeout(_timeout);
+#endif
+
+	Poco::Clock now;
+	while (!shard.timerQueue.empty())
 	{
-		pNf->wait();
+		const TimerQueue::Entry& top = shard.timerQueue.top();
+		if (now < top.pInfo->deadline)
+		{
+			// round up to full milliseconds, as that's the resolution of poll()
+			Poco::Timespan timeout(((top.pInfo->deadline - now + 999)/1000)*1000);
+			return timeout < maxTimeout ? timeout : maxTimeout;
+		}
+
+		SocketInfo* pInfo = top.pInfo;
+		Poco::Net::StreamSocket socket(pInfo->pSocket.duplicate());
+		if (pInfo->timeout.totalMicroseconds() <= pInfo->activity.elapsed())
+		{
+			pInfo->activity.update();
+			shard.timerQueue.schedule(socket, *pInfo);
+			timeout(pInfo);
+		}
+		else
+		{
+			shard.timerQueue.schedule(socket, *pInfo);
+		}
 	}
+	return maxTimeout;
 }
 
 
-void SocketDispatcher::updateSocket(const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout)
+void SocketDispatcher::TimerQueue::schedule(const Poco::Net::Socket& socket, SocketInfo& info)
 {
-	if (inDispatcherThread())
+	if (info.timeout == 0)
 	{
-		updateSocketImpl(socket, mode, timeout);
+		cancel(info);
+		return;
 	}
-	else
+
+	info.deadline = info.activity + info.timeout.totalMicroseconds();
+	if (info.timerIndex == NO_INDEX)
 	{
-		UpdateSocketNotification::Ptr pNf = new UpdateSocketNotification(*this, socket, mode, timeout);
-		_queue.enqueueNotification(pNf);
-		_pollSet.wakeUp();
-		pNf->wait();
+		info.timerIndex = _heap.size();
+		_heap.push_back(Entry{socket, &info});
 	}
+	siftUp(info.timerIndex);
+	siftDown(info.timerIndex);
 }
 
 
-void SocketDispatcher::removeSocket(const Poco::Net::StreamSocket& socket)
+void SocketDispatcher::TimerQueue::cancel(SocketInfo& info)
 {
-	RemoveSocketNotification::Ptr pNf = new RemoveSocketNotification(*this, socket);
-	_queue.enqueueNotification(pNf);
-	_pollSet.wakeUp();
-	if (!inDispatcherThread())
+	std::size_t index = info.timerIndex;
+	if (index != NO_INDEX)
 	{
-		pNf->wait();
+		std::size_t last = _heap.size() - 1;
+		if (index != last)
+		{
+			swap(index, last);
+		}
+		_heap.pop_back();
+		info.timerIndex = NO_INDEX;
+		if (index < _heap.size())
+		{
+			siftUp(index);
+			siftDown(index);
+		}
 	}
 }
 
 
-void SocketDispatcher::closeSocket(const Poco::Net::StreamSocket& socket)
+void SocketDispatcher::TimerQueue::clear()
 {
-	CloseSocketNotification::Ptr pNf = new CloseSocketNotification(*this, socket);
-	_queue.enqueueNotification(pNf);
-	_pollSet.wakeUp();
-	if (!inDispatcherThread())
+	for (auto& entry: _heap)
 	{
-		pNf->wait();
+		entry.pInfo->timerIndex = NO_INDEX;
 	}
+	_heap.clear();
 }
 
 
-bool SocketDispatcher::hasSocket(const Poco::Net::StreamSocket& socket)
+SocketDispatcher::SocketInfo* SocketDispatcher::SocketTable::find(const Poco::Net::Socket& socket)
 {
-	if (inDispatcherThread())
-	{
-		return hasSocketImpl(socket);
-	}
-	else
+	poco_socket_t fd = socket.impl()->sockfd();
+	if (fd != POCO_INVALID_SOCKET)
 	{
-		HasSocketNotification::Ptr pNf = new HasSocketNotification(*this, socket);
-		_queue.enqueueNotification(pNf);
-		_pollSet.wakeUp();
-		pNf->wait();
-		return pNf->result();
+		SocketInfo* pInfo = slot(static_cast<std::size_t>(fd));
+		if (pInfo && pInfo->used && pInfo->pSocket == socket.impl())
+			return pInfo;
+		else
+			return nullptr;
 	}
+
+	// The socket has been closed before removing it, so we
+	// no longer know its descriptor and must search for it.
+	SocketInfo* pFound = nullptr;
+	forEach(
+		[&socket, &pFound](SocketInfo& info)
+		{
+			if (info.pSocket == socket.impl()) pFound = &info;
+		}
+	);
+	return pFound;
 }
 
 
-void SocketDispatcher::sendBytes(Poco::Net::StreamSocket& socket, const void* buffer, std::size_t length, int options)
+SocketDispatcher::SocketInfo* SocketDispatcher::SocketTable::at(const Poco::Net::Socket& socket)
 {
-	if (inDispatcherThread())
-	{
-		sendBytesImpl(socket, Poco::Buffer<char>(reinterpret_cast<const char*>(buffer), length), options);
-	}
+	poco_socket_t fd = socket.impl()->sockfd();
+	if (fd == POCO_INVALID_SOCKET) return nullptr;
+
+	SocketInfo* pInfo = slot(static_cast<std::size_t>(fd));
+	if (pInfo && pInfo->used)
+		return pInfo;
 	else
-	{
-		SendBytesNotification::Ptr pNf = new SendBytesNotification(*this, socket, buffer, length, options);
-		_queue.enqueueNotification(pNf);
-		_pollSet.wakeUp();
-		pNf->wait();
-	}
+		return nullptr;
 }
 
 
-void SocketDispatcher::shutdownSend(Poco::Net::StreamSocket& socket)
+SocketDispatcher::SocketInfo& SocketDispatcher::SocketTable::insert(const Poco::Net::Socket& socket)
 {
-	if (inDispatcherThread())
+	poco_socket_t fd = socket.impl()->sockfd();
+	if (fd == POCO_INVALID_SOCKET) throw Poco::InvalidArgumentException("Cannot add a closed socket to SocketDispatcher"s);
+
+	std::size_t index = static_cast<std::size_t>(fd);
+	if (index > INDEX_MASK) throw Poco::RangeException("Socket descriptor out of range"s);
+
+	std::size_t block = index/BLOCK_SIZE;
+	if (block >= _blocks.size())
 	{
-		shutdownSendImpl(socket);
+		_blocks.resize(block + 1);
 	}
-	else
+	if (!_blocks[block])
 	{
-		ShutdownSendNotification::Ptr pNf = new ShutdownSendNotification(*this, socket);
-		_queue.enqueueNotification(pNf);
-		_pollSet.wakeUp();
-		pNf->wait();
+		_blocks[block].reset(new SocketInfo[BLOCK_SIZE]);
+		for (std::size_t i = 0; i < BLOCK_SIZE; i++)
+		{
+			_blocks[block][i].index = block*BLOCK_SIZE + i;
+		}
 	}
+
+	SocketInfo& info = _blocks[block][index % BLOCK_SIZE];
+	poco_assert (!info.used);
+	info.pSocket.assign(socket.impl(), true);
+	info.activity.update();
+	info.used = true;
+	_size++;
+	return info;
 }
 
 
-void SocketDispatcher::run()
+void SocketDispatcher::SocketTable::release(SocketInfo& info)
 {
-	Poco::Timespan currentTimeout(_timeout);
-	Poco::Timestamp lastSocketDump;
-	while (!stopped())
-	{
-		try
-		{
-			bool dumpSockets = false;
-			if (_logger.trace() && lastSocketDump.isElapsed(30*Poco::Timestamp::resolution()))
-			{
-				_logger.trace("Have %z sockets in dispatcher, %z in PollSet."s, _socketMap.size(), _pollSet.size());
-				dumpSockets = true;
-				lastSocketDump.update();
-			}
-			for (SocketMap::iterator it = _socketMap.begin(); it != _socketMap.end(); ++it)
-			{
-				if (dumpSockets)
-				{
-					_logger.trace("Socket %8?d -> %4d; %8Ld; %2z"s, it->first.impl()->sockfd(), it->second->mode, it->second->timeout.totalMilliseconds(), it->second->pendingSends.size());
-				}
-				if (it->second->timeout != 0 && it->second->timeout < it->second->activity.elapsed())
-				{
-					it->second->activity.update();
-					timeout(it->first, it->second);
-				}
-				if (it->second->pendingSends.empty())
-				{
-					_pollSet.update(it->first, it->second->mode);
-				}
-				else
-				{
-					_pollSet.update(it->first, (it->second->mode & ~Poco::Net::PollSet::POLL_READ) | Poco::Net::PollSet::POLL_WRITE);
-				}
-			}
+	poco_assert (info.used);
+
+	// The record is reset in place, so that releasing it does not
+	// allocate, and its containers keep their capacity for reuse.
+	info.pSocket.reset();
+	info.pHandler.reset();
+	info.mode = 0;
+	info.pollMode = 0;
+	info.timeout = 0;
+	info.timerIndex = TimerQueue::NO_INDEX;
+	info.gatherWrites = false;
+	info.pendingBytes = 0;
+	info.highWatermark = 0;
+	info.lowWatermark = 0;
+	info.throttled = false;
+	info.throttledSources.clear();
+	info.pendingSends.clear();
+	info.bytesReceived = 0;
+	info.framesReceived = 0;
+	info.bytesSent = 0;
+	info.framesSent = 0;
+	info.generation++;
+	info.used = false;
+	_size--;
+}
 
-			Poco::Net::PollSet::SocketModeMap socketModeMap = _pollSet.poll(currentTimeout);
-			if (!socketModeMap.empty())
-			{
-				currentTimeout = _timeout;
-				for (Poco::Net::PollSet::SocketModeMap::const_iterator it = socketModeMap.begin(); it != socketModeMap.end(); ++it)
-				{
-					SocketMap::iterator its = _socketMap.find(it->first);
-					if (its != _socketMap.end())
-					{
-						its->second->activity.update();
-						if (it->second & Poco::Net::PollSet::POLL_READ)
-						{
-							readable(its->first, its->second);
-						}
-						if ((it->second & Poco::Net::PollSet::POLL_WRITE))
-						{
-							writable(its->first, its->second);
-						}
-						if (it->second & Poco::Net::PollSet::POLL_ERROR)
-						{
-							exception(its->first, its->second);
-						}
-					}
-				}
-			}
-			else
-			{
-				if (currentTimeout.totalMicroseconds() < 4*_timeout.totalMicroseconds()) currentTimeout += _timeout.totalMicroseconds()/2;
-			}
 
-			Poco::Notification::Ptr pNf = _socketMap.empty() ? _queue.waitDequeueNotification(MAIN_QUEUE_TIMEOUT) : _queue.dequeueNotification();
-			while (pNf)
-			{
-				TaskNotification::Ptr pTaskNf = pNf.cast<TaskNotification>();
-				if (pTaskNf)
-				{
-					pTaskNf->execute();
-				}
-				pNf = _socketMap.empty() ? _queue.waitDequeueNotification(MAIN_QUEUE_TIMEOUT) : _queue.dequeueNotification();
-			}
-		}
-		catch (Poco::Net::NetException& exc)
+void SocketDispatcher::SocketTable::clear()
+{
+	forEach(
+		[this](SocketInfo& info)
 		{
-			if (exc.code() == POCO_ENOTCONN)
-			{
-				_logger.debug("A socket is no longer connected."s);
-			}
-			else
-			{
-				_logger.error("Network exception in socket dispatcher: %s"s, exc.displayText());
-			}
+			release(info);
 		}
-		catch (Poco::Exception& exc)
+	);
+}
+
+
+void SocketDispatcher::TimerQueue::siftUp(std::size_t index)
+{
+	while (index > 0)
+	{
+		std::size_t parent = (index - 1)/2;
+		if (_heap[index].pInfo->deadline < _heap[parent].pInfo->deadline)
 		{
-			_logger.error("Exception in socket dispatcher: %s"s, exc.displayText());
+			swap(index, parent);
+			index = parent;
 		}
+		else break;
 	}
 }
 
 
-void SocketDispatcher::readable(const Poco::Net::Socket& socket, SocketDispatcher::SocketInfo::Ptr pInfo)
+void SocketDispatcher::TimerQueue::siftDown(std::size_t index)
 {
-	try
+	std::size_t size = _heap.size();
+	for (;;)
 	{
-		Poco::Net::StreamSocket ss(socket);
-		do
-		{
-			pInfo->pHandler->readable(*this, ss);
-		}
-		while (ss.available() > 0 && !ss.poll(0, Poco::Net::PollSet::POLL_READ));
-		// Need to loop here as there could still be buffered data in an internal socket 
-		// buffer (especially with SecureStreamSocket) that would not be indicated by PollSet.
-		// However, we don't want to be stuck handling just that one
-		// socket if a peer drowns us in data. 
+		std::size_t smallest = index;
+		std::size_t left = 2*index + 1;
+		std::size_t right = left + 1;
+		if (left < size && _heap[left].pInfo->deadline < _heap[smallest].pInfo->deadline) smallest = left;
+		if (right < size && _heap[right].pInfo->deadline < _heap[smallest].pInfo->deadline) smallest = right;
+		if (smallest == index) break;
+		swap(index, smallest);
+		index = smallest;
 	}
-	catch (Poco::Exception& exc)
+}
+
+
+void SocketDispatcher::TimerQueue::swap(std::size_t i, std::size_t j)
+{
+	std::swap(_heap[i], _heap[j]);
+	_heap[i].pInfo->timerIndex = i;
+	_heap[j].pInfo->timerIndex = j;
+}
+
+
+void SocketDispatcher::addSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout)
+{
+	_logger.trace("Adding socket %?d (%d) to shard %d..."s, socket.impl()->sockfd(), mode, shard.index);
+	mode |= Poco::Net::PollSet::POLL_ERROR;
+	assignShard(socket, shard);
+	SocketInfo* pOld = shard.socketTable.at(socket);
+	if (pOld)
 	{
-		_logger.log(exc);
+		// Either the socket is re-added, or a socket that has been
+		// closed without removing it had the same descriptor.
+		if (pOld->pSocket != socket.impl()) unassignShard(Poco::Net::StreamSocket(pOld->pSocket.duplicate()), shard);
+		retireSocket(shard, *pOld);
 	}
+	SocketInfo& info = shard.socketTable.insert(socket);
+	shard.load++;
+	info.pHandler = pHandler;
+	info.mode = mode;
+	info.pollMode = mode;
+	info.timeout = timeout;
+	// Only plain TCP sockets can use writev(), as WebSocket
+	// and TLS sockets must process every buffer individually.
+	info.gatherWrites = typeid(*socket.impl()) == typeid(Poco::Net::StreamSocketImpl);
+	info.highWatermark = _highWatermark;
+	info.lowWatermark = _lowWatermark;
+	shard.pollSet.add(socket, mode, SocketTable::handle(info));
+	shard.timerQueue.schedule(socket, info);
 }
 
 
-void SocketDispatcher::writable(const Poco::Net::Socket& socket, SocketDispatcher::SocketInfo::Ptr pInfo)
+void SocketDispatcher::updateSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout)
 {
-	try
+	SocketInfo* pInfo = shard.socketTable.find(socket);
+	if (pInfo)
 	{
-		Poco::Net::StreamSocket ss(socket);
-		if (pInfo->pendingSends.empty())
-		{
-			pInfo->pHandler->writable(*this, ss);
-		}
-		else
+		if (timeout != 0)
 		{
-			while (!pInfo->pendingSends.empty())
-			{
-				PendingSend& pending = *pInfo->pendingSends.begin();
-				if (pending.options == PendingSend::OPT_SHUTDOWN)
-				{
-					_logger.debug("Shutting down socket %?d..."s, ss.impl()->sockfd());
-					if (ss.shutdownSend() >= 0)
-					{
-						_logger.debug("Shut down socket %?d."s, ss.impl()->sockfd());
-						if (pInfo->pendingSends.size() > 1)
-						{
-							_logger.debug("Discarding pending writes after shutdown."s);
-						}
-						pInfo->pendingSends.clear();
-					}
-					else break;
-				}
-				else
-				{
-					int sent = ss.sendBytes(pending.buffer.begin(), static_cast<int>(pending.buffer.size()), pending.options);
-					if (sent > 0)
-					{
-						if (sent < pending.buffer.size())
-						{
-							std::memmove(pending.buffer.begin(), pending.buffer.begin() + sent, pending.buffer.size() - sent);
-							pending.buffer.resize(pending.buffer.size() - sent);
-							break;
-						}
-						else
-						{
-							pInfo->pendingSends.pop_front();
-						}
-					}
-					else break;
-				}
-			}
+			pInfo->timeout = timeout;
+			shard.timerQueue.schedule(socket, *pInfo);
 		}
-	}
-	catch (Poco::Exception& exc)
-	{
-		_logger.log(exc);
+		mode |= Poco::Net::PollSet::POLL_ERROR;
+		_logger.trace("Updating socket %?d (%d -> %d)..."s, socket.impl()->sockfd(), pInfo->mode, mode);
+		pInfo->mode = mode;
+		updatePollMode(shard, socket, *pInfo);
 	}
 }
 
 
-void SocketDispatcher::exception(const Poco::Net::Socket& socket, SocketDispatcher::SocketInfo::Ptr pInfo)
+void SocketDispatcher::updatePollMode(Shard& shard, const Poco::Net::Socket& socket, SocketInfo& info)
 {
-	try
+	int pollMode = info.mode;
+	if (!info.pendingSends.empty())
 	{
-		Poco::Net::StreamSocket ss(socket);
-		pInfo->pHandler->exception(*this, ss);
+		pollMode = (pollMode & ~Poco::Net::PollSet::POLL_READ) | Poco::Net::PollSet::POLL_WRITE;
 	}
-	catch (Poco::Exception& exc)
+	if (info.throttled)
 	{
-		_logger.log(exc);
+		pollMode &= ~Poco::Net::PollSet::POLL_READ;
+	}
+	if (pollMode != info.pollMode)
+	{
+		shard.pollSet.update(socket, pollMode);
+		info.pollMode = pollMode;
 	}
 }
 
 
-void SocketDispatcher::timeout(const Poco::Net::Socket& socket, SocketDispatcher::SocketInfo::Ptr pInfo)
+void SocketDispatcher::throttleSource(Shard& shard, SocketInfo& info)
 {
-	try
+	SocketInfo* pSource = shard.pActiveInfo;
+	if (pSource && pSource->used && pSource != &info && !pSource->throttled)
 	{
-		Poco::Net::StreamSocket ss(socket);
-		pInfo->pHandler->timeout(*this, ss);
+		_logger.trace("Suspending reading from socket %?d (%z bytes pending in destination)."s, shard.activeSocket.impl()->sockfd(), info.pendingBytes);
+		pSource->throttled = true;
+		info.throttledSources.push_back(shard.activeSocket);
+		updatePollMode(shard, shard.activeSocket, *pSource);
 	}
-	catch (Poco::Exception& exc)
+}
+
+
+void SocketDispatcher::resumeSources(Shard& shard, SocketInfo& info)
+{
+	for (const auto& source: info.throttledSources)
 	{
-		_logger.log(exc);
+		SocketInfo* pInfo = shard.socketTable.find(source);
+		if (pInfo && pInfo->throttled)
+		{
+			_logger.trace("Resuming reading from socket %?d."s, source.impl()->sockfd());
+			pInfo->throttled = false;
+			updatePollMode(shard, source, *pInfo);
+		}
 	}
+	info.throttledSources.clear();
 }
 
 
-void SocketDispatcher::addSocketImpl(const Poco::Net::StreamSocket& socket, SocketHandler::Ptr pHandler, int mode, Poco::Timespan timeout)
+void SocketDispatcher::setWatermarks(std::size_t high, std::size_t low)
 {
-	_logger.trace("Adding socket %?d (%d)..."s, socket.impl()->sockfd(), mode);
-	mode |= Poco::Net::PollSet::POLL_ERROR;
-	_socketMap[socket] = new SocketInfo(pHandler, mode, timeout);
-	_pollSet.add(socket, mode);
+	_highWatermark = high;
+	_lowWatermark = low;
 }
 
 
-void SocketDispatcher::updateSocketImpl(const Poco::Net::StreamSocket& socket, int mode, Poco::Timespan timeout)
+void SocketDispatcher::setWatermarks(const Poco::Net::StreamSocket& socket, std::size_t high, std::size_t low)
 {
-	auto it = _socketMap.find(socket);
-	if (it != _socketMap.end())
-	{
-		if (timeout != 0)
+	Shard* pShard = findShard(socket);
+	if (!pShard) return;
+
+	queueTask(*pShard,
+		[pShard, socket, high, low](SocketDispatcher& dispatcher)
 		{
-			it->second->timeout = timeout;
+			SocketInfo* pInfo = pShard->socketTable.find(socket);
+			if (pInfo)
+			{
+				pInfo->highWatermark = high;
+				pInfo->lowWatermark = low;
+				if (!pInfo->throttledSources.empty() && pInfo->pendingBytes <= low)
+				{
+					dispatcher.resumeSources(*pShard, *pInfo);
+				}
+			}
 		}
-		mode |= Poco::Net::PollSet::POLL_ERROR;
-		_logger.trace("Updating socket %?d (%d -> %d)..."s, socket.impl()->sockfd(), it->second->mode, mode);
-		it->second->mode = mode;
-		_pollSet.update(socket, mode);
-	}
+	);
 }
 
 
-void SocketDispatcher::removeSocketImpl(const Poco::Net::StreamSocket& socket)
+void SocketDispatcher::removeSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket)
 {
-	auto it = _socketMap.find(socket);
-	if (it != _socketMap.end())
+	SocketInfo* pInfo = shard.socketTable.find(socket);
+	if (pInfo)
 	{
 		_logger.trace("Removing socket %?d..."s, socket.impl()->sockfd());
-		_socketMap.erase(it);
+		retireSocket(shard, *pInfo);
+		unassignShard(socket, shard);
 		try
 		{
-			_pollSet.remove(socket);
+			shard.pollSet.remove(socket);
 		}
 		catch (Poco::IOException&)
 		{
@@ -620,54 +1507,105 @@ void SocketDispatcher::removeSocketImpl(const Poco::Net::StreamSocket& socket)
 }
 
 
-void SocketDispatcher::closeSocketImpl(Poco::Net::StreamSocket& socket)
+void SocketDispatcher::closeSocketImpl(Shard& shard, Poco::Net::StreamSocket& socket)
 {
 	_logger.trace("Closing socket %?d..."s, socket.impl()->sockfd());
+	SocketInfo* pInfo = shard.socketTable.find(socket);
+	if (pInfo)
+	{
+		retireSocket(shard, *pInfo);
+	}
 	try
 	{
-		_pollSet.remove(socket);
+		shard.pollSet.remove(socket);
 		socket.close();
 	}
 	catch (Poco::IOException&)
 	{
 	}
-	_socketMap.erase(socket);
+	unassignShard(socket, shard);
+}
+
+
+void SocketDispatcher::retireSocket(Shard& shard, SocketInfo& info)
+{
+	shard.timerQueue.cancel(info);
+	resumeSources(shard, info);
+	// The handler may still be executing, e.g. if it removes its own socket.
+	shard.retiredHandlers.push_back(std::move(info.pHandler));
+	shard.socketTable.release(info);
+	shard.load--;
 }
 
 
-bool SocketDispatcher::hasSocketImpl(const Poco::Net::StreamSocket& socket) const
+bool SocketDispatcher::hasSocketImpl(Shard& shard, const Poco::Net::StreamSocket& socket) const
 {
-	return _socketMap.find(socket) != _socketMap.end();
+	return shard.socketTable.find(socket) != nullptr;
 }
 
 
-void SocketDispatcher::resetImpl()
+void SocketDispatcher::resetImpl(Shard& shard)
 {
-	_socketMap.clear();
-	_pollSet.clear();
+	shard.socketTable.forEach(
+		[this, &shard](SocketInfo& info)
+		{
+			unassignShard(Poco::Net::StreamSocket(info.pSocket.duplicate()), shard);
+			shard.retiredHandlers.push_back(std::move(info.pHandler));
+		}
+	);
+	shard.readyList.clear();
+	shard.scheduledTasks.clear();
+	shard.timerQueue.clear();
+	shard.socketTable.clear();
+	shard.pollSet.clear();
+	shard.load = 0;
 }
 
 
-void SocketDispatcher::sendBytesImpl(Poco::Net::StreamSocket& socket, Poco::Buffer<char>&& buffer, int options)
+void SocketDispatcher::sendBytesImpl(Shard& shard, Poco::Net::StreamSocket& socket, Poco::Buffer<char>&& buffer, int options)
 {
-	auto it = _socketMap.find(socket);
-	if (it != _socketMap.end())
+	SocketInfo* pInfo = shard.socketTable.find(socket);
+	if (pInfo)
 	{
-		if  (it->second->pendingSends.empty())
+		pInfo->bytesSent += buffer.size();
+		pInfo->framesSent++;
+		count(shard.bytesSent, buffer.size());
+		count(shard.framesSent, 1);
+		int sent = 0;
+		if  (pInfo->pendingSends.empty())
 		{
-			int sent = socket.sendBytes(buffer.begin(), static_cast<int>(buffer.size()), options);
+			sent = socket.sendBytes(buffer.begin(), static_cast<int>(buffer.size()), options);
 			if (sent < 0)
 			{
-				it->second->pendingSends.emplace_back(std::move(buffer), options);
+				pInfo->pendingSends.emplace_back(std::move(buffer), options);
 			}
 			else if (sent < buffer.size())
 			{
-				it->second->pendingSends.emplace_back(buffer.begin() + sent, buffer.size() - sent, options);
+				pInfo->pendingSends.emplace_back(std::move(buffer), options, sent);
+			}
+			if (!pInfo->pendingSends.empty())
+			{
+				updatePollMode(shard, socket, *pInfo);
 			}
 		}
 		else
 		{
-			it->second->pendingSends.emplace_back(std::move(buffer), options);
+			pInfo->pendingSends.emplace_back(std::move(buffer), options);
+		}
+		if (!pInfo->pendingSends.empty())
+		{
+			pInfo->pendingBytes += pInfo->pendingSends.back().size();
+			shard.pendingSendBytes.record(pInfo->pendingBytes);
+			if (pInfo->highWatermark > 0 && pInfo->pendingBytes > pInfo->highWatermark)
+			{
+				throttleSource(shard, *pInfo);
+			}
+		}
+		if (sent > 0)
+		{
+			// notify last, as the handler may send more data
+			SocketHandler::Ptr pHandler = pInfo->pHandler;
+			pHandler->sent(*this, socket, sent);
 		}
 	}
 	else
@@ -677,23 +1615,24 @@ void SocketDispatcher::sendBytesImpl(Poco::Net::StreamSocket& socket, Poco::Buff
 }
 
 
-void SocketDispatcher::shutdownSendImpl(Poco::Net::StreamSocket& socket)
+void SocketDispatcher::shutdownSendImpl(Shard& shard, Poco::Net::StreamSocket& socket)
 {
-	auto it = _socketMap.find(socket);
-	if (it != _socketMap.end())
+	SocketInfo* pInfo = shard.socketTable.find(socket);
+	if (pInfo)
 	{
-		if  (it->second->pendingSends.empty())
+		if  (pInfo->pendingSends.empty())
 		{
 			int rc = socket.shutdownSend();
 			if (rc < 0)
 			{
 				// would block, try again later
-				it->second->pendingSends.emplace_back(PendingSend::OPT_SHUTDOWN);
+				pInfo->pendingSends.emplace_back(PendingSend::OPT_SHUTDOWN);
+				updatePollMode(shard, socket, *pInfo);
 			}
 		}
 		else
 		{
-			it->second->pendingSends.emplace_back(PendingSend::OPT_SHUTDOWN);
+			pInfo->pendingSends.emplace_back(PendingSend::OPT_SHUTDOWN);
 		}
 	}
 }
@@ -701,12 +1640,71 @@ void SocketDispatcher::shutdownSendImpl(Poco::Net::StreamSocket& socket)
 
 bool SocketDispatcher::hasPendingSends(const Poco::Net::StreamSocket& socket) const
 {
-	auto it = _socketMap.find(socket);
-	if (it != _socketMap.end())
+	Shard* pShard = findShard(socket);
+	if (pShard)
+	{
+		SocketInfo* pInfo = pShard->socketTable.find(socket);
+		if (pInfo)
+		{
+			return !pInfo->pendingSends.empty();
+		}
+	}
+	return false;
+}
+
+
+SocketDispatcher::Shard* SocketDispatcher::findShard(const Poco::Net::Socket& socket) const
+{
+	if (_shards.size() == 1) return _shards[0].get();
+
+	Poco::FastMutex::ScopedLock lock(_shardMapMutex);
+	auto it = _shardMap.find(socket);
+	if (it != _shardMap.end())
+		return it->second;
+	else
+		return nullptr;
+}
+
+
+SocketDispatcher::Shard& SocketDispatcher::selectShard()
+{
+	Shard* pShard = _shards[0].get();
+	for (auto& p: _shards)
+	{
+		if (p->load < pShard->load) pShard = p.get();
+	}
+	return *pShard;
+}
+
+
+void SocketDispatcher::assignShard(const Poco::Net::Socket& socket, Shard& shard)
+{
+	if (_shards.size() == 1) return;
+
+	Poco::FastMutex::ScopedLock lock(_shardMapMutex);
+	_shardMap[socket] = &shard;
+}
+
+
+void SocketDispatcher::unassignShard(const Poco::Net::Socket& socket, Shard& shard)
+{
+	if (_shards.size() == 1) return;
+
+	Poco::FastMutex::ScopedLock lock(_shardMapMutex);
+	auto it = _shardMap.find(socket);
+	if (it != _shardMap.end() && it->second == &shard)
 	{
-		return !it->second->pendingSends.empty();
+		_shardMap.erase(it);
 	}
-	else return false;
+}
+
+
+SocketDispatcher::Shard* SocketDispatcher::currentShard() const
+{
+	if (_pCurrentShard && &_pCurrentShard->dispatcher == this)
+		return _pCurrentShard;
+	else
+		return nullptr;
 }
 
 
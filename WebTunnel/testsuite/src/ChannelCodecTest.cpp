@@ -0,0 +1,263 @@
+//
+// ChannelCodecTest.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "ChannelCodecTest.h"
+#include "CppUnit/TestCaller.h"
+#include "CppUnit/TestSuite.h"
+#include "Poco/WebTunnel/ChannelCodec.h"
+#include "Poco/Random.h"
+#include "Poco/NumberFormatter.h"
+#include "Poco/Exception.h"
+#include <string>
+#include <vector>
+
+
+using Poco::WebTunnel::ChannelCodec;
+
+
+namespace
+{
+	std::string textFrame(int index, std::size_t size)
+		/// Returns compressible data, different for every index.
+	{
+		std::string frame;
+		while (frame.size() < size)
+		{
+			frame += "GET /api/v1/items/";
+			frame += Poco::NumberFormatter::format(index*1000 + static_cast<int>(frame.size()));
+			frame += " HTTP/1.1\r\nHost: device.local\r\nAccept: application/json\r\n\r\n";
+		}
+		frame.resize(size);
+		return frame;
+	}
+
+	std::string randomFrame(Poco::Random& rnd, std::size_t size)
+		/// Returns incompressible data.
+	{
+		std::string frame(size, '\0');
+		for (auto& c: frame) c = rnd.nextChar();
+		return frame;
+	}
+
+	bool transfer(ChannelCodec& sender, ChannelCodec& receiver, const std::string& frame, std::string& received)
+		/// Sends a frame from sender to receiver, compressed if the
+		/// sender decides so, and returns true if it has been compressed.
+	{
+		if (sender.compress(frame.data(), frame.size()))
+		{
+			receiver.decompress(sender.compressed().begin(), sender.compressed().size(), 65536);
+			received.assign(receiver.decompressed().begin(), receiver.decompressed().size());
+			return true;
+		}
+		else
+		{
+			received = frame;
+			return false;
+		}
+	}
+}
+
+
+ChannelCodecTest::ChannelCodecTest(const std::string& name): CppUnit::TestCase(name)
+{
+}
+
+
+ChannelCodecTest::~ChannelCodecTest()
+{
+}
+
+
+void ChannelCodecTest::testRoundTrip()
+{
+	ChannelCodec sender;
+	ChannelCodec receiver;
+	std::string received;
+	for (int i = 0; i < 50; i++)
+	{
+		std::string frame = textFrame(i, 1000 + 97*i);
+		assertTrue (transfer(sender, receiver, frame, received));
+		assertTrue (sender.compressed().size() < frame.size());
+		assertTrue (received == frame);
+	}
+}
+
+
+void ChannelCodecTest::testContext()
+{
+	ChannelCodec sender(9);
+	ChannelCodec receiver;
+	std::string frame = textFrame(0, 2048);
+	std::string received;
+
+	assertTrue (transfer(sender, receiver, frame, received));
+	assertTrue (received == frame);
+	std::size_t first = sender.compressed().size();
+
+	// The compression context is kept across frames, so a repeated
+	// frame only takes a few bytes, and can only be decompressed
+	// by a receiver that has seen the first frame.
+	assertTrue (transfer(sender, receiver, frame, received));
+	assertTrue (received == frame);
+	assertTrue (sender.compressed().size() < first/4);
+
+	ChannelCodec freshReceiver;
+	try
+	{
+		freshReceiver.decompress(sender.compressed().begin(), sender.compressed().size(), 65536);
+		assertTrue (std::string(freshReceiver.decompressed().begin(), freshReceiver.decompressed().size()) != frame);
+	}
+	catch (Poco::DataFormatException&)
+	{
+	}
+}
+
+
+void ChannelCodecTest::testSmallFrames()
+{
+	ChannelCodec sender;
+	ChannelCodec receiver;
+	std::string frame(ChannelCodec::MIN_COMPRESS_SIZE - 1, 'a');
+	std::string received;
+	assertTrue (!transfer(sender, receiver, frame, received));
+	assertTrue (!transfer(sender, receiver, std::string(), received));
+
+	// Small frames do not affect the compression context.
+	frame = textFrame(1, 1000);
+	assertTrue (transfer(sender, receiver, frame, received));
+	assertTrue (received == frame);
+}
+
+
+void ChannelCodecTest::testBackoff()
+{
+	Poco::Random rnd;
+	rnd.seed(42);
+	ChannelCodec sender;
+	ChannelCodec receiver;
+	std::string received;
+
+	// The number of frames bypassing compression doubles with
+	// every frame that does not compress.
+	std::vector<bool> compressed;
+	for (int i = 0; i < 16; i++)
+	{
+		std::string frame = randomFrame(rnd, 1024);
+		compressed.push_back(transfer(sender, receiver, frame, received));
+		assertTrue (received == frame);
+	}
+	const bool expected[] = {true, false, true, false, false, true, false, false, false, false, true, false, false, false, false, false};
+	for (int i = 0; i < 16; i++)
+	{
+		assertTrue (compressed[i] == expected[i]);
+	}
+
+	// Skip the remaining bypassed frames; a frame that compresses well
+	// ends the backoff, and the contexts of both peers are still in sync.
+	std::string frame = textFrame(2, 1000);
+	int bypassed = 0;
+	while (!transfer(sender, receiver, frame, received))
+	{
+		bypassed++;
+	}
+	assertTrue (bypassed == 3);
+	assertTrue (received == frame);
+
+	frame = randomFrame(rnd, 1024);
+	assertTrue (transfer(sender, receiver, frame, received));
+	assertTrue (received == frame);
+	frame = textFrame(3, 1000);
+	assertTrue (!transfer(sender, receiver, frame, received));
+	assertTrue (transfer(sender, receiver, frame, received));
+	assertTrue (received == frame);
+}
+
+
+void ChannelCodecTest::testLargeFrame()
+{
+	Poco::Random rnd;
+	rnd.seed(7);
+	ChannelCodec sender;
+	ChannelCodec receiver;
+
+	// Data that does not compress must still fit into the output buffer.
+	std::string frame = randomFrame(rnd, 65536);
+	assertTrue (sender.compress(frame.data(), frame.size()));
+	assertTrue (sender.compressed().size() > frame.size());
+	receiver.decompress(sender.compressed().begin(), sender.compressed().size(), frame.size());
+	assertTrue (std::string(receiver.decompressed().begin(), receiver.decompressed().size()) == frame);
+
+	// Data that compresses very well must be decompressed completely.
+	ChannelCodec sender2;
+	ChannelCodec receiver2;
+	frame.assign(65536, 'x');
+	assertTrue (sender2.compress(frame.data(), frame.size()));
+	assertTrue (sender2.compressed().size() < 1024);
+	receiver2.decompress(sender2.compressed().begin(), sender2.compressed().size(), frame.size());
+	assertTrue (std::string(receiver2.decompressed().begin(), receiver2.decompressed().size()) == frame);
+}
+
+
+void ChannelCodecTest::testMaxSize()
+{
+	ChannelCodec sender;
+	ChannelCodec receiver;
+	std::string frame(16384, 'x');
+	assertTrue (sender.compress(frame.data(), frame.size()));
+	try
+	{
+		receiver.decompress(sender.compressed().begin(), sender.compressed().size(), frame.size() - 1);
+		fail("decompressed frame exceeds maximum size - must throw");
+	}
+	catch (Poco::DataFormatException&)
+	{
+	}
+}
+
+
+void ChannelCodecTest::testCorrupt()
+{
+	ChannelCodec receiver;
+	const char garbage[] = "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF";
+	try
+	{
+		receiver.decompress(garbage, sizeof(garbage) - 1, 65536);
+		fail("corrupt data - must throw");
+	}
+	catch (Poco::DataFormatException&)
+	{
+	}
+}
+
+
+void ChannelCodecTest::setUp()
+{
+}
+
+
+void ChannelCodecTest::tearDown()
+{
+}
+
+
+CppUnit::Test* ChannelCodecTest::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("ChannelCodecTest");
+
+	CppUnit_addTest(pSuite, ChannelCodecTest, testRoundTrip);
+	CppUnit_addTest(pSuite, ChannelCodecTest, testContext);
+	CppUnit_addTest(pSuite, ChannelCodecTest, testSmallFrames);
+	CppUnit_addTest(pSuite, ChannelCodecTest, testBackoff);
+	CppUnit_addTest(pSuite, ChannelCodecTest, testLargeFrame);
+	CppUnit_addTest(pSuite, ChannelCodecTest, testMaxSize);
+	CppUnit_addTest(pSuite, ChannelCodecTest, testCorrupt);
+
+	return pSuite;
+}
@@ -0,0 +1,42 @@
+//
+// ChannelCodecTest.h
+//
+// Definition of the ChannelCodecTest class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef ChannelCodecTest_INCLUDED
+#define ChannelCodecTest_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "CppUnit/TestCase.h"
+
+
+class ChannelCodecTest: public CppUnit::TestCase
+{
+public:
+	ChannelCodecTest(const std::string& name);
+	~ChannelCodecTest();
+
+	void testRoundTrip();
+	void testContext();
+	void testSmallFrames();
+	void testBackoff();
+	void testLargeFrame();
+	void testMaxSize();
+	void testCorrupt();
+
+	void setUp();
+	void tearDown();
+
+	static CppUnit::Test* suite();
+};
+
+
+#endif // ChannelCodecTest_INCLUDED
@@ -0,0 +1,147 @@
+//
+// EchoServer.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "EchoServer.h"
+#include "Poco/Net/TCPServerConnection.h"
+#include "Poco/Net/TCPServerConnectionFactory.h"
+#include "Poco/Net/TCPServerParams.h"
+#include "Poco/Net/ServerSocket.h"
+#include "Poco/Net/StreamSocket.h"
+#include "Poco/Net/SocketAddress.h"
+#include "Poco/Timespan.h"
+
+
+using Poco::Net::Socket;
+using Poco::Net::StreamSocket;
+using Poco::Net::ServerSocket;
+using Poco::Net::SocketAddress;
+
+
+namespace
+{
+	class EchoConnection: public Poco::Net::TCPServerConnection
+	{
+	public:
+		EchoConnection(const StreamSocket& socket, const EchoServer& server):
+			Poco::Net::TCPServerConnection(socket),
+			_server(server)
+		{
+		}
+
+		void run()
+		{
+			StreamSocket& ss = socket();
+			try
+			{
+				Poco::Timespan span(100000);
+				char buffer[8192];
+				bool first = true;
+				const std::string& greeting = _server.greeting();
+				if (!greeting.empty()) ss.sendBytes(greeting.data(), static_cast<int>(greeting.size()));
+				while (!_server.stopped())
+				{
+					if (!ss.poll(span, Socket::SELECT_READ)) continue;
+
+					int n = ss.receiveBytes(buffer, sizeof(buffer));
+					if (n <= 0) break;
+					if (first && buffer[0] == 'F')
+					{
+						flood(ss);
+						break;
+					}
+					ss.sendBytes(buffer, n);
+					first = false;
+				}
+				ss.shutdownSend();
+			}
+			catch (Poco::Exception&)
+			{
+			}
+		}
+
+		void flood(StreamSocket& ss)
+		{
+			std::string chunk(8192, 'x');
+			Poco::Timespan span(100000);
+			while (!_server.stopped())
+			{
+				if (ss.poll(span, Socket::SELECT_WRITE))
+				{
+					ss.sendBytes(chunk.data(), static_cast<int>(chunk.size()));
+				}
+			}
+		}
+
+	private:
+		const EchoServer& _server;
+	};
+}
+
+
+class EchoServer::ConnectionFactory: public Poco::Net::TCPServerConnectionFactory
+{
+public:
+	ConnectionFactory(EchoServer& server):
+		_server(server)
+	{
+	}
+
+	Poco::Net::TCPServerConnection* createConnection(const StreamSocket& socket)
+	{
+		_server._connections++;
+		return new EchoConnection(socket, _server);
+	}
+
+private:
+	EchoServer& _server;
+};
+
+
+EchoServer::EchoServer(const std::string& greeting):
+	_greeting(greeting),
+	_threadPool(2, 32),
+	_server(new ConnectionFactory(*this), _threadPool, ServerSocket(SocketAddress("127.0.0.1", 0)), new Poco::Net::TCPServerParams),
+	_connections(0),
+	_stopped(false)
+{
+	_server.start();
+}
+
+
+EchoServer::~EchoServer()
+{
+	_stopped = true;
+	_server.stop();
+	_threadPool.joinAll();
+}
+
+
+Poco::UInt16 EchoServer::port() const
+{
+	return _server.socket().address().port();
+}
+
+
+const std::string& EchoServer::greeting() const
+{
+	return _greeting;
+}
+
+
+int EchoServer::connections() const
+{
+	return _connections;
+}
+
+
+bool EchoServer::stopped() const
+{
+	return _stopped;
+}
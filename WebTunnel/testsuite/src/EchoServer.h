@@ -0,0 +1,65 @@
+//
+// EchoServer.h
+//
+// Definition of the EchoServer class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef EchoServer_INCLUDED
+#define EchoServer_INCLUDED
+
+
+#include "Poco/Net/Net.h"
+#include "Poco/Net/TCPServer.h"
+#include "Poco/ThreadPool.h"
+#include <atomic>
+#include <string>
+
+
+class EchoServer
+	/// A multi-threaded echo server, serving every
+	/// connection in its own thread.
+	///
+	/// If the first byte received is an 'F', the connection floods
+	/// the client with data until the server is stopped.
+{
+public:
+	explicit EchoServer(const std::string& greeting = std::string());
+		/// Creates and starts the EchoServer. If a greeting is given,
+		/// it is sent to the client as soon as a connection is accepted.
+
+	~EchoServer();
+		/// Stops and destroys the EchoServer.
+
+	Poco::UInt16 port() const;
+		/// Returns the port the echo server is
+		/// listening on.
+
+	const std::string& greeting() const;
+		/// Returns the greeting.
+
+	int connections() const;
+		/// Returns the number of connections accepted so far.
+
+	bool stopped() const;
+		/// Returns true if the server is being stopped.
+
+private:
+	class ConnectionFactory;
+
+	std::string _greeting;
+	Poco::ThreadPool _threadPool;
+	Poco::Net::TCPServer _server;
+	std::atomic<int> _connections;
+	std::atomic<bool> _stopped;
+
+	friend class ConnectionFactory;
+};
+
+
+#endif // EchoServer_INCLUDED
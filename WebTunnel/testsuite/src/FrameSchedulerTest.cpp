@@ -0,0 +1,293 @@
+//
+// FrameSchedulerTest.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "FrameSchedulerTest.h"
+#include "CppUnit/TestCaller.h"
+#include "CppUnit/TestSuite.h"
+#include "Poco/WebTunnel/FrameScheduler.h"
+#include "Poco/Buffer.h"
+#include <map>
+#include <vector>
+
+
+using Poco::WebTunnel::FrameScheduler;
+
+
+namespace
+{
+	Poco::Buffer<char> makeFrame(std::size_t size, char tag = 0)
+	{
+		Poco::Buffer<char> frame(size);
+		for (std::size_t i = 0; i < size; i++) frame[i] = tag;
+		return frame;
+	}
+}
+
+
+FrameSchedulerTest::FrameSchedulerTest(const std::string& name): CppUnit::TestCase(name)
+{
+}
+
+
+FrameSchedulerTest::~FrameSchedulerTest()
+{
+}
+
+
+void FrameSchedulerTest::testEmpty()
+{
+	FrameScheduler scheduler(1024);
+	assertTrue (scheduler.empty());
+	assertTrue (scheduler.queuedBytes() == 0);
+	assertTrue (scheduler.queuedBytes(1) == 0);
+
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	assertTrue (!scheduler.dequeue(frame, channel, urgent));
+}
+
+
+void FrameSchedulerTest::testOrder()
+{
+	FrameScheduler scheduler(1024);
+	for (char i = 0; i < 10; i++)
+	{
+		scheduler.enqueue(1, 1, makeFrame(100, i));
+		scheduler.enqueue(2, 1, makeFrame(300, i));
+	}
+	assertTrue (scheduler.queuedBytes(1) == 1000);
+	assertTrue (scheduler.queuedBytes(2) == 3000);
+	assertTrue (scheduler.queuedBytes() == 4000);
+
+	// Frames of a channel must be dequeued in the order they have been enqueued.
+	std::map<Poco::UInt16, char> next;
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	while (scheduler.dequeue(frame, channel, urgent))
+	{
+		assertTrue (!urgent);
+		assertTrue (channel == 1 || channel == 2);
+		assertTrue (frame[0] == next[channel]);
+		next[channel]++;
+	}
+	assertTrue (next[1] == 10);
+	assertTrue (next[2] == 10);
+	assertTrue (scheduler.empty());
+	assertTrue (scheduler.queuedBytes() == 0);
+}
+
+
+void FrameSchedulerTest::testFairness()
+{
+	FrameScheduler scheduler(1000);
+	for (int i = 0; i < 100; i++)
+	{
+		scheduler.enqueue(1, 1, makeFrame(500));
+		scheduler.enqueue(2, 1, makeFrame(500));
+		scheduler.enqueue(3, 1, makeFrame(500));
+	}
+
+	// While all channels have frames queued, no channel may get
+	// more than one quantum ahead of the others.
+	std::map<Poco::UInt16, std::size_t> sent;
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	for (int i = 0; i < 240; i++)
+	{
+		assertTrue (scheduler.dequeue(frame, channel, urgent));
+		sent[channel] += frame.size();
+		for (Poco::UInt16 a = 1; a <= 3; a++)
+		{
+			for (Poco::UInt16 b = 1; b <= 3; b++)
+			{
+				assertTrue (sent[a] <= sent[b] + 1000);
+			}
+		}
+	}
+}
+
+
+void FrameSchedulerTest::testWeights()
+{
+	FrameScheduler scheduler(1000);
+	for (int i = 0; i < 400; i++)
+	{
+		scheduler.enqueue(1, 1, makeFrame(250));
+		scheduler.enqueue(2, 3, makeFrame(250));
+	}
+
+	std::map<Poco::UInt16, std::size_t> sent;
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	for (int i = 0; i < 400; i++)
+	{
+		assertTrue (scheduler.dequeue(frame, channel, urgent));
+		sent[channel] += frame.size();
+	}
+	// Bandwidth is shared in proportion to the weights.
+	assertTrue (sent[1] == 25000);
+	assertTrue (sent[2] == 75000);
+}
+
+
+void FrameSchedulerTest::testFrameSizes()
+{
+	// A channel sending large frames must not get a larger share
+	// than a channel sending small frames.
+	FrameScheduler scheduler(2048);
+	for (int i = 0; i < 1000; i++)
+	{
+		scheduler.enqueue(1, 1, makeFrame(64));
+	}
+	for (int i = 0; i < 100; i++)
+	{
+		scheduler.enqueue(2, 1, makeFrame(2048));
+	}
+
+	std::map<Poco::UInt16, std::size_t> sent;
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	while (sent[1] + sent[2] < 40960)
+	{
+		assertTrue (scheduler.dequeue(frame, channel, urgent));
+		sent[channel] += frame.size();
+	}
+	assertTrue (sent[1] + 2048 >= sent[2]);
+	assertTrue (sent[2] + 2048 >= sent[1]);
+}
+
+
+void FrameSchedulerTest::testUrgent()
+{
+	FrameScheduler scheduler(1024);
+	scheduler.enqueue(1, 1, makeFrame(100, 'a'));
+	scheduler.enqueue(1, 1, makeFrame(100, 'b'));
+
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	assertTrue (scheduler.dequeue(frame, channel, urgent));
+	assertTrue (!urgent);
+	assertTrue (channel == 1);
+	assertTrue (frame[0] == 'a');
+
+	// Urgent frames are sent first, in the order they have been enqueued.
+	scheduler.enqueueUrgent(makeFrame(8, 'x'));
+	scheduler.enqueueUrgent(makeFrame(8, 'y'));
+	assertTrue (!scheduler.empty());
+	assertTrue (scheduler.queuedBytes() == 100);
+
+	assertTrue (scheduler.dequeue(frame, channel, urgent));
+	assertTrue (urgent);
+	assertTrue (channel == 0);
+	assertTrue (frame[0] == 'x');
+	assertTrue (scheduler.dequeue(frame, channel, urgent));
+	assertTrue (urgent);
+	assertTrue (frame[0] == 'y');
+
+	assertTrue (scheduler.dequeue(frame, channel, urgent));
+	assertTrue (!urgent);
+	assertTrue (channel == 1);
+	assertTrue (frame[0] == 'b');
+	assertTrue (scheduler.empty());
+
+	scheduler.enqueueUrgent(makeFrame(8));
+	assertTrue (!scheduler.empty());
+	assertTrue (scheduler.dequeue(frame, channel, urgent));
+	assertTrue (urgent);
+	assertTrue (scheduler.empty());
+}
+
+
+void FrameSchedulerTest::testRemove()
+{
+	FrameScheduler scheduler(1024);
+	for (char i = 0; i < 5; i++)
+	{
+		scheduler.enqueue(1, 1, makeFrame(100, i));
+		scheduler.enqueue(2, 1, makeFrame(200, i));
+		scheduler.enqueue(3, 1, makeFrame(300, i));
+	}
+	scheduler.enqueueUrgent(makeFrame(8));
+
+	scheduler.remove(2);
+	scheduler.remove(4);
+	assertTrue (scheduler.queuedBytes(2) == 0);
+	assertTrue (scheduler.queuedBytes() == 2000);
+
+	std::vector<Poco::UInt16> channels;
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	while (scheduler.dequeue(frame, channel, urgent))
+	{
+		if (!urgent) channels.push_back(channel);
+		assertTrue (channel != 2);
+	}
+	assertTrue (channels.size() == 10);
+
+	// A removed channel can be used again.
+	scheduler.enqueue(2, 1, makeFrame(200, 'z'));
+	assertTrue (scheduler.queuedBytes(2) == 200);
+	assertTrue (scheduler.dequeue(frame, channel, urgent));
+	assertTrue (channel == 2);
+	assertTrue (frame[0] == 'z');
+	assertTrue (scheduler.empty());
+}
+
+
+void FrameSchedulerTest::testClear()
+{
+	FrameScheduler scheduler(1024);
+	scheduler.enqueue(1, 1, makeFrame(100));
+	scheduler.enqueue(2, 2, makeFrame(200));
+	scheduler.enqueueUrgent(makeFrame(8));
+	scheduler.clear();
+	assertTrue (scheduler.empty());
+	assertTrue (scheduler.queuedBytes() == 0);
+	assertTrue (scheduler.queuedBytes(1) == 0);
+
+	Poco::Buffer<char> frame(0);
+	Poco::UInt16 channel;
+	bool urgent;
+	assertTrue (!scheduler.dequeue(frame, channel, urgent));
+}
+
+
+void FrameSchedulerTest::setUp()
+{
+}
+
+
+void FrameSchedulerTest::tearDown()
+{
+}
+
+
+CppUnit::Test* FrameSchedulerTest::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("FrameSchedulerTest");
+
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testEmpty);
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testOrder);
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testFairness);
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testWeights);
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testFrameSizes);
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testUrgent);
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testRemove);
+	CppUnit_addTest(pSuite, FrameSchedulerTest, testClear);
+
+	return pSuite;
+}
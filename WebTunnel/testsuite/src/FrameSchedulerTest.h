@@ -0,0 +1,43 @@
+//
+// FrameSchedulerTest.h
+//
+// Definition of the FrameSchedulerTest class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef FrameSchedulerTest_INCLUDED
+#define FrameSchedulerTest_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "CppUnit/TestCase.h"
+
+
+class FrameSchedulerTest: public CppUnit::TestCase
+{
+public:
+	FrameSchedulerTest(const std::string& name);
+	~FrameSchedulerTest();
+
+	void testEmpty();
+	void testOrder();
+	void testFairness();
+	void testWeights();
+	void testFrameSizes();
+	void testUrgent();
+	void testRemove();
+	void testClear();
+
+	void setUp();
+	void tearDown();
+
+	static CppUnit::Test* suite();
+};
+
+
+#endif // FrameSchedulerTest_INCLUDED
@@ -0,0 +1,166 @@
+//
+// HistogramTest.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "HistogramTest.h"
+#include "CppUnit/TestCaller.h"
+#include "CppUnit/TestSuite.h"
+#include "Poco/WebTunnel/Histogram.h"
+#include <limits>
+
+
+using Poco::WebTunnel::Histogram;
+
+
+HistogramTest::HistogramTest(const std::string& name): CppUnit::TestCase(name)
+{
+}
+
+
+HistogramTest::~HistogramTest()
+{
+}
+
+
+void HistogramTest::testBucketIndex()
+{
+	// Small values have a bucket each.
+	for (Poco::UInt64 v = 0; v < Histogram::SUB_BUCKETS; v++)
+	{
+		assertTrue (Histogram::bucketIndex(v) == v);
+	}
+	assertTrue (Histogram::bucketIndex(32) == 32);
+	assertTrue (Histogram::bucketIndex(63) == 63);
+
+	// From 64, sub-buckets are two values wide.
+	assertTrue (Histogram::bucketIndex(64) == 64);
+	assertTrue (Histogram::bucketIndex(65) == 64);
+	assertTrue (Histogram::bucketIndex(66) == 65);
+	assertTrue (Histogram::bucketIndex(127) == 95);
+	assertTrue (Histogram::bucketIndex(128) == 96);
+
+	assertTrue (Histogram::bucketIndex(1000) == 190);
+	assertTrue (Histogram::bucketIndex(std::numeric_limits<Poco::UInt64>::max()) == Histogram::BUCKETS - 1);
+}
+
+
+void HistogramTest::testBucketLimit()
+{
+	assertTrue (Histogram::bucketLimit(0) == 0);
+	assertTrue (Histogram::bucketLimit(31) == 31);
+	assertTrue (Histogram::bucketLimit(63) == 63);
+	assertTrue (Histogram::bucketLimit(64) == 65);
+	assertTrue (Histogram::bucketLimit(95) == 127);
+	assertTrue (Histogram::bucketLimit(190) == 1007);
+	assertTrue (Histogram::bucketLimit(Histogram::BUCKETS - 1) == std::numeric_limits<Poco::UInt64>::max());
+
+	// Every bucket starts right after the previous one's limit.
+	for (std::size_t i = 1; i < Histogram::BUCKETS; i++)
+	{
+		assertTrue (Histogram::bucketIndex(Histogram::bucketLimit(i - 1) + 1) == i);
+		assertTrue (Histogram::bucketIndex(Histogram::bucketLimit(i)) == i);
+	}
+}
+
+
+void HistogramTest::testRelativeError()
+{
+	for (Poco::UInt64 v = 1; v < (Poco::UInt64(1) << 62); v += v/7 + 1)
+	{
+		Poco::UInt64 limit = Histogram::bucketLimit(Histogram::bucketIndex(v));
+		assertTrue (limit >= v);
+		assertTrue (limit - v <= v/Histogram::SUB_BUCKETS);
+	}
+}
+
+
+void HistogramTest::testEmpty()
+{
+	Histogram histogram;
+	Histogram::Snapshot snapshot = histogram.snapshot();
+	assertTrue (snapshot.count == 0);
+	assertTrue (snapshot.sum == 0);
+	assertTrue (snapshot.max == 0);
+	assertTrue (snapshot.buckets.size() == Histogram::BUCKETS);
+	assertTrue (snapshot.mean() == 0.0);
+	assertTrue (snapshot.percentile(50) == 0);
+}
+
+
+void HistogramTest::testPercentile()
+{
+	Histogram histogram;
+	for (Poco::UInt64 v = 1; v <= 1000; v++)
+	{
+		histogram.record(v);
+	}
+	Histogram::Snapshot snapshot = histogram.snapshot();
+	assertTrue (snapshot.count == 1000);
+	assertTrue (snapshot.sum == 500500);
+	assertTrue (snapshot.max == 1000);
+	assertEqualDelta (500.5, snapshot.mean(), 0.001);
+
+	// 500 is counted in the bucket [496, 503], 990 in [976, 991].
+	assertTrue (snapshot.percentile(50) == 503);
+	assertTrue (snapshot.percentile(99) == 991);
+	assertTrue (snapshot.percentile(0) == 1);
+	assertTrue (snapshot.percentile(100) == 1000);
+
+	// A few outliers only show up in the highest percentiles.
+	Histogram skewed;
+	for (int i = 0; i < 990; i++) skewed.record(10);
+	for (int i = 0; i < 10; i++) skewed.record(100000);
+	snapshot = skewed.snapshot();
+	assertTrue (snapshot.percentile(50) == 10);
+	assertTrue (snapshot.percentile(99) == 10);
+	assertTrue (snapshot.percentile(99.9) == 100000);
+}
+
+
+void HistogramTest::testMerge()
+{
+	Histogram h1;
+	Histogram h2;
+	for (Poco::UInt64 v = 1; v <= 500; v++) h1.record(v);
+	for (Poco::UInt64 v = 501; v <= 1000; v++) h2.record(v);
+
+	Histogram::Snapshot snapshot;
+	snapshot.merge(h1.snapshot());
+	snapshot.merge(h2.snapshot());
+	assertTrue (snapshot.count == 1000);
+	assertTrue (snapshot.sum == 500500);
+	assertTrue (snapshot.max == 1000);
+	assertTrue (snapshot.percentile(50) == 503);
+	assertTrue (snapshot.percentile(99) == 991);
+}
+
+
+void HistogramTest::setUp()
+{
+}
+
+
+void HistogramTest::tearDown()
+{
+}
+
+
+CppUnit::Test* HistogramTest::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("HistogramTest");
+
+	CppUnit_addTest(pSuite, HistogramTest, testBucketIndex);
+	CppUnit_addTest(pSuite, HistogramTest, testBucketLimit);
+	CppUnit_addTest(pSuite, HistogramTest, testRelativeError);
+	CppUnit_addTest(pSuite, HistogramTest, testEmpty);
+	CppUnit_addTest(pSuite, HistogramTest, testPercentile);
+	CppUnit_addTest(pSuite, HistogramTest, testMerge);
+
+	return pSuite;
+}
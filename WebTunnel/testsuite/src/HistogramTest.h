@@ -0,0 +1,41 @@
+//
+// HistogramTest.h
+//
+// Definition of the HistogramTest class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef HistogramTest_INCLUDED
+#define HistogramTest_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "CppUnit/TestCase.h"
+
+
+class HistogramTest: public CppUnit::TestCase
+{
+public:
+	HistogramTest(const std::string& name);
+	~HistogramTest();
+
+	void testBucketIndex();
+	void testBucketLimit();
+	void testRelativeError();
+	void testEmpty();
+	void testPercentile();
+	void testMerge();
+
+	void setUp();
+	void tearDown();
+
+	static CppUnit::Test* suite();
+};
+
+
+#endif // HistogramTest_INCLUDED
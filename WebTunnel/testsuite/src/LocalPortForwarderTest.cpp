@@ -0,0 +1,501 @@
+//
+// LocalPortForwarderTest.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "LocalPortForwarderTest.h"
+#include "EchoServer.h"
+#include "CppUnit/TestCaller.h"
+#include "CppUnit/TestSuite.h"
+#include "Poco/WebTunnel/LocalPortForwarder.h"
+#include "Poco/WebTunnel/RemotePortForwarder.h"
+#include "Poco/WebTunnel/SocketDispatcher.h"
+#include "Poco/WebTunnel/Protocol.h"
+#include "Poco/Net/HTTPServer.h"
+#include "Poco/Net/HTTPServerParams.h"
+#include "Poco/Net/HTTPRequestHandler.h"
+#include "Poco/Net/HTTPRequestHandlerFactory.h"
+#include "Poco/Net/HTTPServerRequest.h"
+#include "Poco/Net/HTTPServerResponse.h"
+#include "Poco/Net/HTTPSessionInstantiator.h"
+#include "Poco/Net/ServerSocket.h"
+#include "Poco/Net/StreamSocket.h"
+#include "Poco/Net/SocketAddress.h"
+#include "Poco/Net/WebSocket.h"
+#include "Poco/Net/NetException.h"
+#include "Poco/ThreadPool.h"
+#include "Poco/Thread.h"
+#include "Poco/Event.h"
+#include "Poco/Delegate.h"
+#include "Poco/Timestamp.h"
+#include "Poco/Buffer.h"
+#include "Poco/URI.h"
+#include "Poco/NumberFormatter.h"
+#include <atomic>
+#include <functional>
+#include <vector>
+
+
+using Poco::WebTunnel::LocalPortForwarder;
+using Poco::WebTunnel::RemotePortForwarder;
+using Poco::WebTunnel::SocketDispatcher;
+using Poco::WebTunnel::DefaultWebSocketFactory;
+using Poco::WebTunnel::Protocol;
+using Poco::Net::HTTPServerRequest;
+using Poco::Net::HTTPServerResponse;
+using Poco::Net::StreamSocket;
+using Poco::Net::SocketAddress;
+using Poco::Net::WebSocket;
+
+
+namespace
+{
+	class TunnelServer
+		/// A minimal WebTunnel server.
+		///
+		/// If the client requests multiplexing, and the server supports
+		/// it, the WebSocket connection is handled by a RemotePortForwarder,
+		/// which forwards all channels to the given port. Otherwise, all
+		/// frames received over the WebSocket connection are echoed back,
+		/// which, for the client, looks like a tunnel to an echo server.
+	{
+	public:
+		TunnelServer(Poco::UInt16 port, int capabilities, std::size_t readBudget = 0):
+			_port(port),
+			_capabilities(capabilities),
+			_readBudget(readBudget),
+			_threadPool(2, 32),
+			_server(new RequestHandlerFactory(*this), _threadPool, Poco::Net::ServerSocket(SocketAddress("127.0.0.1", 0)), new Poco::Net::HTTPServerParams),
+			_connections(0),
+			_stopped(false)
+		{
+			_server.start();
+		}
+
+		~TunnelServer()
+		{
+			_stopped = true;
+			_server.stop();
+			_threadPool.joinAll();
+			_dispatcher.stop();
+		}
+
+		Poco::URI uri() const
+		{
+			return Poco::URI("http://127.0.0.1:" + Poco::NumberFormatter::format(_server.port()) + "/");
+		}
+
+		int connections() const
+		{
+			return _connections;
+		}
+
+		SocketDispatcher& dispatcher()
+		{
+			return _dispatcher;
+		}
+
+	private:
+		class RequestHandler: public Poco::Net::HTTPRequestHandler
+		{
+		public:
+			RequestHandler(TunnelServer& server):
+				_server(server)
+			{
+			}
+
+			void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response)
+			{
+				_server._connections++;
+				int capabilities = Protocol::parseCapabilities(request.get("X-WebTunnel-Capabilities", "")) & _server._capabilities;
+				if (!(capabilities & Protocol::WT_CAP_MULTIPLEX)) capabilities = 0;
+				response.set("Sec-WebSocket-Protocol", "com.appinf.webtunnel.client/1.0");
+				response.set("X-WebTunnel-Capabilities", Protocol::formatCapabilities(capabilities));
+				try
+				{
+					Poco::SharedPtr<WebSocket> pWebSocket = new WebSocket(request, response);
+					if (capabilities & Protocol::WT_CAP_MULTIPLEX)
+						forward(pWebSocket, capabilities);
+					else
+						echo(*pWebSocket);
+				}
+				catch (Poco::Exception&)
+				{
+				}
+			}
+
+			void forward(Poco::SharedPtr<WebSocket> pWebSocket, int capabilities)
+			{
+				RemotePortForwarder forwarder(_server._dispatcher, pWebSocket, Poco::Net::IPAddress("127.0.0.1"), {_server._port});
+				if (capabilities & Protocol::WT_CAP_BATCH) forwarder.enableBatching();
+				if (capabilities & Protocol::WT_CAP_FLOW_CONTROL) forwarder.enableFlowControl();
+				if (_server._readBudget > 0) forwarder.setReadBudget(_server._readBudget);
+				forwarder.webSocketClosed += Poco::delegate(this, &RequestHandler::onClose);
+				while (!_server._stopped && !_closed.tryWait(100))
+				{
+				}
+				forwarder.webSocketClosed -= Poco::delegate(this, &RequestHandler::onClose);
+			}
+
+			void echo(WebSocket& webSocket)
+			{
+				webSocket.setReceiveTimeout(Poco::Timespan(0, 100000));
+				Poco::Buffer<char> buffer(0);
+				while (!_server._stopped)
+				{
+					int flags;
+					int n;
+					try
+					{
+						n = webSocket.receiveFrame(buffer, flags);
+					}
+					catch (Poco::TimeoutException&)
+					{
+						continue;
+					}
+					int opcode = flags & WebSocket::FRAME_OP_BITMASK;
+					if (opcode == WebSocket::FRAME_OP_PING)
+					{
+						webSocket.sendFrame(buffer.begin(), n, WebSocket::FRAME_FLAG_FIN | WebSocket::FRAME_OP_PONG);
+					}
+					else if (opcode == WebSocket::FRAME_OP_CLOSE || (n == 0 && flags == 0))
+					{
+						webSocket.shutdown();
+						break;
+					}
+					else if (opcode != WebSocket::FRAME_OP_PONG)
+					{
+						webSocket.sendFrame(buffer.begin(), n, flags);
+					}
+					buffer.resize(0);
+				}
+			}
+
+			void onClose(const int&)
+			{
+				_closed.set();
+			}
+
+		private:
+			TunnelServer& _server;
+			Poco::Event _closed;
+		};
+
+		class RequestHandlerFactory: public Poco::Net::HTTPRequestHandlerFactory
+		{
+		public:
+			RequestHandlerFactory(TunnelServer& server):
+				_server(server)
+			{
+			}
+
+			Poco::Net::HTTPRequestHandler* createRequestHandler(const HTTPServerRequest&)
+			{
+				return new RequestHandler(_server);
+			}
+
+		private:
+			TunnelServer& _server;
+		};
+
+		Poco::UInt16 _port;
+		int _capabilities;
+		std::size_t _readBudget;
+		SocketDispatcher _dispatcher;
+		Poco::ThreadPool _threadPool;
+		Poco::Net::HTTPServer _server;
+		std::atomic<int> _connections;
+		std::atomic<bool> _stopped;
+	};
+
+	bool waitFor(const std::function<bool()>& condition, long milliseconds = 5000)
+	{
+		Poco::Timestamp start;
+		while (!condition())
+		{
+			if (start.isElapsed(milliseconds*1000)) return false;
+			Poco::Thread::sleep(10);
+		}
+		return true;
+	}
+
+	bool receive(StreamSocket& socket, std::size_t size, std::string& received)
+	{
+		received.clear();
+		while (received.size() < size)
+		{
+			char buffer[8192];
+			int n = socket.receiveBytes(buffer, static_cast<int>((std::min)(sizeof(buffer), size - received.size())));
+			if (n <= 0) return false;
+			received.append(buffer, n);
+		}
+		return true;
+	}
+
+	bool echo(StreamSocket& socket, const std::string& data)
+		/// Sends the data in chunks, and checks that every chunk is echoed.
+	{
+		const std::size_t chunkSize = 16384;
+		for (std::size_t offset = 0; offset < data.size(); offset += chunkSize)
+		{
+			std::string chunk = data.substr(offset, chunkSize);
+			socket.sendBytes(chunk.data(), static_cast<int>(chunk.size()));
+			std::string received;
+			if (!receive(socket, chunk.size(), received) || received != chunk) return false;
+		}
+		return true;
+	}
+
+	std::string makeData(std::size_t size, int seed)
+	{
+		std::string data(size, '\0');
+		for (std::size_t i = 0; i < size; i++)
+		{
+			data[i] = static_cast<char>('a' + (i*7 + seed) % 26);
+		}
+		return data;
+	}
+}
+
+
+LocalPortForwarderTest::LocalPortForwarderTest(const std::string& name): CppUnit::TestCase(name)
+{
+}
+
+
+LocalPortForwarderTest::~LocalPortForwarderTest()
+{
+}
+
+
+void LocalPortForwarderTest::testForward()
+{
+	EchoServer echoServer;
+	TunnelServer tunnelServer(echoServer.port(), 0);
+	LocalPortForwarder forwarder(0, echoServer.port(), tunnelServer.uri(), new DefaultWebSocketFactory);
+
+	// Every local connection gets a WebSocket connection of its own.
+	for (int i = 0; i < 3; i++)
+	{
+		StreamSocket socket(SocketAddress("127.0.0.1", forwarder.localPort()));
+		socket.setReceiveTimeout(Poco::Timespan(5, 0));
+		assertTrue (echo(socket, "hello"));
+		assertTrue (echo(socket, makeData(100000, i)));
+	}
+	assertTrue (tunnelServer.connections() == 3);
+}
+
+
+void LocalPortForwarderTest::testWebSocketPool()
+{
+	EchoServer echoServer;
+	TunnelServer tunnelServer(echoServer.port(), 0);
+	LocalPortForwarder forwarder(0, echoServer.port(), tunnelServer.uri(), new DefaultWebSocketFactory);
+	forwarder.enableWebSocketPool(2);
+	assertTrue (forwarder.webSocketPoolSize() == 2);
+	assertTrue (waitFor([&]() { return forwarder.pooledWebSockets() == 2; }));
+	assertTrue (tunnelServer.connections() == 2);
+
+	// A local connection uses a pooled WebSocket connection,
+	// which is then replaced in the background.
+	StreamSocket socket(SocketAddress("127.0.0.1", forwarder.localPort()));
+	socket.setReceiveTimeout(Poco::Timespan(5, 0));
+	assertTrue (echo(socket, "hello"));
+	assertTrue (waitFor([&]() { return forwarder.pooledWebSockets() == 2; }));
+	assertTrue (tunnelServer.connections() == 3);
+
+	StreamSocket socket2(SocketAddress("127.0.0.1", forwarder.localPort()));
+	socket2.setReceiveTimeout(Poco::Timespan(5, 0));
+	assertTrue (echo(socket2, makeData(100000, 1)));
+	assertTrue (echo(socket, "world"));
+	assertTrue (waitFor([&]() { return forwarder.pooledWebSockets() == 2; }));
+	assertTrue (tunnelServer.connections() == 4);
+}
+
+
+void LocalPortForwarderTest::testMultiplexed()
+{
+	testMultiplexing(Protocol::WT_CAP_MULTIPLEX | Protocol::WT_CAP_BATCH | Protocol::WT_CAP_FLOW_CONTROL);
+}
+
+
+void LocalPortForwarderTest::testMultiplexedWithoutFlowControl()
+{
+	testMultiplexing(Protocol::WT_CAP_MULTIPLEX);
+}
+
+
+void LocalPortForwarderTest::testMultiplexing(int capabilities)
+{
+	EchoServer echoServer;
+	TunnelServer tunnelServer(echoServer.port(), capabilities);
+	LocalPortForwarder forwarder(0, echoServer.port(), tunnelServer.uri(), new DefaultWebSocketFactory);
+	forwarder.enableMultiplexing();
+
+	// All local connections share a single WebSocket connection,
+	// and data of different channels must not get mixed up.
+	std::vector<StreamSocket> sockets;
+	for (int i = 0; i < 5; i++)
+	{
+		sockets.emplace_back(SocketAddress("127.0.0.1", forwarder.localPort()));
+		sockets.back().setReceiveTimeout(Poco::Timespan(5, 0));
+	}
+	for (int round = 0; round < 3; round++)
+	{
+		for (std::size_t i = 0; i < sockets.size(); i++)
+		{
+			assertTrue (echo(sockets[i], makeData(1000 + 100*i, static_cast<int>(i))));
+		}
+	}
+
+	// More data than the initial window of a channel.
+	assertTrue (echo(sockets[0], makeData(Protocol::WT_CHANNEL_WINDOW_SIZE + 100000, 42)));
+
+	// Data sent on all channels before reading any echoes.
+	std::vector<std::string> data;
+	for (std::size_t i = 0; i < sockets.size(); i++)
+	{
+		data.push_back(makeData(5000, static_cast<int>(i) + 10));
+		sockets[i].sendBytes(data[i].data(), static_cast<int>(data[i].size()));
+	}
+	for (std::size_t i = 0; i < sockets.size(); i++)
+	{
+		std::string received;
+		assertTrue (receive(sockets[i], data[i].size(), received));
+		assertTrue (received == data[i]);
+	}
+
+	// A closed channel does not affect the others.
+	sockets[2].close();
+	assertTrue (echo(sockets[3], "still there"));
+
+	assertTrue (tunnelServer.connections() == 1);
+	assertTrue (echoServer.connections() == 5);
+}
+
+
+void LocalPortForwarderTest::testMultiplexingNotSupported()
+{
+	EchoServer echoServer;
+	TunnelServer tunnelServer(echoServer.port(), 0);
+	LocalPortForwarder forwarder(0, echoServer.port(), tunnelServer.uri(), new DefaultWebSocketFactory);
+	forwarder.enableMultiplexing();
+
+	// Without support from the server, every local connection
+	// gets a WebSocket connection of its own.
+	for (int i = 0; i < 3; i++)
+	{
+		StreamSocket socket(SocketAddress("127.0.0.1", forwarder.localPort()));
+		socket.setReceiveTimeout(Poco::Timespan(5, 0));
+		assertTrue (echo(socket, "hello"));
+	}
+	assertTrue (tunnelServer.connections() >= 3);
+}
+
+
+void LocalPortForwarderTest::testFlowControl()
+{
+	EchoServer echoServer;
+	TunnelServer tunnelServer(echoServer.port(), Protocol::WT_CAP_MULTIPLEX | Protocol::WT_CAP_FLOW_CONTROL);
+	LocalPortForwarder forwarder(0, echoServer.port(), tunnelServer.uri(), new DefaultWebSocketFactory);
+	forwarder.enableMultiplexing();
+
+	// A local connection that does not read the data it receives
+	// must not block the other connections.
+	StreamSocket flood(SocketAddress("127.0.0.1", forwarder.localPort()));
+	flood.sendBytes("F", 1);
+	assertTrue (flood.poll(Poco::Timespan(5, 0), Poco::Net::Socket::SELECT_READ));
+
+	StreamSocket socket(SocketAddress("127.0.0.1", forwarder.localPort()));
+	socket.setReceiveTimeout(Poco::Timespan(5, 0));
+	assertTrue (echo(socket, "hello"));
+	assertTrue (echo(socket, makeData(100000, 1)));
+
+	// The flooded connection still receives its data.
+	flood.setReceiveTimeout(Poco::Timespan(5, 0));
+	std::string received;
+	assertTrue (receive(flood, 2*Protocol::WT_CHANNEL_WINDOW_SIZE, received));
+	assertTrue (received == std::string(2*Protocol::WT_CHANNEL_WINDOW_SIZE, 'x'));
+}
+
+
+void LocalPortForwarderTest::testBacklog()
+{
+	testBacklogged(0);
+}
+
+
+void LocalPortForwarderTest::testBacklogEdgeTriggered()
+{
+	testBacklogged(1024*1024);
+}
+
+
+void LocalPortForwarderTest::testBacklogged(std::size_t readBudget)
+{
+	EchoServer echoServer;
+	TunnelServer tunnelServer(echoServer.port(), Protocol::WT_CAP_MULTIPLEX, readBudget);
+	LocalPortForwarder forwarder(0, echoServer.port(), tunnelServer.uri(), new DefaultWebSocketFactory);
+	forwarder.enableMultiplexing();
+
+	// Without flow control, a local connection that does not read the
+	// data it receives eventually stops the tunnel from being drained.
+	StreamSocket flood(SocketAddress("127.0.0.1", forwarder.localPort()));
+	flood.sendBytes("F", 1);
+
+	// The server must then stop reading from the flooding connection,
+	// with only a few frames of the channel queued for the WebSocket.
+	SocketDispatcher::SocketMetrics channel;
+	SocketDispatcher::SocketMetrics webSocket;
+	Poco::UInt64 received = 0;
+	Poco::Timestamp start;
+	for (;;)
+	{
+		assertTrue (!start.isElapsed(10000000));
+		Poco::Thread::sleep(200);
+		std::vector<SocketDispatcher::SocketMetrics> metrics = tunnelServer.dispatcher().socketMetrics();
+		if (metrics.size() != 2) continue;
+		// The WebSocket has sent the flood, the channel only the 'F'.
+		if (metrics[0].bytesSent > metrics[1].bytesSent) std::swap(metrics[0], metrics[1]);
+		channel = metrics[0];
+		webSocket = metrics[1];
+		if (channel.bytesReceived > 0 && channel.bytesReceived == received) break;
+		received = channel.bytesReceived;
+	}
+	const Poco::UInt64 queueLimit = 16*(Protocol::WT_FRAME_MAX_SIZE + Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (channel.bytesReceived <= webSocket.bytesSent + webSocket.pendingBytes + 2*queueLimit);
+}
+
+
+void LocalPortForwarderTest::setUp()
+{
+	Poco::Net::HTTPSessionInstantiator::registerInstantiator();
+}
+
+
+void LocalPortForwarderTest::tearDown()
+{
+	Poco::Net::HTTPSessionInstantiator::unregisterInstantiator();
+}
+
+
+CppUnit::Test* LocalPortForwarderTest::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("LocalPortForwarderTest");
+
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testForward);
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testWebSocketPool);
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testMultiplexed);
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testMultiplexedWithoutFlowControl);
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testMultiplexingNotSupported);
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testFlowControl);
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testBacklog);
+	CppUnit_addTest(pSuite, LocalPortForwarderTest, testBacklogEdgeTriggered);
+
+	return pSuite;
+}
@@ -0,0 +1,47 @@
+//
+// LocalPortForwarderTest.h
+//
+// Definition of the LocalPortForwarderTest class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef LocalPortForwarderTest_INCLUDED
+#define LocalPortForwarderTest_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "CppUnit/TestCase.h"
+
+
+class LocalPortForwarderTest: public CppUnit::TestCase
+{
+public:
+	LocalPortForwarderTest(const std::string& name);
+	~LocalPortForwarderTest();
+
+	void testForward();
+	void testWebSocketPool();
+	void testMultiplexed();
+	void testMultiplexedWithoutFlowControl();
+	void testMultiplexingNotSupported();
+	void testFlowControl();
+	void testBacklog();
+	void testBacklogEdgeTriggered();
+
+	void setUp();
+	void tearDown();
+
+	static CppUnit::Test* suite();
+
+private:
+	void testMultiplexing(int capabilities);
+	void testBacklogged(std::size_t readBudget);
+};
+
+
+#endif // LocalPortForwarderTest_INCLUDED
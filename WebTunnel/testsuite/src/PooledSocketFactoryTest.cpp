@@ -0,0 +1,243 @@
+//
+// PooledSocketFactoryTest.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "PooledSocketFactoryTest.h"
+#include "EchoServer.h"
+#include "CppUnit/TestCaller.h"
+#include "CppUnit/TestSuite.h"
+#include "Poco/WebTunnel/PooledSocketFactory.h"
+#include "Poco/Net/StreamSocket.h"
+#include "Poco/Net/SocketAddress.h"
+#include "Poco/Net/IPAddress.h"
+#include "Poco/Thread.h"
+#include "Poco/Timestamp.h"
+#include <functional>
+
+
+using Poco::WebTunnel::PooledSocketFactory;
+using Poco::WebTunnel::SocketFactory;
+using Poco::Net::StreamSocket;
+using Poco::Net::SocketAddress;
+using Poco::Net::IPAddress;
+
+
+namespace
+{
+	bool waitFor(const std::function<bool()>& condition, long milliseconds = 5000)
+	{
+		Poco::Timestamp start;
+		while (!condition())
+		{
+			if (start.isElapsed(milliseconds*1000)) return false;
+			Poco::Thread::sleep(10);
+		}
+		return true;
+	}
+
+	void prepare(StreamSocket& socket)
+		/// Waits until the socket, which may still be connecting,
+		/// is connected, and puts it into blocking mode.
+	{
+		socket.poll(Poco::Timespan(5, 0), Poco::Net::Socket::SELECT_WRITE | Poco::Net::Socket::SELECT_ERROR);
+		socket.setBlocking(true);
+		socket.setReceiveTimeout(Poco::Timespan(5, 0));
+	}
+
+	bool echo(StreamSocket& socket, const std::string& data)
+	{
+		prepare(socket);
+		socket.sendBytes(data.data(), static_cast<int>(data.size()));
+		std::string received;
+		while (received.size() < data.size())
+		{
+			char buffer[256];
+			int n = socket.receiveBytes(buffer, sizeof(buffer));
+			if (n <= 0) return false;
+			received.append(buffer, n);
+		}
+		return received == data;
+	}
+}
+
+
+PooledSocketFactoryTest::PooledSocketFactoryTest(const std::string& name): CppUnit::TestCase(name)
+{
+}
+
+
+PooledSocketFactoryTest::~PooledSocketFactoryTest()
+{
+}
+
+
+void PooledSocketFactoryTest::testPool()
+{
+	EchoServer server;
+	PooledSocketFactory::Ptr pFactory = new PooledSocketFactory(new SocketFactory, IPAddress("127.0.0.1"), {server.port()}, 3);
+	assertTrue (pFactory->available(server.port()) == 0);
+	pFactory->start();
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 3; }));
+	assertTrue (waitFor([&]() { return server.connections() == 3; }));
+
+	// A pooled socket is already connected.
+	StreamSocket socket = pFactory->createSocket(SocketAddress("127.0.0.1", server.port()));
+	assertTrue (waitFor([&]() { return server.connections() == 3; }));
+	assertTrue (echo(socket, "hello"));
+
+	// The pool is refilled in the background.
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 3; }));
+	assertTrue (waitFor([&]() { return server.connections() == 4; }));
+
+	for (int i = 0; i < 5; i++)
+	{
+		StreamSocket other = pFactory->createSocket(SocketAddress("127.0.0.1", server.port()));
+		assertTrue (echo(other, "world"));
+	}
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 3; }));
+	assertTrue (waitFor([&]() { return server.connections() == 9; }));
+	pFactory->stop();
+}
+
+
+void PooledSocketFactoryTest::testUnpooledPort()
+{
+	EchoServer server;
+	EchoServer other;
+	PooledSocketFactory::Ptr pFactory = new PooledSocketFactory(new SocketFactory, IPAddress("127.0.0.1"), {server.port()}, 2);
+	pFactory->start();
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 2; }));
+
+	// Ports that are not pooled are connected on demand.
+	assertTrue (pFactory->available(other.port()) == 0);
+	assertTrue (other.connections() == 0);
+	StreamSocket socket = pFactory->createSocket(SocketAddress("127.0.0.1", other.port()));
+	assertTrue (echo(socket, "hello"));
+	assertTrue (other.connections() == 1);
+	assertTrue (pFactory->available(server.port()) == 2);
+	pFactory->stop();
+}
+
+
+void PooledSocketFactoryTest::testIdleTimeout()
+{
+	EchoServer server;
+	PooledSocketFactory::Ptr pFactory = new PooledSocketFactory(new SocketFactory, IPAddress("127.0.0.1"), {server.port()}, 2, Poco::Timespan(0, 300000));
+	pFactory->start();
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 2; }));
+
+	// Expired sockets are replaced.
+	assertTrue (waitFor([&]() { return server.connections() >= 4; }));
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 2; }));
+
+	StreamSocket socket = pFactory->createSocket(SocketAddress("127.0.0.1", server.port()));
+	assertTrue (echo(socket, "hello"));
+	pFactory->stop();
+}
+
+
+void PooledSocketFactoryTest::testClosedByServer()
+{
+	PooledSocketFactory::Ptr pFactory;
+	Poco::UInt16 port;
+	{
+		EchoServer server;
+		port = server.port();
+		pFactory = new PooledSocketFactory(new SocketFactory, IPAddress("127.0.0.1"), {port}, 2);
+		pFactory->start();
+		assertTrue (waitFor([&]() { return pFactory->available(port) == 2; }));
+	}
+
+	// Sockets closed by the server are never handed out.
+	StreamSocket socket = pFactory->createSocket(SocketAddress("127.0.0.1", port));
+	assertTrue (pFactory->available(port) == 0);
+	bool connected;
+	try
+	{
+		connected = echo(socket, "hello");
+	}
+	catch (Poco::Exception&)
+	{
+		connected = false;
+	}
+	assertTrue (!connected);
+	pFactory->stop();
+}
+
+
+void PooledSocketFactoryTest::testGreeting()
+{
+	// The idle timeout also determines how often pooled sockets are checked.
+	EchoServer server("HELLO\r\n");
+	PooledSocketFactory::Ptr pFactory = new PooledSocketFactory(new SocketFactory, IPAddress("127.0.0.1"), {server.port()}, 2, Poco::Timespan(1, 0));
+	pFactory->start();
+	assertTrue (waitFor([&]() { return server.connections() >= 2; }));
+
+	// Pooling is disabled for servers sending data first,
+	// once the greeting has been found on a pooled socket.
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 0; }));
+
+	// The greeting of a socket connected on demand is not lost.
+	StreamSocket socket = pFactory->createSocket(SocketAddress("127.0.0.1", server.port()));
+	prepare(socket);
+	std::string greeting;
+	while (greeting.size() < 7)
+	{
+		char buffer[16];
+		int n = socket.receiveBytes(buffer, sizeof(buffer));
+		assertTrue (n > 0);
+		greeting.append(buffer, n);
+	}
+	assertTrue (greeting == "HELLO\r\n");
+
+	// The pool is not refilled.
+	assertTrue (!waitFor([&]() { return pFactory->available(server.port()) > 0; }, 600));
+	pFactory->stop();
+}
+
+
+void PooledSocketFactoryTest::testStop()
+{
+	EchoServer server;
+	PooledSocketFactory::Ptr pFactory = new PooledSocketFactory(new SocketFactory, IPAddress("127.0.0.1"), {server.port()}, 2);
+	pFactory->start();
+	assertTrue (waitFor([&]() { return pFactory->available(server.port()) == 2; }));
+	pFactory->stop();
+	assertTrue (pFactory->available(server.port()) == 0);
+
+	// Without pooled sockets, sockets are connected on demand.
+	StreamSocket socket = pFactory->createSocket(SocketAddress("127.0.0.1", server.port()));
+	assertTrue (echo(socket, "hello"));
+	assertTrue (waitFor([&]() { return server.connections() == 3; }));
+}
+
+
+void PooledSocketFactoryTest::setUp()
+{
+}
+
+
+void PooledSocketFactoryTest::tearDown()
+{
+}
+
+
+CppUnit::Test* PooledSocketFactoryTest::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("PooledSocketFactoryTest");
+
+	CppUnit_addTest(pSuite, PooledSocketFactoryTest, testPool);
+	CppUnit_addTest(pSuite, PooledSocketFactoryTest, testUnpooledPort);
+	CppUnit_addTest(pSuite, PooledSocketFactoryTest, testIdleTimeout);
+	CppUnit_addTest(pSuite, PooledSocketFactoryTest, testClosedByServer);
+	CppUnit_addTest(pSuite, PooledSocketFactoryTest, testGreeting);
+	CppUnit_addTest(pSuite, PooledSocketFactoryTest, testStop);
+
+	return pSuite;
+}
@@ -0,0 +1,41 @@
+//
+// PooledSocketFactoryTest.h
+//
+// Definition of the PooledSocketFactoryTest class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef PooledSocketFactoryTest_INCLUDED
+#define PooledSocketFactoryTest_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "CppUnit/TestCase.h"
+
+
+class PooledSocketFactoryTest: public CppUnit::TestCase
+{
+public:
+	PooledSocketFactoryTest(const std::string& name);
+	~PooledSocketFactoryTest();
+
+	void testPool();
+	void testUnpooledPort();
+	void testIdleTimeout();
+	void testClosedByServer();
+	void testGreeting();
+	void testStop();
+
+	void setUp();
+	void tearDown();
+
+	static CppUnit::Test* suite();
+};
+
+
+#endif // PooledSocketFactoryTest_INCLUDED
@@ -0,0 +1,347 @@
+//
+// ProtocolTest.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "ProtocolTest.h"
+#include "CppUnit/TestCaller.h"
+#include "CppUnit/TestSuite.h"
+#include "Poco/WebTunnel/Protocol.h"
+#include <cstring>
+#include <string>
+
+
+using Poco::WebTunnel::Protocol;
+
+
+namespace
+{
+	std::size_t appendFrame(char* pBuffer, std::size_t bufferSize, Poco::UInt16 channel, const std::string& payload)
+		/// Appends a Data frame, preceded by its batch entry header, to a batch.
+	{
+		std::size_t frameSize = Protocol::WT_FRAME_HEADER_SIZE + payload.size();
+		std::size_t n = Protocol::writeBatchEntryHeader(pBuffer, bufferSize, frameSize);
+		n += Protocol::writeHeader(pBuffer + n, bufferSize - n, Protocol::WT_OP_DATA, 0, channel);
+		std::memcpy(pBuffer + n, payload.data(), payload.size());
+		return n + payload.size();
+	}
+}
+
+
+ProtocolTest::ProtocolTest(const std::string& name): CppUnit::TestCase(name)
+{
+}
+
+
+ProtocolTest::~ProtocolTest()
+{
+}
+
+
+void ProtocolTest::testHeader()
+{
+	char buffer[Protocol::WT_FRAME_HEADER_SIZE];
+	std::size_t n = Protocol::writeHeader(buffer, sizeof(buffer), Protocol::WT_OP_DATA, Protocol::WT_FLAG_DEFLATE, 0x1234);
+	assertTrue (n == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (static_cast<unsigned char>(buffer[0]) == Protocol::WT_OP_DATA);
+	assertTrue (static_cast<unsigned char>(buffer[1]) == Protocol::WT_FLAG_DEFLATE);
+	assertTrue (static_cast<unsigned char>(buffer[2]) == 0x12);
+	assertTrue (static_cast<unsigned char>(buffer[3]) == 0x34);
+
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+	Poco::UInt16 port = 0;
+	n = Protocol::readHeader(buffer, sizeof(buffer), opcode, flags, channel, &port);
+	assertTrue (n == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (opcode == Protocol::WT_OP_DATA);
+	assertTrue (flags == Protocol::WT_FLAG_DEFLATE);
+	assertTrue (channel == 0x1234);
+	assertTrue (port == 0);
+
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_DATA) == 4);
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_OPEN_CONFIRM) == 4);
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_CLOSE) == 4);
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_WINDOW_UPDATE) == 4);
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_BATCH) == 4);
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_OPEN_REQUEST) == 6);
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_OPEN_FAULT) == 6);
+	assertTrue (Protocol::headerSize(Protocol::WT_OP_ERROR) == 6);
+}
+
+
+void ProtocolTest::testHeaderWithPort()
+{
+	char buffer[8];
+	std::size_t n = Protocol::writeHeader(buffer, sizeof(buffer), Protocol::WT_OP_OPEN_REQUEST, 0, 7, 8080);
+	assertTrue (n == 6);
+
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+	Poco::UInt16 port = 0;
+	n = Protocol::readHeader(buffer, 6, opcode, flags, channel, &port);
+	assertTrue (n == 6);
+	assertTrue (opcode == Protocol::WT_OP_OPEN_REQUEST);
+	assertTrue (flags == 0);
+	assertTrue (channel == 7);
+	assertTrue (port == 8080);
+
+	n = Protocol::writeHeader(buffer, sizeof(buffer), Protocol::WT_OP_ERROR, 0, 9, Protocol::WT_ERR_CONN_REFUSED);
+	assertTrue (n == 6);
+	Poco::UInt16 error = 0;
+	n = Protocol::readHeader(buffer, 6, opcode, flags, channel, &error);
+	assertTrue (n == 6);
+	assertTrue (opcode == Protocol::WT_OP_ERROR);
+	assertTrue (channel == 9);
+	assertTrue (error == Protocol::WT_ERR_CONN_REFUSED);
+
+	// Without pPortOrErrorCode, only the common part of the header is read.
+	n = Protocol::readHeader(buffer, 6, opcode, flags, channel);
+	assertTrue (n == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (channel == 9);
+}
+
+
+void ProtocolTest::testTruncatedHeader()
+{
+	char buffer[8];
+	Protocol::writeHeader(buffer, sizeof(buffer), Protocol::WT_OP_OPEN_REQUEST, 0, 7, 8080);
+
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+	Poco::UInt16 port = 0;
+	for (std::size_t size = 0; size < Protocol::WT_FRAME_HEADER_SIZE; size++)
+	{
+		assertTrue (Protocol::readHeader(buffer, size, opcode, flags, channel, &port) == 0);
+	}
+	assertTrue (Protocol::readHeader(buffer, 5, opcode, flags, channel, &port) == 0);
+	assertTrue (port == 0);
+	assertTrue (Protocol::readHeader(buffer, 5, opcode, flags, channel) == Protocol::WT_FRAME_HEADER_SIZE);
+}
+
+
+void ProtocolTest::testWindowUpdate()
+{
+	char buffer[Protocol::WT_WINDOW_UPDATE_SIZE];
+	std::size_t n = Protocol::writeWindowUpdate(buffer, sizeof(buffer), 42, 0x12345678);
+	assertTrue (n == Protocol::WT_WINDOW_UPDATE_SIZE);
+
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+	assertTrue (Protocol::readHeader(buffer, n, opcode, flags, channel) == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (opcode == Protocol::WT_OP_WINDOW_UPDATE);
+	assertTrue (flags == 0);
+	assertTrue (channel == 42);
+
+	Poco::UInt32 credit = 0;
+	assertTrue (Protocol::readWindowUpdate(buffer, n, credit));
+	assertTrue (credit == 0x12345678);
+
+	credit = 0;
+	assertTrue (!Protocol::readWindowUpdate(buffer, n - 1, credit));
+	assertTrue (!Protocol::readWindowUpdate(buffer, Protocol::WT_FRAME_HEADER_SIZE, credit));
+	assertTrue (credit == 0);
+}
+
+
+void ProtocolTest::testBatch()
+{
+	char batch[256];
+	std::size_t size = Protocol::writeHeader(batch, sizeof(batch), Protocol::WT_OP_BATCH, 0, 0);
+	size += appendFrame(batch + size, sizeof(batch) - size, 1, "hello");
+	size += appendFrame(batch + size, sizeof(batch) - size, 2, "");
+	size += appendFrame(batch + size, sizeof(batch) - size, 3, "world!");
+
+	Protocol::BatchReader reader(batch, size);
+	const char* pFrame = nullptr;
+	std::size_t frameSize = 0;
+	Poco::UInt8 opcode;
+	Poco::UInt8 flags;
+	Poco::UInt16 channel;
+
+	assertTrue (reader.next(pFrame, frameSize));
+	assertTrue (frameSize == Protocol::WT_FRAME_HEADER_SIZE + 5);
+	assertTrue (Protocol::readHeader(pFrame, frameSize, opcode, flags, channel) == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (opcode == Protocol::WT_OP_DATA);
+	assertTrue (channel == 1);
+	assertTrue (std::string(pFrame + Protocol::WT_FRAME_HEADER_SIZE, 5) == "hello");
+
+	assertTrue (reader.next(pFrame, frameSize));
+	assertTrue (frameSize == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (Protocol::readHeader(pFrame, frameSize, opcode, flags, channel) == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (channel == 2);
+
+	assertTrue (reader.next(pFrame, frameSize));
+	assertTrue (frameSize == Protocol::WT_FRAME_HEADER_SIZE + 6);
+	assertTrue (Protocol::readHeader(pFrame, frameSize, opcode, flags, channel) == Protocol::WT_FRAME_HEADER_SIZE);
+	assertTrue (channel == 3);
+	assertTrue (std::string(pFrame + Protocol::WT_FRAME_HEADER_SIZE, 6) == "world!");
+
+	assertTrue (!reader.next(pFrame, frameSize));
+	assertTrue (!reader.malformed());
+	assertTrue (!reader.next(pFrame, frameSize));
+}
+
+
+void ProtocolTest::testEmptyBatch()
+{
+	char batch[Protocol::WT_FRAME_HEADER_SIZE];
+	std::size_t size = Protocol::writeHeader(batch, sizeof(batch), Protocol::WT_OP_BATCH, 0, 0);
+
+	Protocol::BatchReader reader(batch, size);
+	const char* pFrame;
+	std::size_t frameSize;
+	assertTrue (!reader.next(pFrame, frameSize));
+	assertTrue (!reader.malformed());
+
+	// A batch must at least contain its own header.
+	Protocol::BatchReader shortReader(batch, size - 1);
+	assertTrue (!shortReader.next(pFrame, frameSize));
+	assertTrue (shortReader.malformed());
+}
+
+
+void ProtocolTest::testTruncatedBatch()
+{
+	char batch[256];
+	std::size_t size = Protocol::writeHeader(batch, sizeof(batch), Protocol::WT_OP_BATCH, 0, 0);
+	std::size_t first = size + appendFrame(batch + size, sizeof(batch) - size, 1, "hello");
+	size = first + appendFrame(batch + first, sizeof(batch) - first, 2, "world");
+
+	// Cut off anywhere within the second entry, the first frame must
+	// still be returned, followed by the error.
+	for (std::size_t truncated = first + 1; truncated < size; truncated++)
+	{
+		Protocol::BatchReader reader(batch, truncated);
+		const char* pFrame;
+		std::size_t frameSize;
+		assertTrue (reader.next(pFrame, frameSize));
+		assertTrue (frameSize == Protocol::WT_FRAME_HEADER_SIZE + 5);
+		assertTrue (!reader.malformed());
+		assertTrue (!reader.next(pFrame, frameSize));
+		assertTrue (reader.malformed());
+		assertTrue (!reader.next(pFrame, frameSize));
+	}
+}
+
+
+void ProtocolTest::testMalformedBatch()
+{
+	char batch[256];
+	std::size_t size = Protocol::writeHeader(batch, sizeof(batch), Protocol::WT_OP_BATCH, 0, 0);
+	std::size_t first = size + appendFrame(batch + size, sizeof(batch) - size, 1, "hello");
+	size = first + appendFrame(batch + first, sizeof(batch) - first, 2, "world");
+
+	const char* pFrame;
+	std::size_t frameSize;
+
+	// An entry shorter than a frame header is malformed.
+	for (std::size_t entrySize = 0; entrySize < Protocol::WT_FRAME_HEADER_SIZE; entrySize++)
+	{
+		Protocol::writeBatchEntryHeader(batch + first, sizeof(batch) - first, entrySize);
+		Protocol::BatchReader reader(batch, size);
+		assertTrue (reader.next(pFrame, frameSize));
+		assertTrue (!reader.next(pFrame, frameSize));
+		assertTrue (reader.malformed());
+	}
+
+	// An entry extending beyond the end of the batch is malformed.
+	Protocol::writeBatchEntryHeader(batch + first, sizeof(batch) - first, size - first);
+	Protocol::BatchReader reader(batch, size);
+	assertTrue (reader.next(pFrame, frameSize));
+	assertTrue (!reader.next(pFrame, frameSize));
+	assertTrue (reader.malformed());
+
+	// So is the largest possible entry size.
+	Protocol::writeBatchEntryHeader(batch + Protocol::WT_FRAME_HEADER_SIZE, sizeof(batch) - Protocol::WT_FRAME_HEADER_SIZE, 0xFFFF);
+	Protocol::BatchReader firstReader(batch, size);
+	assertTrue (!firstReader.next(pFrame, frameSize));
+	assertTrue (firstReader.malformed());
+}
+
+
+void ProtocolTest::testBatchEntryHeader()
+{
+	char buffer[Protocol::WT_BATCH_ENTRY_HEADER_SIZE + 16];
+	std::size_t frameSize = 0;
+	assertTrue (Protocol::writeBatchEntryHeader(buffer, sizeof(buffer), 16) == Protocol::WT_BATCH_ENTRY_HEADER_SIZE);
+	assertTrue (Protocol::readBatchEntryHeader(buffer, sizeof(buffer), frameSize) == Protocol::WT_BATCH_ENTRY_HEADER_SIZE);
+	assertTrue (frameSize == 16);
+
+	// The frame must fit into the rest of the buffer.
+	assertTrue (Protocol::readBatchEntryHeader(buffer, sizeof(buffer) - 1, frameSize) == 0);
+
+	assertTrue (Protocol::writeBatchEntryHeader(buffer, sizeof(buffer), 0x1234) == Protocol::WT_BATCH_ENTRY_HEADER_SIZE);
+	assertTrue (static_cast<unsigned char>(buffer[0]) == 0x12);
+	assertTrue (static_cast<unsigned char>(buffer[1]) == 0x34);
+
+	// The buffer must be large enough for the entry header.
+	assertTrue (Protocol::writeBatchEntryHeader(buffer, 1, 4) == 0);
+	assertTrue (Protocol::readBatchEntryHeader(buffer, 1, frameSize) == 0);
+}
+
+
+void ProtocolTest::testCapabilities()
+{
+	assertTrue (Protocol::formatCapabilities(0) == "");
+	assertTrue (Protocol::formatCapabilities(Protocol::WT_CAP_MULTIPLEX) == "multiplex");
+	assertTrue (Protocol::formatCapabilities(Protocol::WT_CAP_BATCH | Protocol::WT_CAP_FLOW_CONTROL | Protocol::WT_CAP_MULTIPLEX) == "batch, flow-control, multiplex");
+
+	assertTrue (Protocol::parseCapabilities("") == 0);
+	assertTrue (Protocol::parseCapabilities("batch, flow-control, multiplex") == (Protocol::WT_CAP_BATCH | Protocol::WT_CAP_FLOW_CONTROL | Protocol::WT_CAP_MULTIPLEX));
+	assertTrue (Protocol::parseCapabilities(" multiplex ,, unknown,batch") == (Protocol::WT_CAP_BATCH | Protocol::WT_CAP_MULTIPLEX));
+	assertTrue (Protocol::parseCapabilities("Multiplex") == 0);
+}
+
+
+void ProtocolTest::testFrameSize()
+{
+	assertTrue (Protocol::offeredFrameSize(0) == Protocol::WT_FRAME_MAX_SIZE);
+	assertTrue (Protocol::offeredFrameSize(16384) == 16384);
+	assertTrue (Protocol::offeredFrameSize(1000000) == Protocol::WT_FRAME_MAX_SIZE_LIMIT);
+
+	assertTrue (Protocol::negotiatedFrameSize("", 16384) == Protocol::WT_FRAME_MAX_SIZE);
+	assertTrue (Protocol::negotiatedFrameSize("invalid", 16384) == Protocol::WT_FRAME_MAX_SIZE);
+	assertTrue (Protocol::negotiatedFrameSize("8192", 16384) == 8192);
+	assertTrue (Protocol::negotiatedFrameSize("65536", 16384) == 16384);
+	assertTrue (Protocol::negotiatedFrameSize("1000000", 1000000) == Protocol::WT_FRAME_MAX_SIZE_LIMIT);
+	assertTrue (Protocol::negotiatedFrameSize("100", 16384) == Protocol::WT_FRAME_MAX_SIZE);
+}
+
+
+void ProtocolTest::setUp()
+{
+}
+
+
+void ProtocolTest::tearDown()
+{
+}
+
+
+CppUnit::Test* ProtocolTest::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("ProtocolTest");
+
+	CppUnit_addTest(pSuite, ProtocolTest, testHeader);
+	CppUnit_addTest(pSuite, ProtocolTest, testHeaderWithPort);
+	CppUnit_addTest(pSuite, ProtocolTest, testTruncatedHeader);
+	CppUnit_addTest(pSuite, ProtocolTest, testWindowUpdate);
+	CppUnit_addTest(pSuite, ProtocolTest, testBatch);
+	CppUnit_addTest(pSuite, ProtocolTest, testEmptyBatch);
+	CppUnit_addTest(pSuite, ProtocolTest, testTruncatedBatch);
+	CppUnit_addTest(pSuite, ProtocolTest, testMalformedBatch);
+	CppUnit_addTest(pSuite, ProtocolTest, testBatchEntryHeader);
+	CppUnit_addTest(pSuite, ProtocolTest, testCapabilities);
+	CppUnit_addTest(pSuite, ProtocolTest, testFrameSize);
+
+	return pSuite;
+}
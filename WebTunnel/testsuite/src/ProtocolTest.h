@@ -0,0 +1,46 @@
+//
+// ProtocolTest.h
+//
+// Definition of the ProtocolTest class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef ProtocolTest_INCLUDED
+#define ProtocolTest_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "CppUnit/TestCase.h"
+
+
+class ProtocolTest: public CppUnit::TestCase
+{
+public:
+	ProtocolTest(const std::string& name);
+	~ProtocolTest();
+
+	void testHeader();
+	void testHeaderWithPort();
+	void testTruncatedHeader();
+	void testWindowUpdate();
+	void testBatch();
+	void testEmptyBatch();
+	void testTruncatedBatch();
+	void testMalformedBatch();
+	void testBatchEntryHeader();
+	void testCapabilities();
+	void testFrameSize();
+
+	void setUp();
+	void tearDown();
+
+	static CppUnit::Test* suite();
+};
+
+
+#endif // ProtocolTest_INCLUDED
@@ -0,0 +1,548 @@
+//
+// SocketDispatcherTest.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "SocketDispatcherTest.h"
+#include "CppUnit/TestCaller.h"
+#include "CppUnit/TestSuite.h"
+#include "Poco/WebTunnel/SocketDispatcher.h"
+#include "Poco/Net/ServerSocket.h"
+#include "Poco/Net/StreamSocket.h"
+#include "Poco/Net/SocketAddress.h"
+#include "Poco/Net/PollSet.h"
+#include "Poco/Thread.h"
+#include "Poco/Event.h"
+#include "Poco/Mutex.h"
+#include "Poco/Timestamp.h"
+#include "Poco/Buffer.h"
+#include <cstring>
+#include <vector>
+
+
+using Poco::WebTunnel::SocketDispatcher;
+using Poco::Net::ServerSocket;
+using Poco::Net::StreamSocket;
+using Poco::Net::SocketAddress;
+using Poco::Net::PollSet;
+
+
+namespace
+{
+	class SocketPair
+		/// A pair of connected sockets.
+	{
+	public:
+		SocketPair():
+			_listener(SocketAddress("127.0.0.1", 0))
+		{
+			client.connect(_listener.address());
+			server = _listener.acceptConnection();
+		}
+
+		StreamSocket client;
+		StreamSocket server;
+
+	private:
+		ServerSocket _listener;
+	};
+
+	class Recorder
+		/// Records events from the dispatcher thread.
+	{
+	public:
+		void record(int event)
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			_events.push_back(event);
+			_recorded.set();
+		}
+
+		bool waitFor(std::size_t count, long milliseconds = 5000)
+		{
+			Poco::Timestamp start;
+			while (size() < count)
+			{
+				if (start.isElapsed(milliseconds*1000)) return false;
+				_recorded.tryWait(100);
+			}
+			return true;
+		}
+
+		std::size_t size() const
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			return _events.size();
+		}
+
+		std::vector<int> events() const
+		{
+			Poco::FastMutex::ScopedLock lock(_mutex);
+
+			return _events;
+		}
+
+	private:
+		std::vector<int> _events;
+		Poco::Event _recorded;
+		mutable Poco::FastMutex _mutex;
+	};
+
+	class TestHandler: public SocketDispatcher::SocketHandler
+		/// Echoes received data, records timeouts and
+		/// removes the socket when it times out or is closed.
+	{
+	public:
+		TestHandler(Recorder& recorder, int id, bool removeOnTimeout = true):
+			_recorder(recorder),
+			_id(id),
+			_removeOnTimeout(removeOnTimeout)
+		{
+		}
+
+		void readable(SocketDispatcher& dispatcher, StreamSocket& socket)
+		{
+			char buffer[1024];
+			int n = socket.receiveBytes(buffer, sizeof(buffer));
+			if (n > 0)
+			{
+				dispatcher.sendBytes(socket, buffer, n, 0);
+			}
+			else
+			{
+				dispatcher.removeSocket(socket);
+			}
+		}
+
+		void writable(SocketDispatcher&, StreamSocket&)
+		{
+		}
+
+		void exception(SocketDispatcher& dispatcher, StreamSocket& socket)
+		{
+			dispatcher.removeSocket(socket);
+		}
+
+		void timeout(SocketDispatcher& dispatcher, StreamSocket& socket)
+		{
+			// Removed before recording, so the socket is gone
+			// when a waiting test sees the timeout.
+			if (_removeOnTimeout) dispatcher.removeSocket(socket);
+			_recorder.record(_id);
+		}
+
+	private:
+		Recorder& _recorder;
+		int _id;
+		bool _removeOnTimeout;
+	};
+
+	class ForwardHandler: public SocketDispatcher::SocketHandler
+		/// Forwards received data to another socket.
+	{
+	public:
+		ForwardHandler(const StreamSocket& destination):
+			_destination(destination)
+		{
+		}
+
+		void readable(SocketDispatcher& dispatcher, StreamSocket& socket)
+		{
+			char buffer[8192];
+			int n = socket.receiveBytes(buffer, sizeof(buffer));
+			if (n > 0)
+			{
+				dispatcher.countReceived(socket, n);
+				dispatcher.sendBytes(_destination, buffer, n, 0);
+			}
+			else
+			{
+				dispatcher.removeSocket(socket);
+			}
+		}
+
+		void writable(SocketDispatcher&, StreamSocket&)
+		{
+		}
+
+		void exception(SocketDispatcher& dispatcher, StreamSocket& socket)
+		{
+			dispatcher.removeSocket(socket);
+		}
+
+		void timeout(SocketDispatcher&, StreamSocket&)
+		{
+		}
+
+	private:
+		StreamSocket _destination;
+	};
+
+	SocketDispatcher::SocketMetrics findMetrics(SocketDispatcher& dispatcher, const StreamSocket& socket)
+	{
+		for (const auto& metrics: dispatcher.socketMetrics())
+		{
+			if (metrics.sockfd == socket.impl()->sockfd()) return metrics;
+		}
+		return SocketDispatcher::SocketMetrics();
+	}
+}
+
+
+SocketDispatcherTest::SocketDispatcherTest(const std::string& name): CppUnit::TestCase(name)
+{
+}
+
+
+SocketDispatcherTest::~SocketDispatcherTest()
+{
+}
+
+
+void SocketDispatcherTest::testQueueTask()
+{
+	SocketDispatcher dispatcher(2);
+	Poco::Thread* pDispatcherThread = nullptr;
+	int executed = 0;
+
+	// Called from another thread, queueTask() waits until the task has been executed.
+	dispatcher.queueTask(
+		[&](SocketDispatcher&)
+		{
+			pDispatcherThread = Poco::Thread::current();
+			executed++;
+		});
+	assertTrue (executed == 1);
+	assertTrue (pDispatcherThread != nullptr);
+	assertTrue (pDispatcherThread != Poco::Thread::current());
+
+	for (int i = 0; i < 100; i++)
+	{
+		dispatcher.queueTask([&](SocketDispatcher&) { executed++; });
+	}
+	assertTrue (executed == 101);
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testCommandOrder()
+{
+	Recorder recorder;
+	SocketDispatcher dispatcher(1);
+
+	// Called from the dispatcher thread, queueTask() does not wait. Tasks
+	// must be executed in order, even if they do not fit into the command queue.
+	const int count = 3000;
+	dispatcher.queueTask(
+		[&](SocketDispatcher& d)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				d.queueTask([&recorder, i](SocketDispatcher&) { recorder.record(i); });
+			}
+		});
+	assertTrue (recorder.waitFor(count));
+
+	std::vector<int> events = recorder.events();
+	assertTrue (events.size() == count);
+	for (int i = 0; i < count; i++)
+	{
+		assertTrue (events[i] == i);
+	}
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testAsync()
+{
+	Recorder recorder;
+	SocketDispatcher dispatcher(2);
+	SocketPair pair;
+
+	// Asynchronous requests for a socket are executed in order, so
+	// the socket can be used right after addSocketAsync() returns.
+	dispatcher.addSocketAsync(pair.server, new TestHandler(recorder, 1), PollSet::POLL_READ);
+	Poco::Buffer<char> buffer(5);
+	std::memcpy(buffer.begin(), "hello", 5);
+	dispatcher.sendBytesAsync(pair.server, std::move(buffer), 0);
+	SocketDispatcher::Completion::Ptr pCompletion = dispatcher.hasSocketAsync(pair.server);
+	assertTrue (pCompletion->tryWait(5000));
+	assertTrue (pCompletion->result());
+
+	pair.client.setReceiveTimeout(Poco::Timespan(5, 0));
+	std::string received;
+	while (received.size() < 5)
+	{
+		char data[16];
+		int n = pair.client.receiveBytes(data, sizeof(data));
+		assertTrue (n > 0);
+		received.append(data, n);
+	}
+	assertTrue (received == "hello");
+
+	dispatcher.removeSocketAsync(pair.server);
+	pCompletion = dispatcher.hasSocketAsync(pair.server);
+	assertTrue (pCompletion->tryWait(5000));
+	assertTrue (!pCompletion->result());
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testReadable()
+{
+	Recorder recorder;
+	SocketDispatcher dispatcher(2);
+	SocketPair pair;
+	dispatcher.addSocket(pair.server, new TestHandler(recorder, 1), PollSet::POLL_READ);
+	assertTrue (dispatcher.hasSocket(pair.server));
+
+	pair.client.setReceiveTimeout(Poco::Timespan(5, 0));
+	std::string data("hello, world");
+	for (int i = 0; i < 10; i++)
+	{
+		pair.client.sendBytes(data.data(), static_cast<int>(data.size()));
+		std::string echo;
+		while (echo.size() < data.size())
+		{
+			char buffer[256];
+			int n = pair.client.receiveBytes(buffer, sizeof(buffer));
+			assertTrue (n > 0);
+			echo.append(buffer, n);
+		}
+		assertTrue (echo == data);
+	}
+
+	pair.client.shutdownSend();
+	Poco::Timestamp start;
+	while (dispatcher.hasSocket(pair.server) && !start.isElapsed(5000000))
+	{
+		Poco::Thread::sleep(10);
+	}
+	assertTrue (!dispatcher.hasSocket(pair.server));
+	assertTrue (recorder.size() == 0);
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testTimeout()
+{
+	Recorder recorder;
+	SocketDispatcher dispatcher(1);
+	SocketPair pair1;
+	SocketPair pair2;
+	SocketPair pair3;
+	SocketPair pair4;
+
+	// Timeouts must fire in the order of their deadlines,
+	// not in the order the sockets have been added.
+	dispatcher.addSocket(pair1.server, new TestHandler(recorder, 3), PollSet::POLL_READ, Poco::Timespan(0, 300000));
+	dispatcher.addSocket(pair2.server, new TestHandler(recorder, 1), PollSet::POLL_READ, Poco::Timespan(0, 100000));
+	dispatcher.addSocket(pair3.server, new TestHandler(recorder, 2), PollSet::POLL_READ, Poco::Timespan(0, 200000));
+	dispatcher.addSocket(pair4.server, new TestHandler(recorder, 4), PollSet::POLL_READ);
+
+	assertTrue (recorder.waitFor(3));
+	std::vector<int> events = recorder.events();
+	assertTrue (events.size() == 3);
+	assertTrue (events[0] == 1);
+	assertTrue (events[1] == 2);
+	assertTrue (events[2] == 3);
+
+	// A socket without timeout must never time out.
+	assertTrue (!dispatcher.hasSocket(pair1.server));
+	assertTrue (dispatcher.hasSocket(pair4.server));
+
+	// Changing the timeout of a socket reschedules it. Removed
+	// sockets must not have timed out again in the meantime.
+	dispatcher.updateSocket(pair4.server, PollSet::POLL_READ, Poco::Timespan(0, 50000));
+	assertTrue (recorder.waitFor(4));
+	events = recorder.events();
+	assertTrue (events.size() == 4);
+	assertTrue (events[3] == 4);
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testTimeoutActivity()
+{
+	Recorder recorder;
+	SocketDispatcher dispatcher(1);
+	SocketPair pair;
+	dispatcher.addSocket(pair.server, new TestHandler(recorder, 1, false), PollSet::POLL_READ, Poco::Timespan(0, 400000));
+
+	// Activity on the socket postpones the timeout.
+	pair.client.setReceiveTimeout(Poco::Timespan(5, 0));
+	for (int i = 0; i < 8; i++)
+	{
+		char c = 'x';
+		pair.client.sendBytes(&c, 1);
+		assertTrue (pair.client.receiveBytes(&c, 1) == 1);
+		Poco::Thread::sleep(100);
+	}
+	assertTrue (recorder.size() == 0);
+
+	// Without activity, the timeout fires repeatedly.
+	assertTrue (recorder.waitFor(2));
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testScheduleTask()
+{
+	Recorder recorder;
+	SocketDispatcher dispatcher(1);
+	SocketPair pair;
+	dispatcher.addSocket(pair.server, new TestHandler(recorder, 0), PollSet::POLL_READ);
+
+	// scheduleTask() can only be used from the dispatcher thread.
+	assertTrue (!dispatcher.scheduleTask(pair.server, 0, [](SocketDispatcher&) {}));
+
+	bool scheduled = false;
+	StreamSocket socket(pair.server);
+	dispatcher.queueTask(pair.server,
+		[&](SocketDispatcher& d)
+		{
+			scheduled =
+				d.scheduleTask(socket, Poco::Timespan(0, 200000), [&recorder](SocketDispatcher&) { recorder.record(3); }) &&
+				d.scheduleTask(socket, Poco::Timespan(0, 50000), [&recorder](SocketDispatcher&) { recorder.record(2); }) &&
+				d.scheduleTask(socket, 0, [&recorder](SocketDispatcher&) { recorder.record(1); });
+		});
+	assertTrue (scheduled);
+
+	assertTrue (recorder.waitFor(3));
+	std::vector<int> events = recorder.events();
+	assertTrue (events[0] == 1);
+	assertTrue (events[1] == 2);
+	assertTrue (events[2] == 3);
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testScheduleTaskRemoved()
+{
+	Recorder recorder;
+	SocketDispatcher dispatcher(1);
+	SocketPair pair;
+	SocketPair other;
+	dispatcher.addSocket(pair.server, new TestHandler(recorder, 0), PollSet::POLL_READ);
+	dispatcher.addSocket(other.server, new TestHandler(recorder, 0), PollSet::POLL_READ, 0, pair.server);
+
+	// Tasks of a removed socket are discarded.
+	StreamSocket socket(pair.server);
+	StreamSocket otherSocket(other.server);
+	dispatcher.queueTask(pair.server,
+		[&](SocketDispatcher& d)
+		{
+			d.scheduleTask(socket, Poco::Timespan(0, 100000), [&recorder](SocketDispatcher&) { recorder.record(1); });
+			d.scheduleTask(otherSocket, Poco::Timespan(0, 200000), [&recorder](SocketDispatcher&) { recorder.record(2); });
+		});
+	dispatcher.removeSocket(pair.server);
+
+	// The discarded task would have been due before the other one.
+	assertTrue (recorder.waitFor(1));
+	std::vector<int> events = recorder.events();
+	assertTrue (events.size() == 1);
+	assertTrue (events[0] == 2);
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::testWatermarks()
+{
+	const std::size_t high = 65536;
+	const std::size_t low = 16384;
+
+	Recorder recorder;
+	SocketDispatcher dispatcher(1);
+	dispatcher.setWatermarks(high, low);
+	SocketPair source;
+	SocketPair destination;
+	destination.server.setSendBufferSize(16384);
+	destination.client.setReceiveBufferSize(16384);
+	destination.server.setBlocking(false);
+	source.server.setBlocking(false);
+	dispatcher.addSocket(destination.server, new TestHandler(recorder, 0), PollSet::POLL_READ);
+	dispatcher.addSocket(source.server, new ForwardHandler(destination.server), PollSet::POLL_READ, 0, destination.server);
+
+	// The destination never reads, so data piles up in its pending
+	// sends until the high watermark is exceeded and reading from
+	// the source is suspended.
+	source.client.setBlocking(false);
+	std::vector<char> chunk(8192, 'x');
+	Poco::UInt64 sent = 0;
+	Poco::Timestamp start;
+	while (!findMetrics(dispatcher, source.server).throttled)
+	{
+		assertTrue (!start.isElapsed(10000000));
+		int n = source.client.sendBytes(chunk.data(), static_cast<int>(chunk.size()));
+		if (n > 0)
+			sent += n;
+		else
+			source.client.poll(Poco::Timespan(0, 10000), Poco::Net::Socket::SELECT_WRITE);
+	}
+	assertTrue (findMetrics(dispatcher, destination.server).pendingBytes > high);
+
+	// Data sent to the suspended source is no longer read.
+	source.client.poll(Poco::Timespan(5, 0), Poco::Net::Socket::SELECT_WRITE);
+	int extra = source.client.sendBytes(chunk.data(), static_cast<int>(chunk.size()));
+	assertTrue (extra > 0);
+	sent += extra;
+	SocketDispatcher::SocketMetrics paused = findMetrics(dispatcher, source.server);
+	Poco::Thread::sleep(200);
+	SocketDispatcher::SocketMetrics metrics = findMetrics(dispatcher, source.server);
+	assertTrue (metrics.throttled);
+	assertTrue (metrics.bytesReceived == paused.bytesReceived);
+	assertTrue (metrics.bytesReceived < sent);
+
+	// Draining the destination below the low watermark resumes
+	// reading, until everything sent has been forwarded.
+	destination.client.setReceiveTimeout(Poco::Timespan(5, 0));
+	Poco::UInt64 received = 0;
+	while (received < sent)
+	{
+		char buffer[8192];
+		int n = destination.client.receiveBytes(buffer, sizeof(buffer));
+		assertTrue (n > 0);
+		received += n;
+	}
+	assertTrue (received == sent);
+	metrics = findMetrics(dispatcher, source.server);
+	assertTrue (!metrics.throttled);
+	assertTrue (metrics.bytesReceived == sent);
+	assertTrue (findMetrics(dispatcher, destination.server).pendingBytes == 0);
+	dispatcher.stop();
+}
+
+
+void SocketDispatcherTest::setUp()
+{
+}
+
+
+void SocketDispatcherTest::tearDown()
+{
+}
+
+
+CppUnit::Test* SocketDispatcherTest::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("SocketDispatcherTest");
+
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testQueueTask);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testCommandOrder);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testAsync);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testReadable);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testTimeout);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testTimeoutActivity);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testScheduleTask);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testScheduleTaskRemoved);
+	CppUnit_addTest(pSuite, SocketDispatcherTest, testWatermarks);
+
+	return pSuite;
+}
@@ -0,0 +1,44 @@
+//
+// SocketDispatcherTest.h
+//
+// Definition of the SocketDispatcherTest class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef SocketDispatcherTest_INCLUDED
+#define SocketDispatcherTest_INCLUDED
+
+
+#include "Poco/WebTunnel/WebTunnel.h"
+#include "CppUnit/TestCase.h"
+
+
+class SocketDispatcherTest: public CppUnit::TestCase
+{
+public:
+	SocketDispatcherTest(const std::string& name);
+	~SocketDispatcherTest();
+
+	void testQueueTask();
+	void testCommandOrder();
+	void testAsync();
+	void testReadable();
+	void testTimeout();
+	void testTimeoutActivity();
+	void testScheduleTask();
+	void testScheduleTaskRemoved();
+	void testWatermarks();
+
+	void setUp();
+	void tearDown();
+
+	static CppUnit::Test* suite();
+};
+
+
+#endif // SocketDispatcherTest_INCLUDED
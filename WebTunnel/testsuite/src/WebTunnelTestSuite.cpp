@@ -0,0 +1,34 @@
+//
+// WebTunnelTestSuite.cpp
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#include "WebTunnelTestSuite.h"
+#include "ProtocolTest.h"
+#include "FrameSchedulerTest.h"
+#include "HistogramTest.h"
+#include "ChannelCodecTest.h"
+#include "SocketDispatcherTest.h"
+#include "PooledSocketFactoryTest.h"
+#include "LocalPortForwarderTest.h"
+
+
+CppUnit::Test* WebTunnelTestSuite::suite()
+{
+	CppUnit::TestSuite* pSuite = new CppUnit::TestSuite("WebTunnelTestSuite");
+
+	pSuite->addTest(ProtocolTest::suite());
+	pSuite->addTest(FrameSchedulerTest::suite());
+	pSuite->addTest(HistogramTest::suite());
+	pSuite->addTest(ChannelCodecTest::suite());
+	pSuite->addTest(SocketDispatcherTest::suite());
+	pSuite->addTest(PooledSocketFactoryTest::suite());
+	pSuite->addTest(LocalPortForwarderTest::suite());
+
+	return pSuite;
+}
@@ -0,0 +1,27 @@
+//
+// WebTunnelTestSuite.h
+//
+// Definition of the WebTunnelTestSuite class.
+//
+// Copyright (c) 2013, Applied Informatics Software Engineering GmbH.
+// and Contributors.
+//
+// SPDX-License-Identifier:	BSL-1.0
+//
+
+
+#ifndef WebTunnelTestSuite_INCLUDED
+#define WebTunnelTestSuite_INCLUDED
+
+
+#include "CppUnit/TestSuite.h"
+
+
+class WebTunnelTestSuite
+{
+public:
+	static CppUnit::Test* suite();
+};
+
+
+#endif // WebTunnelTestSuite_INCLUDED